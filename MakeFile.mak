@@ -4,8 +4,11 @@ CC = gcc
 # Compiler flags
 CFLAGS = -Wall -Werror -ansi -Wextra -std=c99
 
+# Linker flags
+LDFLAGS = -pthread
+
 # Source files
-SOURCES = main.c huffman_compression.c
+SOURCES = main.c huffman_compression.c encryption.c thread_pool.c mapped_file.c sha256.c chacha20_poly1305.c image_filter.c run_length.c fse.c arena.c image_database.c pack_file.c image_cache.c batch_compress.c async_io.c
 
 # Object files
 OBJECTS = $(SOURCES:.c=.o)
@@ -13,16 +16,63 @@ OBJECTS = $(SOURCES:.c=.o)
 # Executable name
 ifeq ($(OS),Windows_NT)
     EXECUTABLE = main.exe
+    ASAN_EXECUTABLE = main_asan.exe
+    CHECK_EXECUTABLE = check_asan.exe
+    BENCH_EXECUTABLE = benchmark.exe
 else
     EXECUTABLE = main
+    ASAN_EXECUTABLE = main_asan
+    CHECK_EXECUTABLE = check_asan
+    BENCH_EXECUTABLE = benchmark
 endif
 
+# Sanitizer flags for the asan target: AddressSanitizer reports leaks when the program exits
+SANITIZE_FLAGS = -fsanitize=address,undefined -fno-omit-frame-pointer -g
+
+# The check and bench targets' data folders, made fresh for every run
+CHECK_DIRECTORY = $(if $(TMPDIR),$(TMPDIR),/tmp)/foc_check
+BENCH_DIRECTORY = $(if $(TMPDIR),$(TMPDIR),/tmp)/foc_bench
+
+# Pack segment size for the check target, small enough for its images to fill several
+CHECK_SEGMENT_SIZE = 65536
+DATA_FOLDERS = Captures Compressed Compressed_And_Encrypted Compressed_And_Decrypted Decompressed Dictionaries
+
+# Optimisation for the bench target
+BENCH_FLAGS = -O2
+
 # Default target
 all: $(EXECUTABLE)
 
 # Link the program
 $(EXECUTABLE): $(OBJECTS)
-	$(CC) $(CFLAGS) -o $@ $^
+	$(CC) $(CFLAGS) -o $@ $^ $(LDFLAGS)
+
+# Build the program with the sanitizers, straight from the sources so no object is shared
+asan: $(ASAN_EXECUTABLE)
+
+$(ASAN_EXECUTABLE): $(SOURCES)
+	$(CC) $(CFLAGS) $(SANITIZE_FLAGS) -o $@ $^ $(LDFLAGS)
+
+# Round-trip a generated image through every save and load path with the sanitizers;
+# a failed round trip, undefined behaviour or a leak report fails the target (needs a POSIX shell)
+check: $(CHECK_EXECUTABLE)
+	rm -rf $(CHECK_DIRECTORY)
+	for folder in $(DATA_FOLDERS); do mkdir -p $(CHECK_DIRECTORY)/$$folder || exit 1; done
+	ASAN_OPTIONS=detect_leaks=1 UBSAN_OPTIONS=halt_on_error=1:print_stacktrace=1 ./$(CHECK_EXECUTABLE)
+
+$(CHECK_EXECUTABLE): check.c $(filter-out main.c,$(SOURCES))
+	$(CC) $(CFLAGS) $(SANITIZE_FLAGS) -DDATA_DIRECTORY='"$(CHECK_DIRECTORY)/"' -DPACK_SEGMENT_MAX_SIZE=$(CHECK_SEGMENT_SIZE) \
+		-o $@ $^ $(LDFLAGS)
+
+# Time the histogram, every coding setting and a whole save and load on Captures/*.bmp
+# and generated uniform, random and solid-colour images (needs a POSIX shell)
+bench: $(BENCH_EXECUTABLE)
+	rm -rf $(BENCH_DIRECTORY)
+	for folder in $(DATA_FOLDERS); do mkdir -p $(BENCH_DIRECTORY)/$$folder || exit 1; done
+	./$(BENCH_EXECUTABLE) Captures/*.bmp
+
+$(BENCH_EXECUTABLE): bench.c $(filter-out main.c,$(SOURCES))
+	$(CC) $(CFLAGS) $(BENCH_FLAGS) -DDATA_DIRECTORY='"$(BENCH_DIRECTORY)/"' -o $@ $^ $(LDFLAGS)
 
 # Compile source files
 %.o: %.c
@@ -31,10 +81,10 @@ $(EXECUTABLE): $(OBJECTS)
 # Clean up
 clean:
 ifeq ($(OS),Windows_NT)
-	del /Q *.o $(EXECUTABLE)
+	del /Q *.o $(EXECUTABLE) $(ASAN_EXECUTABLE) $(CHECK_EXECUTABLE) $(BENCH_EXECUTABLE)
 else
-	rm -f *.o $(EXECUTABLE)
+	rm -f *.o $(EXECUTABLE) $(ASAN_EXECUTABLE) $(CHECK_EXECUTABLE) $(BENCH_EXECUTABLE)
 endif
 
 # Phony targets
-.PHONY: all clean
\ No newline at end of file
+.PHONY: all asan check bench clean
\ No newline at end of file
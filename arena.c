@@ -0,0 +1,145 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#define ARENA_DEFAULT_BLOCK_SIZE ((size_t)256 << 10)
+#define ARENA_ALIGNMENT 16
+
+struct ArenaBlock {
+    ArenaBlock_t* next;
+    size_t capacity;
+    size_t used;
+};
+
+struct Arena {
+    ArenaBlock_t* first;
+    ArenaBlock_t* current; // Block allocations come from, NULL until the first one
+    size_t block_size;
+};
+
+// The block header is padded so the memory after it keeps the alignment
+#define BLOCK_HEADER_SIZE ((sizeof(ArenaBlock_t) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+
+static unsigned char* block_memory(ArenaBlock_t* block) {
+    return (unsigned char*)block + BLOCK_HEADER_SIZE;
+}
+
+
+Arena_t* arena_create(size_t block_size) {
+    Arena_t* arena = (Arena_t*)malloc(sizeof(Arena_t));
+    if (arena == NULL) {
+        printf("Memory allocation failed for arena\n");
+        return NULL;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    return arena;
+}
+
+
+void* arena_alloc(Arena_t* arena, size_t size) {
+    if (size > SIZE_MAX - BLOCK_HEADER_SIZE - ARENA_ALIGNMENT) {
+        printf("Memory allocation failed for arena\n");
+        return NULL;
+    }
+    size = size ? (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1) : ARENA_ALIGNMENT;
+
+    // The current block, then the blocks kept from before the last reset or rewind
+    ArenaBlock_t* last = NULL;
+    ArenaBlock_t* block = arena->current;
+    while (block != NULL) {
+        if (block->capacity - block->used >= size) {
+            unsigned char* memory = block_memory(block) + block->used;
+            block->used += size;
+            arena->current = block;
+            return memory;
+        }
+        last = block;
+        block = block->next;
+        if (block != NULL) {
+            block->used = 0;
+        }
+    }
+
+    size_t capacity = size > arena->block_size ? size : arena->block_size;
+    ArenaBlock_t* fresh = (ArenaBlock_t*)malloc(BLOCK_HEADER_SIZE + capacity);
+    if (fresh == NULL) {
+        printf("Memory allocation failed for arena\n");
+        return NULL;
+    }
+    fresh->next = NULL;
+    fresh->capacity = capacity;
+    fresh->used = size;
+    if (last == NULL) {
+        arena->first = fresh;
+    } else {
+        last->next = fresh;
+    }
+    arena->current = fresh;
+    return block_memory(fresh);
+}
+
+
+void* arena_calloc(Arena_t* arena, size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        printf("Memory allocation failed for arena\n");
+        return NULL;
+    }
+    void* memory = arena_alloc(arena, count * size);
+    if (memory != NULL) {
+        memset(memory, 0, count * size);
+    }
+    return memory;
+}
+
+
+ArenaMark_t arena_mark(const Arena_t* arena) {
+    ArenaMark_t mark;
+    mark.block = arena->current;
+    mark.used = arena->current != NULL ? arena->current->used : 0;
+    return mark;
+}
+
+
+void arena_rewind(Arena_t* arena, ArenaMark_t mark) {
+    if (mark.block == NULL) {
+        arena_reset(arena);
+        return;
+    }
+    arena->current = mark.block;
+    arena->current->used = mark.used;
+}
+
+
+void arena_reset(Arena_t* arena) {
+    // Later blocks are emptied as allocation reaches them again
+    arena->current = arena->first;
+    if (arena->first != NULL) {
+        arena->first->used = 0;
+    }
+}
+
+
+size_t arena_capacity(const Arena_t* arena) {
+    size_t capacity = 0;
+    for (const ArenaBlock_t* block = arena->first; block != NULL; block = block->next) {
+        capacity += block->capacity;
+    }
+    return capacity;
+}
+
+
+void arena_destroy(Arena_t* arena) {
+    if (arena == NULL) return;
+    ArenaBlock_t* block = arena->first;
+    while (block != NULL) {
+        ArenaBlock_t* next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
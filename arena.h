@@ -0,0 +1,47 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Bump allocator for the scratch memory of one compress or decompress. Allocations are
+never freed one by one: arena_rewind drops everything allocated after a mark, and
+arena_reset drops everything in O(1) while keeping the blocks for the next operation.
+An arena is not thread-safe, every thread needs its own. */
+typedef struct Arena Arena_t;
+
+typedef struct ArenaBlock ArenaBlock_t;
+
+// A point to rewind an arena to, from arena_mark
+typedef struct ArenaMark {
+    ArenaBlock_t* block;
+    size_t used;
+} ArenaMark_t;
+
+// Function to create an empty arena that grows in blocks of block_size bytes, 0 for the default
+// Returns NULL on failure
+Arena_t* arena_create(size_t block_size);
+
+// Function to allocate size bytes, aligned for any type, that live until the arena is reset
+// Returns NULL on failure
+void* arena_alloc(Arena_t* arena, size_t size);
+
+// Function to allocate count zeroed elements of size bytes each
+// Returns NULL on failure
+void* arena_calloc(Arena_t* arena, size_t count, size_t size);
+
+// Function to remember how much of the arena is in use
+ArenaMark_t arena_mark(const Arena_t* arena);
+
+// Function to free everything allocated since mark was taken
+void arena_rewind(Arena_t* arena, ArenaMark_t mark);
+
+// Function to free every allocation at once, keeping the memory for reuse
+void arena_reset(Arena_t* arena);
+
+// Function to get the bytes of memory the arena holds
+size_t arena_capacity(const Arena_t* arena);
+
+// Function to give all of the arena's memory back
+void arena_destroy(Arena_t* arena);
+
+#endif // ARENA_H
@@ -0,0 +1,653 @@
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#ifdef __linux__
+#define _DEFAULT_SOURCE // syscall
+#endif
+
+#include "async_io.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// The io_uring back end needs the 5.6 kernel headers (IORING_OP_READ and WRITE, and
+// IORING_FEAT_RW_CUR_POS); built against older ones only the thread back end is compiled
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup)
+#define ASYNC_IO_HAVE_URING
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+#endif
+#endif
+
+#define ASYNC_IO_MAX_DEPTH 4096          // Requests one queue holds
+#define ASYNC_IO_THREADS 4             // Workers of the thread back end
+#define ASYNC_IO_MAX_TRANSFER (1u << 30) // Bytes one system call is asked to move
+
+
+typedef struct IoRequest {
+    int fd;
+    int write;
+    unsigned char* buffer;
+    size_t size;
+    size_t done;           // Bytes moved so far
+    uint64_t offset;
+    int buffer_index;
+    void* tag;
+    int status;
+    struct IoRequest* next; // In the free list or one of the thread back end's lists
+} IoRequest_t;
+
+
+#ifdef ASYNC_IO_HAVE_URING
+typedef struct Uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned char* sq_ring;
+    size_t sq_ring_size;
+    unsigned char* cq_ring;   // The same mapping as sq_ring when the kernel shares them
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned int unsubmitted; // Entries filled in since the last io_uring_enter
+    int buffers_registered;
+} Uring_t;
+#endif
+
+
+struct AsyncIo {
+    int backend;
+    unsigned int depth;
+    IoRequest_t* requests;      // depth of them
+    IoRequest_t* free_requests;
+    unsigned int in_flight;     // Requests queued and not yet reported
+    unsigned char** buffer_bases; // Registered buffers
+    size_t* buffer_sizes;
+    unsigned int buffer_count;
+#ifdef ASYNC_IO_HAVE_URING
+    Uring_t ring;
+#endif
+    // Thread back end
+    pthread_t threads[ASYNC_IO_THREADS];
+    int thread_count;
+    IoRequest_t* pending_head;  // Queued since the last submit
+    IoRequest_t* pending_tail;
+    IoRequest_t* work_head;     // Submitted, waiting for a thread
+    IoRequest_t* work_tail;
+    IoRequest_t* done_head;     // Finished, waiting to be reported
+    IoRequest_t* done_tail;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;  // Signalled when work is submitted or the queue is destroyed
+    pthread_cond_t work_done;   // Signalled when a request finishes
+};
+
+
+/*******************************************************************************
+ * Function Prototypes
+*******************************************************************************/
+static int64_t transfer_at(int fd, int write, unsigned char* buffer, size_t size, uint64_t offset);
+static void run_request(IoRequest_t* request);
+static void* io_thread_main(void* argument);
+static void append_request(IoRequest_t** head, IoRequest_t** tail, IoRequest_t* request);
+static int start_threads(AsyncIo_t* io);
+static unsigned int threads_wait(AsyncIo_t* io, AsyncIoCompletion_t* completions, unsigned int max, unsigned int min);
+static void finish_request(AsyncIo_t* io, IoRequest_t* request, AsyncIoCompletion_t* completion);
+static int queue_request(AsyncIo_t* io, int fd, int write, void* buffer, size_t size, uint64_t offset,
+                         int buffer_index, void* tag);
+#ifdef ASYNC_IO_HAVE_URING
+static int uring_setup(Uring_t* ring, unsigned int depth);
+static void uring_teardown(Uring_t* ring);
+static int uring_queue(Uring_t* ring, IoRequest_t* request);
+static int uring_enter(Uring_t* ring, unsigned int wait_for);
+static unsigned int uring_reap(AsyncIo_t* io, AsyncIoCompletion_t* completions, unsigned int max);
+static unsigned int uring_wait(AsyncIo_t* io, AsyncIoCompletion_t* completions, unsigned int max, unsigned int min);
+#endif
+
+
+#ifdef _WIN32
+
+static pthread_mutex_t seek_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// No positioned reads or writes here: seek and transfer under one lock
+static int64_t transfer_at(int fd, int write, unsigned char* buffer, size_t size, uint64_t offset) {
+    unsigned int count = size < ASYNC_IO_MAX_TRANSFER ? (unsigned int)size : ASYNC_IO_MAX_TRANSFER;
+    int64_t moved = -1;
+    pthread_mutex_lock(&seek_lock);
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) >= 0) {
+        moved = write ? _write(fd, buffer, count) : _read(fd, buffer, count);
+    }
+    pthread_mutex_unlock(&seek_lock);
+    return moved;
+}
+
+#else
+
+static int64_t transfer_at(int fd, int write, unsigned char* buffer, size_t size, uint64_t offset) {
+    size_t count = size < ASYNC_IO_MAX_TRANSFER ? size : ASYNC_IO_MAX_TRANSFER;
+    ssize_t moved;
+    do {
+        moved = write ? pwrite(fd, buffer, count, (off_t)offset) : pread(fd, buffer, count, (off_t)offset);
+    } while (moved < 0 && errno == EINTR);
+    return (int64_t)moved;
+}
+
+#endif
+
+
+static void run_request(IoRequest_t* request) {
+    while (request->done < request->size) {
+        int64_t moved = transfer_at(request->fd, request->write, request->buffer + request->done,
+                                    request->size - request->done, request->offset + request->done);
+        if (moved <= 0) {
+            request->status = 1; // An error, or the end of the file before the whole range was read
+            return;
+        }
+        request->done += (size_t)moved;
+    }
+}
+
+
+static void* io_thread_main(void* argument) {
+    AsyncIo_t* io = (AsyncIo_t*)argument;
+
+    pthread_mutex_lock(&io->lock);
+    while (1) {
+        while (io->work_head == NULL && !io->stopping) {
+            pthread_cond_wait(&io->work_ready, &io->lock);
+        }
+        if (io->work_head == NULL) {
+            break;
+        }
+        IoRequest_t* request = io->work_head;
+        io->work_head = request->next;
+        if (io->work_head == NULL) {
+            io->work_tail = NULL;
+        }
+        pthread_mutex_unlock(&io->lock);
+
+        run_request(request);
+
+        pthread_mutex_lock(&io->lock);
+        append_request(&io->done_head, &io->done_tail, request);
+        pthread_cond_signal(&io->work_done);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+
+static void append_request(IoRequest_t** head, IoRequest_t** tail, IoRequest_t* request) {
+    request->next = NULL;
+    if (*tail == NULL) {
+        *head = request;
+    } else {
+        (*tail)->next = request;
+    }
+    *tail = request;
+}
+
+
+static int start_threads(AsyncIo_t* io) {
+    for (int i = 0; i < ASYNC_IO_THREADS; i++) {
+        if (pthread_create(&io->threads[i], NULL, io_thread_main, io) != 0) {
+            break;
+        }
+        io->thread_count++;
+    }
+    if (io->thread_count == 0) {
+        printf("Failed to start I/O threads\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+static unsigned int threads_wait(AsyncIo_t* io, AsyncIoCompletion_t* completions, unsigned int max, unsigned int min) {
+    async_io_submit(io);
+
+    unsigned int count = 0;
+    pthread_mutex_lock(&io->lock);
+    while (count < max) {
+        if (io->done_head != NULL) {
+            IoRequest_t* request = io->done_head;
+            io->done_head = request->next;
+            if (io->done_head == NULL) {
+                io->done_tail = NULL;
+            }
+            finish_request(io, request, &completions[count++]);
+            continue;
+        }
+        if (count >= min || io->in_flight == 0) {
+            break;
+        }
+        pthread_cond_wait(&io->work_done, &io->lock);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return count;
+}
+
+
+// Report a request and put it back on the free list
+static void finish_request(AsyncIo_t* io, IoRequest_t* request, AsyncIoCompletion_t* completion) {
+    completion->tag = request->tag;
+    completion->status = request->status;
+    completion->bytes = request->done;
+    request->next = io->free_requests;
+    io->free_requests = request;
+    io->in_flight--;
+}
+
+
+#ifdef ASYNC_IO_HAVE_URING
+
+static int uring_setup(Uring_t* ring, unsigned int depth) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(Uring_t));
+    ring->fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+    if (ring->fd < 0) {
+        return 1;
+    }
+    // Plain read and write requests came with the same kernel as this feature
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring->fd);
+        return 1;
+    }
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int shared = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (shared && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    void* sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    void* cq_ring = shared ? sq_ring :
+                    mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    ring->sq_ring = sq_ring == MAP_FAILED ? NULL : (unsigned char*)sq_ring;
+    ring->cq_ring = cq_ring == MAP_FAILED ? NULL : (unsigned char*)cq_ring;
+    ring->sqes = sqes == MAP_FAILED ? NULL : (struct io_uring_sqe*)sqes;
+    if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL) {
+        uring_teardown(ring);
+        return 1;
+    }
+
+    ring->sq_head = (unsigned*)(ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned*)(ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(ring->cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+
+static void uring_teardown(Uring_t* ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+}
+
+
+// Fill in a submission queue entry for what is left of a request
+static int uring_queue(Uring_t* ring, IoRequest_t* request) {
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        return 1;
+    }
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    size_t rest = request->size - request->done;
+    int fixed = request->buffer_index != ASYNC_IO_NO_BUFFER;
+    if (request->write) {
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    } else {
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    }
+    sqe->fd = request->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(request->buffer + request->done);
+    sqe->len = (uint32_t)(rest < ASYNC_IO_MAX_TRANSFER ? rest : ASYNC_IO_MAX_TRANSFER);
+    sqe->off = request->offset + request->done;
+    if (fixed) {
+        sqe->buf_index = (uint16_t)request->buffer_index;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)request;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+    return 0;
+}
+
+
+// Hand the kernel the unsubmitted entries, and wait until wait_for requests have completed
+static int uring_enter(Uring_t* ring, unsigned int wait_for) {
+    while (1) {
+        long submitted = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, wait_for,
+                                 wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted < 0 && errno == EINTR) {
+            continue;
+        }
+        if (submitted < 0) {
+            printf("Error submitting I/O requests\n");
+            return 1;
+        }
+        ring->unsubmitted -= (unsigned int)submitted;
+        return 0;
+    }
+}
+
+
+// Collect what the kernel has finished, queueing the rest of any short transfer again
+static unsigned int uring_reap(AsyncIo_t* io, AsyncIoCompletion_t* completions, unsigned int max) {
+    Uring_t* ring = &io->ring;
+    unsigned int count = 0;
+    unsigned head = *ring->cq_head;
+    while (count < max && head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        IoRequest_t* request = (IoRequest_t*)(uintptr_t)cqe->user_data;
+        int result = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (result > 0) {
+            request->done += (size_t)result;
+            if (request->done < request->size && uring_queue(ring, request) == 0) {
+                continue;
+            }
+        }
+        if (request->done < request->size) {
+            request->status = 1;
+        }
+        finish_request(io, request, &completions[count++]);
+    }
+    return count;
+}
+
+
+static unsigned int uring_wait(AsyncIo_t* io, AsyncIoCompletion_t* completions, unsigned int max, unsigned int min) {
+    unsigned int count = 0;
+    if (io->ring.unsubmitted > 0 && uring_enter(&io->ring, 0)) {
+        return 0;
+    }
+    count += uring_reap(io, completions, max);
+    while (count < min && count < max && io->in_flight > 0) {
+        if (uring_enter(&io->ring, 1)) {
+            break;
+        }
+        count += uring_reap(io, completions + count, max - count);
+    }
+    // Continuations of short transfers queued while reaping go out now
+    if (io->ring.unsubmitted > 0) {
+        uring_enter(&io->ring, 0);
+    }
+    return count;
+}
+
+#endif
+
+
+AsyncIo_t* async_io_create(unsigned int depth, int flags) {
+    if (depth == 0 || depth > ASYNC_IO_MAX_DEPTH) {
+        printf("I/O queue depth must be between 1 and %d\n", ASYNC_IO_MAX_DEPTH);
+        return NULL;
+    }
+    AsyncIo_t* io = (AsyncIo_t*)calloc(1, sizeof(AsyncIo_t));
+    IoRequest_t* requests = (IoRequest_t*)calloc(depth, sizeof(IoRequest_t));
+    if (io == NULL || requests == NULL) {
+        printf("Memory allocation failed for I/O queue\n");
+        free(io);
+        free(requests);
+        return NULL;
+    }
+    io->depth = depth;
+    io->requests = requests;
+    for (unsigned int i = 0; i < depth; i++) {
+        requests[i].next = io->free_requests;
+        io->free_requests = &requests[i];
+    }
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->work_ready, NULL);
+    pthread_cond_init(&io->work_done, NULL);
+
+#ifdef ASYNC_IO_HAVE_URING
+    if (!(flags & ASYNC_IO_FORCE_THREADS) && uring_setup(&io->ring, depth) == 0) {
+        io->backend = ASYNC_IO_BACKEND_URING;
+        return io;
+    }
+#else
+    (void)flags;
+#endif
+    io->backend = ASYNC_IO_BACKEND_THREADS;
+    if (start_threads(io)) {
+        async_io_destroy(io);
+        return NULL;
+    }
+    return io;
+}
+
+
+int async_io_backend(const AsyncIo_t* io) {
+    return io->backend;
+}
+
+
+int async_io_register_buffers(AsyncIo_t* io, void* const* buffers, const size_t* sizes, unsigned int count) {
+    if (io->in_flight > 0) {
+        printf("Buffers can only be registered with no I/O in flight\n");
+        return 1;
+    }
+    unsigned char** bases = (unsigned char**)malloc((count ? count : 1) * sizeof(unsigned char*));
+    size_t* buffer_sizes = (size_t*)malloc((count ? count : 1) * sizeof(size_t));
+    if (bases == NULL || buffer_sizes == NULL) {
+        printf("Memory allocation failed for I/O buffers\n");
+        free(bases);
+        free(buffer_sizes);
+        return 1;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        bases[i] = (unsigned char*)buffers[i];
+        buffer_sizes[i] = sizes[i];
+    }
+
+#ifdef ASYNC_IO_HAVE_URING
+    if (io->backend == ASYNC_IO_BACKEND_URING) {
+        if (io->ring.buffers_registered) {
+            syscall(__NR_io_uring_register, io->ring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+            io->ring.buffers_registered = 0;
+        }
+        struct iovec* vectors = (struct iovec*)malloc((count ? count : 1) * sizeof(struct iovec));
+        int status = vectors == NULL;
+        for (unsigned int i = 0; i < count && status == 0; i++) {
+            vectors[i].iov_base = buffers[i];
+            vectors[i].iov_len = sizes[i];
+        }
+        // Pinning the pages can fail, for one on the locked memory limit
+        if (status == 0 && count > 0 &&
+            syscall(__NR_io_uring_register, io->ring.fd, IORING_REGISTER_BUFFERS, vectors, count) < 0) {
+            status = 1;
+        }
+        free(vectors);
+        if (status) {
+            printf("Failed to register I/O buffers\n");
+            free(bases);
+            free(buffer_sizes);
+            free(io->buffer_bases);
+            free(io->buffer_sizes);
+            io->buffer_bases = NULL;
+            io->buffer_sizes = NULL;
+            io->buffer_count = 0;
+            return 1;
+        }
+        io->ring.buffers_registered = count > 0;
+    }
+#endif
+
+    free(io->buffer_bases);
+    free(io->buffer_sizes);
+    io->buffer_bases = bases;
+    io->buffer_sizes = buffer_sizes;
+    io->buffer_count = count;
+    return 0;
+}
+
+
+static int queue_request(AsyncIo_t* io, int fd, int write, void* buffer, size_t size, uint64_t offset,
+                         int buffer_index, void* tag) {
+    if (buffer_index != ASYNC_IO_NO_BUFFER &&
+        (buffer_index < 0 || (unsigned int)buffer_index >= io->buffer_count ||
+         (unsigned char*)buffer < io->buffer_bases[buffer_index] ||
+         size > io->buffer_sizes[buffer_index] - (size_t)((unsigned char*)buffer - io->buffer_bases[buffer_index]))) {
+        printf("I/O request is outside its registered buffer\n");
+        return 1;
+    }
+    if (io->free_requests == NULL) {
+        printf("I/O queue is full\n");
+        return 1;
+    }
+    IoRequest_t* request = io->free_requests;
+    io->free_requests = request->next;
+    request->fd = fd;
+    request->write = write;
+    request->buffer = (unsigned char*)buffer;
+    request->size = size;
+    request->done = 0;
+    request->offset = offset;
+    request->buffer_index = buffer_index;
+    request->tag = tag;
+    request->status = 0;
+    io->in_flight++;
+
+#ifdef ASYNC_IO_HAVE_URING
+    if (io->backend == ASYNC_IO_BACKEND_URING) {
+        // The ring has room for every request the queue holds, but a full one is drained first;
+        // a request that cannot get in goes back to the free list, as if the queue were full
+        while (uring_queue(&io->ring, request)) {
+            if (uring_enter(&io->ring, 0)) {
+                printf("I/O request could not be queued\n");
+                request->next = io->free_requests;
+                io->free_requests = request;
+                io->in_flight--;
+                return 1;
+            }
+        }
+        return 0;
+    }
+#endif
+    append_request(&io->pending_head, &io->pending_tail, request);
+    return 0;
+}
+
+
+int async_io_read(AsyncIo_t* io, int fd, void* buffer, size_t size, uint64_t offset, int buffer_index, void* tag) {
+    return queue_request(io, fd, 0, buffer, size, offset, buffer_index, tag);
+}
+
+
+int async_io_write(AsyncIo_t* io, int fd, const void* buffer, size_t size, uint64_t offset, int buffer_index, void* tag) {
+    return queue_request(io, fd, 1, (void*)buffer, size, offset, buffer_index, tag);
+}
+
+
+int async_io_submit(AsyncIo_t* io) {
+#ifdef ASYNC_IO_HAVE_URING
+    if (io->backend == ASYNC_IO_BACKEND_URING) {
+        return io->ring.unsubmitted > 0 ? uring_enter(&io->ring, 0) : 0;
+    }
+#endif
+    if (io->pending_head == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&io->lock);
+    if (io->work_tail == NULL) {
+        io->work_head = io->pending_head;
+    } else {
+        io->work_tail->next = io->pending_head;
+    }
+    io->work_tail = io->pending_tail;
+    pthread_cond_broadcast(&io->work_ready);
+    pthread_mutex_unlock(&io->lock);
+    io->pending_head = NULL;
+    io->pending_tail = NULL;
+    return 0;
+}
+
+
+unsigned int async_io_wait(AsyncIo_t* io, AsyncIoCompletion_t* completions, unsigned int max, unsigned int min) {
+#ifdef ASYNC_IO_HAVE_URING
+    if (io->backend == ASYNC_IO_BACKEND_URING) {
+        return uring_wait(io, completions, max, min);
+    }
+#endif
+    return threads_wait(io, completions, max, min);
+}
+
+
+unsigned int async_io_in_flight(const AsyncIo_t* io) {
+    return io->in_flight;
+}
+
+
+void async_io_destroy(AsyncIo_t* io) {
+    if (io == NULL) return;
+
+    // The buffers of requests still running must not be freed under them
+    AsyncIoCompletion_t completions[16];
+    while (io->in_flight > 0 && async_io_wait(io, completions, 16, 1) > 0) {
+    }
+
+#ifdef ASYNC_IO_HAVE_URING
+    if (io->backend == ASYNC_IO_BACKEND_URING) {
+        uring_teardown(&io->ring);
+    }
+#endif
+    pthread_mutex_lock(&io->lock);
+    io->stopping = 1;
+    pthread_cond_broadcast(&io->work_ready);
+    pthread_mutex_unlock(&io->lock);
+    for (int i = 0; i < io->thread_count; i++) {
+        pthread_join(io->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->work_ready);
+    pthread_cond_destroy(&io->work_done);
+    free(io->buffer_bases);
+    free(io->buffer_sizes);
+    free(io->requests);
+    free(io);
+}
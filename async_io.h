@@ -0,0 +1,69 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Queued file I/O. Reads and writes of whole ranges are queued with a tag, handed to
+the system together by async_io_submit, and reported back by async_io_wait in
+whatever order they finish, so one thread can keep many files moving while others
+compute. On Linux the requests go through io_uring, set up with the raw system calls;
+elsewhere, built against kernel headers older than 5.6, or where the kernel refuses
+io_uring, a few threads run them with
+positioned reads and writes. Short transfers are continued until the whole range is
+done. An AsyncIo_t must only be used by one thread at a time. */
+#define ASYNC_IO_BACKEND_URING 1
+#define ASYNC_IO_BACKEND_THREADS 2
+
+// async_io_create flags
+#define ASYNC_IO_FORCE_THREADS 0x01 // Use the thread back end even where io_uring works
+
+// A buffer index for a request into memory that was never registered
+#define ASYNC_IO_NO_BUFFER (-1)
+
+typedef struct AsyncIo AsyncIo_t;
+
+typedef struct AsyncIoCompletion {
+    void* tag;    // As given when the request was queued
+    int status;   // 0 if the whole range was transferred
+    size_t bytes; // Bytes transferred
+} AsyncIoCompletion_t;
+
+// Function to set up a queue that holds up to depth requests at once
+// Returns NULL on failure
+AsyncIo_t* async_io_create(unsigned int depth, int flags);
+
+// Function to tell which back end a queue runs on
+int async_io_backend(const AsyncIo_t* io);
+
+// Function to register buffers the system keeps mapped, so requests into them (given the
+// buffer's index) skip mapping the pages each time; replaces any registered before and must
+// be called with no requests queued. The thread back end just records them.
+// Returns 0 on success, non-zero on failure
+int async_io_register_buffers(AsyncIo_t* io, void* const* buffers, const size_t* sizes, unsigned int count);
+
+// Function to queue a read of size bytes at offset of fd into buffer, which lies inside
+// registered buffer buffer_index or ASYNC_IO_NO_BUFFER
+// Returns 0 on success, non-zero on failure, including a full queue
+int async_io_read(AsyncIo_t* io, int fd, void* buffer, size_t size, uint64_t offset, int buffer_index, void* tag);
+
+// Function to queue a write of size bytes from buffer at offset of fd, as async_io_read
+// Returns 0 on success, non-zero on failure, including a full queue
+int async_io_write(AsyncIo_t* io, int fd, const void* buffer, size_t size, uint64_t offset, int buffer_index, void* tag);
+
+// Function to start every request queued since the last submit
+// Returns 0 on success, non-zero on failure
+int async_io_submit(AsyncIo_t* io);
+
+// Function to submit, then collect up to max finished requests, blocking until at least
+// min have finished (or none are left in flight)
+// Returns the number of completions written
+unsigned int async_io_wait(AsyncIo_t* io, AsyncIoCompletion_t* completions, unsigned int max, unsigned int min);
+
+// Function to get the requests queued or running
+unsigned int async_io_in_flight(const AsyncIo_t* io);
+
+// Function to wait for every request still in flight and free the queue
+void async_io_destroy(AsyncIo_t* io);
+
+#endif // ASYNC_IO_H
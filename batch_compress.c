@@ -0,0 +1,664 @@
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include "batch_compress.h"
+#include "async_io.h"
+#include "encryption.h"
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define BATCH_BUFFERED_PER_WORKER 2     // Images read ahead or waiting to be written, for each worker
+#define BATCH_IO_DEPTH 64               // Reads and writes in flight at once
+#define BATCH_MAX_SLOT_SIZE (16u << 20) // Largest image read into a registered buffer
+
+// Where a file's input is
+#define INPUT_NOT_REQUESTED 0
+#define INPUT_READING 1
+#define INPUT_READY 2
+#define INPUT_DIRECT 3 // Not read for the worker, which loads the image itself
+
+
+typedef struct BatchFile {
+    char* name;
+    uint64_t size;
+    double start;           // When its task began
+    double seconds;         // From its task beginning to its output being written
+    int status;
+    int input_state;
+    unsigned char* input;   // The image, once INPUT_READY
+    int input_slot;         // Its registered buffer, or ASYNC_IO_NO_BUFFER if malloc'd
+    unsigned char* output;  // The file to write, from the worker
+    size_t output_size;
+    int writing;            // Its I/O in flight is the write, not the read
+    int fd;
+} BatchFile_t;
+
+
+typedef struct Batch {
+    BatchFile_t* files;       // In the order they are queued, largest first
+    size_t count;
+    const char* key;          // NULL to compress without encrypting
+    int cipher;
+    CompressionOptions_t options;
+    AsyncIo_t* io;            // NULL if every worker loads and saves its own images
+    size_t buffered_limit;
+    size_t buffered;          // Images read or being read, or waiting to be written
+    size_t next_read;         // Next file the reader looks at in queue order
+    size_t* urgent;           // Files a worker began before the reader got to them
+    size_t urgent_head;
+    size_t urgent_tail;
+    size_t* writes;           // Files whose output is waiting to be queued
+    size_t write_head;
+    size_t write_tail;
+    unsigned char** slots;    // Registered read buffers, slot_size bytes each
+    size_t slot_size;
+    int* free_slots;
+    unsigned int free_slot_count;
+    int registered;           // The slots are registered with io
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t io_wake;   // Signalled when the I/O thread has new work
+    pthread_cond_t ready;     // Signalled when an input is read or a buffered image is written
+} Batch_t;
+
+
+typedef struct BatchTask {
+    Batch_t* batch;
+    size_t index;
+} BatchTask_t;
+
+
+/*******************************************************************************
+ * Function Prototypes
+*******************************************************************************/
+static double now_seconds(void);
+static int has_image_suffix(const char* name);
+static int add_file(BatchFile_t** files, size_t* count, size_t* capacity, const char* name);
+static int list_directory(BatchFile_t** files, size_t* count);
+static int compare_files(const void* a, const void* b);
+static int compare_seconds(const void* a, const void* b);
+static int open_file(const char* path, int write);
+static int close_file(int fd);
+static int start_io(Batch_t* batch, unsigned int workers);
+static void stop_io(Batch_t* batch);
+static void release_input(Batch_t* batch, BatchFile_t* file);
+static void start_read(Batch_t* batch, size_t index);
+static void start_write(Batch_t* batch, size_t index);
+static void finish_io(Batch_t* batch, const AsyncIoCompletion_t* completion);
+static void* io_main(void* argument);
+static void compress_task(void* argument);
+static double percentile(const double* sorted, size_t count, int percent);
+static int run_batch(BatchFile_t* files, size_t count, const char* key, int cipher,
+                     const CompressionOptions_t* options, BatchStats_t* stats);
+static void free_files(BatchFile_t* files, size_t count);
+
+
+static double now_seconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+#endif
+}
+
+
+static int has_image_suffix(const char* name) {
+    size_t length = strlen(name);
+    size_t suffix_length = strlen(BATCH_IMAGE_SUFFIX);
+    if (length <= suffix_length) {
+        return 0;
+    }
+    for (size_t i = 0; i < suffix_length; i++) {
+        if (tolower((unsigned char)name[length - suffix_length + i]) != BATCH_IMAGE_SUFFIX[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+// Add an image from IMAGE_DIRECTORY to the list with its size; one that can't be found still goes in, to fail
+static int add_file(BatchFile_t** files, size_t* count, size_t* capacity, const char* name) {
+    if (*count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 64;
+        BatchFile_t* new_files = (BatchFile_t*)realloc(*files, new_capacity * sizeof(BatchFile_t));
+        if (new_files == NULL) {
+            printf("Memory allocation failed for batch\n");
+            return 1;
+        }
+        *files = new_files;
+        *capacity = new_capacity;
+    }
+
+    BatchFile_t* file = &(*files)[*count];
+    memset(file, 0, sizeof(BatchFile_t));
+    file->name = (char*)malloc(strlen(name) + 1);
+    char* path = create_full_path(IMAGE_DIRECTORY, name);
+    if (file->name == NULL || path == NULL) {
+        printf("Memory allocation failed for batch\n");
+        free(file->name);
+        free(path);
+        return 1;
+    }
+    strcpy(file->name, name);
+    struct stat info;
+    if (stat(path, &info) == 0) {
+        file->size = (uint64_t)info.st_size;
+    }
+    free(path);
+    (*count)++;
+    return 0;
+}
+
+
+static int list_directory(BatchFile_t** files, size_t* count) {
+    size_t capacity = 0;
+    *files = NULL;
+    *count = 0;
+    int status = 0;
+
+#ifdef _WIN32
+    char* pattern = create_full_path(IMAGE_DIRECTORY, "*");
+    if (pattern == NULL) {
+        return 1;
+    }
+    WIN32_FIND_DATAA entry;
+    HANDLE search = FindFirstFileA(pattern, &entry);
+    free(pattern);
+    if (search == INVALID_HANDLE_VALUE) {
+        printf("Error reading image directory\n");
+        return 1;
+    }
+    do {
+        if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && has_image_suffix(entry.cFileName)) {
+            status = add_file(files, count, &capacity, entry.cFileName);
+        }
+    } while (status == 0 && FindNextFileA(search, &entry));
+    FindClose(search);
+#else
+    DIR* directory = opendir(IMAGE_DIRECTORY);
+    if (directory == NULL) {
+        printf("Error reading image directory\n");
+        return 1;
+    }
+    struct dirent* entry;
+    while (status == 0 && (entry = readdir(directory)) != NULL) {
+        if (has_image_suffix(entry->d_name)) {
+            status = add_file(files, count, &capacity, entry->d_name);
+        }
+    }
+    closedir(directory);
+#endif
+
+    if (status) {
+        free_files(*files, *count);
+        *files = NULL;
+        *count = 0;
+    }
+    return status;
+}
+
+
+// Largest first, then by name so a batch always runs in the same order
+static int compare_files(const void* a, const void* b) {
+    const BatchFile_t* file_a = (const BatchFile_t*)a;
+    const BatchFile_t* file_b = (const BatchFile_t*)b;
+    if (file_a->size != file_b->size) {
+        return file_a->size < file_b->size ? 1 : -1;
+    }
+    return strcmp(file_a->name, file_b->name);
+}
+
+
+static int compare_seconds(const void* a, const void* b) {
+    double seconds_a = *(const double*)a;
+    double seconds_b = *(const double*)b;
+    return (seconds_a > seconds_b) - (seconds_a < seconds_b);
+}
+
+
+static int open_file(const char* path, int write) {
+#ifdef _WIN32
+    return write ? _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE)
+                 : _open(path, _O_RDONLY | _O_BINARY);
+#else
+    return write ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : open(path, O_RDONLY);
+#endif
+}
+
+
+static int close_file(int fd) {
+#ifdef _WIN32
+    return _close(fd);
+#else
+    return close(fd);
+#endif
+}
+
+
+// Set up the queue and read buffers the I/O thread uses; without them the workers load and save their own images
+static int start_io(Batch_t* batch, unsigned int workers) {
+    batch->buffered_limit = (size_t)workers * BATCH_BUFFERED_PER_WORKER;
+    batch->urgent = (size_t*)malloc(batch->count * sizeof(size_t));
+    batch->writes = (size_t*)malloc(batch->count * sizeof(size_t));
+    batch->slots = (unsigned char**)calloc(batch->buffered_limit, sizeof(unsigned char*));
+    batch->free_slots = (int*)malloc(batch->buffered_limit * sizeof(int));
+    size_t* slot_sizes = (size_t*)malloc(batch->buffered_limit * sizeof(size_t));
+    if (batch->urgent == NULL || batch->writes == NULL || batch->slots == NULL || batch->free_slots == NULL ||
+        slot_sizes == NULL) {
+        free(slot_sizes);
+        return 1;
+    }
+    batch->io = async_io_create(BATCH_IO_DEPTH, 0);
+    if (batch->io == NULL) {
+        free(slot_sizes);
+        return 1;
+    }
+
+    // Sized for the largest image, which comes first, unless that would take too much memory
+    batch->slot_size = batch->files[0].size < BATCH_MAX_SLOT_SIZE ? (size_t)batch->files[0].size : BATCH_MAX_SLOT_SIZE;
+    if (batch->slot_size > 0) {
+        for (size_t i = 0; i < batch->buffered_limit; i++) {
+            batch->slots[i] = (unsigned char*)malloc(batch->slot_size);
+            if (batch->slots[i] == NULL) {
+                break;
+            }
+            slot_sizes[i] = batch->slot_size;
+            batch->free_slots[batch->free_slot_count] = (int)batch->free_slot_count;
+            batch->free_slot_count++;
+        }
+    }
+    // Unregistered slots still save an allocation per image
+    batch->registered = batch->free_slot_count > 0 &&
+                        async_io_register_buffers(batch->io, (void* const*)batch->slots, slot_sizes,
+                                                  batch->free_slot_count) == 0;
+    free(slot_sizes);
+    return 0;
+}
+
+
+static void stop_io(Batch_t* batch) {
+    async_io_destroy(batch->io);
+    batch->io = NULL;
+    if (batch->slots != NULL) {
+        for (size_t i = 0; i < batch->buffered_limit; i++) {
+            free(batch->slots[i]);
+        }
+    }
+    free(batch->slots);
+    free(batch->free_slots);
+    free(batch->urgent);
+    free(batch->writes);
+}
+
+
+static void release_input(Batch_t* batch, BatchFile_t* file) {
+    if (file->input_slot != ASYNC_IO_NO_BUFFER) {
+        batch->free_slots[batch->free_slot_count++] = file->input_slot;
+    } else {
+        free(file->input);
+    }
+    file->input = NULL;
+}
+
+
+// Queue the read of an image already marked INPUT_READING; one that can't be queued is left to its worker
+static void start_read(Batch_t* batch, size_t index) {
+    BatchFile_t* file = &batch->files[index];
+    char* path = create_full_path(IMAGE_DIRECTORY, file->name);
+    file->fd = path != NULL ? open_file(path, 0) : -1;
+    free(path);
+
+    if (file->fd >= 0 && file->size > 0 && file->size <= SIZE_MAX) {
+        file->input_slot = ASYNC_IO_NO_BUFFER;
+        if (file->size <= batch->slot_size && batch->free_slot_count > 0) {
+            file->input_slot = batch->free_slots[--batch->free_slot_count];
+            file->input = batch->slots[file->input_slot];
+        } else {
+            file->input = (unsigned char*)malloc((size_t)file->size);
+        }
+        int buffer_index = batch->registered ? file->input_slot : ASYNC_IO_NO_BUFFER;
+        file->writing = 0;
+        if (file->input != NULL &&
+            async_io_read(batch->io, file->fd, file->input, (size_t)file->size, 0, buffer_index, file) == 0) {
+            return;
+        }
+        if (file->input != NULL) {
+            release_input(batch, file);
+        }
+    }
+    if (file->fd >= 0) {
+        close_file(file->fd);
+    }
+    file->input_state = INPUT_DIRECT;
+    batch->buffered--;
+    pthread_cond_broadcast(&batch->ready);
+}
+
+
+static void start_write(Batch_t* batch, size_t index) {
+    BatchFile_t* file = &batch->files[index];
+    char* path = batch->key != NULL ? encrypted_database_path(file->name) : compressed_database_path(file->name);
+    file->fd = path != NULL ? open_file(path, 1) : -1;
+    free(path);
+
+    file->writing = 1;
+    if (file->fd >= 0 &&
+        async_io_write(batch->io, file->fd, file->output, file->output_size, 0, ASYNC_IO_NO_BUFFER, file) == 0) {
+        return;
+    }
+    if (file->fd >= 0) {
+        close_file(file->fd);
+    }
+    free(file->output);
+    file->output = NULL;
+    file->status = 1;
+    file->seconds = now_seconds() - file->start;
+    batch->buffered--;
+    pthread_cond_broadcast(&batch->ready);
+}
+
+
+static void finish_io(Batch_t* batch, const AsyncIoCompletion_t* completion) {
+    BatchFile_t* file = (BatchFile_t*)completion->tag;
+    int status = completion->status;
+    if (close_file(file->fd)) {
+        status = 1;
+    }
+
+    if (!file->writing) {
+        if (status) {
+            // The worker tries again itself, and reports why it fails
+            release_input(batch, file);
+            file->input_state = INPUT_DIRECT;
+            batch->buffered--;
+        } else {
+            file->input_state = INPUT_READY;
+        }
+    } else {
+        free(file->output);
+        file->output = NULL;
+        file->status = status;
+        file->seconds = now_seconds() - file->start;
+        batch->buffered--;
+    }
+    pthread_cond_broadcast(&batch->ready);
+}
+
+
+/* The I/O thread owns the queue. It reads images ahead of the workers in the order
+they were queued, up to a budget of images held in memory, and writes the outputs
+the workers hand back, so a worker only waits on the disk when it outruns it. */
+static void* io_main(void* argument) {
+    Batch_t* batch = (Batch_t*)argument;
+    AsyncIoCompletion_t completions[BATCH_IO_DEPTH];
+
+    pthread_mutex_lock(&batch->lock);
+    while (1) {
+        // Reads a worker is waiting for go first, then writes, which free memory, then reads ahead
+        while (batch->urgent_head < batch->urgent_tail && async_io_in_flight(batch->io) < BATCH_IO_DEPTH) {
+            start_read(batch, batch->urgent[batch->urgent_head++]);
+        }
+        while (batch->write_head < batch->write_tail && async_io_in_flight(batch->io) < BATCH_IO_DEPTH) {
+            start_write(batch, batch->writes[batch->write_head++]);
+        }
+        while (batch->next_read < batch->count && batch->buffered < batch->buffered_limit &&
+               async_io_in_flight(batch->io) < BATCH_IO_DEPTH) {
+            size_t index = batch->next_read++;
+            if (batch->files[index].input_state == INPUT_NOT_REQUESTED) {
+                batch->files[index].input_state = INPUT_READING;
+                batch->buffered++;
+                start_read(batch, index);
+            }
+        }
+
+        if (async_io_in_flight(batch->io) == 0) {
+            if (batch->stopping) {
+                break;
+            }
+            pthread_cond_wait(&batch->io_wake, &batch->lock);
+            continue;
+        }
+        // Work the workers add meanwhile waits for the next completion, which is never far off
+        pthread_mutex_unlock(&batch->lock);
+        unsigned int done = async_io_wait(batch->io, completions, BATCH_IO_DEPTH, 1);
+        pthread_mutex_lock(&batch->lock);
+        for (unsigned int i = 0; i < done; i++) {
+            finish_io(batch, &completions[i]);
+        }
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+
+static void compress_task(void* argument) {
+    BatchTask_t* task = (BatchTask_t*)argument;
+    Batch_t* batch = task->batch;
+    BatchFile_t* file = &batch->files[task->index];
+
+    pthread_mutex_lock(&batch->lock);
+    file->start = now_seconds();
+    if (batch->io == NULL) {
+        file->input_state = INPUT_DIRECT;
+    }
+    // Not read ahead yet (a stolen task, or the reader is behind): ask for it first, within a wider budget
+    while (file->input_state == INPUT_NOT_REQUESTED && batch->buffered >= 2 * batch->buffered_limit) {
+        pthread_cond_wait(&batch->ready, &batch->lock);
+    }
+    if (file->input_state == INPUT_NOT_REQUESTED) {
+        file->input_state = INPUT_READING;
+        batch->buffered++;
+        batch->urgent[batch->urgent_tail++] = task->index;
+        pthread_cond_signal(&batch->io_wake);
+    }
+    while (file->input_state == INPUT_READING) {
+        pthread_cond_wait(&batch->ready, &batch->lock);
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    if (file->input_state == INPUT_DIRECT) {
+        if (batch->key != NULL) {
+            file->status = compress_and_encrypt_to_database(file->name, batch->key, batch->cipher, &batch->options);
+        } else {
+            file->status = compress_image_to_database_with_options(file->name, &batch->options);
+        }
+        file->seconds = now_seconds() - file->start;
+        return;
+    }
+
+    int status;
+    if (batch->key != NULL) {
+        status = compress_and_encrypt_buffer(file->input, file->size, batch->key, batch->cipher, &batch->options,
+                                             &file->output, &file->output_size);
+    } else {
+        status = compress_data_to_buffer(file->input, file->size, &batch->options, &file->output, &file->output_size);
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    release_input(batch, file);
+    if (status) {
+        file->status = 1;
+        file->seconds = now_seconds() - file->start;
+        batch->buffered--;
+        pthread_cond_broadcast(&batch->ready);
+    } else {
+        // The output takes the input's place in the budget until it is written
+        batch->writes[batch->write_tail++] = task->index;
+    }
+    pthread_cond_signal(&batch->io_wake);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+
+// Nearest-rank percentile of sorted values
+static double percentile(const double* sorted, size_t count, int percent) {
+    if (count == 0) {
+        return 0.0;
+    }
+    size_t rank = (count * (size_t)percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+
+static int run_batch(BatchFile_t* files, size_t count, const char* key, int cipher,
+                     const CompressionOptions_t* options, BatchStats_t* stats) {
+    memset(stats, 0, sizeof(BatchStats_t));
+    stats->files = count;
+    if (count == 0) {
+        return 0;
+    }
+
+    Batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.files = files;
+    batch.count = count;
+    batch.key = key;
+    batch.cipher = cipher;
+    if (options != NULL) {
+        batch.options = *options;
+    } else {
+        default_compression_options(&batch.options);
+    }
+    // The pool already keeps every core busy with a file each, so blocks and cipher chunks are coded in turn
+    batch.options.thread_count = 1;
+    qsort(files, count, sizeof(BatchFile_t), compare_files);
+
+    BatchTask_t* tasks = (BatchTask_t*)malloc(count * sizeof(BatchTask_t));
+    double* latencies = (double*)malloc(count * sizeof(double));
+    ThreadPool_t* pool = thread_pool_create(0);
+    if (tasks == NULL || latencies == NULL || pool == NULL) {
+        printf("Failed to start batch\n");
+        free(tasks);
+        free(latencies);
+        thread_pool_destroy(pool);
+        return 1;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.io_wake, NULL);
+    pthread_cond_init(&batch.ready, NULL);
+
+    double start = now_seconds();
+    pthread_t io_thread;
+    if (start_io(&batch, (unsigned int)thread_pool_default_size()) || pthread_create(&io_thread, NULL, io_main, &batch) != 0) {
+        stop_io(&batch);
+    }
+    for (size_t i = 0; i < count; i++) {
+        tasks[i].batch = &batch;
+        tasks[i].index = i;
+        if (thread_pool_submit(pool, compress_task, &tasks[i])) {
+            compress_task(&tasks[i]);
+        }
+    }
+    thread_pool_wait(pool);
+
+    // The last outputs may still be on their way to the disk
+    if (batch.io != NULL) {
+        pthread_mutex_lock(&batch.lock);
+        batch.stopping = 1;
+        pthread_cond_signal(&batch.io_wake);
+        pthread_mutex_unlock(&batch.lock);
+        pthread_join(io_thread, NULL);
+        stop_io(&batch);
+    }
+    stats->seconds = now_seconds() - start;
+    stats->steals = thread_pool_steal_count(pool);
+    thread_pool_destroy(pool);
+    pthread_cond_destroy(&batch.ready);
+    pthread_cond_destroy(&batch.io_wake);
+    pthread_mutex_destroy(&batch.lock);
+
+    for (size_t i = 0; i < count; i++) {
+        latencies[i] = files[i].seconds;
+        if (files[i].status) {
+            printf("Failed to save %s\n", files[i].name);
+            stats->failed++;
+        } else {
+            stats->input_bytes += files[i].size;
+        }
+    }
+    qsort(latencies, count, sizeof(double), compare_seconds);
+    stats->latency_p50 = percentile(latencies, count, 50);
+    stats->latency_p90 = percentile(latencies, count, 90);
+    stats->latency_p99 = percentile(latencies, count, 99);
+    stats->latency_max = latencies[count - 1];
+    if (stats->seconds > 0) {
+        stats->files_per_second = (double)(count - stats->failed) / stats->seconds;
+        stats->megabytes_per_second = (double)stats->input_bytes / (1024.0 * 1024.0) / stats->seconds;
+    }
+
+    free(tasks);
+    free(latencies);
+    return stats->failed != 0;
+}
+
+
+static void free_files(BatchFile_t* files, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(files[i].name);
+    }
+    free(files);
+}
+
+
+int batch_compress_directory(const char* key, int cipher, const CompressionOptions_t* options, BatchStats_t* stats) {
+    BatchFile_t* files;
+    size_t count;
+    if (list_directory(&files, &count)) {
+        memset(stats, 0, sizeof(BatchStats_t));
+        return 1;
+    }
+    int status = run_batch(files, count, key, cipher, options, stats);
+    free_files(files, count);
+    return status;
+}
+
+
+int batch_compress_files(const char* const* image_names, size_t count, const char* key, int cipher,
+                         const CompressionOptions_t* options, BatchStats_t* stats) {
+    BatchFile_t* files = NULL;
+    size_t listed = 0;
+    size_t capacity = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (add_file(&files, &listed, &capacity, image_names[i])) {
+            free_files(files, listed);
+            memset(stats, 0, sizeof(BatchStats_t));
+            return 1;
+        }
+    }
+    int status = run_batch(files, listed, key, cipher, options, stats);
+    free_files(files, listed);
+    return status;
+}
+
+
+void batch_print_stats(const BatchStats_t* stats) {
+    printf("Batch: %" PRIu64 " images, %" PRIu64 " failed, %.1f MB in %.2f s\n",
+           (uint64_t)stats->files, (uint64_t)stats->failed, (double)stats->input_bytes / (1024.0 * 1024.0), stats->seconds);
+    printf("Throughput: %.1f files/s, %.1f MB/s\n", stats->files_per_second, stats->megabytes_per_second);
+    printf("Latency per image: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n", stats->latency_p50 * 1e3,
+           stats->latency_p90 * 1e3, stats->latency_p99 * 1e3, stats->latency_max * 1e3);
+    printf("Tasks stolen between workers: %" PRIu64 "\n", stats->steals);
+}
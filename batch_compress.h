@@ -0,0 +1,44 @@
+#ifndef BATCH_COMPRESS_H
+#define BATCH_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "huffman_compression.h"
+
+/* Batch ingest of a directory of captures. Every image is compressed (and encrypted,
+given a key) on its own task of a work-stealing pool with a worker per core, largest
+images first so no big one is left to finish alone at the end. An I/O thread reads
+the next images into memory ahead of the workers and writes their outputs through an
+AsyncIo_t queue (io_uring where the kernel has it), so compressing never waits on
+the disk while it keeps up. A file that fails is counted and named, and the rest of
+the batch goes on. */
+#define BATCH_IMAGE_SUFFIX ".bmp"
+
+typedef struct BatchStats {
+    size_t files;          // Images attempted
+    size_t failed;
+    uint64_t input_bytes;  // Bytes of the images compressed successfully
+    double seconds;        // Wall time of the whole batch
+    double files_per_second;
+    double megabytes_per_second; // Input megabytes (2^20 bytes) per second
+    double latency_p50;    // Seconds from a file's task starting to it finishing
+    double latency_p90;
+    double latency_p99;
+    double latency_max;
+    uint64_t steals;       // Tasks a worker took from another worker's queue
+} BatchStats_t;
+
+// Function to compress every BATCH_IMAGE_SUFFIX file in IMAGE_DIRECTORY to the database,
+// or with a key, compress and encrypt them with the given cipher; options NULL for the defaults
+// Returns 0 if every image was saved, non-zero if any failed or the batch could not run
+int batch_compress_directory(const char* key, int cipher, const CompressionOptions_t* options, BatchStats_t* stats);
+
+// Function to do the same for a list of image names in IMAGE_DIRECTORY
+// Returns 0 if every image was saved, non-zero if any failed or the batch could not run
+int batch_compress_files(const char* const* image_names, size_t count, const char* key, int cipher,
+                         const CompressionOptions_t* options, BatchStats_t* stats);
+
+// Function to print the counts, throughput and latency percentiles of a batch
+void batch_print_stats(const BatchStats_t* stats);
+
+#endif // BATCH_COMPRESS_H
@@ -0,0 +1,367 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "huffman_compression.h"
+#include "encryption.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/* Benchmarks for the bench target. Every BMP named on the command line, then a
+generated uniform, random and solid-colour image, is put through the byte histogram,
+the codec context under several coding settings (ratio, compress and decode speed),
+and a whole save and load cycle, four separate steps against the fused pipeline. The
+bench target builds this optimised, with DATA_DIRECTORY pointing at a scratch folder. */
+#define BENCH_KEY "110011010101101010100"
+#define BENCH_CIPHER CIPHER_CHACHA20_POLY1305
+#define BENCH_SECONDS 0.25 // Each measurement repeats for at least this long
+#define BENCH_WIDTH 1024   // Generated images
+#define BENCH_HEIGHT 1024
+
+#define BENCH_UNIFORM 0 // Every byte value equally often
+#define BENCH_RANDOM 1
+#define BENCH_SOLID 2
+
+
+typedef struct BenchSetting {
+    const char* name;
+    int max_code_length;
+    int image_filter;
+    int run_length;
+    int fse;
+    int context_model;
+} BenchSetting_t;
+
+// Plain Huffman at several code length limits, then each pre-pass or coder on top of it
+static const BenchSetting_t bench_settings[] = {
+    {"Huffman, no code limit", 0, 0, 0, 0, 0},
+    {"Huffman, 15-bit codes", 15, 0, 0, 0, 0},
+    {"Huffman, 12-bit codes", 12, 0, 0, 0, 0},
+    {"Huffman, 9-bit codes", 9, 0, 0, 0, 0},
+    {"FSE where smaller", 0, 0, 0, 1, 0},
+    {"context model where smaller", 0, 0, 0, 0, 1},
+    {"image filter", 0, 1, 0, 0, 0},
+    {"run-length", 0, 0, 1, 0, 0},
+    {"everything", 0, 1, 1, 1, 1},
+};
+
+
+/*******************************************************************************
+ * Function Prototypes
+*******************************************************************************/
+static double now_seconds(void);
+static double megabytes_per_second(size_t size, int runs, double seconds);
+static unsigned char* make_bmp(int pattern, size_t* size);
+static unsigned char* read_file(const char* path, size_t* size);
+static int write_file(const char* directory, const char* name, const unsigned char* data, size_t size);
+static int same_file(const char* directory, const char* name, const unsigned char* data, size_t size);
+static void count_naive(const unsigned char* data, size_t size, uint64_t* freq_table);
+static int bench_histogram(const unsigned char* data, size_t size);
+static int bench_setting(const BenchSetting_t* setting, const unsigned char* data, size_t size);
+static int bench_pipeline(const char* name, const unsigned char* data, size_t size);
+static int bench_image(const char* name, const unsigned char* data, size_t size);
+
+
+static double now_seconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+#endif
+}
+
+
+static double megabytes_per_second(size_t size, int runs, double seconds) {
+    return (double)size * runs / (seconds > 0 ? seconds : 1e-9) / 1e6;
+}
+
+
+// A 24-bit BMP whose pixel bytes follow the pattern
+static unsigned char* make_bmp(int pattern, size_t* size) {
+    size_t stride = (BENCH_WIDTH * 3 + 3) / 4 * 4;
+    *size = 54 + stride * BENCH_HEIGHT;
+    unsigned char* bmp = (unsigned char*)calloc(*size, 1);
+    if (bmp == NULL) {
+        return NULL;
+    }
+    uint32_t fields[] = {(uint32_t)*size, 0, 54, 40, BENCH_WIDTH, BENCH_HEIGHT};
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    for (int i = 0; i < 6; i++) {
+        for (int b = 0; b < 4; b++) {
+            bmp[2 + i * 4 + b] = (unsigned char)(fields[i] >> (8 * b));
+        }
+    }
+    bmp[26] = 1;  // Planes
+    bmp[28] = 24; // Bits per pixel
+
+    const unsigned char solid[3] = {40, 120, 200};
+    uint32_t state = 2463534242u;
+    for (size_t y = 0; y < BENCH_HEIGHT; y++) {
+        unsigned char* row = bmp + 54 + y * stride;
+        for (size_t x = 0; x < BENCH_WIDTH * 3; x++) {
+            if (pattern == BENCH_UNIFORM) {
+                row[x] = (unsigned char)(y * BENCH_WIDTH * 3 + x);
+            } else if (pattern == BENCH_RANDOM) {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                row[x] = (unsigned char)(state >> 24);
+            } else {
+                row[x] = solid[x % 3];
+            }
+        }
+    }
+    return bmp;
+}
+
+
+static unsigned char* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Cannot open %s\n", path);
+        return NULL;
+    }
+    unsigned char* data = NULL;
+    long length = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (length >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = (unsigned char*)malloc(length > 0 ? (size_t)length : 1);
+        if (data != NULL && fread(data, 1, (size_t)length, file) != (size_t)length) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    if (data == NULL) {
+        printf("Cannot read %s\n", path);
+        return NULL;
+    }
+    *size = (size_t)length;
+    return data;
+}
+
+
+static int write_file(const char* directory, const char* name, const unsigned char* data, size_t size) {
+    char* path = create_full_path(directory, name);
+    FILE* file = path != NULL ? fopen(path, "wb") : NULL;
+    free(path);
+    if (file == NULL) {
+        printf("Cannot write %s%s\n", directory, name);
+        return 1;
+    }
+    int status = fwrite(data, 1, size, file) != size;
+    return fclose(file) != 0 || status;
+}
+
+
+// Whether the file holds exactly these bytes
+static int same_file(const char* directory, const char* name, const unsigned char* data, size_t size) {
+    char* path = create_full_path(directory, name);
+    size_t file_size = 0;
+    unsigned char* file = path != NULL ? read_file(path, &file_size) : NULL;
+    int same = file != NULL && file_size == size && memcmp(file, data, size) == 0;
+    free(file);
+    free(path);
+    return same;
+}
+
+
+// The one-counter loop the interleaved histogram replaced, as the baseline
+static void count_naive(const unsigned char* data, size_t size, uint64_t* freq_table) {
+    memset(freq_table, 0, 256 * sizeof(uint64_t));
+    for (size_t i = 0; i < size; i++) {
+        freq_table[data[i]]++;
+    }
+}
+
+
+static int bench_histogram(const unsigned char* data, size_t size) {
+    uint64_t naive[256];
+    uint64_t counted[256];
+    double speeds[2];
+    for (int method = 0; method < 2; method++) {
+        int runs = 0;
+        double start = now_seconds();
+        double elapsed;
+        do {
+            if (method == 0) {
+                count_naive(data, size, naive);
+            } else {
+                count_frequencies(data, size, counted);
+            }
+            runs++;
+            elapsed = now_seconds() - start;
+        } while (elapsed < BENCH_SECONDS);
+        speeds[method] = megabytes_per_second(size, runs, elapsed);
+    }
+    int status = memcmp(naive, counted, sizeof(naive)) != 0;
+    printf("  histogram: one counter %8.0f MB/s, count_frequencies %8.0f MB/s (%.1fx)%s\n",
+           speeds[0], speeds[1], speeds[1] / speeds[0], status ? "  COUNTS DIFFER" : "");
+    return status;
+}
+
+
+// Ratio, compress speed and decode speed (parsing the tables each time, then keeping them) of one setting
+static int bench_setting(const BenchSetting_t* setting, const unsigned char* data, size_t size) {
+    CompressionOptions_t options;
+    default_compression_options(&options);
+    options.max_code_length = setting->max_code_length;
+    options.image_filter = setting->image_filter;
+    options.run_length = setting->run_length;
+    options.fse = setting->fse;
+    options.context_model = setting->context_model;
+
+    // The compressed file is copied out, the context's output buffer is reused by the decodes
+    CodecContext_t* ctx = codec_ctx_create(&options);
+    const unsigned char* output;
+    size_t output_size = 0;
+    unsigned char* compressed = NULL;
+    size_t compressed_size = 0;
+    double compress_speed = 0;
+    int status = ctx == NULL;
+    if (status == 0) {
+        int runs = 0;
+        double start = now_seconds();
+        double elapsed;
+        do {
+            status = compress_buffer(ctx, data, size, &output, &output_size);
+            runs++;
+            elapsed = now_seconds() - start;
+        } while (status == 0 && elapsed < BENCH_SECONDS);
+        compress_speed = megabytes_per_second(size, runs, elapsed);
+        compressed_size = output_size;
+        compressed = status ? NULL : (unsigned char*)malloc(output_size);
+        status = compressed == NULL;
+    }
+    if (status == 0) {
+        memcpy(compressed, output, compressed_size);
+    }
+
+    double decode_speeds[2] = {0, 0};
+    DecodeTables_t* tables = NULL;
+    for (int kept = 0; kept < 2 && status == 0; kept++) {
+        int runs = 0;
+        double start = now_seconds();
+        double elapsed;
+        do {
+            if (kept) {
+                status = decompress_buffer_with_tables(ctx, compressed, compressed_size, &tables, &output, &output_size);
+            } else {
+                status = decompress_buffer(ctx, compressed, compressed_size, &output, &output_size);
+            }
+            status = status || output_size != size || memcmp(output, data, size) != 0;
+            runs++;
+            elapsed = now_seconds() - start;
+        } while (status == 0 && elapsed < BENCH_SECONDS);
+        decode_speeds[kept] = megabytes_per_second(size, runs, elapsed);
+    }
+
+    if (status) {
+        printf("  %-28s FAILED\n", setting->name);
+    } else {
+        printf("  %-28s %10zu %7.2f%% %9.1f %9.1f %9.1f\n", setting->name, compressed_size,
+               100.0 * compressed_size / (size ? size : 1), compress_speed, decode_speeds[0], decode_speeds[1]);
+    }
+    decode_tables_destroy(tables);
+    free(compressed);
+    codec_ctx_destroy(ctx);
+    return status;
+}
+
+
+// One save and load through the folders as four steps, each writing a file the next reads back, then through the fused pipeline
+static int bench_pipeline(const char* name, const unsigned char* data, size_t size) {
+    // "green.bmp" is saved as "green_compressed.bmp" and so on
+    char base[200];
+    char names[4][256];
+    snprintf(base, sizeof(base), "%.*s", (int)(strlen(name) > 4 ? strlen(name) - 4 : 0), name);
+    snprintf(names[0], sizeof(names[0]), "%s_compressed.bmp", base);
+    snprintf(names[1], sizeof(names[1]), "%s_compressed_encrypted.bmp", base);
+    snprintf(names[2], sizeof(names[2]), "%s_compressed_decrypted.bmp", base);
+    snprintf(names[3], sizeof(names[3]), "%s_decompressed.bmp", base);
+
+    CompressionOptions_t options;
+    default_compression_options(&options);
+    double seconds[2];
+    int status = 0;
+    for (int fused = 0; fused < 2 && status == 0; fused++) {
+        int runs = 0;
+        double start = now_seconds();
+        double elapsed;
+        do {
+            if (fused) {
+                status = compress_and_encrypt_to_database(name, BENCH_KEY, BENCH_CIPHER, &options) ||
+                         decrypt_and_decompress_to_decompressed(names[1], BENCH_KEY);
+            } else {
+                status = compress_image_to_database(name) ||
+                         encrypt_file_in_database_with_cipher(names[0], BENCH_KEY, BENCH_CIPHER) ||
+                         decrypt_file_from_database(names[1], BENCH_KEY) ||
+                         decompress_file_to_decompressed(names[2]);
+            }
+            runs++;
+            elapsed = now_seconds() - start;
+        } while (status == 0 && elapsed < BENCH_SECONDS);
+        status = status || !same_file(DECOMPRESSED_DIRECTORY, names[3], data, size);
+        seconds[fused] = elapsed / runs;
+    }
+
+    if (status) {
+        printf("  save and load: FAILED\n");
+    } else {
+        printf("  save and load: four steps %8.2f ms, fused %8.2f ms (%.1fx)\n",
+               seconds[0] * 1e3, seconds[1] * 1e3, seconds[0] / seconds[1]);
+    }
+    return status;
+}
+
+
+static int bench_image(const char* name, const unsigned char* data, size_t size) {
+    printf("%s, %zu bytes\n", name, size);
+    int failures = bench_histogram(data, size);
+    printf("  %-28s %10s %8s %9s %9s %9s\n", "setting", "bytes", "ratio", "comp MB/s", "dec MB/s", "kept MB/s");
+    for (size_t i = 0; i < sizeof(bench_settings) / sizeof(bench_settings[0]); i++) {
+        failures += bench_setting(&bench_settings[i], data, size);
+    }
+    failures += write_file(IMAGE_DIRECTORY, name, data, size) || bench_pipeline(name, data, size);
+    printf("\n");
+    return failures;
+}
+
+
+int main(int argc, char** argv) {
+    int failures = 0;
+
+    // The BMPs named on the command line, saved into IMAGE_DIRECTORY under their own names
+    for (int i = 1; i < argc; i++) {
+        const char* name = argv[i];
+        for (const char* c = argv[i]; *c != '\0'; c++) {
+            if (*c == '/' || *c == '\\') {
+                name = c + 1;
+            }
+        }
+        size_t size;
+        unsigned char* data = read_file(argv[i], &size);
+        failures += data == NULL || bench_image(name, data, size);
+        free(data);
+    }
+
+    const char* generated_names[] = {"uniform.bmp", "random.bmp", "solid.bmp"};
+    for (int pattern = BENCH_UNIFORM; pattern <= BENCH_SOLID; pattern++) {
+        size_t size;
+        unsigned char* data = make_bmp(pattern, &size);
+        failures += data == NULL || bench_image(generated_names[pattern], data, size);
+        free(data);
+    }
+
+    printf("%d benchmark(s) failed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,38 @@
+#ifndef BYTE_ORDER_H
+#define BYTE_ORDER_H
+
+#include <stdint.h>
+
+/* Little-endian integers in byte buffers, the order every file format here stores
+them in. The bytes are assembled one at a time, so they work on any host order and
+at any alignment. */
+
+static inline void put_u32_le(unsigned char* destination, uint32_t value) {
+    destination[0] = (unsigned char)value;
+    destination[1] = (unsigned char)(value >> 8);
+    destination[2] = (unsigned char)(value >> 16);
+    destination[3] = (unsigned char)(value >> 24);
+}
+
+
+static inline void put_u64_le(unsigned char* destination, uint64_t value) {
+    put_u32_le(destination, (uint32_t)value);
+    put_u32_le(destination + 4, (uint32_t)(value >> 32));
+}
+
+
+static inline uint16_t get_u16_le(const unsigned char* source) {
+    return (uint16_t)(source[0] | (source[1] << 8));
+}
+
+
+static inline uint32_t get_u32_le(const unsigned char* source) {
+    return (uint32_t)source[0] | ((uint32_t)source[1] << 8) | ((uint32_t)source[2] << 16) | ((uint32_t)source[3] << 24);
+}
+
+
+static inline uint64_t get_u64_le(const unsigned char* source) {
+    return (uint64_t)get_u32_le(source) | ((uint64_t)get_u32_le(source + 4) << 32);
+}
+
+#endif // BYTE_ORDER_H
@@ -0,0 +1,358 @@
+#include "chacha20_poly1305.h"
+#include "byte_order.h"
+#include <string.h>
+
+// The 8-block AVX2 ChaCha20 core is compiled with a target attribute and picked at run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_CHACHA 1
+#endif
+
+#define POLY1305_LIMB_MASK 0x3ffffff
+
+
+/*******************************************************************************
+ * Function Prototypes
+*******************************************************************************/
+static void chacha20_init_state(uint32_t state[16], const unsigned char* key, const unsigned char* nonce, uint32_t counter);
+static void chacha20_block(const uint32_t state[16], unsigned char output[CHACHA20_BLOCK_SIZE]);
+static void poly1305_blocks(Poly1305_t* mac, const unsigned char* data, size_t size, uint32_t high_bit);
+
+
+static void chacha20_init_state(uint32_t state[16], const unsigned char* key, const unsigned char* nonce, uint32_t counter) {
+    // "expand 32-byte k"
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) {
+        state[4 + i] = get_u32_le(key + 4 * i);
+    }
+    state[12] = counter;
+    for (int i = 0; i < 3; i++) {
+        state[13 + i] = get_u32_le(nonce + 4 * i);
+    }
+}
+
+
+#define ROTATE_LEFT(value, count) (((value) << (count)) | ((value) >> (32 - (count))))
+
+#define QUARTER_ROUND(x, a, b, c, d) \
+    x[a] += x[b]; x[d] ^= x[a]; x[d] = ROTATE_LEFT(x[d], 16); \
+    x[c] += x[d]; x[b] ^= x[c]; x[b] = ROTATE_LEFT(x[b], 12); \
+    x[a] += x[b]; x[d] ^= x[a]; x[d] = ROTATE_LEFT(x[d], 8);  \
+    x[c] += x[d]; x[b] ^= x[c]; x[b] = ROTATE_LEFT(x[b], 7)
+
+
+static void chacha20_block(const uint32_t state[16], unsigned char output[CHACHA20_BLOCK_SIZE]) {
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+
+    for (int round = 0; round < 10; round++) {
+        QUARTER_ROUND(x, 0, 4, 8, 12);
+        QUARTER_ROUND(x, 1, 5, 9, 13);
+        QUARTER_ROUND(x, 2, 6, 10, 14);
+        QUARTER_ROUND(x, 3, 7, 11, 15);
+        QUARTER_ROUND(x, 0, 5, 10, 15);
+        QUARTER_ROUND(x, 1, 6, 11, 12);
+        QUARTER_ROUND(x, 2, 7, 8, 13);
+        QUARTER_ROUND(x, 3, 4, 9, 14);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        put_u32_le(output + 4 * i, x[i] + state[i]);
+    }
+}
+
+
+#ifdef HAVE_AVX2_CHACHA
+
+#define VECTOR_QUARTER_ROUND(x, a, b, c, d)                                                            \
+    x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rotate16); \
+    x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = _mm256_xor_si256(x[b], x[c]);                           \
+    x[b] = _mm256_or_si256(_mm256_slli_epi32(x[b], 12), _mm256_srli_epi32(x[b], 20));                   \
+    x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rotate8);  \
+    x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = _mm256_xor_si256(x[b], x[c]);                           \
+    x[b] = _mm256_or_si256(_mm256_slli_epi32(x[b], 7), _mm256_srli_epi32(x[b], 25))
+
+
+/* Eight consecutive blocks at once: vector i holds word i of all eight blocks, so each
+quarter round is eight quarter rounds. The words are transposed back into byte order
+(8x8 32-bit transposes of words 0-7 and 8-15) before the XOR. */
+__attribute__((target("avx2")))
+static void chacha20_xor_8_blocks(const uint32_t state[16], const unsigned char* input, unsigned char* output) {
+    const __m256i rotate16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                              2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rotate8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                             3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    __m256i initial[16];
+    __m256i x[16];
+    for (int i = 0; i < 16; i++) {
+        initial[i] = _mm256_set1_epi32((int)state[i]);
+    }
+    initial[12] = _mm256_add_epi32(initial[12], _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    memcpy(x, initial, sizeof(x));
+
+    for (int round = 0; round < 10; round++) {
+        VECTOR_QUARTER_ROUND(x, 0, 4, 8, 12);
+        VECTOR_QUARTER_ROUND(x, 1, 5, 9, 13);
+        VECTOR_QUARTER_ROUND(x, 2, 6, 10, 14);
+        VECTOR_QUARTER_ROUND(x, 3, 7, 11, 15);
+        VECTOR_QUARTER_ROUND(x, 0, 5, 10, 15);
+        VECTOR_QUARTER_ROUND(x, 1, 6, 11, 12);
+        VECTOR_QUARTER_ROUND(x, 2, 7, 8, 13);
+        VECTOR_QUARTER_ROUND(x, 3, 4, 9, 14);
+    }
+    for (int i = 0; i < 16; i++) {
+        x[i] = _mm256_add_epi32(x[i], initial[i]);
+    }
+
+    for (int half = 0; half < 2; half++) {
+        const __m256i* w = &x[8 * half];
+        __m256i t0 = _mm256_unpacklo_epi32(w[0], w[1]);
+        __m256i t1 = _mm256_unpackhi_epi32(w[0], w[1]);
+        __m256i t2 = _mm256_unpacklo_epi32(w[2], w[3]);
+        __m256i t3 = _mm256_unpackhi_epi32(w[2], w[3]);
+        __m256i t4 = _mm256_unpacklo_epi32(w[4], w[5]);
+        __m256i t5 = _mm256_unpackhi_epi32(w[4], w[5]);
+        __m256i t6 = _mm256_unpacklo_epi32(w[6], w[7]);
+        __m256i t7 = _mm256_unpackhi_epi32(w[6], w[7]);
+
+        // Row r of the low (high) 128-bit lanes: 4 words of block r (r + 4)
+        __m256i rows[8];
+        rows[0] = _mm256_unpacklo_epi64(t0, t2);
+        rows[1] = _mm256_unpackhi_epi64(t0, t2);
+        rows[2] = _mm256_unpacklo_epi64(t1, t3);
+        rows[3] = _mm256_unpackhi_epi64(t1, t3);
+        rows[4] = _mm256_unpacklo_epi64(t4, t6);
+        rows[5] = _mm256_unpackhi_epi64(t4, t6);
+        rows[6] = _mm256_unpacklo_epi64(t5, t7);
+        rows[7] = _mm256_unpackhi_epi64(t5, t7);
+
+        for (int block = 0; block < 4; block++) {
+            __m256i low_block = _mm256_permute2x128_si256(rows[block], rows[block + 4], 0x20);
+            __m256i high_block = _mm256_permute2x128_si256(rows[block], rows[block + 4], 0x31);
+            size_t low_offset = (size_t)block * CHACHA20_BLOCK_SIZE + 32 * half;
+            size_t high_offset = (size_t)(block + 4) * CHACHA20_BLOCK_SIZE + 32 * half;
+            __m256i data = _mm256_loadu_si256((const __m256i*)(input + low_offset));
+            _mm256_storeu_si256((__m256i*)(output + low_offset), _mm256_xor_si256(data, low_block));
+            data = _mm256_loadu_si256((const __m256i*)(input + high_offset));
+            _mm256_storeu_si256((__m256i*)(output + high_offset), _mm256_xor_si256(data, high_block));
+        }
+    }
+}
+#endif
+
+
+void chacha20_xor(const unsigned char key[CHACHA20_KEY_SIZE], const unsigned char nonce[CHACHA20_NONCE_SIZE],
+                  uint32_t counter, const unsigned char* input, unsigned char* output, size_t size) {
+    uint32_t state[16];
+    chacha20_init_state(state, key, nonce, counter);
+
+#ifdef HAVE_AVX2_CHACHA
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        for (; size >= 8 * CHACHA20_BLOCK_SIZE; size -= 8 * CHACHA20_BLOCK_SIZE) {
+            chacha20_xor_8_blocks(state, input, output);
+            state[12] += 8;
+            input += 8 * CHACHA20_BLOCK_SIZE;
+            output += 8 * CHACHA20_BLOCK_SIZE;
+        }
+    }
+#endif
+
+    unsigned char key_stream[CHACHA20_BLOCK_SIZE];
+    while (size > 0) {
+        chacha20_block(state, key_stream);
+        state[12]++;
+        size_t take = size < CHACHA20_BLOCK_SIZE ? size : CHACHA20_BLOCK_SIZE;
+        for (size_t i = 0; i < take; i++) {
+            output[i] = input[i] ^ key_stream[i];
+        }
+        input += take;
+        output += take;
+        size -= take;
+    }
+}
+
+
+void poly1305_init(Poly1305_t* mac, const unsigned char key[POLY1305_KEY_SIZE]) {
+    // r is clamped as it is split into 26-bit limbs
+    mac->r[0] = get_u32_le(key) & 0x3ffffff;
+    mac->r[1] = (get_u32_le(key + 3) >> 2) & 0x3ffff03;
+    mac->r[2] = (get_u32_le(key + 6) >> 4) & 0x3ffc0ff;
+    mac->r[3] = (get_u32_le(key + 9) >> 6) & 0x3f03fff;
+    mac->r[4] = (get_u32_le(key + 12) >> 8) & 0x00fffff;
+    for (int i = 0; i < 5; i++) {
+        mac->h[i] = 0;
+    }
+    for (int i = 0; i < 4; i++) {
+        mac->pad[i] = get_u32_le(key + 16 + 4 * i);
+    }
+    mac->buffer_fill = 0;
+}
+
+
+// h = (h + block) * r mod 2^130 - 5 for each 16-byte block; high_bit is 2^128 in the top limb
+static void poly1305_blocks(Poly1305_t* mac, const unsigned char* data, size_t size, uint32_t high_bit) {
+    const uint32_t r0 = mac->r[0], r1 = mac->r[1], r2 = mac->r[2], r3 = mac->r[3], r4 = mac->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = mac->h[0], h1 = mac->h[1], h2 = mac->h[2], h3 = mac->h[3], h4 = mac->h[4];
+
+    for (; size >= 16; size -= 16, data += 16) {
+        h0 += get_u32_le(data) & POLY1305_LIMB_MASK;
+        h1 += (get_u32_le(data + 3) >> 2) & POLY1305_LIMB_MASK;
+        h2 += (get_u32_le(data + 6) >> 4) & POLY1305_LIMB_MASK;
+        h3 += (get_u32_le(data + 9) >> 6) & POLY1305_LIMB_MASK;
+        h4 += (get_u32_le(data + 12) >> 8) | high_bit;
+
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        uint32_t carry = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & POLY1305_LIMB_MASK;
+        d1 += carry; carry = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & POLY1305_LIMB_MASK;
+        d2 += carry; carry = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & POLY1305_LIMB_MASK;
+        d3 += carry; carry = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & POLY1305_LIMB_MASK;
+        d4 += carry; carry = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & POLY1305_LIMB_MASK;
+        h0 += carry * 5; carry = h0 >> 26; h0 &= POLY1305_LIMB_MASK;
+        h1 += carry;
+    }
+
+    mac->h[0] = h0; mac->h[1] = h1; mac->h[2] = h2; mac->h[3] = h3; mac->h[4] = h4;
+}
+
+
+void poly1305_update(Poly1305_t* mac, const unsigned char* data, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    if (mac->buffer_fill > 0) {
+        size_t take = 16 - mac->buffer_fill;
+        if (take > size) {
+            take = size;
+        }
+        memcpy(mac->buffer + mac->buffer_fill, data, take);
+        mac->buffer_fill += take;
+        data += take;
+        size -= take;
+        if (mac->buffer_fill < 16) {
+            return;
+        }
+        poly1305_blocks(mac, mac->buffer, 16, 1u << 24);
+        mac->buffer_fill = 0;
+    }
+
+    size_t whole = size & ~(size_t)15;
+    poly1305_blocks(mac, data, whole, 1u << 24);
+    memcpy(mac->buffer, data + whole, size - whole);
+    mac->buffer_fill = size - whole;
+}
+
+
+void poly1305_final(Poly1305_t* mac, unsigned char tag[POLY1305_TAG_SIZE]) {
+    // A short last block carries its own 1 byte instead of 2^128
+    if (mac->buffer_fill > 0) {
+        mac->buffer[mac->buffer_fill] = 1;
+        memset(mac->buffer + mac->buffer_fill + 1, 0, 16 - mac->buffer_fill - 1);
+        poly1305_blocks(mac, mac->buffer, 16, 0);
+    }
+
+    uint32_t h0 = mac->h[0], h1 = mac->h[1], h2 = mac->h[2], h3 = mac->h[3], h4 = mac->h[4];
+    uint32_t carry;
+    carry = h1 >> 26; h1 &= POLY1305_LIMB_MASK; h2 += carry;
+    carry = h2 >> 26; h2 &= POLY1305_LIMB_MASK; h3 += carry;
+    carry = h3 >> 26; h3 &= POLY1305_LIMB_MASK; h4 += carry;
+    carry = h4 >> 26; h4 &= POLY1305_LIMB_MASK; h0 += carry * 5;
+    carry = h0 >> 26; h0 &= POLY1305_LIMB_MASK; h1 += carry;
+
+    // g = h - (2^130 - 5); keep g if it didn't go negative, without branching
+    uint32_t g0 = h0 + 5; carry = g0 >> 26; g0 &= POLY1305_LIMB_MASK;
+    uint32_t g1 = h1 + carry; carry = g1 >> 26; g1 &= POLY1305_LIMB_MASK;
+    uint32_t g2 = h2 + carry; carry = g2 >> 26; g2 &= POLY1305_LIMB_MASK;
+    uint32_t g3 = h3 + carry; carry = g3 >> 26; g3 &= POLY1305_LIMB_MASK;
+    uint32_t g4 = h4 + carry - (1u << 26);
+
+    uint32_t select_g = (g4 >> 31) - 1;
+    uint32_t select_h = ~select_g;
+    h0 = (h0 & select_h) | (g0 & select_g);
+    h1 = (h1 & select_h) | (g1 & select_g);
+    h2 = (h2 & select_h) | (g2 & select_g);
+    h3 = (h3 & select_h) | (g3 & select_g);
+    h4 = (h4 & select_h) | (g4 & select_g);
+
+    // tag = (h + pad) mod 2^128
+    uint32_t words[4];
+    words[0] = h0 | (h1 << 26);
+    words[1] = (h1 >> 6) | (h2 << 20);
+    words[2] = (h2 >> 12) | (h3 << 14);
+    words[3] = (h3 >> 18) | (h4 << 8);
+    uint64_t sum = 0;
+    for (int i = 0; i < 4; i++) {
+        sum += (uint64_t)words[i] + mac->pad[i];
+        put_u32_le(tag + 4 * i, (uint32_t)sum);
+        sum >>= 32;
+    }
+
+    memset(mac, 0, sizeof(*mac));
+}
+
+
+void chacha20_poly1305_tag(const unsigned char key[CHACHA20_KEY_SIZE], const unsigned char nonce[CHACHA20_NONCE_SIZE],
+                           const unsigned char* aad, size_t aad_size, const unsigned char* ciphertext, size_t size,
+                           unsigned char tag[POLY1305_TAG_SIZE]) {
+    // The one-time key is the first 32 bytes of block 0, the payload starts at block 1
+    unsigned char block[CHACHA20_BLOCK_SIZE];
+    uint32_t state[16];
+    chacha20_init_state(state, key, nonce, 0);
+    chacha20_block(state, block);
+
+    static const unsigned char zeros[16] = {0};
+    unsigned char lengths[16];
+    for (int i = 0; i < 8; i++) {
+        lengths[i] = (unsigned char)((uint64_t)aad_size >> (8 * i));
+        lengths[8 + i] = (unsigned char)((uint64_t)size >> (8 * i));
+    }
+
+    Poly1305_t mac;
+    poly1305_init(&mac, block);
+    poly1305_update(&mac, aad, aad_size);
+    poly1305_update(&mac, zeros, (16 - aad_size % 16) % 16);
+    poly1305_update(&mac, ciphertext, size);
+    poly1305_update(&mac, zeros, (16 - size % 16) % 16);
+    poly1305_update(&mac, lengths, sizeof(lengths));
+    poly1305_final(&mac, tag);
+    memset(block, 0, sizeof(block));
+}
+
+
+void chacha20_poly1305_seal(const unsigned char key[CHACHA20_KEY_SIZE], const unsigned char nonce[CHACHA20_NONCE_SIZE],
+                            const unsigned char* aad, size_t aad_size, const unsigned char* plaintext,
+                            unsigned char* ciphertext, size_t size, unsigned char tag[POLY1305_TAG_SIZE]) {
+    chacha20_xor(key, nonce, 1, plaintext, ciphertext, size);
+    chacha20_poly1305_tag(key, nonce, aad, aad_size, ciphertext, size, tag);
+}
+
+
+int chacha20_poly1305_open(const unsigned char key[CHACHA20_KEY_SIZE], const unsigned char nonce[CHACHA20_NONCE_SIZE],
+                           const unsigned char* aad, size_t aad_size, const unsigned char* ciphertext,
+                           unsigned char* plaintext, size_t size, const unsigned char tag[POLY1305_TAG_SIZE]) {
+    unsigned char expected[POLY1305_TAG_SIZE];
+    chacha20_poly1305_tag(key, nonce, aad, aad_size, ciphertext, size, expected);
+    if (constant_time_compare(expected, tag, POLY1305_TAG_SIZE) != 0) {
+        return 1;
+    }
+    chacha20_xor(key, nonce, 1, ciphertext, plaintext, size);
+    return 0;
+}
+
+
+int constant_time_compare(const unsigned char* a, const unsigned char* b, size_t size) {
+    unsigned char difference = 0;
+    for (size_t i = 0; i < size; i++) {
+        difference |= a[i] ^ b[i];
+    }
+    return difference != 0;
+}
@@ -0,0 +1,51 @@
+#ifndef CHACHA20_POLY1305_H
+#define CHACHA20_POLY1305_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA20_KEY_SIZE 32
+#define CHACHA20_NONCE_SIZE 12
+#define CHACHA20_BLOCK_SIZE 64
+#define POLY1305_KEY_SIZE 32
+#define POLY1305_TAG_SIZE 16
+
+// Running state of a Poly1305 one-time authenticator (RFC 8439 section 2.5)
+typedef struct Poly1305 {
+    uint32_t r[5];           // Clamped key, 26-bit limbs
+    uint32_t h[5];           // Accumulator, 26-bit limbs
+    uint32_t pad[4];
+    unsigned char buffer[16];
+    size_t buffer_fill;
+} Poly1305_t;
+
+// Function to XOR size bytes with the ChaCha20 key stream (RFC 8439 section 2.4),
+// starting at the given block counter; input and output may be the same buffer
+void chacha20_xor(const unsigned char key[CHACHA20_KEY_SIZE], const unsigned char nonce[CHACHA20_NONCE_SIZE],
+                  uint32_t counter, const unsigned char* input, unsigned char* output, size_t size);
+
+void poly1305_init(Poly1305_t* mac, const unsigned char key[POLY1305_KEY_SIZE]);
+void poly1305_update(Poly1305_t* mac, const unsigned char* data, size_t size);
+void poly1305_final(Poly1305_t* mac, unsigned char tag[POLY1305_TAG_SIZE]);
+
+// Function to compute the AEAD tag of a ciphertext and its associated data (RFC 8439 section 2.8)
+void chacha20_poly1305_tag(const unsigned char key[CHACHA20_KEY_SIZE], const unsigned char nonce[CHACHA20_NONCE_SIZE],
+                           const unsigned char* aad, size_t aad_size, const unsigned char* ciphertext, size_t size,
+                           unsigned char tag[POLY1305_TAG_SIZE]);
+
+// Function to encrypt size bytes and compute their tag
+void chacha20_poly1305_seal(const unsigned char key[CHACHA20_KEY_SIZE], const unsigned char nonce[CHACHA20_NONCE_SIZE],
+                            const unsigned char* aad, size_t aad_size, const unsigned char* plaintext,
+                            unsigned char* ciphertext, size_t size, unsigned char tag[POLY1305_TAG_SIZE]);
+
+// Function to check the tag and, only if it matches, decrypt size bytes
+// Returns 0 on success, non-zero if the tag does not match (plaintext is left untouched)
+int chacha20_poly1305_open(const unsigned char key[CHACHA20_KEY_SIZE], const unsigned char nonce[CHACHA20_NONCE_SIZE],
+                           const unsigned char* aad, size_t aad_size, const unsigned char* ciphertext,
+                           unsigned char* plaintext, size_t size, const unsigned char tag[POLY1305_TAG_SIZE]);
+
+// Function to compare two byte strings in time that depends only on their length
+// Returns 0 if they are equal
+int constant_time_compare(const unsigned char* a, const unsigned char* b, size_t size);
+
+#endif // CHACHA20_POLY1305_H
@@ -0,0 +1,653 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "huffman_compression.h"
+#include "encryption.h"
+#include "image_filter.h"
+#include "image_database.h"
+#include "async_io.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Round trips for the check target. A generated BMP goes through the file save and
+load paths, the memory codec with its context, and both stream modes, under every
+coding option. The check target builds this with the sanitizers and DATA_DIRECTORY
+pointing at a scratch folder, so a leak anywhere on these paths fails the build. */
+#define CHECK_IMAGE_NAME "check.bmp"
+#define CHECK_KEY "110011010101101010100"
+#define CHECK_WRONG_KEY "110011010101101010101"
+#define CHECK_RANGE_NAME "range.bmp"
+#define CHECK_RANGE_SIZE ((size_t)5 << 19) // Two and a half of the chunked cipher's 1 MiB chunks
+#define CHECK_WIDTH 123
+#define CHECK_HEIGHT 77
+#define CHECK_STREAM_CHUNK 1000 // Bytes handed to the stream coders at a time
+#define CHECK_DATABASE_IMAGES 40
+#define CHECK_DATABASE_IMAGE_SIZE 20000 // Noise, so a few images fill a check-sized pack segment
+#define CHECK_ASYNC_NAME "async.bin"
+#define CHECK_ASYNC_SIZE 100000
+
+
+typedef struct Buffer {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+} Buffer_t;
+
+
+/*******************************************************************************
+ * Function Prototypes
+*******************************************************************************/
+static unsigned char* make_bmp(size_t* size);
+static unsigned char* read_whole_file(const char* directory, const char* name, size_t* size);
+static int write_whole_file(const char* directory, const char* name, const unsigned char* data, size_t size);
+static int same_bytes(const unsigned char* a, size_t a_size, const unsigned char* b, size_t b_size);
+static int check_files(const unsigned char* image, size_t image_size);
+static int check_rejected(int cipher, int modify);
+static int check_chunked_range(void);
+static int check_codec_context(const unsigned char* image, size_t image_size, const CompressionOptions_t* options);
+static int check_dictionary(const unsigned char* image, size_t image_size);
+static int append_to_buffer(void* context, const unsigned char* data, size_t size);
+static int check_stream(const unsigned char* image, size_t image_size, int mode, const CompressionOptions_t* options);
+static int check_filter_layouts(const unsigned char* image, size_t image_size);
+static void make_noise(unsigned char* data, size_t size, uint32_t seed);
+static int load_matches(ImageDatabase_t* database, const ImageKey_t* key, const unsigned char* image, size_t size);
+static int check_database(void);
+static int wait_for_all(AsyncIo_t* io, unsigned int count, AsyncIoCompletion_t* completions);
+static int check_async_io(int flags);
+static int report(const char* name, int status);
+
+
+// A 24-bit BMP with smooth gradients, a flat band and some noise, so every coding option has something to do
+static unsigned char* make_bmp(size_t* size) {
+    size_t stride = (CHECK_WIDTH * 3 + 3) / 4 * 4;
+    *size = 54 + stride * CHECK_HEIGHT;
+    unsigned char* bmp = (unsigned char*)calloc(*size, 1);
+    if (bmp == NULL) {
+        return NULL;
+    }
+    uint32_t fields[] = {(uint32_t)*size, 0, 54, 40, CHECK_WIDTH, CHECK_HEIGHT};
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    for (int i = 0; i < 6; i++) {
+        for (int b = 0; b < 4; b++) {
+            bmp[2 + i * 4 + b] = (unsigned char)(fields[i] >> (8 * b));
+        }
+    }
+    bmp[26] = 1;  // Planes
+    bmp[28] = 24; // Bits per pixel
+
+    uint32_t noise = 12345;
+    for (size_t y = 0; y < CHECK_HEIGHT; y++) {
+        unsigned char* row = bmp + 54 + y * stride;
+        for (size_t x = 0; x < CHECK_WIDTH; x++) {
+            noise = noise * 1103515245u + 12345u;
+            int flat = y >= 30 && y < 40;
+            row[x * 3] = flat ? 200 : (unsigned char)(x * 2);
+            row[x * 3 + 1] = flat ? 200 : (unsigned char)(y * 3 + x);
+            row[x * 3 + 2] = flat ? 200 : (unsigned char)(x + y + ((noise >> 16) & 7));
+        }
+    }
+    return bmp;
+}
+
+
+static unsigned char* read_whole_file(const char* directory, const char* name, size_t* size) {
+    char* path = create_full_path(directory, name);
+    FILE* file = path != NULL ? fopen(path, "rb") : NULL;
+    free(path);
+    if (file == NULL) {
+        return NULL;
+    }
+    unsigned char* data = NULL;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long length = ftell(file);
+        data = length >= 0 ? (unsigned char*)malloc((size_t)length + 1) : NULL;
+        *size = (size_t)length;
+        if (data != NULL && (fseek(file, 0, SEEK_SET) != 0 || fread(data, 1, *size, file) != *size)) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    return data;
+}
+
+
+static int write_whole_file(const char* directory, const char* name, const unsigned char* data, size_t size) {
+    char* path = create_full_path(directory, name);
+    FILE* file = path != NULL ? fopen(path, "wb") : NULL;
+    free(path);
+    if (file == NULL) {
+        printf("Cannot write %s%s\n", directory, name);
+        return 1;
+    }
+    int status = fwrite(data, 1, size, file) != size;
+    return fclose(file) != 0 || status;
+}
+
+
+static int same_bytes(const unsigned char* a, size_t a_size, const unsigned char* b, size_t b_size) {
+    return a != NULL && b != NULL && a_size == b_size && memcmp(a, b, a_size) == 0;
+}
+
+
+// Save and load through the folders: plain, and fused with every cipher
+static int check_files(const unsigned char* image, size_t image_size) {
+    int failures = 0;
+    failures += report("save to the database", compress_image_to_database(CHECK_IMAGE_NAME));
+
+    size_t compressed_size = 0;
+    unsigned char* compressed = read_whole_file(CLIENT_DATABASE, "check_compressed.bmp", &compressed_size);
+    char* output_path = create_full_path(DECOMPRESSED_DIRECTORY, "check_buffer.bmp");
+    int status = compressed == NULL || output_path == NULL ||
+                 decompress_buffer_to_file(compressed, compressed_size, output_path);
+    size_t loaded_size = 0;
+    unsigned char* loaded = status ? NULL : read_whole_file(DECOMPRESSED_DIRECTORY, "check_buffer.bmp", &loaded_size);
+    failures += report("load into a file", !same_bytes(image, image_size, loaded, loaded_size));
+    free(loaded);
+    free(output_path);
+    free(compressed);
+
+    CompressionOptions_t options;
+    default_compression_options(&options);
+    const int ciphers[] = {CIPHER_XOR, CIPHER_CHACHA20_POLY1305, CIPHER_CHACHA20_POLY1305_CHUNKED};
+    const char* cipher_names[] = {"fused save and load, XOR", "fused save and load, ChaCha20-Poly1305",
+                                  "fused save and load, chunked ChaCha20-Poly1305"};
+    for (int i = 0; i < 3; i++) {
+        status = compress_and_encrypt_to_database(CHECK_IMAGE_NAME, CHECK_KEY, ciphers[i], &options) ||
+                 decrypt_and_decompress_to_decompressed("check_compressed_encrypted.bmp", CHECK_KEY);
+        loaded = status ? NULL : read_whole_file(DECOMPRESSED_DIRECTORY, "check_decompressed.bmp", &loaded_size);
+        failures += report(cipher_names[i], !same_bytes(image, image_size, loaded, loaded_size));
+        free(loaded);
+    }
+    return failures;
+}
+
+
+/* A fused load must refuse a wrong key, or a byte modified after sealing, before it
+decodes anything: it fails and writes no decompressed file. */
+static int check_rejected(int cipher, int modify) {
+    CompressionOptions_t options;
+    default_compression_options(&options);
+    if (compress_and_encrypt_to_database(CHECK_IMAGE_NAME, CHECK_KEY, cipher, &options)) {
+        return 1;
+    }
+    const char* key = CHECK_WRONG_KEY;
+    if (modify) {
+        // Ciphertext just before the last tag
+        size_t sealed_size = 0;
+        unsigned char* sealed = read_whole_file(COMPRESSED_AND_ENCRYPTED_DIRECTORY, "check_compressed_encrypted.bmp",
+                                                &sealed_size);
+        int status = sealed == NULL || sealed_size < 64;
+        if (status == 0) {
+            sealed[sealed_size - 20] ^= 1;
+            status = write_whole_file(COMPRESSED_AND_ENCRYPTED_DIRECTORY, "check_compressed_encrypted.bmp", sealed,
+                                      sealed_size);
+        }
+        free(sealed);
+        if (status) {
+            return 1;
+        }
+        key = CHECK_KEY;
+    }
+
+    char* output_path = create_full_path(DECOMPRESSED_DIRECTORY, "check_decompressed.bmp");
+    if (output_path == NULL) {
+        return 1;
+    }
+    remove(output_path);
+    int status = decrypt_and_decompress_to_decompressed("check_compressed_encrypted.bmp", key) == 0;
+    FILE* written = fopen(output_path, "rb");
+    if (written != NULL) {
+        fclose(written);
+        status = 1;
+    }
+    free(output_path);
+    return status;
+}
+
+
+// With one chunk of a chunked file modified, a range in another chunk still decrypts and one in the modified chunk does not
+static int check_chunked_range(void) {
+    unsigned char* plain = (unsigned char*)malloc(CHECK_RANGE_SIZE);
+    if (plain == NULL) {
+        return 1;
+    }
+    make_noise(plain, CHECK_RANGE_SIZE, 7);
+    int status = write_whole_file(CLIENT_DATABASE, CHECK_RANGE_NAME, plain, CHECK_RANGE_SIZE) ||
+                 encrypt_file_in_database_with_cipher(CHECK_RANGE_NAME, CHECK_KEY, CIPHER_CHACHA20_POLY1305_CHUNKED);
+
+    // Byte 1000 of the file lies in the first chunk, past the header
+    size_t sealed_size = 0;
+    unsigned char* sealed = status ? NULL : read_whole_file(COMPRESSED_AND_ENCRYPTED_DIRECTORY, "range_encrypted.bmp",
+                                                            &sealed_size);
+    status = sealed == NULL || sealed_size <= CHECK_RANGE_SIZE;
+    if (status == 0) {
+        sealed[1000] ^= 1;
+        status = write_whole_file(COMPRESSED_AND_ENCRYPTED_DIRECTORY, "range_encrypted.bmp", sealed, sealed_size);
+    }
+    free(sealed);
+
+    unsigned char range[1000];
+    size_t offset = CHECK_RANGE_SIZE - 2 * sizeof(range);
+    status = status || decrypt_range_from_database("range_encrypted.bmp", CHECK_KEY, offset, sizeof(range), range) ||
+             memcmp(range, plain + offset, sizeof(range)) != 0 ||
+             decrypt_range_from_database("range_encrypted.bmp", CHECK_KEY, 0, sizeof(range), range) == 0;
+    free(plain);
+    return status;
+}
+
+
+// Compress and decompress twice through one context, which then reuses its buffers, decoding once as is and once keeping the tables
+static int check_codec_context(const unsigned char* image, size_t image_size, const CompressionOptions_t* options) {
+    CodecContext_t* ctx = codec_ctx_create(options);
+    if (ctx == NULL) {
+        return 1;
+    }
+    int status = 0;
+    DecodeTables_t* tables = NULL;
+    for (int round = 0; round < 2 && status == 0; round++) {
+        const unsigned char* compressed;
+        size_t compressed_size;
+        status = compress_buffer(ctx, image, image_size, &compressed, &compressed_size);
+        unsigned char* copy = status ? NULL : (unsigned char*)malloc(compressed_size);
+        if (copy == NULL) {
+            status = 1;
+            break;
+        }
+        memcpy(copy, compressed, compressed_size);
+
+        const unsigned char* output;
+        size_t output_size;
+        status = decompress_buffer(ctx, copy, compressed_size, &output, &output_size) ||
+                 !same_bytes(image, image_size, output, output_size) ||
+                 decompress_buffer_with_tables(ctx, copy, compressed_size, &tables, &output, &output_size) ||
+                 !same_bytes(image, image_size, output, output_size);
+        free(copy);
+        decode_tables_destroy(tables);
+        tables = NULL;
+    }
+    codec_ctx_destroy(ctx);
+    return status;
+}
+
+
+static int check_dictionary(const unsigned char* image, size_t image_size) {
+    const unsigned char* samples[] = {image};
+    size_t sample_sizes[] = {image_size};
+    HuffmanDictionary_t* dictionary = huffman_dictionary_train(samples, sample_sizes, 1, NULL);
+    if (dictionary == NULL) {
+        return 1;
+    }
+    CompressionOptions_t options;
+    default_compression_options(&options);
+    options.dictionary = dictionary;
+    CodecContext_t* ctx = codec_ctx_create(&options);
+    // A context of its own loads the saved dictionary; ctx is handed it instead
+    int status = ctx == NULL || codec_ctx_add_dictionary(ctx, dictionary) || huffman_dictionary_save(dictionary) ||
+                 check_codec_context(image, image_size, &options);
+    if (status == 0) {
+        const unsigned char* compressed;
+        const unsigned char* output;
+        size_t compressed_size;
+        size_t output_size;
+        unsigned char* copy = NULL;
+        status = compress_buffer(ctx, image, image_size, &compressed, &compressed_size) ||
+                 (copy = (unsigned char*)malloc(compressed_size)) == NULL;
+        if (status == 0) {
+            memcpy(copy, compressed, compressed_size);
+            status = decompress_buffer(ctx, copy, compressed_size, &output, &output_size) ||
+                     !same_bytes(image, image_size, output, output_size);
+        }
+        free(copy);
+    }
+    codec_ctx_destroy(ctx);
+    huffman_dictionary_destroy(dictionary);
+    return status;
+}
+
+
+static int append_to_buffer(void* context, const unsigned char* data, size_t size) {
+    Buffer_t* buffer = (Buffer_t*)context;
+    if (size == 0) {
+        return 0;
+    }
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = (buffer->size + size) * 2;
+        unsigned char* grown = (unsigned char*)realloc(buffer->data, capacity);
+        if (grown == NULL) {
+            return 1;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return 0;
+}
+
+
+// Encode in small chunks, then decode in small chunks into a small output window
+static int check_stream(const unsigned char* image, size_t image_size, int mode, const CompressionOptions_t* options) {
+    Buffer_t compressed = {NULL, 0, 0};
+    HuffmanEncoderStream_t* encoder = encoder_stream_create(mode, options, append_to_buffer, &compressed);
+    int status = encoder == NULL;
+    for (int pass = 0; pass < (mode == STREAM_MODE_TWO_PASS ? 2 : 1) && status == 0; pass++) {
+        if (pass == 1) {
+            status = encoder_stream_begin_encode(encoder);
+        }
+        for (size_t offset = 0; offset < image_size && status == 0; offset += CHECK_STREAM_CHUNK) {
+            size_t length = image_size - offset < CHECK_STREAM_CHUNK ? image_size - offset : CHECK_STREAM_CHUNK;
+            status = encoder_stream_feed(encoder, image + offset, length);
+        }
+    }
+    status = status || encoder_stream_finish(encoder);
+    encoder_stream_destroy(encoder);
+
+    Buffer_t decoded = {NULL, 0, 0};
+    HuffmanDecoderStream_t* decoder = status ? NULL : decoder_stream_create();
+    status = status || decoder == NULL;
+    size_t consumed = 0;
+    int result = STREAM_CONTINUE;
+    unsigned char window[CHECK_STREAM_CHUNK];
+    while (status == 0 && result == STREAM_CONTINUE) {
+        size_t available = compressed.size - consumed;
+        size_t input_used = 0;
+        size_t written = 0;
+        result = decoder_stream_decompress(decoder, compressed.data + consumed,
+                                           available < CHECK_STREAM_CHUNK ? available : CHECK_STREAM_CHUNK, &input_used,
+                                           window, sizeof(window), &written);
+        consumed += input_used;
+        status = result == STREAM_ERROR || append_to_buffer(&decoded, window, written) ||
+                 (result == STREAM_CONTINUE && input_used == 0 && written == 0 && available == 0);
+    }
+    decoder_stream_destroy(decoder);
+
+    status = status || !same_bytes(image, image_size, decoded.data, decoded.size);
+    free(compressed.data);
+    free(decoded.data);
+    return status;
+}
+
+
+/* Only 3 and 4-channel layouts may be reverted: one read back from a file with fewer
+channels would have the revert read and write past the planes. Checked directly, and
+through a compressed file whose layout is changed to a single channel. */
+static int check_filter_layouts(const unsigned char* image, size_t image_size) {
+    const ImageLayout_t bad_layouts[] = {
+        {54, 100, 100, 1, 1, COLOUR_TRANSFORM_NONE},
+        {54, 200, 100, 1, 2, COLOUR_TRANSFORM_NONE},
+        {54, 500, 100, 1, 5, COLOUR_TRANSFORM_NONE},
+        {54, 100, 100, 1, 1, COLOUR_TRANSFORM_SUBTRACT_GREEN},
+    };
+    const ImageLayout_t good_layouts[] = {
+        {54, 300, 100, 1, 3, COLOUR_TRANSFORM_SUBTRACT_GREEN},
+        {54, 400, 100, 1, 4, COLOUR_TRANSFORM_NONE},
+    };
+    unsigned char row_filters[5] = {0};
+    unsigned char filtered[600] = {0};
+    unsigned char output[600];
+    for (int i = 0; i < 4; i++) {
+        if (image_layout_check(&bad_layouts[i], sizeof(filtered)) == 0 ||
+            image_filter_revert(&bad_layouts[i], row_filters, filtered, sizeof(filtered), output) == 0) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (image_layout_check(&good_layouts[i], sizeof(filtered)) != 0) {
+            return 1;
+        }
+    }
+
+    // The filter header holds the pixel offset, stride, width and height, then the channel count
+    CompressionOptions_t options;
+    default_compression_options(&options);
+    CodecContext_t* ctx = codec_ctx_create(&options);
+    const unsigned char* compressed;
+    size_t compressed_size;
+    unsigned char* copy = NULL;
+    int status = ctx == NULL || compress_buffer(ctx, image, image_size, &compressed, &compressed_size) ||
+                 (copy = (unsigned char*)malloc(compressed_size)) == NULL;
+    if (status == 0) {
+        memcpy(copy, compressed, compressed_size);
+        unsigned char header[25] = {54};
+        size_t stride = (CHECK_WIDTH * 3 + 3) / 4 * 4;
+        for (int b = 0; b < 4; b++) {
+            header[8 + b] = (unsigned char)(stride >> (8 * b));
+            header[16 + b] = (unsigned char)(CHECK_WIDTH >> (8 * b));
+            header[20 + b] = (unsigned char)(CHECK_HEIGHT >> (8 * b));
+        }
+        header[24] = 3;
+        size_t position = 0;
+        while (position + sizeof(header) <= compressed_size && memcmp(copy + position, header, sizeof(header)) != 0) {
+            position++;
+        }
+        status = position + sizeof(header) > compressed_size; // No filtered planes to tamper with
+        if (status == 0) {
+            copy[position + 24] = 1;
+            const unsigned char* output_data;
+            size_t output_data_size;
+            status = decompress_buffer(ctx, copy, compressed_size, &output_data, &output_data_size) == 0;
+        }
+    }
+    free(copy);
+    codec_ctx_destroy(ctx);
+    return status;
+}
+
+
+static void make_noise(unsigned char* data, size_t size, uint32_t seed) {
+    uint32_t state = seed * 2654435761u + 1;
+    for (size_t i = 0; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[i] = (unsigned char)(state >> 24);
+    }
+}
+
+
+static int load_matches(ImageDatabase_t* database, const ImageKey_t* key, const unsigned char* image, size_t size) {
+    unsigned char* loaded;
+    size_t loaded_size;
+    if (image_database_load(database, key, &loaded, &loaded_size)) {
+        return 0;
+    }
+    int same = same_bytes(image, size, loaded, loaded_size);
+    free(loaded);
+    return same;
+}
+
+
+/* Save enough images to seal several pack segments, save one again, remove three in
+four (and one reference of the duplicate), compact, then reopen and load everything
+back from the replayed journal. One more save after reopening goes into the resumed
+active segment and must survive a second reopen. */
+static int check_database(void) {
+    unsigned char* images = (unsigned char*)malloc((size_t)(CHECK_DATABASE_IMAGES + 1) * CHECK_DATABASE_IMAGE_SIZE);
+    ImageKey_t keys[CHECK_DATABASE_IMAGES + 1];
+    ImageDatabase_t* database = images != NULL ? image_database_open(NULL, NULL) : NULL;
+    int status = database == NULL;
+    for (int i = 0; i <= CHECK_DATABASE_IMAGES && status == 0; i++) {
+        make_noise(images + (size_t)i * CHECK_DATABASE_IMAGE_SIZE, CHECK_DATABASE_IMAGE_SIZE, (uint32_t)i);
+    }
+    for (int i = 0; i < CHECK_DATABASE_IMAGES && status == 0; i++) {
+        status = image_database_save(database, images + (size_t)i * CHECK_DATABASE_IMAGE_SIZE,
+                                     CHECK_DATABASE_IMAGE_SIZE, &keys[i]);
+    }
+
+    // The duplicate only adds a reference, which the first remove takes back
+    ImageKey_t duplicate;
+    ImageRecord_t record;
+    status = status || image_database_save(database, images, CHECK_DATABASE_IMAGE_SIZE, &duplicate) ||
+             memcmp(&duplicate, &keys[0], sizeof(duplicate)) != 0 ||
+             image_database_count(database) != CHECK_DATABASE_IMAGES ||
+             image_database_find(database, &keys[0], &record) || record.references != 2;
+    for (int i = 0; i < CHECK_DATABASE_IMAGES && status == 0; i++) {
+        if (i % 4 != 0 || i == 0) {
+            status = image_database_remove(database, &keys[i]);
+        }
+    }
+    int kept = CHECK_DATABASE_IMAGES / 4;
+    status = status || image_database_count(database) != (uint64_t)kept;
+    if (status == 0) {
+        image_database_compact(database);
+    }
+    image_database_close(database);
+
+    for (int reopen = 0; reopen < 2 && status == 0; reopen++) {
+        database = image_database_open(NULL, NULL);
+        status = database == NULL || image_database_count(database) != (uint64_t)kept + (uint64_t)reopen;
+        for (int i = 0; i < CHECK_DATABASE_IMAGES && status == 0; i += 4) {
+            status = !load_matches(database, &keys[i], images + (size_t)i * CHECK_DATABASE_IMAGE_SIZE,
+                                   CHECK_DATABASE_IMAGE_SIZE);
+        }
+        status = status || image_database_find(database, &keys[1], &record) == 0;
+        if (status == 0 && reopen == 0) {
+            status = image_database_save(database, images + (size_t)CHECK_DATABASE_IMAGES * CHECK_DATABASE_IMAGE_SIZE,
+                                         CHECK_DATABASE_IMAGE_SIZE, &keys[CHECK_DATABASE_IMAGES]);
+        }
+        status = status || !load_matches(database, &keys[CHECK_DATABASE_IMAGES],
+                                         images + (size_t)CHECK_DATABASE_IMAGES * CHECK_DATABASE_IMAGE_SIZE,
+                                         CHECK_DATABASE_IMAGE_SIZE);
+        image_database_close(database);
+    }
+    free(images);
+    return status;
+}
+
+
+// Collect count completions, each tagged with its index
+static int wait_for_all(AsyncIo_t* io, unsigned int count, AsyncIoCompletion_t* completions) {
+    AsyncIoCompletion_t finished[4];
+    unsigned int received = 0;
+    while (received < count) {
+        unsigned int got = async_io_wait(io, finished, 4, 1);
+        if (got == 0) {
+            return 1;
+        }
+        for (unsigned int i = 0; i < got; i++) {
+            size_t index = (size_t)finished[i].tag;
+            if (index >= count) {
+                return 1;
+            }
+            completions[index] = finished[i];
+        }
+        received += got;
+    }
+    return async_io_in_flight(io) != 0;
+}
+
+
+/* Write a file as two requests, then read it back whole into a registered buffer
+alongside a read that runs past the end of the file, which must finish with status 1. */
+static int check_async_io(int flags) {
+    AsyncIo_t* io = async_io_create(8, flags);
+    char* path = create_full_path(DECOMPRESSED_DIRECTORY, CHECK_ASYNC_NAME);
+    unsigned char* data = (unsigned char*)malloc(CHECK_ASYNC_SIZE);
+    unsigned char* read_back = (unsigned char*)malloc(CHECK_ASYNC_SIZE);
+    unsigned char tail[1000];
+    AsyncIoCompletion_t completions[2];
+    int status = io == NULL || path == NULL || data == NULL || read_back == NULL ||
+                 ((flags & ASYNC_IO_FORCE_THREADS) && async_io_backend(io) != ASYNC_IO_BACKEND_THREADS);
+
+    int fd = status ? -1 : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    status = status || fd < 0;
+    if (status == 0) {
+        make_noise(data, CHECK_ASYNC_SIZE, 3);
+        size_t half = CHECK_ASYNC_SIZE / 2;
+        status = async_io_write(io, fd, data, half, 0, ASYNC_IO_NO_BUFFER, (void*)0) ||
+                 async_io_write(io, fd, data + half, CHECK_ASYNC_SIZE - half, half, ASYNC_IO_NO_BUFFER, (void*)1) ||
+                 wait_for_all(io, 2, completions) || completions[0].status != 0 || completions[1].status != 0 ||
+                 completions[0].bytes + completions[1].bytes != CHECK_ASYNC_SIZE;
+    }
+    if (fd >= 0) {
+        status = close(fd) != 0 || status;
+    }
+
+    fd = status ? -1 : open(path, O_RDONLY);
+    status = status || fd < 0;
+    if (status == 0) {
+        void* buffers[] = {read_back};
+        size_t sizes[] = {CHECK_ASYNC_SIZE};
+        status = async_io_register_buffers(io, buffers, sizes, 1) ||
+                 async_io_read(io, fd, read_back, CHECK_ASYNC_SIZE, 0, 0, (void*)0) ||
+                 async_io_read(io, fd, tail, sizeof(tail), CHECK_ASYNC_SIZE - sizeof(tail) / 2, ASYNC_IO_NO_BUFFER,
+                               (void*)1) ||
+                 wait_for_all(io, 2, completions) || completions[0].status != 0 ||
+                 !same_bytes(data, CHECK_ASYNC_SIZE, read_back, completions[0].bytes) || completions[1].status != 1;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    async_io_destroy(io);
+    free(read_back);
+    free(data);
+    free(path);
+    return status;
+}
+
+
+static int report(const char* name, int status) {
+    printf("%-50s %s\n", name, status ? "FAILED" : "ok");
+    return status != 0;
+}
+
+
+int main(void) {
+    size_t image_size;
+    unsigned char* image = make_bmp(&image_size);
+    if (image == NULL || write_whole_file(IMAGE_DIRECTORY, CHECK_IMAGE_NAME, image, image_size)) {
+        printf("Cannot set up the check image\n");
+        free(image);
+        return 1;
+    }
+
+    int failures = check_files(image, image_size);
+    failures += report("wrong key rejected, ChaCha20-Poly1305", check_rejected(CIPHER_CHACHA20_POLY1305, 0));
+    failures += report("modified byte rejected, ChaCha20-Poly1305", check_rejected(CIPHER_CHACHA20_POLY1305, 1));
+    failures += report("wrong key rejected, chunked ChaCha20-Poly1305",
+                       check_rejected(CIPHER_CHACHA20_POLY1305_CHUNKED, 0));
+    failures += report("modified byte rejected, chunked ChaCha20-Poly1305",
+                       check_rejected(CIPHER_CHACHA20_POLY1305_CHUNKED, 1));
+    failures += report("chunked range read past a modified chunk", check_chunked_range());
+
+    // Each option on its own, then blocks coded on several threads
+    const char* option_names[] = {"codec context, defaults", "codec context, 12-bit code limit",
+                                  "codec context, plain Huffman", "codec context, 4 KiB blocks on 3 threads"};
+    for (int i = 0; i < 4; i++) {
+        CompressionOptions_t options;
+        default_compression_options(&options);
+        if (i == 1) {
+            options.max_code_length = 12;
+        } else if (i == 2) {
+            options.image_filter = 0;
+            options.run_length = 0;
+            options.fse = 0;
+            options.context_model = 0;
+        } else if (i == 3) {
+            options.block_size = 4096;
+            options.thread_count = 3;
+        }
+        failures += report(option_names[i], check_codec_context(image, image_size, &options));
+    }
+    failures += report("codec context, trained dictionary", check_dictionary(image, image_size));
+
+    CompressionOptions_t stream_options;
+    default_compression_options(&stream_options);
+    stream_options.block_size = 4096;
+    failures += report("stream, semi-static", check_stream(image, image_size, STREAM_MODE_SEMI_STATIC, &stream_options));
+    failures += report("stream, two-pass", check_stream(image, image_size, STREAM_MODE_TWO_PASS, &stream_options));
+
+    failures += report("filter layouts other than 3 or 4 channels rejected", check_filter_layouts(image, image_size));
+    failures += report("image database save, remove, compact and reopen", check_database());
+    failures += report("async I/O, thread back end", check_async_io(ASYNC_IO_FORCE_THREADS));
+    failures += report("async I/O, default back end", check_async_io(0));
+
+    free(image);
+    printf("%d check(s) failed\n", failures);
+    return failures != 0;
+}
@@ -1,13 +1,641 @@
+#ifdef _WIN32
+#define _CRT_RAND_S
+#endif
+
 #include "huffman_compression.h"
 #include "encryption.h"
+#include "mapped_file.h"
+#include "chacha20_poly1305.h"
+#include "sha256.h"
+#include "thread_pool.h"
+#include "byte_order.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
-#define DEBUG 0
+// SSE2 is part of x86-64; the AVX2 kernel is compiled with a target attribute and
+// picked at run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_XOR_KERNELS 1
+#endif
+
 #define MAX_KEY_LENGTH 256
 
+// Widest step of the XOR kernels. The key stream is a whole number of key periods
+// and of this width, so every step starts at the same key phase.
+#define KEY_STREAM_ALIGNMENT 64
+#define KEY_STREAM_MIN_LENGTH 4096
+
+/* Files made by an authenticated cipher start with a header: magic, version, cipher,
+KDF salt, nonce and a key check value, followed by the ciphertext and its tag. The
+header is authenticated too. XOR files have no header at all. */
+#define SEALED_MAGIC "HUFE"
+#define SEALED_FORMAT_VERSION 1
+#define SEALED_SALT_SIZE 16
+#define SEALED_KEY_CHECK_SIZE 8
+#define SEALED_NONCE_OFFSET (6 + SEALED_SALT_SIZE)
+#define SEALED_KEY_CHECK_OFFSET (SEALED_NONCE_OFFSET + CHACHA20_NONCE_SIZE)
+#define SEALED_HEADER_SIZE (SEALED_KEY_CHECK_OFFSET + SEALED_KEY_CHECK_SIZE)
+#define SEALED_OVERHEAD (SEALED_HEADER_SIZE + POLY1305_TAG_SIZE)
+
+/* CIPHER_CHACHA20_POLY1305_CHUNKED adds the chunk size (4 bytes) and the plaintext
+size (8 bytes) to the header, then seals every chunk on its own: chunk i uses the file
+nonce with i XORed into its last 8 bytes and the whole header as associated data, and
+is followed by its tag. Any chunk can be checked and decrypted without the others, so
+chunks are spread over the thread pool and a byte range can be read on its own. */
+#define CHUNKED_HEADER_SIZE (SEALED_HEADER_SIZE + 12)
+#define ENCRYPTION_CHUNK_SIZE (1u << 20)
+
+// Chunk task modes
+#define CHUNK_SEAL 0
+#define CHUNK_VERIFY 1
+#define CHUNK_DECRYPT 2
+
+// PBKDF2-HMAC-SHA256 rounds that turn a password into a ChaCha20 key
+#define KDF_ITERATIONS 20000
+
+
+// An opened encrypted buffer, ready to be verified and decrypted into any output
+typedef struct Decryption {
+    int cipher;
+    KeyStream_t stream;                    // CIPHER_XOR
+    unsigned char key[CHACHA20_KEY_SIZE];  // The ChaCha20 ciphers
+    const unsigned char* header;
+    const unsigned char* nonce;
+    const unsigned char* ciphertext;       // Start of the file for the chunked cipher
+    uint32_t chunk_size;
+    size_t size;                           // Bytes of plaintext
+} Decryption_t;
+
+
+// One chunk of the chunked cipher, sealed, verified or (partly) decrypted by a pool worker
+typedef struct ChunkTask {
+    int mode;
+    const unsigned char* key;
+    const unsigned char* header;
+    const unsigned char* file_nonce;
+    uint64_t index;
+    size_t offset;               // CHUNK_DECRYPT: first byte within the chunk
+    size_t size;
+    unsigned char* plain;
+    unsigned char* sealed;       // Chunk ciphertext, followed by its tag
+    int status;
+} ChunkTask_t;
+
+
+/*******************************************************************************
+ * Function Prototypes
+*******************************************************************************/
+static size_t greatest_common_divisor(size_t a, size_t b);
+static void xor_bytes_scalar(const unsigned char* input, const unsigned char* key_bytes, unsigned char* output, size_t size);
+static void xor_bytes(const unsigned char* input, const unsigned char* key_bytes, unsigned char* output, size_t size);
+static int fill_random(unsigned char* output, size_t size);
+static void derive_key(const char* password, const unsigned char* salt, unsigned char key[CHACHA20_KEY_SIZE],
+                       unsigned char key_check[SEALED_KEY_CHECK_SIZE]);
+static uint64_t chunk_count(uint64_t size, uint32_t chunk_size);
+static size_t encrypted_size(size_t size, int cipher);
+static void chacha20_xor_at(const unsigned char* key, const unsigned char* nonce, uint64_t offset,
+                            const unsigned char* input, unsigned char* output, size_t size);
+static void chunk_nonce(const unsigned char* file_nonce, uint64_t index, unsigned char nonce[CHACHA20_NONCE_SIZE]);
+static void chunk_task(void* argument);
+static int run_chunk_tasks(int mode, const unsigned char* key, const unsigned char* header, uint32_t chunk_size,
+                           uint64_t offset, uint64_t size, unsigned char* plain, unsigned char* sealed, int thread_count);
+static int encrypt_into(const char* password, int cipher, const unsigned char* data, size_t size, unsigned char* output,
+                        int thread_count);
+static int open_encrypted_header(const char* password, const unsigned char* input, size_t input_size, Decryption_t* decryption);
+static int verify_decryption(const Decryption_t* decryption, uint64_t offset, uint64_t size);
+static int prepare_decryption(const char* password, const unsigned char* input, size_t input_size, Decryption_t* decryption);
+static int decrypt_range(const Decryption_t* decryption, uint64_t offset, size_t size, unsigned char* output);
+static int run_decryption(const Decryption_t* decryption, unsigned char* output);
+static void free_decryption(Decryption_t* decryption);
+static int encrypt_file_with_cipher(const char* inputPath, const char* outputPath, const char* key, int cipher);
+static int decrypt_file_with_key(const char* inputPath, const char* outputPath, const char* key);
+static void replace_suffix(const char* filename, size_t suffix_length, const char* new_suffix, char* output_name, size_t output_size);
+
+
+static size_t greatest_common_divisor(size_t a, size_t b) {
+    while (b != 0) {
+        size_t remainder = a % b;
+        a = b;
+        b = remainder;
+    }
+    return a;
+}
+
+
+int key_stream_init(KeyStream_t* stream, const char* key) {
+    stream->bytes = NULL;
+    stream->length = 0;
+
+    size_t key_len = strlen(key);
+    if (key_len == 0 || key_len > MAX_KEY_LENGTH) {
+        printf("Invalid key length. Must be between 1 and %d bytes.\n", MAX_KEY_LENGTH);
+        return 1;
+    }
+
+    // lcm(key_len, KEY_STREAM_ALIGNMENT), repeated up to a comfortable block size
+    size_t period = key_len / greatest_common_divisor(key_len, KEY_STREAM_ALIGNMENT) * KEY_STREAM_ALIGNMENT;
+    size_t length = period;
+    while (length < KEY_STREAM_MIN_LENGTH) {
+        length += period;
+    }
+
+    stream->bytes = (unsigned char*)malloc(length);
+    if (stream->bytes == NULL) {
+        printf("Memory allocation failed for key stream\n");
+        return 1;
+    }
+    for (size_t i = 0; i < length; i++) {
+        stream->bytes[i] = (unsigned char)key[i % key_len];
+    }
+    stream->length = length;
+    return 0;
+}
+
+
+void key_stream_free(KeyStream_t* stream) {
+    free(stream->bytes);
+    stream->bytes = NULL;
+    stream->length = 0;
+}
+
+
+static void xor_bytes_scalar(const unsigned char* input, const unsigned char* key_bytes, unsigned char* output, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        uint64_t key_word;
+        memcpy(&word, input + i, 8);
+        memcpy(&key_word, key_bytes + i, 8);
+        word ^= key_word;
+        memcpy(output + i, &word, 8);
+    }
+    for (; i < size; i++) {
+        output[i] = input[i] ^ key_bytes[i];
+    }
+}
+
+
+#ifdef HAVE_X86_XOR_KERNELS
+static void xor_bytes_sse2(const unsigned char* input, const unsigned char* key_bytes, unsigned char* output, size_t size) {
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i*)(input + i));
+        __m128i key_block = _mm_loadu_si128((const __m128i*)(key_bytes + i));
+        _mm_storeu_si128((__m128i*)(output + i), _mm_xor_si128(data, key_block));
+    }
+    xor_bytes_scalar(input + i, key_bytes + i, output + i, size - i);
+}
+
+
+__attribute__((target("avx2")))
+static void xor_bytes_avx2(const unsigned char* input, const unsigned char* key_bytes, unsigned char* output, size_t size) {
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m256i low = _mm256_loadu_si256((const __m256i*)(input + i));
+        __m256i high = _mm256_loadu_si256((const __m256i*)(input + i + 32));
+        low = _mm256_xor_si256(low, _mm256_loadu_si256((const __m256i*)(key_bytes + i)));
+        high = _mm256_xor_si256(high, _mm256_loadu_si256((const __m256i*)(key_bytes + i + 32)));
+        _mm256_storeu_si256((__m256i*)(output + i), low);
+        _mm256_storeu_si256((__m256i*)(output + i + 32), high);
+    }
+    xor_bytes_scalar(input + i, key_bytes + i, output + i, size - i);
+}
+#endif
+
+
+// XOR size bytes of input with as many key stream bytes, using the widest kernel the CPU has
+static void xor_bytes(const unsigned char* input, const unsigned char* key_bytes, unsigned char* output, size_t size) {
+#ifdef HAVE_X86_XOR_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        xor_bytes_avx2(input, key_bytes, output, size);
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        xor_bytes_sse2(input, key_bytes, output, size);
+        return;
+    }
+#endif
+    xor_bytes_scalar(input, key_bytes, output, size);
+}
+
+
+void key_stream_xor(const KeyStream_t* stream, uint64_t offset, const unsigned char* input, unsigned char* output, size_t size) {
+    size_t position = (size_t)(offset % stream->length);
+    while (size > 0) {
+        size_t take = stream->length - position;
+        if (take > size) {
+            take = size;
+        }
+        xor_bytes(input, stream->bytes + position, output, take);
+        input += take;
+        output += take;
+        size -= take;
+        position = 0;
+    }
+}
+
+
+static int fill_random(unsigned char* output, size_t size) {
+#ifdef _WIN32
+    for (size_t i = 0; i < size; i++) {
+        unsigned int value;
+        if (rand_s(&value) != 0) {
+            printf("Failed to generate random bytes\n");
+            return 1;
+        }
+        output[i] = (unsigned char)value;
+    }
+    return 0;
+#else
+    FILE* source = fopen("/dev/urandom", "rb");
+    if (source == NULL || fread(output, 1, size, source) != size) {
+        printf("Failed to generate random bytes\n");
+        if (source != NULL) {
+            fclose(source);
+        }
+        return 1;
+    }
+    fclose(source);
+    return 0;
+#endif
+}
+
+
+// Stretch the password with the file's salt; the key check lets a wrong password be
+// rejected without touching the ciphertext
+static void derive_key(const char* password, const unsigned char* salt, unsigned char key[CHACHA20_KEY_SIZE],
+                       unsigned char key_check[SEALED_KEY_CHECK_SIZE]) {
+    pbkdf2_sha256(password, strlen(password), salt, SEALED_SALT_SIZE, KDF_ITERATIONS, key, CHACHA20_KEY_SIZE);
+
+    unsigned char check[SHA256_DIGEST_SIZE];
+    hmac_sha256(key, CHACHA20_KEY_SIZE, "key check", 9, check);
+    memcpy(key_check, check, SEALED_KEY_CHECK_SIZE);
+}
+
+
+static uint64_t chunk_count(uint64_t size, uint32_t chunk_size) {
+    // Even empty data gets one (empty) chunk, so there is always a tag to check
+    return size == 0 ? 1 : (size + chunk_size - 1) / chunk_size;
+}
+
+
+static size_t encrypted_size(size_t size, int cipher) {
+    if (cipher == CIPHER_CHACHA20_POLY1305) {
+        return size + SEALED_OVERHEAD;
+    }
+    if (cipher == CIPHER_CHACHA20_POLY1305_CHUNKED) {
+        return CHUNKED_HEADER_SIZE + size + (size_t)chunk_count(size, ENCRYPTION_CHUNK_SIZE) * POLY1305_TAG_SIZE;
+    }
+    return size;
+}
+
+
+// ChaCha20 from any byte offset of a message whose first byte uses block counter 1
+static void chacha20_xor_at(const unsigned char* key, const unsigned char* nonce, uint64_t offset,
+                            const unsigned char* input, unsigned char* output, size_t size) {
+    uint32_t counter = (uint32_t)(1 + offset / CHACHA20_BLOCK_SIZE);
+    size_t skip = (size_t)(offset % CHACHA20_BLOCK_SIZE);
+    if (skip > 0 && size > 0) {
+        unsigned char block[CHACHA20_BLOCK_SIZE];
+        size_t take = CHACHA20_BLOCK_SIZE - skip < size ? CHACHA20_BLOCK_SIZE - skip : size;
+        memset(block, 0, sizeof(block));
+        memcpy(block + skip, input, take);
+        chacha20_xor(key, nonce, counter, block, block, sizeof(block));
+        memcpy(output, block + skip, take);
+        input += take;
+        output += take;
+        size -= take;
+        counter++;
+    }
+    if (size > 0) {
+        chacha20_xor(key, nonce, counter, input, output, size);
+    }
+}
+
+
+static void chunk_nonce(const unsigned char* file_nonce, uint64_t index, unsigned char nonce[CHACHA20_NONCE_SIZE]) {
+    memcpy(nonce, file_nonce, CHACHA20_NONCE_SIZE);
+    for (int i = 0; i < 8; i++) {
+        nonce[4 + i] ^= (unsigned char)(index >> (8 * i));
+    }
+}
+
+
+static void chunk_task(void* argument) {
+    ChunkTask_t* task = (ChunkTask_t*)argument;
+    unsigned char nonce[CHACHA20_NONCE_SIZE];
+    unsigned char tag[POLY1305_TAG_SIZE];
+    chunk_nonce(task->file_nonce, task->index, nonce);
+
+    if (task->mode == CHUNK_SEAL) {
+        chacha20_poly1305_seal(task->key, nonce, task->header, CHUNKED_HEADER_SIZE, task->plain,
+                               task->sealed, task->size, task->sealed + task->size);
+    } else if (task->mode == CHUNK_VERIFY) {
+        chacha20_poly1305_tag(task->key, nonce, task->header, CHUNKED_HEADER_SIZE, task->sealed, task->size, tag);
+        task->status = constant_time_compare(tag, task->sealed + task->size, POLY1305_TAG_SIZE);
+    } else {
+        chacha20_xor_at(task->key, nonce, task->offset, task->sealed + task->offset, task->plain, task->size);
+    }
+}
+
+
+/* Run one task per chunk, on up to thread_count threads (0 for one per CPU core, never
+more than there are chunks). plain is the plaintext of byte offset (file position),
+sealed the start of the encrypted file. Sealing and verifying cover whole chunks;
+decrypting covers exactly offset..offset+size. */
+static int run_chunk_tasks(int mode, const unsigned char* key, const unsigned char* header, uint32_t chunk_size,
+                           uint64_t offset, uint64_t size, unsigned char* plain, unsigned char* sealed, int thread_count) {
+    uint64_t total_size = get_u64_le(header + SEALED_HEADER_SIZE + 4);
+    uint64_t first = offset / chunk_size;
+    uint64_t last = size == 0 ? first : (offset + size - 1) / chunk_size;
+    if (last >= chunk_count(total_size, chunk_size)) {
+        return 1;
+    }
+    uint64_t count = last - first + 1;
+
+    ChunkTask_t* tasks = (ChunkTask_t*)calloc((size_t)count, sizeof(ChunkTask_t));
+    if (tasks == NULL) {
+        printf("Memory allocation failed for chunk tasks\n");
+        return 1;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        ChunkTask_t* task = &tasks[i];
+        uint64_t index = first + i;
+        uint64_t chunk_start = index * chunk_size;
+        uint64_t chunk_end = chunk_start + chunk_size < total_size ? chunk_start + chunk_size : total_size;
+
+        task->mode = mode;
+        task->key = key;
+        task->header = header;
+        task->file_nonce = header + SEALED_NONCE_OFFSET;
+        task->index = index;
+        task->sealed = sealed + CHUNKED_HEADER_SIZE + index * ((uint64_t)chunk_size + POLY1305_TAG_SIZE);
+        if (mode == CHUNK_DECRYPT) {
+            uint64_t start = offset > chunk_start ? offset : chunk_start;
+            uint64_t end = offset + size < chunk_end ? offset + size : chunk_end;
+            task->offset = (size_t)(start - chunk_start);
+            task->size = (size_t)(end - start);
+            task->plain = plain + (start - offset);
+        } else {
+            task->size = (size_t)(chunk_end - chunk_start);
+            task->plain = plain != NULL ? plain + (chunk_start - offset) : NULL;
+        }
+    }
+
+    if (thread_count <= 0) {
+        thread_count = thread_pool_default_size();
+    }
+    if ((uint64_t)thread_count > count) {
+        thread_count = (int)count;
+    }
+    ThreadPool_t* pool = thread_count > 1 ? thread_pool_create(thread_count) : NULL;
+    for (uint64_t i = 0; i < count; i++) {
+        if (pool == NULL || thread_pool_submit(pool, chunk_task, &tasks[i])) {
+            chunk_task(&tasks[i]);
+        }
+    }
+    if (pool != NULL) {
+        thread_pool_wait(pool);
+        thread_pool_destroy(pool);
+    }
+
+    int status = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        status |= tasks[i].status;
+    }
+    free(tasks);
+    return status;
+}
+
+
+// Encrypt size bytes into output, which holds encrypted_size(size, cipher) bytes; the
+// chunked cipher seals on up to thread_count threads, 0 for one per CPU core
+static int encrypt_into(const char* password, int cipher, const unsigned char* data, size_t size, unsigned char* output,
+                        int thread_count) {
+    if (cipher == CIPHER_XOR) {
+        KeyStream_t stream;
+        if (key_stream_init(&stream, password)) {
+            return 1;
+        }
+        if (size > 0) {
+            key_stream_xor(&stream, 0, data, output, size);
+        }
+        key_stream_free(&stream);
+        return 0;
+    }
+    if (cipher != CIPHER_CHACHA20_POLY1305 && cipher != CIPHER_CHACHA20_POLY1305_CHUNKED) {
+        printf("Unknown cipher %d\n", cipher);
+        return 1;
+    }
+
+    unsigned char* header = output;
+    memcpy(header, SEALED_MAGIC, 4);
+    header[4] = SEALED_FORMAT_VERSION;
+    header[5] = (unsigned char)cipher;
+    if (fill_random(header + 6, SEALED_SALT_SIZE + CHACHA20_NONCE_SIZE)) {
+        return 1;
+    }
+
+    unsigned char key[CHACHA20_KEY_SIZE];
+    derive_key(password, header + 6, key, header + SEALED_KEY_CHECK_OFFSET);
+    int status = 0;
+    if (cipher == CIPHER_CHACHA20_POLY1305) {
+        chacha20_poly1305_seal(key, header + SEALED_NONCE_OFFSET, header, SEALED_HEADER_SIZE, data,
+                               output + SEALED_HEADER_SIZE, size, output + SEALED_HEADER_SIZE + size);
+    } else {
+        put_u32_le(header + SEALED_HEADER_SIZE, ENCRYPTION_CHUNK_SIZE);
+        put_u64_le(header + SEALED_HEADER_SIZE + 4, size);
+        status = run_chunk_tasks(CHUNK_SEAL, key, header, ENCRYPTION_CHUNK_SIZE, 0, size, (unsigned char*)data, output,
+                                 thread_count);
+    }
+    memset(key, 0, sizeof(key));
+    return status;
+}
+
+
+/* Work out how input was encrypted and, for an authenticated cipher, check the key.
+The tags are checked separately (verify_decryption), so nothing has been decrypted
+when wrong-key input is turned away. */
+static int open_encrypted_header(const char* password, const unsigned char* input, size_t input_size, Decryption_t* decryption) {
+    memset(decryption, 0, sizeof(*decryption));
+
+    if (input_size < SEALED_OVERHEAD || memcmp(input, SEALED_MAGIC, 4) != 0 || input[4] != SEALED_FORMAT_VERSION) {
+        // No header: a repeating-key XOR file
+        decryption->cipher = CIPHER_XOR;
+        decryption->ciphertext = input;
+        decryption->size = input_size;
+        return key_stream_init(&decryption->stream, password);
+    }
+
+    decryption->cipher = input[5];
+    decryption->header = input;
+    decryption->nonce = input + SEALED_NONCE_OFFSET;
+    if (decryption->cipher == CIPHER_CHACHA20_POLY1305) {
+        decryption->ciphertext = input + SEALED_HEADER_SIZE;
+        decryption->size = input_size - SEALED_OVERHEAD;
+    } else if (decryption->cipher == CIPHER_CHACHA20_POLY1305_CHUNKED) {
+        if (input_size < CHUNKED_HEADER_SIZE) {
+            printf("Encrypted data is corrupt\n");
+            return 1;
+        }
+        decryption->chunk_size = get_u32_le(input + SEALED_HEADER_SIZE);
+        uint64_t size = get_u64_le(input + SEALED_HEADER_SIZE + 4);
+        uint64_t chunks = decryption->chunk_size ? chunk_count(size, decryption->chunk_size) : 0;
+        if (chunks == 0 || size > input_size || CHUNKED_HEADER_SIZE + size + chunks * POLY1305_TAG_SIZE != input_size) {
+            printf("Encrypted data is corrupt\n");
+            return 1;
+        }
+        decryption->ciphertext = input;
+        decryption->size = (size_t)size;
+    } else {
+        printf("Unknown cipher %d\n", input[5]);
+        return 1;
+    }
+
+    unsigned char key_check[SEALED_KEY_CHECK_SIZE];
+    derive_key(password, input + 6, decryption->key, key_check);
+    if (constant_time_compare(key_check, input + SEALED_KEY_CHECK_OFFSET, SEALED_KEY_CHECK_SIZE) != 0) {
+        printf("Wrong key\n");
+        free_decryption(decryption);
+        return 1;
+    }
+    return 0;
+}
+
+
+// Check the tags covering size bytes of plaintext from offset (every tag for the single-tag cipher)
+static int verify_decryption(const Decryption_t* decryption, uint64_t offset, uint64_t size) {
+    int status = 0;
+    if (decryption->cipher == CIPHER_CHACHA20_POLY1305) {
+        unsigned char tag[POLY1305_TAG_SIZE];
+        chacha20_poly1305_tag(decryption->key, decryption->nonce, decryption->header, SEALED_HEADER_SIZE,
+                              decryption->ciphertext, decryption->size, tag);
+        status = constant_time_compare(tag, decryption->ciphertext + decryption->size, POLY1305_TAG_SIZE);
+    } else if (decryption->cipher == CIPHER_CHACHA20_POLY1305_CHUNKED) {
+        status = run_chunk_tasks(CHUNK_VERIFY, decryption->key, decryption->header, decryption->chunk_size,
+                                 offset, size, NULL, (unsigned char*)decryption->ciphertext, 0);
+    }
+    if (status) {
+        printf("Encrypted data is corrupt\n");
+    }
+    return status;
+}
+
+
+/* Open input and check every tag. Nothing is decrypted here, so corrupt or wrong-key
+input is turned away before any output is written or decompressed. */
+static int prepare_decryption(const char* password, const unsigned char* input, size_t input_size, Decryption_t* decryption) {
+    if (open_encrypted_header(password, input, input_size, decryption)) {
+        return 1;
+    }
+    if (verify_decryption(decryption, 0, decryption->size)) {
+        free_decryption(decryption);
+        return 1;
+    }
+    return 0;
+}
+
+
+// Decrypt size bytes of plaintext from offset into output; the range must have been verified
+static int decrypt_range(const Decryption_t* decryption, uint64_t offset, size_t size, unsigned char* output) {
+    if (size == 0) {
+        return 0;
+    }
+    if (decryption->cipher == CIPHER_XOR) {
+        key_stream_xor(&decryption->stream, offset, decryption->ciphertext + offset, output, size);
+        return 0;
+    }
+    if (decryption->cipher == CIPHER_CHACHA20_POLY1305) {
+        chacha20_xor_at(decryption->key, decryption->nonce, offset, decryption->ciphertext + offset, output, size);
+        return 0;
+    }
+    return run_chunk_tasks(CHUNK_DECRYPT, decryption->key, decryption->header, decryption->chunk_size,
+                           offset, size, output, (unsigned char*)decryption->ciphertext, 0);
+}
+
+
+// Decrypt into output, which holds decryption->size bytes
+static int run_decryption(const Decryption_t* decryption, unsigned char* output) {
+    return decrypt_range(decryption, 0, decryption->size, output);
+}
+
+
+static void free_decryption(Decryption_t* decryption) {
+    key_stream_free(&decryption->stream);
+    memset(decryption->key, 0, sizeof(decryption->key));
+}
+
+
+static int encrypt_file_with_cipher(const char* inputPath, const char* outputPath, const char* key, int cipher) {
+    MappedFile_t input;
+    MappedFile_t output;
+    if (map_file_for_reading(inputPath, &input)) {
+        printf("Failed to open files\n");
+        return 1;
+    }
+    if (map_file_for_writing(outputPath, encrypted_size((size_t)input.size, cipher), &output)) {
+        printf("Failed to open files\n");
+        unmap_file(&input);
+        return 1;
+    }
+
+    int status = encrypt_into(key, cipher, input.data, (size_t)input.size, output.data, 0);
+    if (status) {
+        output.size = 0;
+    }
+    unmap_file(&input);
+    if (unmap_file(&output)) {
+        printf("Failed to write to output file\n");
+        status = 1;
+    }
+    return status;
+}
+
+
+static int decrypt_file_with_key(const char* inputPath, const char* outputPath, const char* key) {
+    MappedFile_t input;
+    if (map_file_for_reading(inputPath, &input)) {
+        printf("Failed to open files\n");
+        return 1;
+    }
+
+    // The output file is only created once the input has been verified
+    Decryption_t decryption;
+    if (prepare_decryption(key, input.data, (size_t)input.size, &decryption)) {
+        unmap_file(&input);
+        return 1;
+    }
+
+    MappedFile_t output;
+    int status = 1;
+    if (map_file_for_writing(outputPath, decryption.size, &output)) {
+        printf("Failed to open files\n");
+    } else {
+        status = run_decryption(&decryption, output.data);
+        if (status) {
+            output.size = 0;
+        }
+        if (unmap_file(&output)) {
+            printf("Failed to write to output file\n");
+            status = 1;
+        }
+    }
+
+    free_decryption(&decryption);
+    unmap_file(&input);
+    return status;
+}
+
+
 int encrypt_file_in_database(const char* filename, const char* key) {
+    return encrypt_file_in_database_with_cipher(filename, key, CIPHER_XOR);
+}
+
+
+int encrypt_file_in_database_with_cipher(const char* filename, const char* key, int cipher) {
     size_t key_len = strlen(key);
     if (key_len == 0 || key_len > MAX_KEY_LENGTH) {
         printf("Invalid key length. Must be between 1 and %d bytes.\n", MAX_KEY_LENGTH);
@@ -45,76 +673,10 @@ int encrypt_file_in_database(const char* filename, const char* key) {
         return 1;
     }
 
-    // output path
-    char final_path[512];
-    strncpy(final_path, outputPath, sizeof(final_path) - 1);
-    final_path[sizeof(final_path) - 1] = '\0';
-
-    FILE* inFile = fopen(inputPath, "rb");
-    FILE* outFile = fopen(outputPath, "wb");
-    
-    if (!inFile || !outFile) {
-        printf("Failed to open files\n");
-        if (inFile){
-            fclose(inFile);
-        }
-        if (outFile){
-            fclose(outFile);
-        }
-        free(inputPath);
-        free(outputPath);
-        return 1;
-    }
-
-    // buffer for batch processing
-    unsigned char buffer[4096];
-    unsigned char encrypted_buffer[4096];
-    size_t bytes_read;
-    size_t key_pos = 0;
-    
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), inFile)) > 0) {
-        for (size_t i = 0; i < bytes_read; i++) {
-            encrypted_buffer[i] = buffer[i] ^ key[key_pos];
-            key_pos = (key_pos + 1) % key_len;
-            
-            if (DEBUG) {
-                printf("Original byte: ");
-                for (int j = 7; j >= 0; j--) {
-                    printf("%d", (buffer[i] >> j) & 1);
-                }
-                printf(" XOR Key: ");
-                for (int j = 7; j >= 0; j--) {
-                    printf("%d", (key[key_pos] >> j) & 1);
-                }
-                printf(" = Encrypted: ");
-                for (int j = 7; j >= 0; j--) {
-                    printf("%d", (encrypted_buffer[i] >> j) & 1);
-                }
-                printf("\n");
-            }
-        }
-        
-        // Write encrypted buffer to output file
-        if (fwrite(encrypted_buffer, 1, bytes_read, outFile) != bytes_read) {
-            printf("Failed to write to output file\n");
-            fclose(inFile);
-            fclose(outFile);
-            free(inputPath);
-            free(outputPath);
-            return 1;
-        }
-    }
-
-    // Cleanup
-    fclose(inFile);
-    fclose(outFile);
+    int status = encrypt_file_with_cipher(inputPath, outputPath, key, cipher);
     free(inputPath);
     free(outputPath);
-    
-    if (DEBUG) {
-        printf("File encrypted successfully: %s\n", final_path);
-    }
-    return 0;
+    return status;
 }
 
 int decrypt_file_from_database(const char* filename, const char* key) {
@@ -156,70 +718,190 @@ int decrypt_file_from_database(const char* filename, const char* key) {
         return 1;
     }
 
-    // Store output path for final message
-    char final_path[512];
-    strncpy(final_path, outputPath, sizeof(final_path) - 1);
-    final_path[sizeof(final_path) - 1] = '\0';
+    int status = decrypt_file_with_key(inputPath, outputPath, key);
+    free(inputPath);
+    free(outputPath);
+    return status;
+}
 
-    FILE* inFile = fopen(inputPath, "rb");
-    FILE* outFile = fopen(outputPath, "wb");
-    
-    if (!inFile || !outFile) {
+
+/* Random access: only the header and the chunks covering the range are read, checked
+and decrypted, so a slice of a large file costs about one chunk. The other ciphers
+seek too (their key streams start at any offset) but have to check the whole tag. */
+int decrypt_range_from_database(const char* filename, const char* key, uint64_t offset, size_t size, unsigned char* output) {
+    size_t key_len = strlen(key);
+    if (key_len == 0 || key_len > MAX_KEY_LENGTH) {
+        printf("Invalid key length. Must be between 1 and %d bytes.\n", MAX_KEY_LENGTH);
+        return 1;
+    }
+
+    char* inputPath = create_full_path(COMPRESSED_AND_ENCRYPTED_DIRECTORY, filename);
+    if (!inputPath) {
+        printf("Failed to create input path\n");
+        return 1;
+    }
+
+    MappedFile_t input;
+    int status = 1;
+    if (map_file_for_reading(inputPath, &input)) {
         printf("Failed to open files\n");
-        if (inFile) fclose(inFile);
-        if (outFile) fclose(outFile);
+    } else {
+        Decryption_t decryption;
+        if (open_encrypted_header(key, input.data, (size_t)input.size, &decryption) == 0) {
+            if (offset > decryption.size || size > decryption.size - offset) {
+                printf("Range is past the end of the file\n");
+            } else if (verify_decryption(&decryption, offset, size) == 0) {
+                status = decrypt_range(&decryption, offset, size, output);
+            }
+            free_decryption(&decryption);
+        }
+        unmap_file(&input);
+    }
+    free(inputPath);
+    return status;
+}
+
+
+// Copy filename without its last suffix_length characters, then append new_suffix
+static void replace_suffix(const char* filename, size_t suffix_length, const char* new_suffix, char* output_name, size_t output_size) {
+    char base_name[256];
+    strncpy(base_name, filename, sizeof(base_name) - 1);
+    base_name[sizeof(base_name) - 1] = '\0';
+
+    size_t len = strlen(base_name);
+    if (len >= suffix_length) {
+        base_name[len - suffix_length] = '\0';
+    }
+    snprintf(output_name, output_size, "%s%s", base_name, new_suffix);
+}
+
+
+/* Fused save: the image is compressed into memory and encrypted on its way into the
+mapped output file, so neither Compressed/ nor a second read of it is involved.
+The result is the same file encrypt_file_in_database_with_cipher would make from
+compress_image_to_database's output. */
+int compress_and_encrypt_to_database(const char* image_name, const char* key, int cipher, const CompressionOptions_t* options) {
+    size_t key_len = strlen(key);
+    if (key_len == 0 || key_len > MAX_KEY_LENGTH) {
+        printf("Invalid key length. Must be between 1 and %d bytes.\n", MAX_KEY_LENGTH);
+        return 1;
+    }
+
+    char* inputPath = create_full_path(IMAGE_DIRECTORY, image_name);
+    char* outputPath = encrypted_database_path(image_name);
+    if (!inputPath || !outputPath) {
+        printf("Failed to create file paths\n");
         free(inputPath);
         free(outputPath);
         return 1;
     }
 
-    // buffer for batch processing
-    unsigned char buffer[4096];
-    unsigned char decrypted_buffer[4096];
-    size_t bytes_read;
-    size_t key_pos = 0;
-    
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), inFile)) > 0) {
-        for (size_t i = 0; i < bytes_read; i++) {
-            decrypted_buffer[i] = buffer[i] ^ key[key_pos];
-            key_pos = (key_pos + 1) % key_len;
-            
-            if (DEBUG) {
-                printf("Encrypted byte: ");
-                for (int j = 7; j >= 0; j--) {
-                    printf("%d", (buffer[i] >> j) & 1);
-                }
-                printf(" XOR Key: ");
-                for (int j = 7; j >= 0; j--) {
-                    printf("%d", (key[key_pos] >> j) & 1);
-                }
-                printf(" = Decrypted: ");
-                for (int j = 7; j >= 0; j--) {
-                    printf("%d", (decrypted_buffer[i] >> j) & 1);
-                }
-                printf("\n");
+    MappedFile_t image;
+    MappedFile_t output;
+    unsigned char* compressed = NULL;
+    size_t compressed_size = 0;
+    int status = 1;
+
+    if (map_file_for_reading(inputPath, &image) == 0) {
+        if (compress_data_to_buffer(image.data, image.size, options, &compressed, &compressed_size) == 0 &&
+            map_file_for_writing(outputPath, encrypted_size(compressed_size, cipher), &output) == 0) {
+            status = encrypt_into(key, cipher, compressed, compressed_size, output.data, options->thread_count);
+            if (status) {
+                output.size = 0;
+            }
+            if (unmap_file(&output)) {
+                printf("Failed to write to output file\n");
+                status = 1;
             }
         }
-        
-        // Write decrypted buffer to output file
-        if (fwrite(decrypted_buffer, 1, bytes_read, outFile) != bytes_read) {
-            printf("Failed to write to output file\n");
-            fclose(inFile);
-            fclose(outFile);
-            free(inputPath);
-            free(outputPath);
-            return 1;
-        }
+        unmap_file(&image);
     }
 
-    // Cleanup
-    fclose(inFile);
-    fclose(outFile);
+    free(compressed);
     free(inputPath);
     free(outputPath);
-    
-    if (DEBUG) {
-        printf("File decrypted successfully: %s\n", final_path);
+    return status;
+}
+
+
+char* encrypted_database_path(const char* image_name) {
+    char output_name[256];
+    replace_suffix(image_name, 4, "_compressed_encrypted.bmp", output_name, sizeof(output_name));
+    return create_full_path(COMPRESSED_AND_ENCRYPTED_DIRECTORY, output_name);
+}
+
+
+int compress_and_encrypt_buffer(const unsigned char* data, uint64_t size, const char* key, int cipher,
+                                const CompressionOptions_t* options, unsigned char** output, size_t* output_size) {
+    *output = NULL;
+    *output_size = 0;
+    size_t key_len = strlen(key);
+    if (key_len == 0 || key_len > MAX_KEY_LENGTH) {
+        printf("Invalid key length. Must be between 1 and %d bytes.\n", MAX_KEY_LENGTH);
+        return 1;
+    }
+
+    unsigned char* compressed = NULL;
+    size_t compressed_size = 0;
+    if (compress_data_to_buffer(data, size, options, &compressed, &compressed_size)) {
+        return 1;
+    }
+    size_t sealed_size = encrypted_size(compressed_size, cipher);
+    unsigned char* sealed = (unsigned char*)malloc(sealed_size ? sealed_size : 1);
+    if (sealed == NULL) {
+        printf("Memory allocation failed for encrypted output\n");
+        free(compressed);
+        return 1;
+    }
+    int status = encrypt_into(key, cipher, compressed, compressed_size, sealed, options->thread_count);
+    free(compressed);
+    if (status) {
+        free(sealed);
+        return 1;
     }
+    *output = sealed;
+    *output_size = sealed_size;
     return 0;
-}
\ No newline at end of file
+}
+
+
+/* Fused load: the encrypted file is checked (key and tag, for an authenticated cipher),
+decrypted once into memory and handed straight to the decoder, which writes
+Decompressed/ directly. Input that fails the check is never decompressed. */
+int decrypt_and_decompress_to_decompressed(const char* filename, const char* key) {
+    // "green_compressed_encrypted.bmp" becomes "green_decompressed.bmp"
+    char output_name[256];
+    replace_suffix(filename, 25, "_decompressed.bmp", output_name, sizeof(output_name));
+    char* inputPath = create_full_path(COMPRESSED_AND_ENCRYPTED_DIRECTORY, filename);
+    char* outputPath = create_full_path(DECOMPRESSED_DIRECTORY, output_name);
+    if (!inputPath || !outputPath) {
+        printf("Failed to create file paths\n");
+        free(inputPath);
+        free(outputPath);
+        return 1;
+    }
+
+    MappedFile_t input;
+    Decryption_t decryption;
+    int status = 1;
+    if (map_file_for_reading(inputPath, &input) == 0) {
+        if (prepare_decryption(key, input.data, (size_t)input.size, &decryption) == 0) {
+            unsigned char* compressed = (unsigned char*)malloc(decryption.size ? decryption.size : 1);
+            if (compressed == NULL) {
+                printf("Memory allocation failed for decrypted data\n");
+            } else {
+                status = run_decryption(&decryption, compressed);
+                if (status == 0) {
+                    status = decompress_buffer_to_file(compressed, decryption.size, outputPath);
+                }
+                free(compressed);
+            }
+            free_decryption(&decryption);
+        }
+        unmap_file(&input);
+    }
+
+    free(inputPath);
+    free(outputPath);
+    return status;
+}
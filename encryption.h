@@ -3,9 +3,68 @@
 
 // Include necessary standard library headers
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "huffman_compression.h"
+
+// A repeating-key XOR stream: the key repeated over a whole number of key periods
+// and vector widths, so any offset can be XORed without a per-byte modulo
+typedef struct KeyStream {
+    unsigned char* bytes;
+    size_t length;
+} KeyStream_t;
+
+// Ciphers: the original repeating-key XOR, and ChaCha20-Poly1305 with a PBKDF2 key,
+// which rejects a wrong key or modified data before anything is decrypted. The chunked
+// variant seals every 1 MiB on its own, so chunks are encrypted and decrypted on all
+// cores and a byte range can be read without decrypting the rest of the file
+#define CIPHER_XOR 0
+#define CIPHER_CHACHA20_POLY1305 1
+#define CIPHER_CHACHA20_POLY1305_CHUNKED 2
 
 // Function declarations
 int encrypt_file_in_database(const char* filename, const char* key);
 int decrypt_file_from_database(const char* filename, const char* key);
 
+// Function to encrypt a file from the database with the given cipher; the decrypt
+// functions recognise the cipher from the file
+// Returns 0 on success, non-zero on failure
+int encrypt_file_in_database_with_cipher(const char* filename, const char* key, int cipher);
+
+// Function to compress an image from the images directory and save it encrypted,
+// without writing the unencrypted compressed file
+// Returns 0 on success, non-zero on failure
+int compress_and_encrypt_to_database(const char* image_name, const char* key, int cipher, const CompressionOptions_t* options);
+
+// Function to get the path compress_and_encrypt_to_database saves an image to; free it after use
+// Returns NULL on failure
+char* encrypted_database_path(const char* image_name);
+
+// Function to compress and encrypt size bytes of an image into the file
+// compress_and_encrypt_to_database would write, held in memory; options->thread_count
+// also sets the threads the chunked cipher seals on; *output is allocated with malloc
+// and belongs to the caller
+// Returns 0 on success, non-zero on failure
+int compress_and_encrypt_buffer(const unsigned char* data, uint64_t size, const char* key, int cipher,
+                                const CompressionOptions_t* options, unsigned char** output, size_t* output_size);
+
+// Function to decrypt a file saved by compress_and_encrypt_to_database (or by
+// encrypt_file_in_database) and decompress it, without intermediate files
+// Returns 0 on success, non-zero on failure, including a wrong key or corrupt file
+int decrypt_and_decompress_to_decompressed(const char* filename, const char* key);
+
+// Function to decrypt size bytes of plaintext starting at offset from an encrypted file
+// in the database, checking only the chunks that cover them for the chunked cipher
+// Returns 0 on success, non-zero on failure, including a wrong key, corrupt data or a range past the end
+int decrypt_range_from_database(const char* filename, const char* key, uint64_t offset, size_t size, unsigned char* output);
+
+// Function to expand a key into a key stream
+// Returns 0 on success, non-zero on failure
+int key_stream_init(KeyStream_t* stream, const char* key);
+
+void key_stream_free(KeyStream_t* stream);
+
+// Function to XOR size bytes that sit offset bytes into the file; input and output may be the same buffer
+void key_stream_xor(const KeyStream_t* stream, uint64_t offset, const unsigned char* input, unsigned char* output, size_t size);
+
 #endif // ENCRYPTION_H
\ No newline at end of file
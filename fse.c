@@ -0,0 +1,369 @@
+#include "fse.h"
+#include <string.h>
+
+/* The coder keeps two interleaved states, so consecutive symbols don't wait on each
+other. Symbols are encoded last to first and their bits written least significant
+bit first; the decoder reads the bitstream backwards from a 1 bit that marks its end. */
+
+
+typedef struct FseDecodeEntry {
+    uint16_t baseline; // Next state, before the bits read for it are added
+    unsigned char bits;
+    unsigned char symbol;
+} FseDecodeEntry_t;
+
+
+// Position of the highest set bit, value must not be 0
+static int highest_bit(uint32_t value) {
+    return 31 - __builtin_clz(value);
+}
+
+
+// log2(value) in 1/256ths of a bit, value must not be 0
+static uint32_t log2_fixed(uint32_t value) {
+    int whole = highest_bit(value);
+    uint64_t mantissa = ((uint64_t)value << 16) >> whole; // 1.0 to 2.0 in 16.16 fixed point
+    uint32_t fraction = 0;
+    for (int i = 0; i < 8; i++) {
+        mantissa = (mantissa * mantissa) >> 16;
+        fraction <<= 1;
+        if (mantissa >= (2u << 16)) {
+            mantissa >>= 1;
+            fraction |= 1;
+        }
+    }
+    return ((uint32_t)whole << 8) | fraction;
+}
+
+
+int fse_normalize(const uint64_t* freq_table, uint64_t total, uint16_t* normalized, int* table_log) {
+    int symbol_count = 0;
+    int largest = 0;
+    for (int s = 0; s < FSE_SYMBOLS; s++) {
+        if (freq_table[s] > 0) {
+            symbol_count++;
+        }
+        if (freq_table[s] > freq_table[largest]) {
+            largest = s;
+        }
+    }
+    if (total == 0 || symbol_count == 0) {
+        return 1;
+    }
+
+    // Big enough for the precision the input can use, with room for twice the symbols in use
+    int log = total > 1 ? highest_bit((uint32_t)(total > UINT32_MAX ? UINT32_MAX : total - 1)) - 2 : FSE_MIN_TABLE_LOG;
+    int needed = symbol_count > 1 ? highest_bit((uint32_t)symbol_count - 1) + 2 : FSE_MIN_TABLE_LOG;
+    if (log < needed) {
+        log = needed;
+    }
+    if (log < FSE_MIN_TABLE_LOG) {
+        log = FSE_MIN_TABLE_LOG;
+    }
+    if (log > FSE_MAX_TABLE_LOG) {
+        log = FSE_MAX_TABLE_LOG;
+    }
+    uint32_t table_size = 1u << log;
+
+    uint32_t sum = 0;
+    for (int s = 0; s < FSE_SYMBOLS; s++) {
+        uint32_t count = 0;
+        if (freq_table[s] > 0) {
+            count = (uint32_t)((double)freq_table[s] * table_size / (double)total);
+            if (count == 0) {
+                count = 1;
+            }
+        }
+        normalized[s] = (uint16_t)count;
+        sum += count;
+    }
+
+    // Rare symbols rounded up to 1 can overshoot: take the excess from the biggest counts
+    while (sum > table_size) {
+        int biggest = largest;
+        for (int s = 0; s < FSE_SYMBOLS; s++) {
+            if (normalized[s] > normalized[biggest]) {
+                biggest = s;
+            }
+        }
+        normalized[biggest]--;
+        sum--;
+    }
+    normalized[largest] = (uint16_t)(normalized[largest] + (table_size - sum));
+
+    *table_log = log;
+    return 0;
+}
+
+
+uint64_t fse_estimate_bits(const uint64_t* freq_table, const uint16_t* normalized, int table_log) {
+    uint64_t cost = 0; // In 1/256ths of a bit
+    for (int s = 0; s < FSE_SYMBOLS; s++) {
+        if (freq_table[s] > 0) {
+            if (normalized[s] == 0) {
+                return UINT64_MAX;
+            }
+            cost += freq_table[s] * (((uint32_t)table_log << 8) - log2_fixed(normalized[s]));
+        }
+    }
+    // Plus the two final states and the end marker
+    return cost / 256 + 2 * (uint64_t)table_log + 1;
+}
+
+
+size_t fse_write_counts(const uint16_t* normalized, int table_log, unsigned char* output) {
+    int last_symbol = 0;
+    for (int s = 0; s < FSE_SYMBOLS; s++) {
+        if (normalized[s] > 0) {
+            last_symbol = s;
+        }
+    }
+
+    size_t position = 0;
+    output[position++] = (unsigned char)table_log;
+    output[position++] = (unsigned char)last_symbol;
+    for (int s = 0; s <= last_symbol;) {
+        uint16_t count = normalized[s];
+        if (count == 0) {
+            // A zero is followed by how many more zeros come after it
+            int zeros = 0;
+            while (s + 1 + zeros <= last_symbol && normalized[s + 1 + zeros] == 0 && zeros < 255) {
+                zeros++;
+            }
+            output[position++] = 0;
+            output[position++] = (unsigned char)zeros;
+            s += 1 + zeros;
+        } else {
+            if (count >= 0x80) {
+                output[position++] = (unsigned char)(0x80 | (count & 0x7F));
+                count >>= 7;
+            }
+            output[position++] = (unsigned char)count;
+            s++;
+        }
+    }
+    return position;
+}
+
+
+int fse_read_counts(const unsigned char* input, size_t input_size, size_t* position, uint16_t* normalized, int* table_log) {
+    size_t pos = *position;
+    if (input_size - pos < 2) {
+        return 1;
+    }
+    int log = input[pos++];
+    int last_symbol = input[pos++];
+    if (log < FSE_MIN_TABLE_LOG || log > FSE_MAX_TABLE_LOG) {
+        return 1;
+    }
+
+    memset(normalized, 0, FSE_SYMBOLS * sizeof(uint16_t));
+    uint32_t sum = 0;
+    for (int s = 0; s <= last_symbol;) {
+        if (pos >= input_size) {
+            return 1;
+        }
+        uint32_t count = input[pos++];
+        if (count == 0) {
+            if (pos >= input_size) {
+                return 1;
+            }
+            s += 1 + input[pos++];
+            continue;
+        }
+        if (count & 0x80) {
+            if (pos >= input_size) {
+                return 1;
+            }
+            count = (count & 0x7F) | ((uint32_t)input[pos++] << 7);
+        }
+        sum += count;
+        if (sum > (1u << log)) {
+            return 1;
+        }
+        normalized[s++] = (uint16_t)count;
+    }
+    if (sum != (1u << log)) {
+        return 1;
+    }
+
+    *table_log = log;
+    *position = pos;
+    return 0;
+}
+
+
+size_t fse_encode_bound(const uint64_t* freq_table, const uint16_t* normalized, int table_log) {
+    uint64_t bits = 2 * (uint64_t)table_log + 1;
+    for (int s = 0; s < FSE_SYMBOLS; s++) {
+        if (freq_table[s] > 0 && normalized[s] > 0) {
+            bits += freq_table[s] * (uint64_t)(table_log - highest_bit(normalized[s]) + 1);
+        }
+    }
+    // Whole 32-bit words are stored at a time
+    return (size_t)(bits / 8) + 8;
+}
+
+
+// Deal each symbol's table slots out across the table, so its states are spread evenly
+static void spread_symbols(const uint16_t* normalized, int table_log, unsigned char* spread) {
+    uint32_t table_size = 1u << table_log;
+    uint32_t mask = table_size - 1;
+    uint32_t step = (table_size >> 1) + (table_size >> 3) + 3; // Odd, so every slot is visited once
+    uint32_t position = 0;
+    for (int s = 0; s < FSE_SYMBOLS; s++) {
+        for (uint32_t i = 0; i < normalized[s]; i++) {
+            spread[position] = (unsigned char)s;
+            position = (position + step) & mask;
+        }
+    }
+}
+
+
+size_t fse_encode(const unsigned char* data, size_t size, const uint16_t* normalized, int table_log, unsigned char* output) {
+    uint32_t table_size = 1u << table_log;
+    unsigned char spread[1u << FSE_MAX_TABLE_LOG];
+    uint16_t state_table[1u << FSE_MAX_TABLE_LOG];
+    uint32_t delta_bits[FSE_SYMBOLS];
+    int32_t delta_state[FSE_SYMBOLS];
+    uint32_t next[FSE_SYMBOLS];
+
+    spread_symbols(normalized, table_log, spread);
+    uint32_t cumulative = 0;
+    for (int s = 0; s < FSE_SYMBOLS; s++) {
+        next[s] = cumulative;
+        uint32_t count = normalized[s];
+        if (count > 0) {
+            /* A state x in [L, 2L) sheds k bits so that x >> k lands in [count, 2 * count):
+            k is shift or shift - 1, and (x + delta_bits) >> 16 picks which */
+            int shift = table_log - highest_bit(count);
+            delta_bits[s] = ((uint32_t)shift << 16) - (count << shift);
+            delta_state[s] = (int32_t)cumulative - (int32_t)count;
+        }
+        cumulative += count;
+    }
+    for (uint32_t u = 0; u < table_size; u++) {
+        state_table[next[spread[u]]++] = (uint16_t)(table_size + u);
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (normalized[data[i]] == 0) {
+            return 0;
+        }
+    }
+
+    uint32_t states[2] = {table_size, table_size};
+    uint64_t accumulator = 0;
+    int bit_count = 0;
+    size_t position = 0;
+    for (size_t i = size; i-- > 0;) {
+        uint32_t* state = &states[i & 1];
+        unsigned char symbol = data[i];
+        uint32_t bits = (*state + delta_bits[symbol]) >> 16;
+        accumulator |= (uint64_t)(*state & ((1u << bits) - 1)) << bit_count;
+        bit_count += (int)bits;
+        *state = state_table[(int32_t)(*state >> bits) + delta_state[symbol]];
+        if (bit_count >= 32) {
+            for (int b = 0; b < 4; b++) {
+                output[position++] = (unsigned char)(accumulator >> (8 * b));
+            }
+            accumulator >>= 32;
+            bit_count -= 32;
+        }
+    }
+
+    // The final states (read first), then the end marker
+    accumulator |= (uint64_t)(states[1] - table_size) << bit_count;
+    bit_count += table_log;
+    accumulator |= (uint64_t)(states[0] - table_size) << bit_count;
+    bit_count += table_log;
+    accumulator |= (uint64_t)1 << bit_count;
+    bit_count++;
+    for (int b = 0; b < bit_count; b += 8) {
+        output[position++] = (unsigned char)(accumulator >> b);
+    }
+    return position;
+}
+
+
+int fse_decode(const unsigned char* input, size_t input_size, const uint16_t* normalized, int table_log,
+               unsigned char* output, size_t output_size) {
+    uint32_t table_size = 1u << table_log;
+    unsigned char spread[1u << FSE_MAX_TABLE_LOG];
+    FseDecodeEntry_t table[1u << FSE_MAX_TABLE_LOG];
+    uint32_t next[FSE_SYMBOLS];
+
+    spread_symbols(normalized, table_log, spread);
+    for (int s = 0; s < FSE_SYMBOLS; s++) {
+        next[s] = normalized[s];
+    }
+    for (uint32_t u = 0; u < table_size; u++) {
+        unsigned char symbol = spread[u];
+        uint32_t x = next[symbol]++; // From count to 2 * count - 1
+        int bits = table_log - highest_bit(x);
+        table[u].symbol = symbol;
+        table[u].bits = (unsigned char)bits;
+        table[u].baseline = (uint16_t)((x << bits) - table_size);
+    }
+
+    if (input_size == 0 || input[input_size - 1] == 0) {
+        return 1;
+    }
+    // Short bitstreams are read from a zero-padded copy, so a whole word can always be loaded
+    unsigned char small[8];
+    const unsigned char* bytes = input;
+    if (input_size < 8) {
+        memset(small, 0, sizeof(small));
+        memcpy(small, input, input_size);
+        bytes = small;
+    }
+
+    // remaining counts the unread bits; the window holds the 8 bytes from byte window_start
+    uint64_t remaining = (uint64_t)(input_size - 1) * 8 + highest_bit(input[input_size - 1]);
+    uint64_t window = 0;
+    uint64_t window_start = 0;
+#define FSE_REFILL() do { \
+        window_start = remaining >= 64 ? (remaining >> 3) - 7 : 0; \
+        memcpy(&window, bytes + window_start, 8); \
+    } while (0)
+#define FSE_READ(count) ((window >> (remaining - window_start * 8)) & ((1u << (count)) - 1))
+
+    if (remaining < 2 * (uint64_t)table_log) {
+        return 1;
+    }
+    FSE_REFILL();
+    uint32_t states[2];
+    remaining -= table_log;
+    states[0] = (uint32_t)FSE_READ(table_log);
+    remaining -= table_log;
+    states[1] = (uint32_t)FSE_READ(table_log);
+
+    size_t i = 0;
+    // Fast loop: a refill leaves at least 56 bits in the window, two symbols take at most 24
+    while (i + 2 <= output_size && remaining >= 2 * FSE_MAX_TABLE_LOG) {
+        FSE_REFILL();
+        const FseDecodeEntry_t* entry = &table[states[0]];
+        output[i] = entry->symbol;
+        remaining -= entry->bits;
+        states[0] = entry->baseline + (uint32_t)FSE_READ(entry->bits);
+        entry = &table[states[1]];
+        output[i + 1] = entry->symbol;
+        remaining -= entry->bits;
+        states[1] = entry->baseline + (uint32_t)FSE_READ(entry->bits);
+        i += 2;
+    }
+    for (; i < output_size; i++) {
+        const FseDecodeEntry_t* entry = &table[states[i & 1]];
+        if (entry->bits > remaining) {
+            return 1;
+        }
+        FSE_REFILL();
+        output[i] = entry->symbol;
+        remaining -= entry->bits;
+        states[i & 1] = entry->baseline + (uint32_t)FSE_READ(entry->bits);
+    }
+#undef FSE_READ
+#undef FSE_REFILL
+
+    // A whole bitstream is used up exactly, and leaves both states where encoding began
+    return remaining != 0 || states[0] != 0 || states[1] != 0;
+}
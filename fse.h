@@ -0,0 +1,46 @@
+#ifndef FSE_H
+#define FSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Finite State Entropy: table-driven asymmetric numeral systems (tANS). Symbol counts
+are normalised to sum to 1 << table_log, and each symbol then costs close to its
+fractional information content instead of a whole number of bits, which is what a
+skewed histogram loses with Huffman codes. */
+#define FSE_SYMBOLS 256
+#define FSE_MIN_TABLE_LOG 5
+#define FSE_MAX_TABLE_LOG 12
+
+// Largest normalised count header fse_write_counts produces
+#define FSE_MAX_HEADER_SIZE (2 + 2 * FSE_SYMBOLS)
+
+// Function to choose a table size for a histogram of total symbols and normalise the
+// counts to it; every symbol that occurs keeps a count of at least 1
+// Returns 0 on success, non-zero if the histogram is empty
+int fse_normalize(const uint64_t* freq_table, uint64_t total, uint16_t* normalized, int* table_log);
+
+// Function to estimate the bits coding the histogram with these normalised counts takes
+uint64_t fse_estimate_bits(const uint64_t* freq_table, const uint16_t* normalized, int table_log);
+
+// Function to write the normalised counts into output, which holds FSE_MAX_HEADER_SIZE bytes
+// Returns the bytes written
+size_t fse_write_counts(const uint16_t* normalized, int table_log, unsigned char* output);
+
+// Function to read normalised counts at input[*position], advancing *position past them
+// Returns 0 on success, non-zero if they are malformed
+int fse_read_counts(const unsigned char* input, size_t input_size, size_t* position, uint16_t* normalized, int* table_log);
+
+// Function to get the most bytes fse_encode can write for a histogram
+size_t fse_encode_bound(const uint64_t* freq_table, const uint16_t* normalized, int table_log);
+
+// Function to code size bytes into output, which holds fse_encode_bound bytes
+// Returns the bytes written, or 0 on failure
+size_t fse_encode(const unsigned char* data, size_t size, const uint16_t* normalized, int table_log, unsigned char* output);
+
+// Function to decode exactly output_size bytes from a whole FSE bitstream
+// Returns 0 on success, non-zero if the bitstream is malformed
+int fse_decode(const unsigned char* input, size_t input_size, const uint16_t* normalized, int table_log,
+               unsigned char* output, size_t output_size);
+
+#endif // FSE_H
@@ -1,47 +1,264 @@
 #include "huffman_compression.h"
+#include "thread_pool.h"
+#include "mapped_file.h"
+#include "image_filter.h"
+#include "run_length.h"
+#include "fse.h"
+#include "arena.h"
+#include "sha256.h"
+#include "byte_order.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <inttypes.h>
+
+// The AVX2 histogram path is compiled with a target attribute and picked at run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_HISTOGRAM 1
+#endif
 
 #define MAX_SYMBOLS 256
+#define MAX_NODES (2 * MAX_SYMBOLS - 1)
 #define DEBUG 0
 
+// Bits resolved by the first lookup of the table-driven decoder, and the widest
+// overflow sub-table used for codes longer than that
+#define DECODE_ROOT_BITS 11
+#define DECODE_SUB_BITS 8
+
+// Sub-histograms the byte counter spreads consecutive bytes over, so runs of one
+// value don't serialise on a single counter. Their 32-bit counts are flushed into
+// the 64-bit totals after every slice of HISTOGRAM_SLICE bytes.
+#define HISTOGRAM_WAYS 8
+#define HISTOGRAM_SLICE ((size_t)1 << 30)
+
+// Longest code the canonical code builder and the bit writer can hold
+#define MAX_CANONICAL_LENGTH 64
+
+// Container header written by write_compressed_file. Files without it are in the
+// legacy format: original size as a 4-byte int followed by the pre-order tree.
+#define HUFFMAN_MAGIC "HUFC"
+#define HUFFMAN_FORMAT_VERSION 1
+#define CONTAINER_HEADER_SIZE 14
+
+// Container flags: the data is split into blocks with their own code tables,
+// or it is a stream of self-describing frames. A filtered container codes the
+// BMP's pixels as filtered channel planes (see image_filter.h); its header is
+// followed by the image layout and a filter type per plane row. A run-length
+// container Huffman-codes the run-length coded data (see run_length.h), after
+// any filtering; the unit and coded size follow the other headers. A dictionary
+// container has segments coded with a shared dictionary, whose 4-byte ID comes
+// straight after the header.
+#define CONTAINER_FLAG_BLOCKS 0x01
+#define CONTAINER_FLAG_STREAM 0x02
+#define CONTAINER_FLAG_FILTERED 0x04
+#define CONTAINER_FLAG_RUNS 0x08
+#define CONTAINER_FLAG_DICTIONARY 0x10
+#define CONTAINER_KNOWN_FLAGS (CONTAINER_FLAG_BLOCKS | CONTAINER_FLAG_STREAM | CONTAINER_FLAG_FILTERED | CONTAINER_FLAG_RUNS | \
+                               CONTAINER_FLAG_DICTIONARY)
+#define DICTIONARY_ID_SIZE 4
+
+// Image layout of a filtered container: pixel offset, stride, width, height, channels,
+// colour transform
+#define IMAGE_FILTER_HEADER_SIZE 26
+
+// Run-length header: unit size, then the size of the run-length coded data
+#define RUN_LENGTH_HEADER_SIZE 9
+
+// Run-length coding is only tried when runs cover at least this share of the data
+#define RUN_LENGTH_MIN_COVERAGE_DIVISOR 4
+
+// Stream frames: 4-byte raw size, 4-byte payload size, frame type
+#define FRAME_HEADER_SIZE 9
+#define FRAME_NEW_TABLE 0
+#define FRAME_SAME_TABLE 1
+#define DEFAULT_STREAM_BLOCK_SIZE (1u << 20)
+#define STREAM_MAX_BLOCK_SIZE (64u << 20)
+
+// Decoder stream states
+#define DECODER_CONTAINER_HEADER 0
+#define DECODER_FRAME_HEADER 1
+#define DECODER_PAYLOAD 2
+#define DECODER_OUTPUT 3
+#define DECODER_END 4
+#define DECODER_ERROR 5
+
+// How the code lengths in front of a segment's bitstream are stored, or that the
+// segment is FSE coded (normalised counts, see fse.h, then its bitstream) or context
+// modelled (table count, context table and code lengths per table, then its bitstream),
+// or that it is just a bitstream coded with the container's dictionary
+#define SEGMENT_HUFFMAN_NIBBLES 0
+#define SEGMENT_HUFFMAN_RUNS 1
+#define SEGMENT_FSE 2
+#define SEGMENT_CONTEXT_HUFFMAN 3
+#define SEGMENT_DICTIONARY 4
+
+/* Order-1 context modelling: the byte before each symbol (0 before the first) picks
+which of up to CONTEXT_MAX_TABLES Huffman tables codes it. The 256 contexts are
+clustered so that contexts with alike histograms share a table. */
+#define CONTEXT_MAX_TABLES 16
+#define CONTEXT_CLUSTER_ROUNDS 3
+#define CONTEXT_MIN_SEGMENT_SIZE (16u << 10) // Smaller segments don't earn back the tables
+#define CONTEXT_MISSING_SYMBOL_BITS 24 // Charged for a symbol a table has no code for while clustering
+#define CONTEXT_MAX_CODE_LENGTH 11 // Context tables decode with one lookup of this many bits
+
+// Dictionary file: magic, version and ID, then the code lengths as a segment stores them
+#define DICTIONARY_MAGIC "HUFD"
+#define DICTIONARY_FORMAT_VERSION 1
+#define DICTIONARY_HEADER_SIZE 9
+#define DICTIONARY_MAX_CODE_LENGTH 15 // Keeps the lengths in nibbles and the decode table small
+#define CODEC_MAX_DICTIONARIES 16
+
+
 typedef unsigned char byte;
 
 typedef struct HuffmanNode {
     int symbol;
-    int frequency;
+    uint64_t frequency;
     struct HuffmanNode *left;
     struct HuffmanNode *right;
     struct HuffmanNode *parent;
-    int is_found;
 } HuffmanNode_t;
 
 
+typedef struct HuffmanTree {
+    HuffmanNode_t nodes[MAX_NODES]; // Every node of the tree, leaves and branches alike
+    int node_count;
+    HuffmanNode_t* root;
+} HuffmanTree_t;
+
+
 typedef struct FileData {
     char *data;        // Pointer to store all the information in the file
     unsigned char *header; // Pointer to store the header of the file
-    unsigned int fileSize; // Size of the file
-    unsigned int original_fileSize; // Size of the original file
-    HuffmanNode_t* huffman_tree; // Pointer to store the huffman tree
+    uint64_t fileSize; // Size of the file
+    uint64_t original_fileSize; // Size of the original file
+    HuffmanTree_t* huffman_tree; // Pointer to store the huffman tree (legacy files only)
+    int flags; // Container flags of a compressed file
+    ImageLayout_t layout; // Filtered containers: where the pixels go
+    const unsigned char* row_filters; // Filtered containers: the filter of every plane row
+    uint32_t run_length_unit; // Run-length containers: bytes per unit
+    uint64_t run_length_size; // Run-length containers: size of the run-length coded data
+    const HuffmanDictionary_t* dictionary; // Dictionary containers: the dictionary the segments may use
+    const HuffmanDictionary_t* const* dictionaries; // Loaded dictionaries to look in before DICTIONARY_DIRECTORY
+    int dictionary_count;
+    DecodeTables_t* tables; // Tables to decode with or to fill in, NULL to parse them and let them go
+    int thread_count; // Threads that decode blocks in parallel, 0 for one per CPU core
+    MappedFile_t mapping; // The mapped file that data points into
+    Arena_t* arena; // Owns this struct, its header and legacy tree, and the scratch memory of its compress or decompress
 } FileData_t;
 
 
+typedef struct HuffmanCode {
+    uint64_t code; // Code bits, right-aligned
+    int length;    // Code length in bits, 0 if the symbol has no code
+} HuffmanCode_t;
+
+
+typedef struct ByteBuffer {
+    byte* data;
+    size_t size;
+    size_t capacity;
+} ByteBuffer_t;
+
+
+typedef struct BitWriter {
+    ByteBuffer_t* output;
+    uint64_t accumulator; // Pending bits, most significant bit first
+    int bit_count;
+} BitWriter_t;
+
+
+typedef struct DecodeEntry {
+    unsigned int next;      // Offset of the sub-table (links only)
+    unsigned short symbol;  // Decoded symbol (leaves only)
+    unsigned char length;   // Number of bits consumed by this entry
+    unsigned char sub_bits; // Index width of the sub-table, 0 for leaves
+} DecodeEntry_t;
+
+
+typedef struct DecodeTable {
+    DecodeEntry_t* entries; // Root table followed by every overflow sub-table
+    unsigned int size;
+    unsigned int capacity;
+    int in_arena;           // 1 if the table lives in an arena, which free_decode_table leaves alone
+} DecodeTable_t;
+
+
+// What decoding a segment parsed before it got to the bitstream, kept to decode it again
+typedef struct SegmentTable {
+    int type;                  // First byte of the segment the tables came from
+    size_t input_size;         // Its size, so tables are never used for some other segment
+    size_t position;           // Where its bitstream starts
+    DecodeTable_t* table;      // Huffman segments
+    uint16_t* context_entries; // Context segments: context_count tables of CONTEXT_MAX_CODE_LENGTH bits
+    int context_count;
+    unsigned char context_table[MAX_SYMBOLS];
+} SegmentTable_t;
+
+
+struct DecodeTables {
+    SegmentTable_t* segments; // One per segment, filled in by the first decompress
+    uint32_t segment_count;
+};
+
+
+typedef struct ContextModel {
+    int table_count;
+    unsigned char context_table[MAX_SYMBOLS]; // Table each previous byte selects
+    unsigned char code_lengths[CONTEXT_MAX_TABLES][MAX_SYMBOLS];
+    uint64_t total_bits; // Bitstream bits, before the header
+    size_t header_size;
+} ContextModel_t;
+
+
+struct HuffmanDictionary {
+    uint32_t id; // First 4 bytes of the SHA-256 of the code lengths
+    unsigned char code_lengths[MAX_SYMBOLS];
+    HuffmanCode_t* codes;
+    DecodeTable_t* decode_table;
+    Arena_t* arena; // Holds everything above; the dictionary's own unless it was loaded into a file's arena
+};
+
+
+// Pre-passes picked for a compressed file, and the data they leave to entropy code
+typedef struct CodedData {
+    const byte* data;
+    uint64_t size;
+    ImageLayout_t layout;
+    const byte* row_filters; // NULL unless the data is filtered planes
+    uint32_t run_length_unit; // 0 unless the data is run-length coded
+} CodedData_t;
+
+
 /* Function Prototypes */
 FileData_t* readBMPFile(const char* inputPath);
-int* getFrequencyTable(const FileData_t* fileData);
-void sortHuffmanTree(HuffmanNode_t* huffman_tree[]);
-HuffmanNode_t* createHuffmanTree(const int* freq_table);
-char** generateHuffmanCodes(HuffmanNode_t* head);
-byte char_array_to_byte(const char bit_array[9]);
-void write_compressed_file(FileData_t* fileData, HuffmanNode_t* huffman_tree, char** huffman_codes, const char* outputPath);
+void add_frequencies(const byte* data, size_t size, uint64_t* freq_table);
+HuffmanTree_t* createHuffmanTree(const uint64_t* freq_table, int skip_zero_frequency, Arena_t* arena);
+void get_code_lengths(const HuffmanTree_t* huffman_tree, unsigned char* code_lengths);
+int limit_code_lengths(const uint64_t* freq_table, int max_code_length, unsigned char* code_lengths, Arena_t* arena);
+HuffmanCode_t* generateHuffmanCodes(const unsigned char* code_lengths, Arena_t* arena);
+HuffmanTree_t* build_canonical_tree(const unsigned char* code_lengths, Arena_t* arena);
+int write_compressed_file(FileData_t* fileData, const CompressionOptions_t* options, const char* outputPath);
 FileData_t* read_compressed_file(const char* inputPath);
-void decompress_file(FileData_t* compressed_fileData, const char* outputPath);
+int decompress_file(FileData_t* compressed_fileData, const char* outputPath);
+DecodeTable_t* build_decode_table(const HuffmanNode_t* huffman_tree, Arena_t* arena);
+void free_decode_table(DecodeTable_t* table);
 char* int_to_binary(unsigned int number);
-void serialize_huffman_tree(HuffmanNode_t* node, FILE* file);
-void free_huffman_tree(HuffmanNode_t* node);
+HuffmanTree_t* deserialize_huffman_tree(const byte* input, size_t input_size, size_t* position, Arena_t* arena);
+void free_file_data(FileData_t* fileData);
+static int parse_compressed_data(FileData_t* compressed_fileData, const byte* input, size_t input_size);
+static int walk_stream_frames(const byte* input, size_t input_size, byte* output, uint64_t output_size, uint64_t* total_size,
+                              Arena_t* arena);
+static HuffmanDictionary_t* read_dictionary_file(uint32_t id, Arena_t* arena);
 char* create_full_path(const char* directory, const char* filename);
+void default_compression_options(CompressionOptions_t* options);
 int compress_image_to_database(const char* image_name);
+int compress_image_to_database_with_options(const char* image_name, const CompressionOptions_t* options);
+char* compressed_database_path(const char* image_name);
 int decompress_file_to_decompressed(const char* image_name);
 
 
@@ -57,8 +274,36 @@ char* create_full_path(const char* directory, const char* filename) {
 }
 
 
+void default_compression_options(CompressionOptions_t* options) {
+    options->max_code_length = DEFAULT_MAX_CODE_LENGTH;
+    options->block_size = DEFAULT_BLOCK_SIZE;
+    options->thread_count = 0;
+    options->image_filter = 1;
+    options->run_length = 1;
+    options->fse = 1;
+    options->context_model = 1;
+    options->dictionary = NULL;
+}
+
+
 int compress_image_to_database(const char* image_name) {
+    CompressionOptions_t options;
+    default_compression_options(&options);
+    return compress_image_to_database_with_options(image_name, &options);
+}
+
+
+static int check_compression_options(const CompressionOptions_t* options) {
+    if (options->max_code_length != 0 &&
+        (options->max_code_length < 8 || options->max_code_length > MAX_CANONICAL_LENGTH)) {
+        printf("Maximum code length must be 0 (no limit) or between 8 and %d bits\n", MAX_CANONICAL_LENGTH);
+        return 1;
+    }
+    return 0;
+}
+
 
+char* compressed_database_path(const char* image_name) {
     char base_name[241];
     char output_name[256];
     
@@ -73,9 +318,18 @@ int compress_image_to_database(const char* image_name) {
     }
     
     snprintf(output_name, sizeof(output_name), "%s_compressed.bmp", base_name);
-    
+    return create_full_path(CLIENT_DATABASE, output_name);
+}
+
+
+int compress_image_to_database_with_options(const char* image_name, const CompressionOptions_t* options) {
+
+    if (check_compression_options(options)) {
+        return 1;
+    }
+
     char* inputPath = create_full_path(IMAGE_DIRECTORY, image_name);
-    char* outputPath = create_full_path(CLIENT_DATABASE, output_name);
+    char* outputPath = compressed_database_path(image_name);
 
     if (!inputPath || !outputPath) {
         free(inputPath);
@@ -88,17 +342,18 @@ int compress_image_to_database(const char* image_name) {
     }
 
     FileData_t* original_fileData = readBMPFile(inputPath);
-    int* freq_table = getFrequencyTable(original_fileData);
-    HuffmanNode_t* huffman_head = createHuffmanTree(freq_table);
-    char** huffman_codes = generateHuffmanCodes(huffman_head);
-
-    write_compressed_file(original_fileData, huffman_head, huffman_codes, outputPath);
+    if (original_fileData == NULL) {
+        free(inputPath);
+        free(outputPath);
+        return 1;
+    }
+    int status = write_compressed_file(original_fileData, options, outputPath);
+    free_file_data(original_fileData);
 
     // Clean up
     free(inputPath);
     free(outputPath);
-    // Add any necessary cleanup for other allocated resources
-    return 0;
+    return status;
 }
 
 
@@ -133,512 +388,3070 @@ int decompress_file_to_decompressed(const char* image_name) {
     }
 
     FileData_t* compressed_fileData = read_compressed_file(inputPath);
-    decompress_file(compressed_fileData, outputPath);
+    int status = compressed_fileData == NULL || decompress_file(compressed_fileData, outputPath);
+    free_file_data(compressed_fileData);
 
     // Clean up
     free(inputPath);
     free(outputPath);
-    // Add any necessary cleanup for compressed_fileData
-    return 0;
+    return status;
 }
 
 
-FileData_t* readBMPFile(const char* inputPath) {
-    FileData_t *fileData = (FileData_t*)malloc(sizeof(FileData_t));
-    if (fileData == NULL) {
-        printf("Memory allocation failed\n");
+// A zeroed FileData_t living in an arena of its own, which free_file_data destroys
+static FileData_t* new_file_data(void) {
+    Arena_t* arena = arena_create(0);
+    if (arena == NULL) {
         return NULL;
     }
-    
-    FILE *file = fopen(inputPath, "rb");
-    if (file == NULL) {
-        printf("Error opening file\n");
-        free(fileData);
+    FileData_t* fileData = (FileData_t*)arena_calloc(arena, 1, sizeof(FileData_t));
+    if (fileData == NULL) {
+        printf("Memory allocation failed for file data\n");
+        arena_destroy(arena);
         return NULL;
     }
+    fileData->arena = arena;
+    return fileData;
+}
 
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    fileData->fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
 
-    // Allocate memory for file data
-    fileData->data = (char*)malloc(fileData->fileSize);
-    if (fileData->data == NULL) {
-        printf("Memory allocation failed for file data\n");
-        fclose(file);
-        free(fileData);
+FileData_t* readBMPFile(const char* inputPath) {
+    FileData_t *fileData = new_file_data();
+    if (fileData == NULL) {
         return NULL;
     }
 
-    // Read all the characters in the file's binaries and store them in fileData->data
-    size_t bytesRead = fread(fileData->data, 1, fileData->fileSize, file);
-    if (bytesRead != fileData->fileSize) {
-        printf("Error reading file\n");
-        fclose(file);
-        free(fileData->data);
-        free(fileData);
+    // Map the file rather than copying it, the encoder reads straight from the mapping
+    if (map_file_for_reading(inputPath, &fileData->mapping)) {
+        printf("Error opening file\n");
+        arena_destroy(fileData->arena);
         return NULL;
     }
+    fileData->data = (char*)fileData->mapping.data;
+    fileData->fileSize = fileData->mapping.size;
 
     // Allocate memory for header (assuming 54 bytes for standard BMP header)
-    fileData->header = (unsigned char*)malloc(54);
+    fileData->header = (unsigned char*)arena_calloc(fileData->arena, 54, 1);
     if (fileData->header == NULL) {
-        printf("Memory allocation failed for header\n");
-        fclose(file);
-        free(fileData->data);
-        free(fileData);
+        free_file_data(fileData);
         return NULL;
     }
 
     // Copy the first 54 bytes to the header
-    memcpy(fileData->header, fileData->data, 54);
+    if (fileData->fileSize > 0) {
+        memcpy(fileData->header, fileData->data, fileData->fileSize < 54 ? (size_t)fileData->fileSize : 54);
+    }
 
-    fclose(file);
     return fileData;
 }
 
 
-int* getFrequencyTable(const FileData_t* fileData) {
-    /* Create frequency table */
-    int* freq_table = (int*)malloc(MAX_SYMBOLS * sizeof(int));
-
+void count_frequencies(const byte* data, size_t size, uint64_t* freq_table) {
     /* Zero the frequency table */
     for (int i = 0; i < MAX_SYMBOLS; i++) {
         freq_table[i] = 0;
     }
 
     /* Populate the frequency table */
-    for (unsigned int i = 54; i < fileData->fileSize; i++) { // Start after the header
-        freq_table[(unsigned char)fileData->data[i]]++;
+    add_frequencies(data, size, freq_table);
+}
+
+
+// Count the bytes of one slice into the sub-histograms, eight bytes per step
+static size_t count_slice_scalar(const byte* data, size_t size, uint32_t counts[HISTOGRAM_WAYS][MAX_SYMBOLS]) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        counts[0][word & 0xFF]++;
+        counts[1][(word >> 8) & 0xFF]++;
+        counts[2][(word >> 16) & 0xFF]++;
+        counts[3][(word >> 24) & 0xFF]++;
+        counts[4][(word >> 32) & 0xFF]++;
+        counts[5][(word >> 40) & 0xFF]++;
+        counts[6][(word >> 48) & 0xFF]++;
+        counts[7][word >> 56]++;
+    }
+    return i;
+}
+
+
+#ifdef HAVE_AVX2_HISTOGRAM
+/* A 32-byte run of one value (solid fills, padding, blank scanlines) is counted with
+a single compare; anything else goes through the scalar sub-histograms. */
+__attribute__((target("avx2")))
+static size_t count_slice_avx2(const byte* data, size_t size, uint32_t counts[HISTOGRAM_WAYS][MAX_SYMBOLS]) {
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i first = _mm256_set1_epi8((char)data[i]);
+        if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, first)) == 0xFFFFFFFFu) {
+            counts[0][data[i]] += 32;
+        } else {
+            count_slice_scalar(data + i, 32, counts);
+        }
     }
+    return i;
+}
+#endif
+
+
+typedef size_t (*CountSlice_t)(const byte* data, size_t size, uint32_t counts[HISTOGRAM_WAYS][MAX_SYMBOLS]);
 
-    return freq_table;
+static CountSlice_t select_count_slice(void) {
+#ifdef HAVE_AVX2_HISTOGRAM
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return count_slice_avx2;
+    }
+#endif
+    return count_slice_scalar;
 }
 
 
-void sortHuffmanTree(HuffmanNode_t* huffman_tree[]) {
-    int i, j;
-    for (i = 0; i < MAX_SYMBOLS; i++) {
-        for (j = i + 1; j < MAX_SYMBOLS; j++) {
-            if (huffman_tree[i]->frequency < huffman_tree[j]->frequency) {
-                HuffmanNode_t* temp = huffman_tree[i];
-                huffman_tree[i] = huffman_tree[j];
-                huffman_tree[j] = temp;
+// Add the byte counts of data to freq_table
+void add_frequencies(const byte* data, size_t size, uint64_t* freq_table) {
+    CountSlice_t count_slice = select_count_slice();
+    uint32_t counts[HISTOGRAM_WAYS][MAX_SYMBOLS];
+
+    while (size > 0) {
+        size_t slice = size < HISTOGRAM_SLICE ? size : HISTOGRAM_SLICE;
+        memset(counts, 0, sizeof(counts));
+
+        size_t counted = count_slice(data, slice, counts);
+        for (size_t i = counted; i < slice; i++) {
+            counts[0][data[i]]++;
+        }
+
+        for (int symbol = 0; symbol < MAX_SYMBOLS; symbol++) {
+            uint64_t total = 0;
+            for (int way = 0; way < HISTOGRAM_WAYS; way++) {
+                total += counts[way][symbol];
             }
+            freq_table[symbol] += total;
         }
+        data += slice;
+        size -= slice;
     }
 }
 
 
-HuffmanNode_t* createHuffmanTree(const int* freq_table) {
+static HuffmanNode_t* new_huffman_node(HuffmanTree_t* tree, int symbol, uint64_t frequency) {
+    HuffmanNode_t* node = &tree->nodes[tree->node_count++];
+    node->symbol = symbol;
+    node->frequency = frequency;
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = NULL;
+    return node;
+}
 
-    HuffmanNode_t* huffman_tree[MAX_SYMBOLS];
 
-    /* Populate the huffman tree with leaf nodes */
-    int i;
-    for (i = 0; i < MAX_SYMBOLS; i++) {
-        HuffmanNode_t* node = (HuffmanNode_t*)malloc(sizeof(HuffmanNode_t));
-        node->symbol = i;
-        node->frequency = freq_table[i];
-        node->left = NULL;
-        node->right = NULL;
-        node->parent = NULL;
-        node->is_found = 0;
-        huffman_tree[i] = node;
-    }  
-
-    /* Sort the huffman tree in descending order */
-    sortHuffmanTree(huffman_tree);
-
-    int nodeCount = MAX_SYMBOLS;
-    
-    /* Create the huffman tree, observing the smallest two nodes of the tree each time 
-    the size of the tree reduces by 1 each iteration so this loop shortens its span by 1 each time */
-    while (nodeCount > 1) {
-        int smallest = nodeCount - 1;
-        int secondSmallest = nodeCount - 2;
-        
-        /* Combine smallest two nodes into a branch, and add it to the tree anywhere above the smallest node*/
-        HuffmanNode_t* branch = (HuffmanNode_t*)malloc(sizeof(HuffmanNode_t));
-
-        branch->symbol = -1; /* Branch nodes don't represent a symbol */
-        branch->frequency = huffman_tree[smallest]->frequency + huffman_tree[secondSmallest]->frequency;
-        branch->left = huffman_tree[smallest];
-        branch->right = huffman_tree[secondSmallest];
-        branch->parent = NULL;
-        branch->is_found = 0;
-        branch->right->parent = branch;
-        branch->left->parent = branch;
-        nodeCount--;
-        
-        huffman_tree[secondSmallest] = branch;
-        
-        /* Re-ort the huffman tree */
-        sortHuffmanTree(huffman_tree);
+// Ascending by frequency, ties broken by symbol so the tree is deterministic
+static int compare_leaves(const void* a, const void* b) {
+    const HuffmanNode_t* left = *(const HuffmanNode_t* const*)a;
+    const HuffmanNode_t* right = *(const HuffmanNode_t* const*)b;
+    if (left->frequency != right->frequency) {
+        return left->frequency < right->frequency ? -1 : 1;
     }
-    
-    // free(freq_table);
-    return huffman_tree[0];
+    return left->symbol - right->symbol;
 }
 
 
-char** generateHuffmanCodes(HuffmanNode_t* head) {
-
-    char ** huffman_codes = (char**)malloc(MAX_SYMBOLS * sizeof(char*));
-    int max_traversal_length = 256;
-    char* traversal_path = (char *)malloc(max_traversal_length * sizeof(char));
-    
-    for (int i = 0; i <= max_traversal_length; i++) {
-        traversal_path[i] = '\0';
+HuffmanTree_t* createHuffmanTree(const uint64_t* freq_table, int skip_zero_frequency, Arena_t* arena) {
+    HuffmanTree_t* tree = (HuffmanTree_t*)arena_alloc(arena, sizeof(HuffmanTree_t));
+    if (tree == NULL) {
+        return NULL;
     }
-    // printf("Initial traversal path is: %s\n", traversal_path);
+    tree->node_count = 0;
 
+    /* Create the leaf nodes, optionally leaving out symbols that never occur */
+    HuffmanNode_t* leaves[MAX_SYMBOLS];
+    int leaf_count = 0;
     for (int i = 0; i < MAX_SYMBOLS; i++) {
-        huffman_codes[i] = (char*)malloc(max_traversal_length * sizeof(char));
-        strcpy(huffman_codes[i], traversal_path);
-    }
-
-    HuffmanNode_t* current = head;
-    int leafs_found = 0;
-    int depth = 0;
-
-    while (leafs_found < MAX_SYMBOLS) {
-        if (current->left == NULL && current->right == NULL && current->is_found == 0) {
-            // printf("leaf number %d found, go up\n", leafs_found);
-            // Leaf node found
-            leafs_found++;
-            current->is_found = 1;
-            strcpy(huffman_codes[current->symbol], traversal_path);
-            // printf("Symbol: %d, Code: %s\n", current->symbol, traversal_path);
-            
-            current = current->parent;
-            traversal_path[depth] = '\0';
-            depth--;
-        } else if (current->left->is_found == 1 && current->right->is_found == 1) {
-            // printf("branch, go up\n");
-            current->is_found = 1;
-            current = current->parent;
-            traversal_path[depth] = '\0';
-            depth--;
-        } else if (current->left != NULL &&current->left->is_found == 0) {
-            // printf("go left\n");
-            // Go left
-            current = current->left;
-            traversal_path[depth] = '0';
-            depth++;
-        } else if (current->right != NULL && current->right->is_found == 0) {
-            // printf("go right\n");
-            // Go right
-            current = current->right;
-            traversal_path[depth] = '1';
-            depth++;
-        } else {
-            // Shouldn't reach here
-            printf("Error\n");
-            break;
+        if (!skip_zero_frequency || freq_table[i] > 0) {
+            leaves[leaf_count++] = new_huffman_node(tree, i, freq_table[i]);
         }
     }
 
+    /* A tree needs at least two leaves for every symbol to get a non-empty code */
+    for (int i = 0; leaf_count < 2; i++) {
+        if (freq_table[i] == 0) {
+            leaves[leaf_count++] = new_huffman_node(tree, i, 0);
+        }
+    }
 
-    free(traversal_path);
+    qsort(leaves, leaf_count, sizeof(HuffmanNode_t*), compare_leaves);
+
+    /* Two-queue construction: the leaves are sorted, and branches are created in
+    non-decreasing frequency order, so the two smallest nodes are always at the
+    front of one of the two queues. Ties take the leaf first. */
+    HuffmanNode_t* branches[MAX_SYMBOLS];
+    int leaf_front = 0;
+    int branch_front = 0;
+    int branch_count = 0;
+
+    while ((leaf_count - leaf_front) + (branch_count - branch_front) > 1) {
+        HuffmanNode_t* smallest[2];
+        for (int k = 0; k < 2; k++) {
+            if (branch_front == branch_count ||
+                (leaf_front < leaf_count && leaves[leaf_front]->frequency <= branches[branch_front]->frequency)) {
+                smallest[k] = leaves[leaf_front++];
+            } else {
+                smallest[k] = branches[branch_front++];
+            }
+        }
 
-    return huffman_codes;
+        /* Combine smallest two nodes into a branch */
+        HuffmanNode_t* branch = new_huffman_node(tree, -1, smallest[0]->frequency + smallest[1]->frequency);
+        branch->left = smallest[0];
+        branch->right = smallest[1];
+        branch->left->parent = branch;
+        branch->right->parent = branch;
+        branches[branch_count++] = branch;
+    }
+
+    tree->root = branches[branch_count - 1];
+    return tree;
 }
 
 
-byte char_array_to_byte(const char bit_array[9]) {
-    byte result = 0;
-    for (int i = 0; i < 8; i++) {  // Still process only 8 bits
-        if (bit_array[i] == '1') {
-            result = (result << 1) | 1;
-        } else {
-            // Treat '0', '2', or any other character as '0' bit
-            result = result << 1;
-        }
+static void assign_code_lengths(const HuffmanNode_t* node, int depth, unsigned char* code_lengths) {
+    if (node->left == NULL && node->right == NULL) {
+        code_lengths[node->symbol] = (unsigned char)depth;
+        return;
     }
-    return result;
+    assign_code_lengths(node->left, depth + 1, code_lengths);
+    assign_code_lengths(node->right, depth + 1, code_lengths);
 }
 
 
-void serialize_huffman_tree(HuffmanNode_t* node, FILE* file) {
-    if (node == NULL) {
-        return;
-    }
-    
-    // Write a byte to indicate if it's a leaf node (1) or internal node (0)
-    unsigned char is_leaf = (node->symbol != -1) ? 1 : 0;
-    fwrite(&is_leaf, sizeof(unsigned char), 1, file);
-    
-    if (is_leaf) {
-        // If it's a leaf, write the symbol
-        fwrite(&node->symbol, sizeof(int), 1, file);
-    } else {
-        // Recursively serialize left and right children
-        serialize_huffman_tree(node->left, file);
-        serialize_huffman_tree(node->right, file);
-    }
+// Code length of every symbol is its leaf depth, 0 for symbols not in the tree
+void get_code_lengths(const HuffmanTree_t* huffman_tree, unsigned char* code_lengths) {
+    memset(code_lengths, 0, MAX_SYMBOLS);
+    assign_code_lengths(huffman_tree->root, 0, code_lengths);
 }
 
 
-void write_compressed_file(FileData_t* fileData, HuffmanNode_t* huffman_tree, char** huffman_codes, const char* outputPath) {
-    if (DEBUG) {
-        printf("Writing compressed file to %s\n", outputPath);
-    }
+typedef struct PackageItem {
+    uint64_t weight;
+    int symbol; // Leaf symbol, or -1 for a package of two items from the next level down
+} PackageItem_t;
 
-    FILE* file = fopen(outputPath, "wb");
-    if (file == NULL) {
-        printf("Error writing to file in write_compressed_file function\n");
-        return;
+
+static int compare_package_items(const void* a, const void* b) {
+    const PackageItem_t* left = (const PackageItem_t*)a;
+    const PackageItem_t* right = (const PackageItem_t*)b;
+    if (left->weight != right->weight) {
+        return left->weight < right->weight ? -1 : 1;
     }
+    return left->symbol - right->symbol;
+}
 
-    char buffer_array[9] = "00000000";  // Initialize with '0's, add space for null terminator
-    int buffer_index = 0;
-    int bytes_written = 0;
 
-    // Write the original file size first (important for decompression)
-    fwrite(&fileData->fileSize, sizeof(unsigned int), 1, file);
-    bytes_written += sizeof(unsigned int);
-    
-    if (DEBUG) {
-        printf("Original file size written to the header: %d\n", fileData->fileSize);
+/* Package-merge: replace the code lengths of the symbols that have a code with the
+optimal lengths of at most max_code_length bits. Level j's list holds the leaves
+merged with pairs ("packages") of level j + 1's list, all sorted by weight. The
+2n - 2 lightest items of level 1 are chosen; every chosen leaf adds one bit to
+its symbol, and every chosen package chooses its two items one level down. */
+int limit_code_lengths(const uint64_t* freq_table, int max_code_length, unsigned char* code_lengths, Arena_t* arena) {
+    PackageItem_t leaves[MAX_SYMBOLS];
+    int leaf_count = 0;
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (code_lengths[i] > 0) {
+            leaves[leaf_count].weight = freq_table[i];
+            leaves[leaf_count].symbol = i;
+            leaf_count++;
+        }
+    }
+    if (leaf_count < 2 || max_code_length > MAX_CANONICAL_LENGTH ||
+        (max_code_length < 31 && (1 << max_code_length) < leaf_count)) {
+        printf("Cannot fit %d symbols into %d-bit codes\n", leaf_count, max_code_length);
+        return 1;
+    }
+    qsort(leaves, leaf_count, sizeof(PackageItem_t), compare_package_items);
+
+    int list_capacity = 2 * leaf_count;
+    ArenaMark_t mark = arena_mark(arena);
+    PackageItem_t* lists = (PackageItem_t*)arena_alloc(arena, (size_t)max_code_length * list_capacity * sizeof(PackageItem_t));
+    int* list_sizes = (int*)arena_alloc(arena, max_code_length * sizeof(int));
+    if (lists == NULL || list_sizes == NULL) {
+        arena_rewind(arena, mark);
+        return 1;
     }
 
-    // Serialize the Huffman tree
-    serialize_huffman_tree(huffman_tree, file);
-
-    // For every byte in the file, including the header
-    for (unsigned int i = 0; i < fileData->fileSize; i++) {
-        unsigned char current_byte = (unsigned char)fileData->data[i];
-        char* binary_str = huffman_codes[current_byte];
-        
-        // For every bit in the huffman code of the byte
-        for (int j = 0; binary_str[j] != '\0'; j++) {
-            buffer_array[buffer_index] = binary_str[j];
-            buffer_index++;
-            
-            // If the buffer is full, convert it to a byte and write it to the file
-            if (buffer_index == 8) {
-                unsigned char b = char_array_to_byte(buffer_array);
-                fputc(b, file);
-                bytes_written++;
-                
-                // Reset the buffer
-                memset(buffer_array, '0', 8);
-                buffer_array[8] = '\0';  // Ensure null termination
-                buffer_index = 0;
+    // The deepest level is just the leaves
+    PackageItem_t* deepest = &lists[(size_t)(max_code_length - 1) * list_capacity];
+    memcpy(deepest, leaves, leaf_count * sizeof(PackageItem_t));
+    list_sizes[max_code_length - 1] = leaf_count;
+
+    for (int level = max_code_length - 2; level >= 0; level--) {
+        const PackageItem_t* below = &lists[(size_t)(level + 1) * list_capacity];
+        int package_count = list_sizes[level + 1] / 2;
+        PackageItem_t* list = &lists[(size_t)level * list_capacity];
+        int size = 0;
+        int leaf = 0;
+        int package = 0;
+
+        // Merge the leaves with the packages, leaves first on ties
+        while (leaf < leaf_count || package < package_count) {
+            uint64_t package_weight = 0;
+            if (package < package_count) {
+                package_weight = below[2 * package].weight + below[2 * package + 1].weight;
+            }
+            if (package == package_count || (leaf < leaf_count && leaves[leaf].weight <= package_weight)) {
+                list[size++] = leaves[leaf++];
+            } else {
+                list[size].weight = package_weight;
+                list[size].symbol = -1;
+                size++;
+                package++;
             }
         }
+        list_sizes[level] = size;
     }
 
-    // If there are any bits left in the buffer, pad with zeros and write
-    if (buffer_index > 0) {
-        unsigned char b = char_array_to_byte(buffer_array);
-        fputc(b, file);
-        bytes_written++;
+    for (int i = 0; i < leaf_count; i++) {
+        code_lengths[leaves[i].symbol] = 0;
     }
 
-    if (DEBUG) {
-        printf("Bytes written to compressed file: %d\n", bytes_written);
+    int chosen = 2 * leaf_count - 2;
+    for (int level = 0; level < max_code_length && chosen > 0; level++) {
+        const PackageItem_t* list = &lists[(size_t)level * list_capacity];
+        int packages_chosen = 0;
+        for (int i = 0; i < chosen; i++) {
+            if (list[i].symbol >= 0) {
+                code_lengths[list[i].symbol]++;
+            } else {
+                packages_chosen++;
+            }
+        }
+        chosen = 2 * packages_chosen;
     }
 
-    fclose(file);
+    arena_rewind(arena, mark);
+    return 0;
 }
 
 
-HuffmanNode_t* deserialize_huffman_tree(FILE* file) {
-    unsigned char is_leaf;
-    if (fread(&is_leaf, sizeof(unsigned char), 1, file) != 1) {
-        return NULL; // End of file or error
+/* Canonical codes: shorter codes first, and within a length in symbol order, each
+code one more than the previous. Only the lengths are needed to rebuild them. */
+HuffmanCode_t* generateHuffmanCodes(const unsigned char* code_lengths, Arena_t* arena) {
+    int length_count[MAX_CANONICAL_LENGTH + 1] = {0};
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (code_lengths[i] > MAX_CANONICAL_LENGTH) {
+            printf("Huffman code of %d bits is too long\n", code_lengths[i]);
+            return NULL;
+        }
+        length_count[code_lengths[i]]++;
     }
-    
-    HuffmanNode_t* node = (HuffmanNode_t*)malloc(sizeof(HuffmanNode_t));
-    if (node == NULL) {
-        printf("Memory allocation failed\n");
-        return NULL;
+    length_count[0] = 0;
+
+    uint64_t next_code[MAX_CANONICAL_LENGTH + 1];
+    uint64_t code = 0;
+    for (int length = 1; length <= MAX_CANONICAL_LENGTH; length++) {
+        code = (code + length_count[length - 1]) << 1;
+        next_code[length] = code;
     }
-    
-    if (is_leaf) {
-        fread(&node->symbol, sizeof(int), 1, file);
-        node->left = node->right = NULL;
-    } else {
-        node->symbol = -1;
-        node->left = deserialize_huffman_tree(file);
-        node->right = deserialize_huffman_tree(file);
-        if (node->left) node->left->parent = node;
-        if (node->right) node->right->parent = node;
+
+    HuffmanCode_t* huffman_codes = (HuffmanCode_t*)arena_calloc(arena, MAX_SYMBOLS, sizeof(HuffmanCode_t));
+    if (huffman_codes == NULL) {
+        return NULL;
     }
-    
-    node->frequency = 0;
-    node->parent = NULL;
-    node->is_found = 0;
-    
-    return node;
-}
 
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        int length = code_lengths[i];
+        if (length > 0) {
+            huffman_codes[i].code = next_code[length]++;
+            huffman_codes[i].length = length;
+        }
+    }
 
-void free_huffman_tree(HuffmanNode_t* node) {
-    if (node == NULL) return;
-    free_huffman_tree(node->left);
-    free_huffman_tree(node->right);
-    free(node);
+    return huffman_codes;
 }
 
 
-FileData_t* read_compressed_file(const char* inputPath) {
-    FileData_t* compressed_fileData = (FileData_t*)malloc(sizeof(FileData_t));
-    if (compressed_fileData == NULL) {
-        printf("Memory allocation failed for file data\n");
-        return NULL;
+// Rebuild the tree of a canonical code, rejecting lengths that don't form a complete prefix code
+HuffmanTree_t* build_canonical_tree(const unsigned char* code_lengths, Arena_t* arena) {
+    int length_count[MAX_CANONICAL_LENGTH + 1] = {0};
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (code_lengths[i] > MAX_CANONICAL_LENGTH) {
+            return NULL;
+        }
+        length_count[code_lengths[i]]++;
     }
 
-    FILE* file = fopen(inputPath, "rb");
-    if (file == NULL) {
-        printf("Error opening file at read_compressed_file function\n");
-        free(compressed_fileData);
-        return NULL;
+    /* Count the unused codes at each length. Going negative means the lengths are
+    over-subscribed; more unused codes than symbols left means they can never fill up. */
+    int64_t unused = 1;
+    int symbols_left = MAX_SYMBOLS - length_count[0];
+    for (int length = 1; length <= MAX_CANONICAL_LENGTH; length++) {
+        unused = 2 * unused - length_count[length];
+        symbols_left -= length_count[length];
+        if (unused < 0 || unused > symbols_left) {
+            return NULL;
+        }
     }
-
-    // Read the original file size
-    if (fread(&compressed_fileData->original_fileSize, sizeof(unsigned int), 1, file) != 1) {
-        printf("Error reading original file size\n");
-        fclose(file);
-        free(compressed_fileData);
+    if (unused != 0) {
         return NULL;
     }
 
-    // Deserialize the Huffman tree
-    compressed_fileData->huffman_tree = deserialize_huffman_tree(file);
-    if (compressed_fileData->huffman_tree == NULL) {
-        printf("Error deserializing Huffman tree\n");
-        fclose(file);
-        free(compressed_fileData);
+    // The codes are only needed while the tree is built, so they go after it in the arena
+    HuffmanTree_t* tree = (HuffmanTree_t*)arena_alloc(arena, sizeof(HuffmanTree_t));
+    if (tree == NULL) {
         return NULL;
     }
-
-    // Get the remaining file size (compressed data)
-    long current_position = ftell(file);
-    fseek(file, 0, SEEK_END);
-    compressed_fileData->fileSize = ftell(file) - current_position;
-    fseek(file, current_position, SEEK_SET);
-
-    // Allocate memory for compressed data
-    compressed_fileData->data = (char*)malloc(compressed_fileData->fileSize);
-    if (compressed_fileData->data == NULL) {
-        printf("Memory allocation failed for compressed data\n");
-        fclose(file);
-        free_huffman_tree(compressed_fileData->huffman_tree);
-        free(compressed_fileData);
+    ArenaMark_t mark = arena_mark(arena);
+    HuffmanCode_t* huffman_codes = generateHuffmanCodes(code_lengths, arena);
+    if (huffman_codes == NULL) {
         return NULL;
     }
+    tree->node_count = 0;
+    tree->root = new_huffman_node(tree, -1, 0);
 
-    // Read the compressed data
-    size_t bytesRead = fread(compressed_fileData->data, 1, compressed_fileData->fileSize, file);
-    if (bytesRead != compressed_fileData->fileSize) {
-        printf("Error reading compressed data: expected %u bytes, read %zu bytes\n", 
-               compressed_fileData->fileSize, bytesRead);
-        fclose(file);
-        free(compressed_fileData->data);
-        free_huffman_tree(compressed_fileData->huffman_tree);
-        free(compressed_fileData);
-        return NULL;
+    // Walk each code down from the root, creating branches on the way
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        const HuffmanCode_t* code = &huffman_codes[i];
+        HuffmanNode_t* node = tree->root;
+        for (int bit = code->length - 1; bit >= 0; bit--) {
+            HuffmanNode_t** child = ((code->code >> bit) & 1) ? &node->right : &node->left;
+            if (*child == NULL) {
+                *child = new_huffman_node(tree, bit == 0 ? i : -1, 0);
+                (*child)->parent = node;
+            }
+            node = *child;
+        }
     }
 
-    fclose(file);
-    return compressed_fileData;
+    arena_rewind(arena, mark);
+    return tree;
 }
 
 
-char* int_to_binary(unsigned int number) {
-    // Special case for zero
-    if (number == 0) {
-        char* zero_str = (char*)malloc(2);
-        zero_str[0] = '0';
-        zero_str[1] = '\0';
-        return zero_str;
+static int byte_buffer_reserve(ByteBuffer_t* buffer, size_t extra) {
+    if (buffer->size + extra <= buffer->capacity) {
+        return 0;
+    }
+    size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+    while (capacity < buffer->size + extra) {
+        capacity *= 2;
+    }
+    byte* data = (byte*)realloc(buffer->data, capacity);
+    if (data == NULL) {
+        printf("Memory allocation failed for output buffer\n");
+        return 1;
     }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
 
-    int num_bits = sizeof(number) * 8;  // 8 bits per byte
-    char* temp_str = (char*)malloc(num_bits + 1);  // Temporary string for all bits
 
-    if (temp_str == NULL) {
-        return NULL;
+static int byte_buffer_append(ByteBuffer_t* buffer, const void* data, size_t size) {
+    if (byte_buffer_reserve(buffer, size)) {
+        return 1;
     }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return 0;
+}
 
-    temp_str[num_bits] = '\0';  // Null terminator
-    int i;
 
-    // Fill the temp string with binary digits
-    for (i = num_bits - 1; i >= 0; i--) {
-        temp_str[i] = (number & 1) ? '1' : '0';
-        number >>= 1;
+/* Append the low count bits of value (1 to 64) to the stream. The caller reserves
+room for the whole bitstream up front, so the hot loop never checks capacity. */
+static void put_bits(BitWriter_t* writer, uint64_t value, int count) {
+    if (writer->bit_count + count < 64) {
+        writer->accumulator |= value << (64 - writer->bit_count - count);
+        writer->bit_count += count;
+        return;
     }
 
-    // Find the first '1' to eliminate leading zeros
-    int first_one_idx = 0;
-    while (temp_str[first_one_idx] == '0') {
-        first_one_idx++;
-    }
+    // The accumulator is full: top it up, move all 8 bytes out, keep the remainder
+    int remainder = writer->bit_count + count - 64;
+    writer->accumulator |= value >> remainder;
 
-    // Allocate memory for the result string with no leading zeros
-    char* binary_str = (char*)malloc(num_bits - first_one_idx + 1);  // +1 for null terminator
-    if (binary_str == NULL) {
-        free(temp_str);  // Clean up temporary string if memory allocation fails
-        return NULL;
+    byte* destination = writer->output->data + writer->output->size;
+    for (int i = 0; i < 8; i++) {
+        destination[i] = (byte)(writer->accumulator >> (56 - 8 * i));
     }
+    writer->output->size += 8;
 
-    // Copy the relevant part of the temp string to the final result
-    for (i = 0; temp_str[first_one_idx + i] != '\0'; i++) {
-        binary_str[i] = temp_str[first_one_idx + i];
-    }
-    binary_str[i] = '\0';  // Null terminate the result string
+    writer->accumulator = remainder ? value << (64 - remainder) : 0;
+    writer->bit_count = remainder;
+}
 
-    free(temp_str);  // Clean up the temporary string
-    return binary_str;
+
+// Write out the pending bits, zero-padding the final byte
+static void finish_bit_writer(BitWriter_t* writer) {
+    for (int i = 0; i < writer->bit_count; i += 8) {
+        writer->output->data[writer->output->size++] = (byte)(writer->accumulator >> (56 - i));
+    }
+    writer->accumulator = 0;
+    writer->bit_count = 0;
 }
 
 
-void decompress_file(FileData_t* compressed_fileData, const char* outputPath) {
-    FILE* file = fopen(outputPath, "wb");
-    if (file == NULL) {
-        printf("Error writing to file at decompress_file function\n");
-        return;
+/* Code lengths go out either as 128 bytes of nibbles (when every length fits in
+4 bits) or as (run - 1, length) byte pairs, whichever is smaller */
+static int write_code_lengths(ByteBuffer_t* output, const unsigned char* code_lengths) {
+    byte runs[1 + 2 * MAX_SYMBOLS];
+    int run_bytes = 1;
+    int max_length = 0;
+
+    for (int i = 0; i < MAX_SYMBOLS;) {
+        int run = 1;
+        while (i + run < MAX_SYMBOLS && code_lengths[i + run] == code_lengths[i]) {
+            run++;
+        }
+        runs[run_bytes++] = (byte)(run - 1);
+        runs[run_bytes++] = code_lengths[i];
+        if (code_lengths[i] > max_length) {
+            max_length = code_lengths[i];
+        }
+        i += run;
     }
 
-    if (DEBUG) {
-        printf("Original file size according to the header: %u\n", compressed_fileData->original_fileSize);
+    if (max_length <= 15 && 1 + MAX_SYMBOLS / 2 <= run_bytes) {
+        byte nibbles[1 + MAX_SYMBOLS / 2];
+        nibbles[0] = SEGMENT_HUFFMAN_NIBBLES;
+        for (int i = 0; i < MAX_SYMBOLS; i += 2) {
+            nibbles[1 + i / 2] = (byte)((code_lengths[i] << 4) | code_lengths[i + 1]);
+        }
+        return byte_buffer_append(output, nibbles, sizeof(nibbles));
     }
 
-    HuffmanNode_t* current = compressed_fileData->huffman_tree;
-    unsigned int bytes_decoded = 0;
+    runs[0] = SEGMENT_HUFFMAN_RUNS;
+    return byte_buffer_append(output, runs, run_bytes);
+}
 
-    for (size_t i = 0; i < compressed_fileData->fileSize; i++) {
-        unsigned char byte = (unsigned char)compressed_fileData->data[i];
-        for (int j = 7; j >= 0; j--) {
-            if (byte & (1 << j)) {
-                current = current->right;
-            } else {
-                current = current->left;
-            }
 
-            if (current->left == NULL && current->right == NULL) {
-                if (bytes_decoded < compressed_fileData->original_fileSize) {
-                    fputc(current->symbol, file);
-                    bytes_decoded++;
-                    current = compressed_fileData->huffman_tree;
-                } else {
-                    break;
-                }
-            }
+// Parse the segment type and code lengths at input[*position], advancing *position past them
+static int read_code_lengths(const byte* input, size_t input_size, size_t* position, unsigned char* code_lengths) {
+    size_t pos = *position;
+    if (pos >= input_size) {
+        return 1;
+    }
+    int segment_type = input[pos++];
+
+    if (segment_type == SEGMENT_HUFFMAN_NIBBLES) {
+        if (input_size - pos < MAX_SYMBOLS / 2) {
+            return 1;
         }
-        if (bytes_decoded >= compressed_fileData->original_fileSize) {
-            break;
+        for (int i = 0; i < MAX_SYMBOLS; i += 2) {
+            code_lengths[i] = input[pos] >> 4;
+            code_lengths[i + 1] = input[pos] & 0x0F;
+            pos++;
+        }
+    } else if (segment_type == SEGMENT_HUFFMAN_RUNS) {
+        for (int i = 0; i < MAX_SYMBOLS;) {
+            if (input_size - pos < 2 || i + input[pos] + 1 > MAX_SYMBOLS) {
+                return 1;
+            }
+            memset(&code_lengths[i], input[pos + 1], input[pos] + 1);
+            i += input[pos] + 1;
+            pos += 2;
         }
+    } else {
+        printf("Unknown segment type %d\n", segment_type);
+        return 1;
     }
-    
+
+    *position = pos;
+    return 0;
+}
+
+
+// Code lengths for a histogram, honouring options->max_code_length, without building the codes
+static int build_code_lengths(const uint64_t* freq_table, const CompressionOptions_t* options, unsigned char* code_lengths,
+                              Arena_t* arena) {
+    ArenaMark_t mark = arena_mark(arena);
+    HuffmanTree_t* huffman_tree = createHuffmanTree(freq_table, 1, arena);
+    if (huffman_tree == NULL) {
+        return 1;
+    }
+    get_code_lengths(huffman_tree, code_lengths);
+    arena_rewind(arena, mark);
+
+    // Codes deeper than the limit (or than the canonical code builder allows) get re-balanced
+    int max_code_length = options->max_code_length ? options->max_code_length : MAX_CANONICAL_LENGTH;
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (code_lengths[i] > max_code_length) {
+            return limit_code_lengths(freq_table, max_code_length, code_lengths, arena);
+        }
+    }
+    return 0;
+}
+
+
+// Code lengths and canonical codes for a histogram; only the codes are left in the arena
+static HuffmanCode_t* build_codes(const uint64_t* freq_table, const CompressionOptions_t* options, unsigned char* code_lengths,
+                                  Arena_t* arena) {
+    if (build_code_lengths(freq_table, options, code_lengths, arena)) {
+        return NULL;
+    }
+    return generateHuffmanCodes(code_lengths, arena);
+}
+
+
+// FSE-code size bytes of data as one segment, after its segment type and counts
+static int encode_fse_segment(const byte* data, size_t size, const uint64_t* freq_table, const uint16_t* normalized,
+                              int table_log, const byte* counts, size_t counts_size, ByteBuffer_t* output) {
+    if (byte_buffer_append(output, counts, counts_size) ||
+        byte_buffer_reserve(output, fse_encode_bound(freq_table, normalized, table_log))) {
+        return 1;
+    }
+    size_t written = fse_encode(data, size, normalized, table_log, output->data + output->size);
+    if (written == 0) {
+        printf("FSE coding failed\n");
+        return 1;
+    }
+    output->size += written;
+    return 0;
+}
+
+
+// Write a context modelled segment's header: segment type, table count, context table and code lengths
+static int write_context_header(ByteBuffer_t* output, const ContextModel_t* model) {
+    byte header[2] = {SEGMENT_CONTEXT_HUFFMAN, (byte)model->table_count};
+    if (byte_buffer_append(output, header, 2) || write_code_lengths(output, model->context_table)) {
+        return 1;
+    }
+    for (int k = 0; k < model->table_count; k++) {
+        if (write_code_lengths(output, model->code_lengths[k])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Bits the context's symbols cost under a table, charging for symbols it has no code for
+static uint64_t context_bits(const uint64_t* freq, const byte* used, int used_count, const unsigned char* code_lengths) {
+    uint64_t bits = 0;
+    for (int i = 0; i < used_count; i++) {
+        unsigned char length = code_lengths[used[i]];
+        bits += freq[used[i]] * (length ? length : CONTEXT_MISSING_SYMBOL_BITS);
+    }
+    return bits;
+}
+
+
+/* Cluster the contexts into table_count tables, k-means style. The first table is seeded
+with the busiest context and each next one with the context the seeds so far code worst,
+against a rough guess (log2 of its distinct symbols per symbol) of what its own table
+would cost. Then every context moves to the table that codes it in the fewest bits and
+the tables are rebuilt from the contexts they hold, until nothing moves. Tables that lose
+all their contexts are dropped, so model->table_count can come out smaller. */
+static int cluster_contexts(const uint64_t* context_freq, const uint64_t* context_totals, const byte* symbols,
+                            const int* symbol_counts, int table_count, const CompressionOptions_t* options,
+                            ContextModel_t* model, Arena_t* arena) {
+    uint64_t table_freq[CONTEXT_MAX_TABLES][MAX_SYMBOLS];
+    uint64_t seed_bits[MAX_SYMBOLS]; // Bits under the best seed so far
+    int seeded[MAX_SYMBOLS] = {0};
+
+    // Rounds steer by plain Huffman code lengths, only the final tables honour the length limit
+    CompressionOptions_t unlimited = *options;
+    unlimited.max_code_length = 0;
+
+    for (int c = 0; c < MAX_SYMBOLS; c++) {
+        seed_bits[c] = UINT64_MAX;
+    }
+    for (int k = 0; k < table_count; k++) {
+        int seed = -1;
+        uint64_t best_gain = 0;
+        for (int c = 0; c < MAX_SYMBOLS; c++) {
+            if (seeded[c] || context_totals[c] == 0) {
+                continue;
+            }
+            uint64_t gain = context_totals[c];
+            if (k > 0) {
+                int own_bits = 0;
+                while ((1 << own_bits) < symbol_counts[c]) {
+                    own_bits++;
+                }
+                uint64_t own = context_totals[c] * (uint64_t)own_bits;
+                gain = seed_bits[c] > own ? seed_bits[c] - own : 0;
+            }
+            if (seed < 0 || gain > best_gain) {
+                seed = c;
+                best_gain = gain;
+            }
+        }
+        if (seed < 0) {
+            return 1; // Fewer contexts in use than tables
+        }
+
+        seeded[seed] = 1;
+        memcpy(table_freq[k], context_freq + (size_t)seed * MAX_SYMBOLS, sizeof(table_freq[k]));
+        if (build_code_lengths(table_freq[k], &unlimited, model->code_lengths[k], arena)) {
+            return 1;
+        }
+        for (int c = 0; c < MAX_SYMBOLS; c++) {
+            if (context_totals[c] > 0) {
+                uint64_t bits = context_bits(context_freq + (size_t)c * MAX_SYMBOLS, symbols + (size_t)c * MAX_SYMBOLS,
+                                             symbol_counts[c], model->code_lengths[k]);
+                if (bits < seed_bits[c]) {
+                    seed_bits[c] = bits;
+                }
+            }
+        }
+    }
+
+    for (int round = 0; round < CONTEXT_CLUSTER_ROUNDS; round++) {
+        int changed = round == 0;
+        for (int c = 0; c < MAX_SYMBOLS; c++) {
+            if (context_totals[c] == 0) {
+                continue;
+            }
+            int best_table = 0;
+            uint64_t best_bits = UINT64_MAX;
+            for (int k = 0; k < table_count; k++) {
+                uint64_t bits = context_bits(context_freq + (size_t)c * MAX_SYMBOLS, symbols + (size_t)c * MAX_SYMBOLS,
+                                             symbol_counts[c], model->code_lengths[k]);
+                if (bits < best_bits) {
+                    best_bits = bits;
+                    best_table = k;
+                }
+            }
+            if (model->context_table[c] != best_table) {
+                model->context_table[c] = (unsigned char)best_table;
+                changed = 1;
+            }
+        }
+        if (!changed) {
+            break;
+        }
+
+        // Rebuild the table histograms, renumbering the tables that kept contexts
+        int renumber[CONTEXT_MAX_TABLES];
+        int kept = 0;
+        for (int k = 0; k < table_count; k++) {
+            renumber[k] = -1;
+        }
+        memset(table_freq, 0, sizeof(table_freq));
+        for (int c = 0; c < MAX_SYMBOLS; c++) {
+            if (context_totals[c] == 0) {
+                continue;
+            }
+            int k = model->context_table[c];
+            if (renumber[k] < 0) {
+                renumber[k] = kept++;
+            }
+            model->context_table[c] = (unsigned char)renumber[k];
+            const uint64_t* freq = context_freq + (size_t)c * MAX_SYMBOLS;
+            const byte* used = symbols + (size_t)c * MAX_SYMBOLS;
+            for (int i = 0; i < symbol_counts[c]; i++) {
+                table_freq[model->context_table[c]][used[i]] += freq[used[i]];
+            }
+        }
+        table_count = kept;
+        for (int k = 0; k < table_count; k++) {
+            if (build_code_lengths(table_freq[k], &unlimited, model->code_lengths[k], arena)) {
+                return 1;
+            }
+        }
+    }
+    for (int k = 0; k < table_count; k++) {
+        if (build_code_lengths(table_freq[k], options, model->code_lengths[k], arena)) {
+            return 1;
+        }
+    }
+
+    // Unused contexts follow their neighbour, so the context table stores as long runs
+    model->table_count = table_count;
+    model->total_bits = 0;
+    for (int c = 0; c < MAX_SYMBOLS; c++) {
+        if (context_totals[c] == 0) {
+            model->context_table[c] = c > 0 ? model->context_table[c - 1] : 0;
+            continue;
+        }
+        model->total_bits += context_bits(context_freq + (size_t)c * MAX_SYMBOLS, symbols + (size_t)c * MAX_SYMBOLS,
+                                          symbol_counts[c], model->code_lengths[model->context_table[c]]);
+    }
+
+    ByteBuffer_t header = {0};
+    int status = write_context_header(&header, model);
+    model->header_size = header.size;
+    free(header.data);
+    return status;
+}
+
+
+/* Find the context model (2, 4, 8 or 16 tables) that codes data smallest, header
+included. Returns 0 with the model in *model, non-zero if none could be built. */
+static int build_context_model(const byte* data, size_t size, const CompressionOptions_t* options, ContextModel_t* model,
+                               Arena_t* arena) {
+    ArenaMark_t mark = arena_mark(arena);
+    uint64_t* context_freq = (uint64_t*)arena_calloc(arena, (size_t)MAX_SYMBOLS * MAX_SYMBOLS, sizeof(uint64_t));
+    byte* symbols = (byte*)arena_alloc(arena, (size_t)MAX_SYMBOLS * MAX_SYMBOLS);
+    if (context_freq == NULL || symbols == NULL) {
+        arena_rewind(arena, mark);
+        return 1;
+    }
+
+    byte previous = 0;
+    for (size_t i = 0; i < size; i++) {
+        context_freq[(size_t)previous * MAX_SYMBOLS + data[i]]++;
+        previous = data[i];
+    }
+
+    // Per context, its total and the symbols that occur in it, so clustering skips the zeros
+    uint64_t context_totals[MAX_SYMBOLS];
+    int symbol_counts[MAX_SYMBOLS];
+    for (int c = 0; c < MAX_SYMBOLS; c++) {
+        context_totals[c] = 0;
+        symbol_counts[c] = 0;
+        for (int s = 0; s < MAX_SYMBOLS; s++) {
+            uint64_t count = context_freq[(size_t)c * MAX_SYMBOLS + s];
+            if (count > 0) {
+                context_totals[c] += count;
+                symbols[(size_t)c * MAX_SYMBOLS + symbol_counts[c]++] = (byte)s;
+            }
+        }
+    }
+
+    // Short enough codes that each table decodes with a single lookup
+    CompressionOptions_t context_options = *options;
+    if (context_options.max_code_length == 0 || context_options.max_code_length > CONTEXT_MAX_CODE_LENGTH) {
+        context_options.max_code_length = CONTEXT_MAX_CODE_LENGTH;
+    }
+
+    int status = 1;
+    uint64_t best_bits = UINT64_MAX;
+    ContextModel_t candidate;
+    memset(&candidate, 0, sizeof(candidate));
+    for (int table_count = 2; table_count <= CONTEXT_MAX_TABLES; table_count *= 2) {
+        if (cluster_contexts(context_freq, context_totals, symbols, symbol_counts, table_count, &context_options, &candidate,
+                             arena)) {
+            break;
+        }
+        uint64_t bits = candidate.total_bits + 8 * (uint64_t)candidate.header_size;
+        if (bits >= best_bits) {
+            break; // More tables stopped paying for themselves
+        }
+        best_bits = bits;
+        *model = candidate;
+        status = 0;
+    }
+
+    arena_rewind(arena, mark);
+    return status;
+}
+
+
+// Huffman-code size bytes of data as one segment, switching tables on the byte before each symbol
+static int encode_context_segment(const byte* data, size_t size, const ContextModel_t* model, ByteBuffer_t* output,
+                                  Arena_t* arena) {
+    ArenaMark_t mark = arena_mark(arena);
+    HuffmanCode_t* huffman_codes[CONTEXT_MAX_TABLES] = {NULL};
+    int status = write_context_header(output, model) || byte_buffer_reserve(output, (size_t)(model->total_bits / 8) + 16);
+    for (int k = 0; k < model->table_count && status == 0; k++) {
+        huffman_codes[k] = generateHuffmanCodes(model->code_lengths[k], arena);
+        status = huffman_codes[k] == NULL;
+    }
+
+    if (status == 0) {
+        BitWriter_t writer;
+        writer.output = output;
+        writer.accumulator = 0;
+        writer.bit_count = 0;
+
+        byte previous = 0;
+        for (size_t i = 0; i < size; i++) {
+            const HuffmanCode_t* code = &huffman_codes[model->context_table[previous]][data[i]];
+            put_bits(&writer, code->code, code->length);
+            previous = data[i];
+        }
+        finish_bit_writer(&writer);
+    }
+
+    arena_rewind(arena, mark);
+    return status;
+}
+
+
+// Huffman-code size bytes of data, total_bits long, after what output already holds
+static int write_huffman_bits(const byte* data, size_t size, const HuffmanCode_t* huffman_codes, uint64_t total_bits,
+                              ByteBuffer_t* output) {
+    // The histogram gives the exact bitstream size, so reserve it (plus a spill word) once
+    if (byte_buffer_reserve(output, (size_t)(total_bits / 8) + 16)) {
+        return 1;
+    }
+
+    BitWriter_t writer;
+    writer.output = output;
+    writer.accumulator = 0;
+    writer.bit_count = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        const HuffmanCode_t* code = &huffman_codes[data[i]];
+        put_bits(&writer, code->code, code->length);
+    }
+    finish_bit_writer(&writer);
+    return 0;
+}
+
+
+// Bits the dictionary would code a histogram in, UINT64_MAX if it has no code for one of its symbols
+static uint64_t dictionary_bits(const HuffmanDictionary_t* dictionary, const uint64_t* freq_table) {
+    uint64_t total_bits = 0;
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (freq_table[i] > 0 && dictionary->code_lengths[i] == 0) {
+            return UINT64_MAX;
+        }
+        total_bits += freq_table[i] * dictionary->code_lengths[i];
+    }
+    return total_bits;
+}
+
+
+/* Code size bytes of data as one segment: its code lengths, then its Huffman bitstream,
+or, when the options allow them and they come out smaller, its FSE counts and bitstream,
+a bitstream coded with the dictionary, or its context model and context-switching
+Huffman bitstream */
+static int encode_segment(const byte* data, size_t size, const CompressionOptions_t* options, ByteBuffer_t* output,
+                          Arena_t* arena) {
+    uint64_t freq_table[MAX_SYMBOLS];
+    count_frequencies(data, size, freq_table);
+
+    ArenaMark_t mark = arena_mark(arena);
+    unsigned char code_lengths[MAX_SYMBOLS];
+    HuffmanCode_t* huffman_codes = build_codes(freq_table, options, code_lengths, arena);
+    if (huffman_codes == NULL) {
+        arena_rewind(arena, mark);
+        return 1;
+    }
+
+    uint64_t total_bits = 0;
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        total_bits += freq_table[i] * huffman_codes[i].length;
+    }
+    size_t start = output->size;
+    if (write_code_lengths(output, code_lengths)) {
+        arena_rewind(arena, mark);
+        return 1;
+    }
+
+    int segment_type = SEGMENT_HUFFMAN_NIBBLES;
+    uint64_t best_size = (output->size - start) + (total_bits + 7) / 8;
+
+    uint16_t normalized[FSE_SYMBOLS];
+    int table_log;
+    byte counts[1 + FSE_MAX_HEADER_SIZE];
+    size_t counts_size = 0;
+    if (options->fse && size > 0 && fse_normalize(freq_table, size, normalized, &table_log) == 0) {
+        counts[0] = SEGMENT_FSE;
+        counts_size = 1 + fse_write_counts(normalized, table_log, counts + 1);
+        uint64_t fse_size = counts_size + (fse_estimate_bits(freq_table, normalized, table_log) + 7) / 8;
+        if (fse_size < best_size) {
+            segment_type = SEGMENT_FSE;
+            best_size = fse_size;
+        }
+    }
+
+    uint64_t shared_bits = UINT64_MAX;
+    if (options->dictionary != NULL) {
+        shared_bits = dictionary_bits(options->dictionary, freq_table);
+        if (shared_bits != UINT64_MAX && 1 + (shared_bits + 7) / 8 < best_size) {
+            segment_type = SEGMENT_DICTIONARY;
+            best_size = 1 + (shared_bits + 7) / 8;
+        }
+    }
+
+    ContextModel_t model;
+    if (options->context_model && size >= CONTEXT_MIN_SEGMENT_SIZE && build_context_model(data, size, options, &model, arena) == 0 &&
+        model.header_size + (model.total_bits + 7) / 8 < best_size) {
+        segment_type = SEGMENT_CONTEXT_HUFFMAN;
+    }
+
+    if (segment_type != SEGMENT_HUFFMAN_NIBBLES) {
+        arena_rewind(arena, mark);
+        output->size = start;
+        if (segment_type == SEGMENT_FSE) {
+            return encode_fse_segment(data, size, freq_table, normalized, table_log, counts, counts_size, output);
+        }
+        if (segment_type == SEGMENT_DICTIONARY) {
+            byte type = SEGMENT_DICTIONARY;
+            return byte_buffer_append(output, &type, 1) ||
+                   write_huffman_bits(data, size, options->dictionary->codes, shared_bits, output);
+        }
+        return encode_context_segment(data, size, &model, output, arena);
+    }
+
+    int status = write_huffman_bits(data, size, huffman_codes, total_bits, output);
+    arena_rewind(arena, mark);
+    return status;
+}
+
+
+// Threads worth starting for block_count blocks: thread_count (0 for one per CPU core), but never more than there are blocks
+static int block_thread_count(int thread_count, uint32_t block_count) {
+    if (thread_count <= 0) {
+        thread_count = thread_pool_default_size();
+    }
+    return (uint32_t)thread_count < block_count ? thread_count : (int)block_count;
+}
+
+
+typedef struct BlockTask {
+    const byte* data;
+    size_t size;
+    const CompressionOptions_t* options;
+    ByteBuffer_t output;
+    Arena_t* arena; // Scratch memory, NULL for a task run by a pool worker, which makes its own
+    int status;
+} BlockTask_t;
+
+
+static void encode_block_task(void* argument) {
+    BlockTask_t* block = (BlockTask_t*)argument;
+    Arena_t* arena = block->arena != NULL ? block->arena : arena_create(0);
+    block->status = arena == NULL || encode_segment(block->data, block->size, block->options, &block->output, arena);
+    if (block->arena == NULL) {
+        arena_destroy(arena);
+    }
+}
+
+
+// Code the segments (or the block index and blocks) that follow the container header
+static int encode_payload(const byte* data, uint64_t size, const CompressionOptions_t* options, ByteBuffer_t* output,
+                          Arena_t* arena) {
+    if (!(options->block_size > 0 && size > options->block_size)) {
+        return encode_segment(data, (size_t)size, options, output, arena);
+    }
+
+    uint32_t block_count = (uint32_t)((size + options->block_size - 1) / options->block_size);
+    ArenaMark_t mark = arena_mark(arena);
+    BlockTask_t* blocks = (BlockTask_t*)arena_calloc(arena, block_count, sizeof(BlockTask_t));
+    if (blocks == NULL) {
+        return 1;
+    }
+    for (uint32_t i = 0; i < block_count; i++) {
+        uint64_t offset = (uint64_t)i * options->block_size;
+        blocks[i].data = data + offset;
+        blocks[i].size = (size_t)(size - offset < options->block_size ? size - offset : options->block_size);
+        blocks[i].options = options;
+        blocks[i].status = 1;
+    }
+
+    int thread_count = block_thread_count(options->thread_count, block_count);
+    ThreadPool_t* pool = thread_count > 1 ? thread_pool_create(thread_count) : NULL;
+    for (uint32_t i = 0; i < block_count; i++) {
+        if (pool == NULL || thread_pool_submit(pool, encode_block_task, &blocks[i])) {
+            // Run here, every block's scratch memory comes back before the next one starts
+            blocks[i].arena = arena;
+            encode_block_task(&blocks[i]);
+        }
+    }
+    if (pool != NULL) {
+        thread_pool_wait(pool);
+        thread_pool_destroy(pool);
+    }
+
+    // Block index, then the blocks back to back
+    int status = 0;
+    byte index_entry[8];
+    put_u32_le(index_entry, options->block_size);
+    put_u32_le(index_entry + 4, block_count);
+    status |= byte_buffer_append(output, index_entry, 8);
+    for (uint32_t i = 0; i < block_count; i++) {
+        status |= blocks[i].status;
+        put_u32_le(index_entry, (uint32_t)blocks[i].output.size);
+        status |= byte_buffer_append(output, index_entry, 4);
+    }
+    for (uint32_t i = 0; i < block_count; i++) {
+        if (status == 0) {
+            status |= byte_buffer_append(output, blocks[i].output.data, blocks[i].output.size);
+        }
+        free(blocks[i].output.data);
+    }
+    arena_rewind(arena, mark);
+
+    if (status) {
+        printf("Error compressing blocks\n");
+    }
+    return status;
+}
+
+
+// Bits a single Huffman (or FSE, if smaller) table would spend on a histogram, to compare two candidate inputs
+static uint64_t estimate_coded_bits(const uint64_t* freq_table, const CompressionOptions_t* options, Arena_t* arena) {
+    unsigned char code_lengths[MAX_SYMBOLS];
+    if (build_code_lengths(freq_table, options, code_lengths, arena)) {
+        return UINT64_MAX;
+    }
+    uint64_t total_bits = 0;
+    uint64_t total = 0;
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        total_bits += freq_table[i] * code_lengths[i];
+        total += freq_table[i];
+    }
+
+    uint16_t normalized[FSE_SYMBOLS];
+    int table_log;
+    if (options->fse && fse_normalize(freq_table, total, normalized, &table_log) == 0) {
+        uint64_t fse_bits = fse_estimate_bits(freq_table, normalized, table_log);
+        if (fse_bits < total_bits) {
+            return fse_bits;
+        }
+    }
+    return total_bits;
+}
+
+
+// Bits the side information of a filtered container costs
+static uint64_t filter_side_bits(const ImageLayout_t* layout) {
+    return (IMAGE_FILTER_HEADER_SIZE + image_filter_row_count(layout)) * 8;
+}
+
+
+/* Filter the pixels of a BMP into *filtered and its row filter types into *row_filters,
+both allocated in the arena, with whichever colour transform codes smaller, and set
+*filtered_bits to its estimated size. Both are left NULL when the data isn't a BMP the
+filter handles, or when the side information alone would cost bits_to_beat.
+Returns non-zero only if memory runs out. */
+static int filter_image(const byte* data, uint64_t size, const CompressionOptions_t* options, uint64_t bits_to_beat,
+                        ImageLayout_t* layout, byte** filtered, byte** row_filters, uint64_t* filtered_bits, Arena_t* arena) {
+    *filtered = NULL;
+    *row_filters = NULL;
+    *filtered_bits = UINT64_MAX;
+    if (!options->image_filter || image_layout_from_bmp(data, size, layout) || filter_side_bits(layout) >= bits_to_beat) {
+        return 0;
+    }
+
+    // The best candidate so far and the one being tried take turns in two pairs of buffers
+    ArenaMark_t mark = arena_mark(arena);
+    uint64_t freq_table[MAX_SYMBOLS];
+    uint32_t best_transform = COLOUR_TRANSFORM_NONE;
+    byte* candidate = (byte*)arena_alloc(arena, (size_t)size);
+    byte* candidate_filters = (byte*)arena_alloc(arena, (size_t)image_filter_row_count(layout));
+    int status = candidate == NULL || candidate_filters == NULL;
+    uint32_t last_transform = layout->channels >= 3 ? COLOUR_TRANSFORM_SUBTRACT_GREEN : COLOUR_TRANSFORM_NONE;
+    for (uint32_t transform = COLOUR_TRANSFORM_NONE; status == 0 && transform <= last_transform; transform++) {
+        layout->colour_transform = transform;
+        status = image_filter_apply(layout, data, size, candidate, candidate_filters);
+        if (status) {
+            break;
+        }
+        count_frequencies(candidate, (size_t)size, freq_table);
+        uint64_t bits = estimate_coded_bits(freq_table, options, arena);
+        if (bits != UINT64_MAX && (*filtered == NULL || bits < *filtered_bits)) {
+            // Keep the best candidate, the next one is written over the other buffer
+            byte* swap = *filtered;
+            *filtered = candidate;
+            candidate = swap;
+            swap = *row_filters;
+            *row_filters = candidate_filters;
+            candidate_filters = swap;
+            *filtered_bits = bits;
+            best_transform = transform;
+        }
+        if (candidate == NULL && transform < last_transform) {
+            candidate = (byte*)arena_alloc(arena, (size_t)size);
+            candidate_filters = (byte*)arena_alloc(arena, (size_t)image_filter_row_count(layout));
+            status = candidate == NULL || candidate_filters == NULL;
+        }
+    }
+    layout->colour_transform = best_transform;
+
+    if (status) {
+        arena_rewind(arena, mark);
+        *filtered = NULL;
+        *row_filters = NULL;
+    }
+    return status;
+}
+
+
+/* Run-length code data (a whole pixel per unit for an unfiltered BMP) into *runs, in the arena, when
+runs cover enough of it and the coded result takes fewer Huffman bits; *runs is left
+NULL otherwise. *bits gets the estimated size of whichever was picked.
+Returns non-zero only if memory runs out. */
+static int run_length_pass(const byte* data, uint64_t size, uint32_t unit, const CompressionOptions_t* options,
+                           byte** runs, uint64_t* runs_size, uint64_t* bits, Arena_t* arena) {
+    uint64_t freq_table[MAX_SYMBOLS];
+    count_frequencies(data, (size_t)size, freq_table);
+    *bits = estimate_coded_bits(freq_table, options, arena);
+    *runs = NULL;
+    *runs_size = 0;
+    if (!options->run_length || size == 0 ||
+        run_length_coverage(data, size, unit) < size / RUN_LENGTH_MIN_COVERAGE_DIVISOR) {
+        return 0;
+    }
+
+    // Anything bigger than the input isn't worth keeping
+    ArenaMark_t mark = arena_mark(arena);
+    *runs = (byte*)arena_alloc(arena, (size_t)size);
+    if (*runs == NULL) {
+        return 1;
+    }
+    *runs_size = run_length_encode(data, size, unit, *runs, size);
+
+    uint64_t runs_bits = UINT64_MAX;
+    if (*runs_size != UINT64_MAX) {
+        count_frequencies(*runs, (size_t)*runs_size, freq_table);
+        runs_bits = estimate_coded_bits(freq_table, options, arena);
+    }
+    if (runs_bits != UINT64_MAX && runs_bits + RUN_LENGTH_HEADER_SIZE * 8 < *bits) {
+        *bits = runs_bits + RUN_LENGTH_HEADER_SIZE * 8;
+    } else {
+        arena_rewind(arena, mark);
+        *runs = NULL;
+        *runs_size = 0;
+    }
+    return 0;
+}
+
+
+/* Run the pre-passes over size bytes of data into *coded, whatever they allocate left in
+the arena: a BMP may become filtered planes and data dominated by runs may be
+run-length coded. The candidates, raw or filtered and with or without runs, are compared
+on the Huffman bits their histograms would need. */
+static int prepare_coded_data(const byte* data, uint64_t size, const CompressionOptions_t* options, CodedData_t* coded,
+                              Arena_t* arena) {
+    // An unfiltered image repeats whole pixels, filtered planes repeat bytes
+    ImageLayout_t layout;
+    uint32_t unit = image_layout_from_bmp(data, size, &layout) == 0 ? layout.channels : 1;
+    ArenaMark_t mark = arena_mark(arena);
+    byte* runs;
+    uint64_t runs_size;
+    uint64_t best_bits;
+    if (run_length_pass(data, size, unit, options, &runs, &runs_size, &best_bits, arena)) {
+        return 1;
+    }
+
+    // Everything the filtered candidates allocate goes after this, to be dropped if they lose
+    ArenaMark_t filtered_mark = arena_mark(arena);
+    byte* filtered;
+    byte* row_filters;
+    uint64_t filtered_bits;
+    if (filter_image(data, size, options, best_bits, &layout, &filtered, &row_filters, &filtered_bits, arena)) {
+        arena_rewind(arena, mark);
+        return 1;
+    }
+    if (filtered != NULL) {
+        byte* filtered_runs;
+        uint64_t filtered_runs_size;
+        if (run_length_pass(filtered, size, 1, options, &filtered_runs, &filtered_runs_size, &filtered_bits, arena)) {
+            arena_rewind(arena, mark);
+            return 1;
+        }
+        if (filtered_bits + filter_side_bits(&layout) < best_bits) {
+            runs = filtered_runs;
+            runs_size = filtered_runs_size;
+            unit = 1;
+        } else {
+            arena_rewind(arena, filtered_mark);
+            filtered = NULL;
+            row_filters = NULL;
+        }
+    }
+
+    coded->data = filtered != NULL ? filtered : data;
+    coded->size = size;
+    coded->layout = layout;
+    coded->row_filters = row_filters;
+    coded->run_length_unit = 0;
+    if (runs != NULL) {
+        coded->data = runs;
+        coded->size = runs_size;
+        coded->run_length_unit = unit;
+    }
+    return 0;
+}
+
+
+// Whether any segment of a payload encode_payload just wrote codes with the dictionary
+static int payload_uses_dictionary(const byte* payload, size_t payload_size, int flags) {
+    if (!(flags & CONTAINER_FLAG_BLOCKS)) {
+        return payload_size > 0 && payload[0] == SEGMENT_DICTIONARY;
+    }
+    uint32_t block_count = get_u32_le(payload + 4);
+    size_t offset = 8 + (size_t)block_count * 4;
+    for (uint32_t i = 0; i < block_count; i++) {
+        uint32_t block_size = get_u32_le(payload + 8 + 4 * (size_t)i);
+        if (block_size > 0 && payload[offset] == SEGMENT_DICTIONARY) {
+            return 1;
+        }
+        offset += block_size;
+    }
+    return 0;
+}
+
+
+/* Lay out the container for size bytes of data in output: the header, then the headers
+of the pre-passes prepare_coded_data picked, then the payload. In block mode the data
+is cut into options->block_size chunks with their own code tables, encoded in parallel,
+and a table of their compressed sizes comes first. The dictionary ID is dropped again
+if no segment ended up using it. */
+static int compress_to_buffer(const byte* data, uint64_t size, const CompressionOptions_t* options, ByteBuffer_t* output,
+                              Arena_t* arena) {
+    ArenaMark_t mark = arena_mark(arena);
+    CodedData_t coded;
+    if (prepare_coded_data(data, size, options, &coded, arena)) {
+        return 1;
+    }
+
+    size_t header_start = output->size;
+    byte header[CONTAINER_HEADER_SIZE + DICTIONARY_ID_SIZE];
+    size_t header_size = CONTAINER_HEADER_SIZE;
+    memcpy(header, HUFFMAN_MAGIC, 4);
+    header[4] = HUFFMAN_FORMAT_VERSION;
+    header[5] = options->block_size > 0 && coded.size > options->block_size ? CONTAINER_FLAG_BLOCKS : 0;
+    header[5] |= coded.row_filters != NULL ? CONTAINER_FLAG_FILTERED : 0;
+    header[5] |= coded.run_length_unit != 0 ? CONTAINER_FLAG_RUNS : 0;
+    put_u64_le(header + 6, size);
+    if (options->dictionary != NULL) {
+        header[5] |= CONTAINER_FLAG_DICTIONARY;
+        put_u32_le(header + CONTAINER_HEADER_SIZE, options->dictionary->id);
+        header_size += DICTIONARY_ID_SIZE;
+    }
+    int status = byte_buffer_append(output, header, header_size);
+
+    if (coded.row_filters != NULL) {
+        byte image_header[IMAGE_FILTER_HEADER_SIZE];
+        put_u64_le(image_header, coded.layout.pixel_offset);
+        put_u64_le(image_header + 8, coded.layout.stride);
+        put_u32_le(image_header + 16, coded.layout.width);
+        put_u32_le(image_header + 20, coded.layout.height);
+        image_header[24] = (byte)coded.layout.channels;
+        image_header[25] = (byte)coded.layout.colour_transform;
+        status = status || byte_buffer_append(output, image_header, sizeof(image_header)) ||
+                 byte_buffer_append(output, coded.row_filters, (size_t)image_filter_row_count(&coded.layout));
+    }
+    if (coded.run_length_unit != 0) {
+        byte run_length_header[RUN_LENGTH_HEADER_SIZE];
+        run_length_header[0] = (byte)coded.run_length_unit;
+        put_u64_le(run_length_header + 1, coded.size);
+        status = status || byte_buffer_append(output, run_length_header, sizeof(run_length_header));
+    }
+    size_t payload_start = output->size;
+    status = status || encode_payload(coded.data, coded.size, options, output, arena);
+
+    if (status == 0 && options->dictionary != NULL &&
+        !payload_uses_dictionary(output->data + payload_start, output->size - payload_start, header[5])) {
+        size_t id_end = header_start + CONTAINER_HEADER_SIZE + DICTIONARY_ID_SIZE;
+        memmove(output->data + id_end - DICTIONARY_ID_SIZE, output->data + id_end, output->size - id_end);
+        output->size -= DICTIONARY_ID_SIZE;
+        output->data[header_start + 5] &= (byte)~CONTAINER_FLAG_DICTIONARY;
+    }
+
+    arena_rewind(arena, mark);
+    return status;
+}
+
+
+int compress_data_to_buffer(const unsigned char* data, uint64_t size, const CompressionOptions_t* options,
+                            unsigned char** output, size_t* output_size) {
+    *output = NULL;
+    *output_size = 0;
+    if (check_compression_options(options)) {
+        return 1;
+    }
+
+    Arena_t* arena = arena_create(0);
+    if (arena == NULL) {
+        return 1;
+    }
+    ByteBuffer_t buffer = {NULL, 0, 0};
+    int status = compress_to_buffer(data, size, options, &buffer, arena);
+    arena_destroy(arena);
+    if (status) {
+        free(buffer.data);
+        return 1;
+    }
+    *output = buffer.data;
+    *output_size = buffer.size;
+    return 0;
+}
+
+
+int write_compressed_file(FileData_t* fileData, const CompressionOptions_t* options, const char* outputPath) {
+    if (DEBUG) {
+        printf("Writing compressed file to %s\n", outputPath);
+    }
+
+    ByteBuffer_t output = {NULL, 0, 0};
+    if (compress_to_buffer((const byte*)fileData->data, fileData->fileSize, options, &output, fileData->arena)) {
+        free(output.data);
+        return 1;
+    }
+
+    FILE* file = fopen(outputPath, "wb");
+    if (file == NULL) {
+        printf("Error writing to file in write_compressed_file function\n");
+        free(output.data);
+        return 1;
+    }
+
+    int status = 0;
+    if (fwrite(output.data, 1, output.size, file) != output.size) {
+        printf("Error writing compressed data\n");
+        status = 1;
+    }
+
+    if (DEBUG) {
+        printf("Bytes written to compressed file: %zu\n", output.size);
+    }
+
+    fclose(file);
+    free(output.data);
+    return status;
+}
+
+
+static HuffmanNode_t* deserialize_huffman_node(HuffmanTree_t* tree, const byte* input, size_t input_size, size_t* position) {
+    if (*position >= input_size) {
+        return NULL; // End of file
+    }
+    unsigned char is_leaf = input[(*position)++];
+
+    if (tree->node_count == MAX_NODES) {
+        return NULL; // More nodes than any valid tree can have
+    }
+    HuffmanNode_t* node = new_huffman_node(tree, -1, 0);
+
+    if (is_leaf) {
+        int symbol;
+        if (input_size - *position < sizeof(int)) {
+            return NULL;
+        }
+        memcpy(&symbol, input + *position, sizeof(int));
+        *position += sizeof(int);
+        if (symbol < 0 || symbol >= MAX_SYMBOLS) {
+            return NULL;
+        }
+        node->symbol = symbol;
+    } else {
+        node->left = deserialize_huffman_node(tree, input, input_size, position);
+        node->right = deserialize_huffman_node(tree, input, input_size, position);
+        if (node->left == NULL || node->right == NULL) {
+            return NULL;
+        }
+        node->left->parent = node;
+        node->right->parent = node;
+    }
+
+    return node;
+}
+
+
+// Parse the pre-order tree of a legacy file at input[*position], advancing *position past it
+HuffmanTree_t* deserialize_huffman_tree(const byte* input, size_t input_size, size_t* position, Arena_t* arena) {
+    // Every node lives in the tree's own node array
+    HuffmanTree_t* tree = (HuffmanTree_t*)arena_alloc(arena, sizeof(HuffmanTree_t));
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->node_count = 0;
+
+    tree->root = deserialize_huffman_node(tree, input, input_size, position);
+    if (tree->root == NULL) {
+        return NULL;
+    }
+    return tree;
+}
+
+
+void free_file_data(FileData_t* fileData) {
+    if (fileData == NULL) return;
+    unmap_file(&fileData->mapping);
+    // The struct itself lives in the arena too
+    arena_destroy(fileData->arena);
+}
+
+
+FileData_t* read_compressed_file(const char* inputPath) {
+    FileData_t* compressed_fileData = new_file_data();
+    if (compressed_fileData == NULL) {
+        return NULL;
+    }
+
+    if (map_file_for_reading(inputPath, &compressed_fileData->mapping)) {
+        printf("Error opening file at read_compressed_file function\n");
+        arena_destroy(compressed_fileData->arena);
+        return NULL;
+    }
+
+    // The compressed data is read straight out of the mapping
+    if (parse_compressed_data(compressed_fileData, compressed_fileData->mapping.data, (size_t)compressed_fileData->mapping.size)) {
+        free_file_data(compressed_fileData);
+        return NULL;
+    }
+    return compressed_fileData;
+}
+
+
+// Read the header (or legacy tree) of a compressed file held in memory; data is left
+// pointing into input
+static int parse_compressed_data(FileData_t* compressed_fileData, const byte* input, size_t input_size) {
+    size_t position;
+
+    if (input_size < 5) {
+        printf("Error reading original file size\n");
+        return 1;
+    }
+
+    if (memcmp(input, HUFFMAN_MAGIC, 4) == 0 && input[4] == HUFFMAN_FORMAT_VERSION) {
+        // Versioned container: flags and original size, the segments stay in data
+        if (input_size < CONTAINER_HEADER_SIZE) {
+            printf("Error reading compressed file header\n");
+            return 1;
+        }
+        compressed_fileData->flags = input[5];
+        compressed_fileData->original_fileSize = get_u64_le(input + 6);
+        position = CONTAINER_HEADER_SIZE;
+        if ((compressed_fileData->flags & ~CONTAINER_KNOWN_FLAGS) ||
+            ((compressed_fileData->flags & CONTAINER_FLAG_STREAM) &&
+             (compressed_fileData->flags & (CONTAINER_FLAG_FILTERED | CONTAINER_FLAG_RUNS | CONTAINER_FLAG_DICTIONARY)))) {
+            printf("Unsupported compressed file flags\n");
+            return 1;
+        }
+
+        if (compressed_fileData->flags & CONTAINER_FLAG_DICTIONARY) {
+            if (input_size - position < DICTIONARY_ID_SIZE) {
+                printf("Error reading dictionary ID\n");
+                return 1;
+            }
+            uint32_t id = get_u32_le(input + position);
+            position += DICTIONARY_ID_SIZE;
+            for (int i = 0; i < compressed_fileData->dictionary_count; i++) {
+                if (compressed_fileData->dictionaries[i]->id == id) {
+                    compressed_fileData->dictionary = compressed_fileData->dictionaries[i];
+                }
+            }
+            if (compressed_fileData->dictionary == NULL) {
+                compressed_fileData->dictionary = read_dictionary_file(id, compressed_fileData->arena);
+                if (compressed_fileData->dictionary == NULL) {
+                    return 1;
+                }
+            }
+        }
+
+        if (compressed_fileData->flags & CONTAINER_FLAG_FILTERED) {
+            ImageLayout_t* layout = &compressed_fileData->layout;
+            if (input_size - position < IMAGE_FILTER_HEADER_SIZE) {
+                printf("Error reading image filter header\n");
+                return 1;
+            }
+            layout->pixel_offset = get_u64_le(input + position);
+            layout->stride = get_u64_le(input + position + 8);
+            layout->width = get_u32_le(input + position + 16);
+            layout->height = get_u32_le(input + position + 20);
+            layout->channels = input[position + 24];
+            layout->colour_transform = input[position + 25];
+            position += IMAGE_FILTER_HEADER_SIZE;
+            if (image_layout_check(layout, compressed_fileData->original_fileSize) ||
+                image_filter_row_count(layout) > input_size - position) {
+                printf("Error reading image filter header\n");
+                return 1;
+            }
+            compressed_fileData->row_filters = input + position;
+            position += (size_t)image_filter_row_count(layout);
+        }
+
+        if (compressed_fileData->flags & CONTAINER_FLAG_RUNS) {
+            if (input_size - position < RUN_LENGTH_HEADER_SIZE) {
+                printf("Error reading run-length header\n");
+                return 1;
+            }
+            compressed_fileData->run_length_unit = input[position];
+            compressed_fileData->run_length_size = get_u64_le(input + position + 1);
+            position += RUN_LENGTH_HEADER_SIZE;
+            if (compressed_fileData->run_length_unit == 0 || compressed_fileData->run_length_unit > RUN_LENGTH_MAX_UNIT) {
+                printf("Error reading run-length header\n");
+                return 1;
+            }
+        }
+
+        // A single-pass stream only learns its size at the end: add up the frames
+        if ((compressed_fileData->flags & CONTAINER_FLAG_STREAM) && compressed_fileData->original_fileSize == UINT64_MAX &&
+            walk_stream_frames(input + position, input_size - position, NULL, 0, &compressed_fileData->original_fileSize,
+                               compressed_fileData->arena)) {
+            printf("Error reading compressed stream frames\n");
+            return 1;
+        }
+    } else {
+        /* Legacy file: the first 4 bytes are the original file size and the tree
+        follows. Its root is never a leaf, so the 5th byte can't be a version number. */
+        unsigned int original_size;
+        memcpy(&original_size, input, sizeof(unsigned int));
+        compressed_fileData->original_fileSize = original_size;
+        position = sizeof(unsigned int);
+        compressed_fileData->huffman_tree = deserialize_huffman_tree(input, input_size, &position, compressed_fileData->arena);
+        if (compressed_fileData->huffman_tree == NULL) {
+            printf("Error deserializing Huffman tree\n");
+            return 1;
+        }
+    }
+
+    compressed_fileData->data = (char*)(input + position);
+    compressed_fileData->fileSize = input_size - position;
+    return 0;
+}
+
+
+char* int_to_binary(unsigned int number) {
+    // Special case for zero
+    if (number == 0) {
+        char* zero_str = (char*)malloc(2);
+        zero_str[0] = '0';
+        zero_str[1] = '\0';
+        return zero_str;
+    }
+
+    int num_bits = sizeof(number) * 8;  // 8 bits per byte
+    char* temp_str = (char*)malloc(num_bits + 1);  // Temporary string for all bits
+
+    if (temp_str == NULL) {
+        return NULL;
+    }
+
+    temp_str[num_bits] = '\0';  // Null terminator
+    int i;
+
+    // Fill the temp string with binary digits
+    for (i = num_bits - 1; i >= 0; i--) {
+        temp_str[i] = (number & 1) ? '1' : '0';
+        number >>= 1;
+    }
+
+    // Find the first '1' to eliminate leading zeros
+    int first_one_idx = 0;
+    while (temp_str[first_one_idx] == '0') {
+        first_one_idx++;
+    }
+
+    // Allocate memory for the result string with no leading zeros
+    char* binary_str = (char*)malloc(num_bits - first_one_idx + 1);  // +1 for null terminator
+    if (binary_str == NULL) {
+        free(temp_str);  // Clean up temporary string if memory allocation fails
+        return NULL;
+    }
+
+    // Copy the relevant part of the temp string to the final result
+    for (i = 0; temp_str[first_one_idx + i] != '\0'; i++) {
+        binary_str[i] = temp_str[first_one_idx + i];
+    }
+    binary_str[i] = '\0';  // Null terminate the result string
+
+    free(temp_str);  // Clean up the temporary string
+    return binary_str;
+}
+
+
+static int subtree_height(const HuffmanNode_t* node) {
+    if (node == NULL || (node->left == NULL && node->right == NULL)) {
+        return 0;
+    }
+    int left = subtree_height(node->left);
+    int right = subtree_height(node->right);
+    return 1 + (left > right ? left : right);
+}
+
+
+// Entries the sub-tables below node take, node sitting depth bits below the root of a table of index width bits
+static unsigned int count_decode_entries(const HuffmanNode_t* node, int bits, int depth) {
+    if (node == NULL || (node->left == NULL && node->right == NULL)) {
+        return 0;
+    }
+    if (depth == bits) {
+        int sub_bits = subtree_height(node);
+        if (sub_bits > DECODE_SUB_BITS) {
+            sub_bits = DECODE_SUB_BITS;
+        }
+        return (1u << sub_bits) + count_decode_entries(node, sub_bits, 0);
+    }
+    return count_decode_entries(node->left, bits, depth + 1) + count_decode_entries(node->right, bits, depth + 1);
+}
+
+
+// Hand out the next count entries of the table, which was sized up front by count_decode_entries
+static int reserve_decode_entries(DecodeTable_t* table, unsigned int count) {
+    unsigned int offset = table->size;
+    if (count > table->capacity - table->size) {
+        return -1;
+    }
+    table->size += count;
+    return (int)offset;
+}
+
+
+/* Fill the entries of the table at table_offset (index width bits) for every code
+that passes through node, which sits depth bits below the table's own root */
+static int fill_decode_table(DecodeTable_t* table, unsigned int table_offset, int bits,
+                             const HuffmanNode_t* node, int depth, unsigned int prefix) {
+    if (node == NULL) {
+        return 1; // Malformed tree: internal node with a missing child
+    }
+
+    if (node->left == NULL && node->right == NULL) {
+        // A leaf owns every index that starts with its code
+        unsigned int first = prefix << (bits - depth);
+        unsigned int count = 1u << (bits - depth);
+        for (unsigned int i = 0; i < count; i++) {
+            DecodeEntry_t* entry = &table->entries[table_offset + first + i];
+            entry->next = 0;
+            entry->symbol = (unsigned short)node->symbol;
+            entry->length = (unsigned char)depth;
+            entry->sub_bits = 0;
+        }
+        return 0;
+    }
+
+    if (depth == bits) {
+        // Code continues past this table, chain to an overflow sub-table for this node
+        int sub_bits = subtree_height(node);
+        if (sub_bits > DECODE_SUB_BITS) {
+            sub_bits = DECODE_SUB_BITS;
+        }
+        int sub_offset = reserve_decode_entries(table, 1u << sub_bits);
+        if (sub_offset < 0) {
+            return 1;
+        }
+        DecodeEntry_t* entry = &table->entries[table_offset + prefix];
+        entry->next = (unsigned int)sub_offset;
+        entry->symbol = 0;
+        entry->length = (unsigned char)bits;
+        entry->sub_bits = (unsigned char)sub_bits;
+        return fill_decode_table(table, (unsigned int)sub_offset, sub_bits, node, 0, 0);
+    }
+
+    if (fill_decode_table(table, table_offset, bits, node->left, depth + 1, prefix << 1)) {
+        return 1;
+    }
+    return fill_decode_table(table, table_offset, bits, node->right, depth + 1, (prefix << 1) | 1);
+}
+
+
+// Build the decode table of a tree in the arena, or with malloc when arena is NULL
+DecodeTable_t* build_decode_table(const HuffmanNode_t* huffman_tree, Arena_t* arena) {
+    if (huffman_tree == NULL || (huffman_tree->left == NULL && huffman_tree->right == NULL)) {
+        printf("Huffman tree has no codes to decode\n");
+        return NULL;
+    }
+
+    // The sub-tables are counted first, so the entries are allocated once at their final size
+    unsigned int capacity = (1u << DECODE_ROOT_BITS) + count_decode_entries(huffman_tree, DECODE_ROOT_BITS, 0);
+    DecodeTable_t* table;
+    if (arena != NULL) {
+        table = (DecodeTable_t*)arena_alloc(arena, sizeof(DecodeTable_t));
+        if (table == NULL) {
+            return NULL;
+        }
+        table->entries = (DecodeEntry_t*)arena_alloc(arena, capacity * sizeof(DecodeEntry_t));
+    } else {
+        table = (DecodeTable_t*)malloc(sizeof(DecodeTable_t));
+        if (table == NULL) {
+            printf("Memory allocation failed for decode table\n");
+            return NULL;
+        }
+        table->entries = (DecodeEntry_t*)malloc(capacity * sizeof(DecodeEntry_t));
+    }
+    table->in_arena = arena != NULL;
+    table->capacity = capacity;
+    table->size = 0;
+    if (table->entries == NULL || reserve_decode_entries(table, 1u << DECODE_ROOT_BITS) < 0 ||
+        fill_decode_table(table, 0, DECODE_ROOT_BITS, huffman_tree, 0, 0)) {
+        printf("Error building decode table\n");
+        free_decode_table(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+
+void free_decode_table(DecodeTable_t* table) {
+    if (table == NULL || table->in_arena) return;
+    free(table->entries);
+    free(table);
+}
+
+
+// Decode up to output_size symbols from a bitstream, returning how many were complete
+static size_t decode_huffman_bits(const DecodeTable_t* table, const byte* input, size_t input_size,
+                                  byte* output, size_t output_size) {
+    const DecodeEntry_t* entries = table->entries;
+    size_t input_pos = 0;
+    uint64_t bit_buffer = 0; // Unconsumed bits, most significant bit first
+    int bit_count = 0;
+    size_t bytes_decoded = 0;
+
+    while (bytes_decoded < output_size) {
+        // Top up the bit buffer; past the end of the data it reads as zeros
+        while (bit_count <= 56 && input_pos < input_size) {
+            bit_buffer |= (uint64_t)input[input_pos++] << (56 - bit_count);
+            bit_count += 8;
+        }
+
+        const DecodeEntry_t* entry = &entries[bit_buffer >> (64 - DECODE_ROOT_BITS)];
+        while (entry->sub_bits != 0 && entry->length <= bit_count) {
+            bit_buffer <<= entry->length;
+            bit_count -= entry->length;
+            while (bit_count <= 56 && input_pos < input_size) {
+                bit_buffer |= (uint64_t)input[input_pos++] << (56 - bit_count);
+                bit_count += 8;
+            }
+            entry = &entries[entry->next + (unsigned int)(bit_buffer >> (64 - entry->sub_bits))];
+        }
+
+        // A truncated final code is dropped, just like the tree walk did
+        if (entry->sub_bits != 0 || entry->length > bit_count) {
+            break;
+        }
+        bit_buffer <<= entry->length;
+        bit_count -= entry->length;
+        output[bytes_decoded++] = (byte)entry->symbol;
+    }
+
+    return bytes_decoded;
+}
+
+
+// Parse a segment's code lengths at input[*position] and build its decode table, in
+// table_arena or with malloc when that is NULL; the tree it is built from is left in arena
+static DecodeTable_t* read_segment_table(const byte* input, size_t input_size, size_t* position, Arena_t* arena,
+                                         Arena_t* table_arena) {
+    unsigned char code_lengths[MAX_SYMBOLS];
+    if (read_code_lengths(input, input_size, position, code_lengths)) {
+        return NULL;
+    }
+
+    HuffmanTree_t* huffman_tree = build_canonical_tree(code_lengths, arena);
+    if (huffman_tree == NULL) {
+        return NULL;
+    }
+    return build_decode_table(huffman_tree->root, table_arena);
+}
+
+
+// Fill a context table's single-level decode table: symbol | length << 8 for every
+// CONTEXT_MAX_CODE_LENGTH-bit prefix, 0 where no code starts
+static int build_context_decode_table(const unsigned char* code_lengths, uint16_t* entries, Arena_t* arena) {
+    uint32_t kraft = 0;
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (code_lengths[i] > CONTEXT_MAX_CODE_LENGTH) {
+            return 1;
+        }
+        if (code_lengths[i] > 0) {
+            kraft += 1u << (CONTEXT_MAX_CODE_LENGTH - code_lengths[i]);
+        }
+    }
+    if (kraft == 0 || kraft > (1u << CONTEXT_MAX_CODE_LENGTH)) {
+        return 1; // No codes, or more than the code space holds
+    }
+
+    ArenaMark_t mark = arena_mark(arena);
+    HuffmanCode_t* huffman_codes = generateHuffmanCodes(code_lengths, arena);
+    if (huffman_codes == NULL) {
+        return 1;
+    }
+    memset(entries, 0, sizeof(uint16_t) << CONTEXT_MAX_CODE_LENGTH);
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        int length = huffman_codes[i].length;
+        if (length > 0) {
+            uint32_t first = (uint32_t)huffman_codes[i].code << (CONTEXT_MAX_CODE_LENGTH - length);
+            for (uint32_t k = 0; k < (1u << (CONTEXT_MAX_CODE_LENGTH - length)); k++) {
+                entries[first + k] = (uint16_t)(i | (length << 8));
+            }
+        }
+    }
+    arena_rewind(arena, mark);
+    return 0;
+}
+
+
+// Decode up to output_size symbols, each with the table the byte before it selects, returning how many were complete
+static size_t decode_context_bits(const uint16_t* const* context_entries, const byte* input, size_t input_size,
+                                  byte* output, size_t output_size) {
+    size_t input_pos = 0;
+    uint64_t bit_buffer = 0; // Unconsumed bits, most significant bit first
+    int bit_count = 0;
+    size_t bytes_decoded = 0;
+    byte previous = 0;
+
+    while (bytes_decoded < output_size) {
+        while (bit_count <= 56 && input_pos < input_size) {
+            bit_buffer |= (uint64_t)input[input_pos++] << (56 - bit_count);
+            bit_count += 8;
+        }
+
+        uint16_t entry = context_entries[previous][bit_buffer >> (64 - CONTEXT_MAX_CODE_LENGTH)];
+        int length = entry >> 8;
+        if (length == 0 || length > bit_count) {
+            break;
+        }
+        bit_buffer <<= length;
+        bit_count -= length;
+        previous = (byte)entry;
+        output[bytes_decoded++] = previous;
+    }
+
+    return bytes_decoded;
+}
+
+
+/* Parse a context modelled segment's header into context_table and the decode tables it
+selects from, allocated in arena or with malloc when that is NULL. *position gets where
+the bitstream starts. */
+static uint16_t* read_context_tables(const byte* input, size_t input_size, size_t* position,
+                                     unsigned char* context_table, Arena_t* arena, Arena_t* table_arena) {
+    if (input_size < 2 || input[1] == 0 || input[1] > CONTEXT_MAX_TABLES) {
+        return NULL;
+    }
+    int table_count = input[1];
+    *position = 2;
+    if (read_code_lengths(input, input_size, position, context_table)) {
+        return NULL;
+    }
+    for (int c = 0; c < MAX_SYMBOLS; c++) {
+        if (context_table[c] >= table_count) {
+            return NULL;
+        }
+    }
+
+    size_t entries_size = ((size_t)table_count << CONTEXT_MAX_CODE_LENGTH) * sizeof(uint16_t);
+    uint16_t* entries = (uint16_t*)(table_arena != NULL ? arena_alloc(table_arena, entries_size) : malloc(entries_size));
+    if (entries == NULL) {
+        return NULL;
+    }
+    int status = 0;
+    for (int k = 0; k < table_count && status == 0; k++) {
+        unsigned char code_lengths[MAX_SYMBOLS];
+        status = read_code_lengths(input, input_size, position, code_lengths) ||
+                 build_context_decode_table(code_lengths, entries + ((size_t)k << CONTEXT_MAX_CODE_LENGTH), arena);
+    }
+    if (status) {
+        if (table_arena == NULL) {
+            free(entries);
+        }
+        return NULL;
+    }
+    return entries;
+}
+
+
+// Decode a context modelled segment's bitstream with tables already parsed into exactly output_size bytes
+static int decode_context_with_tables(const byte* input, size_t input_size, const uint16_t* entries,
+                                      const unsigned char* context_table, byte* output, size_t output_size) {
+    const uint16_t* context_entries[MAX_SYMBOLS];
+    for (int c = 0; c < MAX_SYMBOLS; c++) {
+        context_entries[c] = entries + ((size_t)context_table[c] << CONTEXT_MAX_CODE_LENGTH);
+    }
+    return decode_context_bits(context_entries, input, input_size, output, output_size) != output_size;
+}
+
+
+// Decode the FSE counts at input[position] and the bitstream after them into exactly output_size bytes
+static int decode_fse_segment(const byte* input, size_t input_size, size_t position, byte* output, size_t output_size) {
+    uint16_t normalized[FSE_SYMBOLS];
+    int table_log;
+    if (fse_read_counts(input, input_size, &position, normalized, &table_log)) {
+        return 1;
+    }
+    return fse_decode(input + position, input_size - position, normalized, table_log, output, output_size);
+}
+
+
+/* Parse a Huffman or context segment's tables into cached, with malloc, so they can
+decode it again. Returns non-zero if the segment is corrupt. */
+static int cache_segment_table(const byte* input, size_t input_size, SegmentTable_t* cached, Arena_t* arena) {
+    ArenaMark_t mark = arena_mark(arena);
+    cached->type = input[0];
+    cached->input_size = input_size;
+    cached->position = 0;
+    if (input[0] == SEGMENT_CONTEXT_HUFFMAN) {
+        cached->context_entries = read_context_tables(input, input_size, &cached->position, cached->context_table, arena, NULL);
+        cached->context_count = cached->context_entries != NULL ? input[1] : 0;
+    } else {
+        cached->table = read_segment_table(input, input_size, &cached->position, arena, NULL);
+    }
+    arena_rewind(arena, mark);
+    return cached->table == NULL && cached->context_entries == NULL;
+}
+
+
+/* Decode one segment (code lengths and bitstream, FSE counts and bitstream, a context
+model and its bitstream, or a bitstream coded with the dictionary, NULL if there is
+none) into exactly output_size bytes. cached (may be NULL) holds the tables of an
+earlier decode of this segment, or gets them if it is empty. */
+static int decode_segment(const byte* input, size_t input_size, byte* output, size_t output_size,
+                          const HuffmanDictionary_t* dictionary, SegmentTable_t* cached, Arena_t* arena) {
+    if (input_size > 0 && input[0] == SEGMENT_FSE) {
+        return decode_fse_segment(input, input_size, 1, output, output_size);
+    }
+    if (input_size > 0 && input[0] == SEGMENT_DICTIONARY) {
+        return dictionary == NULL ||
+               decode_huffman_bits(dictionary->decode_table, input + 1, input_size - 1, output, output_size) != output_size;
+    }
+
+    if (cached != NULL && input_size > 0) {
+        if (cached->table == NULL && cached->context_entries == NULL &&
+            cache_segment_table(input, input_size, cached, arena)) {
+            return 1;
+        }
+        if (cached->type != input[0] || cached->input_size != input_size) {
+            return 1;
+        }
+        if (cached->context_entries != NULL) {
+            return decode_context_with_tables(input + cached->position, input_size - cached->position,
+                                              cached->context_entries, cached->context_table, output, output_size);
+        }
+        return decode_huffman_bits(cached->table, input + cached->position, input_size - cached->position,
+                                   output, output_size) != output_size;
+    }
+
+    size_t position = 0;
+    ArenaMark_t mark = arena_mark(arena);
+    int status = 1;
+    if (input_size > 0 && input[0] == SEGMENT_CONTEXT_HUFFMAN) {
+        unsigned char context_table[MAX_SYMBOLS];
+        uint16_t* entries = read_context_tables(input, input_size, &position, context_table, arena, arena);
+        status = entries == NULL ||
+                 decode_context_with_tables(input + position, input_size - position, entries, context_table, output, output_size);
+    } else {
+        DecodeTable_t* table = read_segment_table(input, input_size, &position, arena, arena);
+        status = table == NULL ||
+                 decode_huffman_bits(table, input + position, input_size - position, output, output_size) != output_size;
+    }
+    arena_rewind(arena, mark);
+    return status;
+}
+
+
+typedef struct DecodeTask {
+    const byte* input;
+    size_t input_size;
+    byte* output;
+    size_t output_size;
+    const HuffmanDictionary_t* dictionary;
+    SegmentTable_t* table; // Tables of an earlier decode, or to fill in; NULL for neither
+    Arena_t* arena; // Scratch memory, NULL for a task run by a pool worker, which makes its own
+    int status;
+} DecodeTask_t;
+
+
+static void decode_block_task(void* argument) {
+    DecodeTask_t* block = (DecodeTask_t*)argument;
+    Arena_t* arena = block->arena != NULL ? block->arena : arena_create(0);
+    block->status = arena == NULL || decode_segment(block->input, block->input_size, block->output, block->output_size,
+                                                    block->dictionary, block->table, arena);
+    if (block->arena == NULL) {
+        arena_destroy(arena);
+    }
+}
+
+
+// Give tables a slot for each of segment_count segments, unless they already have one for each
+static int reserve_segment_tables(DecodeTables_t* tables, uint32_t segment_count) {
+    if (tables->segments != NULL) {
+        return tables->segment_count != segment_count;
+    }
+    tables->segments = (SegmentTable_t*)calloc(segment_count, sizeof(SegmentTable_t));
+    if (tables->segments == NULL) {
+        printf("Memory allocation failed for decode tables\n");
+        return 1;
+    }
+    tables->segment_count = segment_count;
+    return 0;
+}
+
+
+/* Decode the payload that follows a container header into output_size bytes. tables
+(may be NULL) are the segment tables of an earlier decode of the same payload, or get
+them; streams keep no tables. */
+static int decompress_from_buffer(int flags, const byte* input, size_t input_size, byte* output, uint64_t output_size,
+                                  const HuffmanDictionary_t* dictionary, DecodeTables_t* tables, int thread_count, Arena_t* arena) {
+    if (flags & CONTAINER_FLAG_STREAM) {
+        uint64_t produced;
+        return walk_stream_frames(input, input_size, output, output_size, &produced, arena) || produced != output_size;
+    }
+
+    if (!(flags & CONTAINER_FLAG_BLOCKS)) {
+        if (tables != NULL && reserve_segment_tables(tables, 1)) {
+            return 1;
+        }
+        return decode_segment(input, input_size, output, (size_t)output_size, dictionary,
+                              tables != NULL ? &tables->segments[0] : NULL, arena);
+    }
+
+    if (input_size < 8) {
+        return 1;
+    }
+    uint32_t block_size = get_u32_le(input);
+    uint32_t block_count = get_u32_le(input + 4);
+    if (block_size == 0 || block_count != (output_size + block_size - 1) / block_size ||
+        (input_size - 8) / 4 < block_count || (tables != NULL && reserve_segment_tables(tables, block_count))) {
+        return 1;
+    }
+
+    ArenaMark_t mark = arena_mark(arena);
+    DecodeTask_t* blocks = (DecodeTask_t*)arena_calloc(arena, block_count, sizeof(DecodeTask_t));
+    if (blocks == NULL) {
+        return 1;
+    }
+
+    // Walk the index to find where each block starts
+    size_t offset = 8 + (size_t)block_count * 4;
+    for (uint32_t i = 0; i < block_count; i++) {
+        uint32_t compressed_size = get_u32_le(input + 8 + 4 * (size_t)i);
+        if (compressed_size > input_size - offset) {
+            arena_rewind(arena, mark);
+            return 1;
+        }
+        uint64_t output_offset = (uint64_t)i * block_size;
+        blocks[i].input = input + offset;
+        blocks[i].input_size = compressed_size;
+        blocks[i].output = output + output_offset;
+        blocks[i].output_size = (size_t)(output_size - output_offset < block_size ? output_size - output_offset : block_size);
+        blocks[i].dictionary = dictionary;
+        blocks[i].table = tables != NULL ? &tables->segments[i] : NULL;
+        blocks[i].status = 1;
+        offset += compressed_size;
+    }
+
+    thread_count = block_thread_count(thread_count, block_count);
+    ThreadPool_t* pool = thread_count > 1 ? thread_pool_create(thread_count) : NULL;
+    for (uint32_t i = 0; i < block_count; i++) {
+        if (pool == NULL || thread_pool_submit(pool, decode_block_task, &blocks[i])) {
+            blocks[i].arena = arena;
+            decode_block_task(&blocks[i]);
+        }
+    }
+    if (pool != NULL) {
+        thread_pool_wait(pool);
+        thread_pool_destroy(pool);
+    }
+
+    int status = 0;
+    for (uint32_t i = 0; i < block_count; i++) {
+        status |= blocks[i].status;
+    }
+    arena_rewind(arena, mark);
+    return status;
+}
+
+
+/* Huffman-decode a filtered or run-length coded container, then undo its pre-passes in
+the reverse order: expand the runs, then un-filter the planes into output. */
+static int decode_transformed(const FileData_t* compressed_fileData, byte* output, Arena_t* arena) {
+    uint64_t size = compressed_fileData->original_fileSize;
+    int flags = compressed_fileData->flags;
+    uint64_t coded_size = (flags & CONTAINER_FLAG_RUNS) ? compressed_fileData->run_length_size : size;
+
+    // The run-length coded data is never bigger than what it expands to
+    if (coded_size > size) {
+        return 1;
+    }
+    ArenaMark_t mark = arena_mark(arena);
+    byte* coded = (byte*)arena_alloc(arena, (size_t)coded_size);
+    byte* filtered = NULL;
+    if ((flags & CONTAINER_FLAG_RUNS) && (flags & CONTAINER_FLAG_FILTERED)) {
+        filtered = (byte*)arena_alloc(arena, (size_t)size);
+    }
+    if (coded == NULL || ((flags & CONTAINER_FLAG_RUNS) && (flags & CONTAINER_FLAG_FILTERED) && filtered == NULL)) {
+        arena_rewind(arena, mark);
+        return 1;
+    }
+
+    int status = decompress_from_buffer(flags, (const byte*)compressed_fileData->data, (size_t)compressed_fileData->fileSize,
+                                        coded, coded_size, compressed_fileData->dictionary, compressed_fileData->tables,
+                                        compressed_fileData->thread_count, arena);
+    const byte* pixels = coded;
+    if (status == 0 && (flags & CONTAINER_FLAG_RUNS)) {
+        byte* expanded = (flags & CONTAINER_FLAG_FILTERED) ? filtered : output;
+        status = run_length_decode(coded, coded_size, compressed_fileData->run_length_unit, expanded, size);
+        pixels = expanded;
+    }
+    if (status == 0 && (flags & CONTAINER_FLAG_FILTERED)) {
+        status = image_filter_revert(&compressed_fileData->layout, compressed_fileData->row_filters, pixels, size, output);
+    }
+
+    arena_rewind(arena, mark);
+    return status;
+}
+
+
+/* Decode a parsed compressed file into output, which holds original_fileSize bytes.
+*written gets the bytes produced: all of them, except that a legacy file's short
+bitstream still yields the symbols it holds. */
+static int decode_file_data(const FileData_t* compressed_fileData, byte* output, uint64_t* written) {
+    const byte* input = (const byte*)compressed_fileData->data;
+    *written = compressed_fileData->original_fileSize;
+
+    if (compressed_fileData->huffman_tree != NULL) {
+        ArenaMark_t mark = arena_mark(compressed_fileData->arena);
+        DecodeTable_t* table = build_decode_table(compressed_fileData->huffman_tree->root, compressed_fileData->arena);
+        if (table == NULL) {
+            *written = 0;
+            return 1;
+        }
+        *written = decode_huffman_bits(table, input, (size_t)compressed_fileData->fileSize,
+                                       output, (size_t)compressed_fileData->original_fileSize);
+        arena_rewind(compressed_fileData->arena, mark);
+        return 0;
+    }
+
+    int status;
+    if (compressed_fileData->flags & (CONTAINER_FLAG_FILTERED | CONTAINER_FLAG_RUNS)) {
+        status = decode_transformed(compressed_fileData, output, compressed_fileData->arena);
+    } else {
+        status = decompress_from_buffer(compressed_fileData->flags, input, (size_t)compressed_fileData->fileSize,
+                                        output, compressed_fileData->original_fileSize, compressed_fileData->dictionary,
+                                        compressed_fileData->tables, compressed_fileData->thread_count,
+                                        compressed_fileData->arena);
+    }
+    if (status) {
+        printf("Compressed data is corrupt\n");
+        *written = 0;
+    }
+    return status;
+}
+
+
+int decompress_file(FileData_t* compressed_fileData, const char* outputPath) {
+    if (DEBUG) {
+        printf("Original file size according to the header: %" PRIu64 "\n", compressed_fileData->original_fileSize);
+    }
+
+    // Decode straight into the output file, mapped at its final size
+    MappedFile_t output;
+    if (map_file_for_writing(outputPath, compressed_fileData->original_fileSize, &output)) {
+        printf("Error writing to file at decompress_file function\n");
+        return 1;
+    }
+
+    int status = decode_file_data(compressed_fileData, output.data, &output.size);
+
     if (DEBUG) {
-        printf("Bytes written to decompressed file: %d\n", bytes_decoded);
+        printf("Bytes written to decompressed file: %" PRIu64 "\n", output.size);
+    }
+
+    if (unmap_file(&output)) {
+        printf("Error writing decompressed data\n");
+        status = 1;
+    }
+    return status;
+}
+
+
+int decompress_buffer_to_file(const unsigned char* input, size_t input_size, const char* outputPath) {
+    // The input is borrowed, so only the arena (legacy tree and scratch memory) is ours to free
+    FileData_t compressed_fileData;
+    memset(&compressed_fileData, 0, sizeof(compressed_fileData));
+    compressed_fileData.arena = arena_create(0);
+    if (compressed_fileData.arena == NULL) {
+        return 1;
+    }
+    int status = parse_compressed_data(&compressed_fileData, input, input_size) ||
+                 decompress_file(&compressed_fileData, outputPath);
+    arena_destroy(compressed_fileData.arena);
+    return status;
+}
+
+
+// Build a dictionary, its codes and its decode table from code lengths, all in the arena
+static HuffmanDictionary_t* dictionary_from_lengths(const unsigned char* code_lengths, Arena_t* arena) {
+    HuffmanDictionary_t* dictionary = (HuffmanDictionary_t*)arena_calloc(arena, 1, sizeof(HuffmanDictionary_t));
+    if (dictionary == NULL) {
+        return NULL;
+    }
+    memcpy(dictionary->code_lengths, code_lengths, MAX_SYMBOLS);
+
+    HuffmanTree_t* huffman_tree = build_canonical_tree(code_lengths, arena);
+    if (huffman_tree == NULL) {
+        printf("Dictionary code lengths are invalid\n");
+        return NULL;
+    }
+    dictionary->decode_table = build_decode_table(huffman_tree->root, arena);
+    dictionary->codes = generateHuffmanCodes(code_lengths, arena);
+    if (dictionary->decode_table == NULL || dictionary->codes == NULL) {
+        return NULL;
+    }
+
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    sha256(code_lengths, MAX_SYMBOLS, digest);
+    dictionary->id = get_u32_le(digest);
+    return dictionary;
+}
+
+
+HuffmanDictionary_t* huffman_dictionary_train(const unsigned char* const* samples, const size_t* sample_sizes,
+                                              size_t sample_count, const CompressionOptions_t* options) {
+    CompressionOptions_t train_options;
+    if (options != NULL) {
+        train_options = *options;
+    } else {
+        default_compression_options(&train_options);
+    }
+    train_options.dictionary = NULL;
+    if (check_compression_options(&train_options)) {
+        return NULL;
+    }
+    if (sample_count == 0) {
+        printf("A dictionary needs at least one sample\n");
+        return NULL;
+    }
+
+    Arena_t* arena = arena_create(0);
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    // Every symbol keeps a code, so any file can fall back to the dictionary's table
+    uint64_t freq_table[MAX_SYMBOLS];
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        freq_table[i] = 1;
+    }
+    for (size_t i = 0; i < sample_count; i++) {
+        CodedData_t coded;
+        if (prepare_coded_data(samples[i], sample_sizes[i], &train_options, &coded, arena)) {
+            arena_destroy(arena);
+            return NULL;
+        }
+        add_frequencies(coded.data, (size_t)coded.size, freq_table);
+        arena_reset(arena);
+    }
+
+    unsigned char code_lengths[MAX_SYMBOLS];
+    train_options.max_code_length = DICTIONARY_MAX_CODE_LENGTH;
+    HuffmanDictionary_t* dictionary = NULL;
+    if (build_code_lengths(freq_table, &train_options, code_lengths, arena) == 0) {
+        arena_reset(arena);
+        dictionary = dictionary_from_lengths(code_lengths, arena);
+    }
+    if (dictionary == NULL) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    dictionary->arena = arena;
+    return dictionary;
+}
+
+
+uint32_t huffman_dictionary_id(const HuffmanDictionary_t* dictionary) {
+    return dictionary->id;
+}
+
+
+// Where the dictionary with this ID is saved; the caller frees the path
+static char* dictionary_path(uint32_t id) {
+    char file_name[16];
+    snprintf(file_name, sizeof(file_name), "%08" PRIx32 ".dict", id);
+    return create_full_path(DICTIONARY_DIRECTORY, file_name);
+}
+
+
+int huffman_dictionary_save(const HuffmanDictionary_t* dictionary) {
+    byte header[DICTIONARY_HEADER_SIZE];
+    memcpy(header, DICTIONARY_MAGIC, 4);
+    header[4] = DICTIONARY_FORMAT_VERSION;
+    put_u32_le(header + 5, dictionary->id);
+    ByteBuffer_t output = {NULL, 0, 0};
+    if (byte_buffer_append(&output, header, sizeof(header)) || write_code_lengths(&output, dictionary->code_lengths)) {
+        free(output.data);
+        return 1;
+    }
+
+    char* path = dictionary_path(dictionary->id);
+    if (path == NULL) {
+        free(output.data);
+        return 1;
     }
+    FILE* file = fopen(path, "wb");
+    free(path);
+    if (file == NULL) {
+        printf("Error writing dictionary file\n");
+        free(output.data);
+        return 1;
+    }
+    int status = fwrite(output.data, 1, output.size, file) != output.size;
+    status |= fclose(file) != 0;
+    if (status) {
+        printf("Error writing dictionary file\n");
+    }
+    free(output.data);
+    return status;
+}
+
 
+// Load the dictionary with this ID from DICTIONARY_DIRECTORY into the arena
+static HuffmanDictionary_t* read_dictionary_file(uint32_t id, Arena_t* arena) {
+    char* path = dictionary_path(id);
+    if (path == NULL) {
+        return NULL;
+    }
+    FILE* file = fopen(path, "rb");
+    free(path);
+    if (file == NULL) {
+        printf("Dictionary %08" PRIx32 " not found\n", id);
+        return NULL;
+    }
+    byte input[DICTIONARY_HEADER_SIZE + 1 + 2 * MAX_SYMBOLS];
+    size_t input_size = fread(input, 1, sizeof(input), file);
     fclose(file);
-}
\ No newline at end of file
+
+    size_t position = DICTIONARY_HEADER_SIZE;
+    unsigned char code_lengths[MAX_SYMBOLS];
+    if (input_size < DICTIONARY_HEADER_SIZE || memcmp(input, DICTIONARY_MAGIC, 4) != 0 ||
+        input[4] != DICTIONARY_FORMAT_VERSION || get_u32_le(input + 5) != id ||
+        read_code_lengths(input, input_size, &position, code_lengths)) {
+        printf("Error reading dictionary %08" PRIx32 "\n", id);
+        return NULL;
+    }
+
+    ArenaMark_t mark = arena_mark(arena);
+    HuffmanDictionary_t* dictionary = dictionary_from_lengths(code_lengths, arena);
+    if (dictionary != NULL && dictionary->id != id) {
+        printf("Dictionary %08" PRIx32 " does not match its ID\n", id);
+        dictionary = NULL;
+    }
+    if (dictionary == NULL) {
+        arena_rewind(arena, mark);
+    }
+    return dictionary;
+}
+
+
+HuffmanDictionary_t* huffman_dictionary_load(uint32_t id) {
+    Arena_t* arena = arena_create(0);
+    if (arena == NULL) {
+        return NULL;
+    }
+    HuffmanDictionary_t* dictionary = read_dictionary_file(id, arena);
+    if (dictionary == NULL) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    dictionary->arena = arena;
+    return dictionary;
+}
+
+
+void huffman_dictionary_destroy(HuffmanDictionary_t* dictionary) {
+    if (dictionary == NULL) return;
+    // The struct itself lives in the arena too
+    arena_destroy(dictionary->arena);
+}
+
+
+struct CodecContext {
+    CompressionOptions_t options;
+    Arena_t* arena;      // Scratch memory, reset rather than freed between images
+    ByteBuffer_t output; // Result of the latest call, its capacity kept for the next one
+    const HuffmanDictionary_t* dictionaries[CODEC_MAX_DICTIONARIES]; // Decode without going to DICTIONARY_DIRECTORY
+    int dictionary_count;
+};
+
+
+CodecContext_t* codec_ctx_create(const CompressionOptions_t* options) {
+    CodecContext_t* ctx = (CodecContext_t*)calloc(1, sizeof(CodecContext_t));
+    if (ctx == NULL) {
+        printf("Memory allocation failed for codec context\n");
+        return NULL;
+    }
+    if (options != NULL) {
+        ctx->options = *options;
+    } else {
+        default_compression_options(&ctx->options);
+    }
+    ctx->arena = arena_create(0);
+    if (ctx->arena == NULL || check_compression_options(&ctx->options)) {
+        codec_ctx_destroy(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+int compress_buffer(CodecContext_t* ctx, const unsigned char* input, size_t input_size,
+                    const unsigned char** output, size_t* output_size) {
+    *output = NULL;
+    *output_size = 0;
+    arena_reset(ctx->arena);
+    ctx->output.size = 0;
+    if (compress_to_buffer(input, input_size, &ctx->options, &ctx->output, ctx->arena)) {
+        return 1;
+    }
+    *output = ctx->output.data;
+    *output_size = ctx->output.size;
+    return 0;
+}
+
+
+// Decompress into the context's output buffer, with the tables of an earlier decompress of the same file, or filling them in
+static int decompress_with_tables(CodecContext_t* ctx, const unsigned char* input, size_t input_size, DecodeTables_t* tables,
+                                  const unsigned char** output, size_t* output_size) {
+    *output = NULL;
+    *output_size = 0;
+    arena_reset(ctx->arena);
+
+    // The input is borrowed, the legacy tree (if any) goes in the context's arena
+    FileData_t compressed_fileData;
+    memset(&compressed_fileData, 0, sizeof(compressed_fileData));
+    compressed_fileData.arena = ctx->arena;
+    compressed_fileData.dictionaries = ctx->dictionaries;
+    compressed_fileData.dictionary_count = ctx->dictionary_count;
+    compressed_fileData.tables = tables;
+    compressed_fileData.thread_count = ctx->options.thread_count;
+    if (parse_compressed_data(&compressed_fileData, input, input_size)) {
+        return 1;
+    }
+    if (compressed_fileData.original_fileSize > SIZE_MAX / 2) {
+        printf("Compressed data is corrupt\n");
+        return 1;
+    }
+
+    ctx->output.size = 0;
+    uint64_t written;
+    if (byte_buffer_reserve(&ctx->output, (size_t)compressed_fileData.original_fileSize) ||
+        decode_file_data(&compressed_fileData, ctx->output.data, &written)) {
+        return 1;
+    }
+    ctx->output.size = (size_t)written;
+    *output = ctx->output.data;
+    *output_size = ctx->output.size;
+    return 0;
+}
+
+
+int decompress_buffer(CodecContext_t* ctx, const unsigned char* input, size_t input_size,
+                      const unsigned char** output, size_t* output_size) {
+    return decompress_with_tables(ctx, input, input_size, NULL, output, output_size);
+}
+
+
+int decompress_buffer_with_tables(CodecContext_t* ctx, const unsigned char* input, size_t input_size,
+                                  DecodeTables_t** tables, const unsigned char** output, size_t* output_size) {
+    if (*tables != NULL) {
+        return decompress_with_tables(ctx, input, input_size, *tables, output, output_size);
+    }
+
+    DecodeTables_t* new_tables = (DecodeTables_t*)calloc(1, sizeof(DecodeTables_t));
+    if (new_tables == NULL) {
+        printf("Memory allocation failed for decode tables\n");
+        return 1;
+    }
+    int status = decompress_with_tables(ctx, input, input_size, new_tables, output, output_size);
+
+    // Streams and legacy files leave nothing worth keeping
+    if (status == 0 && new_tables->segment_count > 0) {
+        *tables = new_tables;
+    } else {
+        decode_tables_destroy(new_tables);
+    }
+    return status;
+}
+
+
+size_t decode_tables_size(const DecodeTables_t* tables) {
+    size_t size = sizeof(DecodeTables_t) + tables->segment_count * sizeof(SegmentTable_t);
+    for (uint32_t i = 0; i < tables->segment_count; i++) {
+        const SegmentTable_t* segment = &tables->segments[i];
+        if (segment->table != NULL) {
+            size += sizeof(DecodeTable_t) + segment->table->capacity * sizeof(DecodeEntry_t);
+        }
+        size += ((size_t)segment->context_count << CONTEXT_MAX_CODE_LENGTH) * sizeof(uint16_t);
+    }
+    return size;
+}
+
+
+void decode_tables_destroy(DecodeTables_t* tables) {
+    if (tables == NULL) return;
+    for (uint32_t i = 0; i < tables->segment_count; i++) {
+        free_decode_table(tables->segments[i].table);
+        free(tables->segments[i].context_entries);
+    }
+    free(tables->segments);
+    free(tables);
+}
+
+
+int codec_ctx_add_dictionary(CodecContext_t* ctx, const HuffmanDictionary_t* dictionary) {
+    if (ctx->dictionary_count == CODEC_MAX_DICTIONARIES) {
+        printf("A codec context holds at most %d dictionaries\n", CODEC_MAX_DICTIONARIES);
+        return 1;
+    }
+    ctx->dictionaries[ctx->dictionary_count++] = dictionary;
+    return 0;
+}
+
+
+void codec_ctx_destroy(CodecContext_t* ctx) {
+    if (ctx == NULL) return;
+    arena_destroy(ctx->arena);
+    free(ctx->output.data);
+    free(ctx);
+}
+
+
+/* Streaming API. A stream container (CONTAINER_FLAG_STREAM) holds a run of frames,
+each a 9-byte header (raw size, payload size, frame type) and a payload, closed by a
+frame with a raw size of 0. FRAME_NEW_TABLE payloads are a whole segment; the
+FRAME_SAME_TABLE payloads of a two-pass stream are just a bitstream coded with the
+most recent table. No frame is bigger than STREAM_MAX_BLOCK_SIZE, which is what
+bounds the memory both ends need. */
+
+struct HuffmanEncoderStream {
+    int mode;
+    CompressionOptions_t options;
+    StreamWrite_t write;
+    void* context;
+    size_t block_size;
+    int header_written;
+    int encoding;                  // Two-pass: 0 during the histogram pass
+    uint64_t freq_table[MAX_SYMBOLS]; // Two-pass: histogram of the whole input
+    uint64_t total_size;           // Two-pass: bytes seen by the histogram pass
+    uint64_t encoded_size;         // Two-pass: bytes encoded so far
+    unsigned char code_lengths[MAX_SYMBOLS];
+    HuffmanCode_t* huffman_codes;  // Two-pass: codes shared by every frame, in the arena
+    int table_sent;
+    ByteBuffer_t block;            // Semi-static: input of the frame being filled
+    ByteBuffer_t frame;            // Payload of the frame being built
+    int frame_type;
+    size_t frame_raw_size;
+    BitWriter_t writer;
+    Arena_t* arena;                // Scratch memory of each frame's segment
+    int failed;
+};
+
+
+struct HuffmanDecoderStream {
+    int state;
+    byte header[CONTAINER_HEADER_SIZE];
+    size_t header_fill;
+    uint32_t raw_size;             // Current frame
+    uint32_t payload_size;
+    int frame_type;
+    ByteBuffer_t payload;
+    ByteBuffer_t decoded;
+    size_t decoded_pos;            // Bytes of decoded already handed to the caller
+    DecodeTable_t* table;          // Table of the latest FRAME_NEW_TABLE frame
+    uint64_t expected_size;        // From the container header, UINT64_MAX if unknown
+    uint64_t produced_size;
+    Arena_t* arena;                // Scratch memory of each frame's segment
+};
+
+
+static int stream_write_header(HuffmanEncoderStream_t* stream) {
+    if (stream->header_written) {
+        return 0;
+    }
+    byte header[CONTAINER_HEADER_SIZE];
+    memcpy(header, HUFFMAN_MAGIC, 4);
+    header[4] = HUFFMAN_FORMAT_VERSION;
+    header[5] = CONTAINER_FLAG_STREAM;
+    put_u64_le(header + 6, stream->mode == STREAM_MODE_TWO_PASS ? stream->total_size : UINT64_MAX);
+    stream->header_written = 1;
+    return stream->write(stream->context, header, sizeof(header));
+}
+
+
+static int stream_write_frame(HuffmanEncoderStream_t* stream, uint32_t raw_size, int frame_type,
+                              const byte* payload, size_t payload_size) {
+    byte frame_header[FRAME_HEADER_SIZE];
+    put_u32_le(frame_header, raw_size);
+    put_u32_le(frame_header + 4, (uint32_t)payload_size);
+    frame_header[8] = (byte)frame_type;
+
+    if (stream_write_header(stream) || stream->write(stream->context, frame_header, sizeof(frame_header))) {
+        return 1;
+    }
+    if (payload_size > 0 && stream->write(stream->context, payload, payload_size)) {
+        return 1;
+    }
+    return 0;
+}
+
+
+HuffmanEncoderStream_t* encoder_stream_create(int mode, const CompressionOptions_t* options, StreamWrite_t write, void* context) {
+    if (mode != STREAM_MODE_SEMI_STATIC && mode != STREAM_MODE_TWO_PASS) {
+        printf("Unknown stream mode %d\n", mode);
+        return NULL;
+    }
+
+    HuffmanEncoderStream_t* stream = (HuffmanEncoderStream_t*)calloc(1, sizeof(HuffmanEncoderStream_t));
+    if (stream == NULL) {
+        printf("Memory allocation failed for encoder stream\n");
+        return NULL;
+    }
+    stream->arena = arena_create(0);
+    if (stream->arena == NULL) {
+        free(stream);
+        return NULL;
+    }
+    stream->mode = mode;
+    stream->options = *options;
+    stream->options.dictionary = NULL; // Stream containers have no room for a dictionary ID
+    stream->write = write;
+    stream->context = context;
+    stream->block_size = options->block_size ? options->block_size : DEFAULT_STREAM_BLOCK_SIZE;
+    if (stream->block_size > STREAM_MAX_BLOCK_SIZE) {
+        stream->block_size = STREAM_MAX_BLOCK_SIZE;
+    }
+    stream->encoding = mode == STREAM_MODE_SEMI_STATIC;
+    stream->writer.output = &stream->frame;
+    return stream;
+}
+
+
+// Semi-static: code the buffered block with a table of its own
+static int stream_flush_block(HuffmanEncoderStream_t* stream) {
+    stream->frame.size = 0;
+    if (encode_segment(stream->block.data, stream->block.size, &stream->options, &stream->frame, stream->arena)) {
+        return 1;
+    }
+    int status = stream_write_frame(stream, (uint32_t)stream->block.size, FRAME_NEW_TABLE,
+                                    stream->frame.data, stream->frame.size);
+    stream->block.size = 0;
+    return status;
+}
+
+
+// Two-pass: close the current frame's bitstream and send it
+static int stream_flush_frame(HuffmanEncoderStream_t* stream) {
+    finish_bit_writer(&stream->writer);
+    int status = stream_write_frame(stream, (uint32_t)stream->frame_raw_size, stream->frame_type,
+                                    stream->frame.data, stream->frame.size);
+    stream->frame.size = 0;
+    stream->frame_raw_size = 0;
+    return status;
+}
+
+
+int encoder_stream_begin_encode(HuffmanEncoderStream_t* stream) {
+    if (stream->mode != STREAM_MODE_TWO_PASS || stream->encoding) {
+        printf("Stream is not in its histogram pass\n");
+        return 1;
+    }
+    stream->huffman_codes = build_codes(stream->freq_table, &stream->options, stream->code_lengths, stream->arena);
+    if (stream->huffman_codes == NULL) {
+        stream->failed = 1;
+        return 1;
+    }
+    stream->encoding = 1;
+    return 0;
+}
+
+
+int encoder_stream_feed(HuffmanEncoderStream_t* stream, const unsigned char* data, size_t size) {
+    if (stream->failed) {
+        return 1;
+    }
+
+    if (!stream->encoding) {
+        // Two-pass histogram pass
+        add_frequencies(data, size, stream->freq_table);
+        stream->total_size += size;
+        return 0;
+    }
+
+    while (size > 0) {
+        if (stream->mode == STREAM_MODE_SEMI_STATIC) {
+            size_t take = stream->block_size - stream->block.size;
+            if (take > size) {
+                take = size;
+            }
+            if (byte_buffer_append(&stream->block, data, take) ||
+                (stream->block.size == stream->block_size && stream_flush_block(stream))) {
+                stream->failed = 1;
+                return 1;
+            }
+            data += take;
+            size -= take;
+            continue;
+        }
+
+        size_t take = stream->block_size - stream->frame_raw_size;
+        if (take > size) {
+            take = size;
+        }
+        if (stream->encoded_size + take > stream->total_size) {
+            printf("Encode pass is longer than the histogram pass\n");
+            stream->failed = 1;
+            return 1;
+        }
+
+        // A frame opens with the code lengths if the decoder hasn't seen them yet
+        if (stream->frame_raw_size == 0) {
+            stream->frame_type = stream->table_sent ? FRAME_SAME_TABLE : FRAME_NEW_TABLE;
+            if (!stream->table_sent && write_code_lengths(&stream->frame, stream->code_lengths)) {
+                stream->failed = 1;
+                return 1;
+            }
+            stream->table_sent = 1;
+        }
+
+        if (byte_buffer_reserve(&stream->frame, take * 8 + 16)) {
+            stream->failed = 1;
+            return 1;
+        }
+        for (size_t i = 0; i < take; i++) {
+            const HuffmanCode_t* code = &stream->huffman_codes[data[i]];
+            if (code->length == 0) {
+                printf("Encode pass holds bytes the histogram pass never saw\n");
+                stream->failed = 1;
+                return 1;
+            }
+            put_bits(&stream->writer, code->code, code->length);
+        }
+        stream->frame_raw_size += take;
+        stream->encoded_size += take;
+        data += take;
+        size -= take;
+
+        if (stream->frame_raw_size == stream->block_size && stream_flush_frame(stream)) {
+            stream->failed = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+int encoder_stream_finish(HuffmanEncoderStream_t* stream) {
+    if (stream->failed || !stream->encoding) {
+        printf("Stream can't be finished\n");
+        return 1;
+    }
+
+    int status = 0;
+    if (stream->mode == STREAM_MODE_SEMI_STATIC) {
+        if (stream->block.size > 0) {
+            status = stream_flush_block(stream);
+        }
+    } else {
+        if (stream->encoded_size != stream->total_size) {
+            printf("Encode pass is shorter than the histogram pass\n");
+            status = 1;
+        } else if (stream->frame_raw_size > 0) {
+            status = stream_flush_frame(stream);
+        }
+    }
+
+    // End of stream marker
+    if (status == 0) {
+        status = stream_write_frame(stream, 0, FRAME_NEW_TABLE, NULL, 0);
+    }
+    stream->failed = 1; // Nothing more may be fed
+    return status;
+}
+
+
+void encoder_stream_destroy(HuffmanEncoderStream_t* stream) {
+    if (stream == NULL) return;
+    arena_destroy(stream->arena);
+    free(stream->block.data);
+    free(stream->frame.data);
+    free(stream);
+}
+
+
+HuffmanDecoderStream_t* decoder_stream_create(void) {
+    HuffmanDecoderStream_t* stream = (HuffmanDecoderStream_t*)calloc(1, sizeof(HuffmanDecoderStream_t));
+    if (stream == NULL) {
+        printf("Memory allocation failed for decoder stream\n");
+        return NULL;
+    }
+    stream->arena = arena_create(0);
+    if (stream->arena == NULL) {
+        free(stream);
+        return NULL;
+    }
+    stream->state = DECODER_CONTAINER_HEADER;
+    return stream;
+}
+
+
+// Check a frame header against the limits every valid encoder respects
+static int check_frame_header(uint32_t raw_size, uint32_t payload_size, int frame_type, int have_table) {
+    if (raw_size > STREAM_MAX_BLOCK_SIZE || (uint64_t)payload_size > (uint64_t)raw_size * 8 + 2 * MAX_SYMBOLS + 16) {
+        return 1;
+    }
+    if (frame_type == FRAME_SAME_TABLE) {
+        return !have_table;
+    }
+    return frame_type != FRAME_NEW_TABLE;
+}
+
+
+// Decode a complete frame payload into output, updating *table for FRAME_NEW_TABLE frames
+static int decode_frame(int frame_type, const byte* payload, size_t payload_size,
+                        byte* output, size_t raw_size, DecodeTable_t** table, Arena_t* arena) {
+    size_t position = 0;
+    if (frame_type == FRAME_NEW_TABLE && payload_size > 0 &&
+        (payload[0] == SEGMENT_FSE || payload[0] == SEGMENT_CONTEXT_HUFFMAN)) {
+        // These frames leave no single Huffman table for FRAME_SAME_TABLE frames to use
+        free_decode_table(*table);
+        *table = NULL;
+        return decode_segment(payload, payload_size, output, raw_size, NULL, NULL, arena);
+    }
+    if (frame_type == FRAME_NEW_TABLE) {
+        // The table outlives the frame, so it is malloc'd rather than left in the arena
+        ArenaMark_t mark = arena_mark(arena);
+        DecodeTable_t* new_table = read_segment_table(payload, payload_size, &position, arena, NULL);
+        arena_rewind(arena, mark);
+        if (new_table == NULL) {
+            return 1;
+        }
+        free_decode_table(*table);
+        *table = new_table;
+    }
+    return decode_huffman_bits(*table, payload + position, payload_size - position, output, raw_size) != raw_size;
+}
+
+
+int decoder_stream_decompress(HuffmanDecoderStream_t* stream,
+                              const unsigned char* input, size_t input_size, size_t* input_used,
+                              unsigned char* output, size_t output_capacity, size_t* output_written) {
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+
+    while (stream->state != DECODER_ERROR) {
+        if (stream->state == DECODER_OUTPUT) {
+            // Hand over as much of the decoded frame as the caller has room for
+            size_t take = stream->decoded.size - stream->decoded_pos;
+            if (take > output_capacity - out_pos) {
+                take = output_capacity - out_pos;
+            }
+            memcpy(output + out_pos, stream->decoded.data + stream->decoded_pos, take);
+            out_pos += take;
+            stream->decoded_pos += take;
+            if (stream->decoded_pos < stream->decoded.size) {
+                break; // Caller's buffer is full
+            }
+            stream->state = DECODER_FRAME_HEADER;
+            stream->header_fill = 0;
+            continue;
+        }
+
+        if (stream->state == DECODER_END || in_pos == input_size) {
+            break;
+        }
+
+        if (stream->state == DECODER_CONTAINER_HEADER || stream->state == DECODER_FRAME_HEADER) {
+            size_t needed = stream->state == DECODER_CONTAINER_HEADER ? CONTAINER_HEADER_SIZE : FRAME_HEADER_SIZE;
+            size_t take = needed - stream->header_fill;
+            if (take > input_size - in_pos) {
+                take = input_size - in_pos;
+            }
+            memcpy(stream->header + stream->header_fill, input + in_pos, take);
+            stream->header_fill += take;
+            in_pos += take;
+            if (stream->header_fill < needed) {
+                break;
+            }
+
+            if (stream->state == DECODER_CONTAINER_HEADER) {
+                if (memcmp(stream->header, HUFFMAN_MAGIC, 4) != 0 || stream->header[4] != HUFFMAN_FORMAT_VERSION ||
+                    !(stream->header[5] & CONTAINER_FLAG_STREAM)) {
+                    printf("Not a compressed stream\n");
+                    stream->state = DECODER_ERROR;
+                    break;
+                }
+                stream->expected_size = get_u64_le(stream->header + 6);
+                stream->state = DECODER_FRAME_HEADER;
+                stream->header_fill = 0;
+                continue;
+            }
+
+            stream->raw_size = get_u32_le(stream->header);
+            stream->payload_size = get_u32_le(stream->header + 4);
+            stream->frame_type = stream->header[8];
+            if (stream->raw_size == 0) {
+                int complete = stream->expected_size == UINT64_MAX || stream->expected_size == stream->produced_size;
+                stream->state = complete ? DECODER_END : DECODER_ERROR;
+                continue;
+            }
+            if (check_frame_header(stream->raw_size, stream->payload_size, stream->frame_type, stream->table != NULL) ||
+                byte_buffer_reserve(&stream->payload, stream->payload_size) ||
+                byte_buffer_reserve(&stream->decoded, stream->raw_size)) {
+                stream->state = DECODER_ERROR;
+                break;
+            }
+            stream->payload.size = 0;
+            stream->state = DECODER_PAYLOAD;
+            continue;
+        }
+
+        // DECODER_PAYLOAD: collect the frame, then decode it in one go
+        size_t take = stream->payload_size - stream->payload.size;
+        if (take > input_size - in_pos) {
+            take = input_size - in_pos;
+        }
+        memcpy(stream->payload.data + stream->payload.size, input + in_pos, take);
+        stream->payload.size += take;
+        in_pos += take;
+        if (stream->payload.size < stream->payload_size) {
+            break;
+        }
+
+        if (decode_frame(stream->frame_type, stream->payload.data, stream->payload.size,
+                         stream->decoded.data, stream->raw_size, &stream->table, stream->arena)) {
+            printf("Compressed stream is corrupt\n");
+            stream->state = DECODER_ERROR;
+            break;
+        }
+        stream->decoded.size = stream->raw_size;
+        stream->decoded_pos = 0;
+        stream->produced_size += stream->raw_size;
+        stream->state = DECODER_OUTPUT;
+    }
+
+    *input_used = in_pos;
+    *output_written = out_pos;
+    if (stream->state == DECODER_ERROR) {
+        return STREAM_ERROR;
+    }
+    return stream->state == DECODER_END ? STREAM_END : STREAM_CONTINUE;
+}
+
+
+void decoder_stream_destroy(HuffmanDecoderStream_t* stream) {
+    if (stream == NULL) return;
+    free(stream->payload.data);
+    free(stream->decoded.data);
+    free_decode_table(stream->table);
+    arena_destroy(stream->arena);
+    free(stream);
+}
+
+
+// Walk the frames of a stream payload, decoding them into output when it isn't NULL
+static int walk_stream_frames(const byte* input, size_t input_size, byte* output, uint64_t output_size, uint64_t* total_size,
+                              Arena_t* arena) {
+    DecodeTable_t* table = NULL;
+    size_t position = 0;
+    uint64_t produced = 0;
+    int status = 1;
+
+    while (input_size - position >= FRAME_HEADER_SIZE) {
+        uint32_t raw_size = get_u32_le(input + position);
+        uint32_t payload_size = get_u32_le(input + position + 4);
+        int frame_type = input[position + 8];
+        position += FRAME_HEADER_SIZE;
+
+        if (raw_size == 0) {
+            status = 0;
+            break;
+        }
+        if (check_frame_header(raw_size, payload_size, frame_type, output == NULL || table != NULL) ||
+            payload_size > input_size - position) {
+            break;
+        }
+        if (output != NULL) {
+            if (raw_size > output_size - produced ||
+                decode_frame(frame_type, input + position, payload_size, output + produced, raw_size, &table, arena)) {
+                break;
+            }
+        }
+        produced += raw_size;
+        position += payload_size;
+    }
+
+    free_decode_table(table);
+    *total_size = produced;
+    return status;
+}
@@ -3,22 +3,197 @@
 
 // You might want to include these if they're needed by users of this header
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 
 // If you want these to be accessible to users of the header
+// Building with DATA_DIRECTORY defined (ending in a separator) puts the folders under it instead
+#ifdef DATA_DIRECTORY
+#define IMAGE_DIRECTORY DATA_DIRECTORY "Captures/"
+#define CLIENT_DATABASE DATA_DIRECTORY "Compressed/"
+#define COMPRESSED_AND_ENCRYPTED_DIRECTORY DATA_DIRECTORY "Compressed_And_Encrypted/"
+#define COMPRESSED_AND_DECRYPTED_DIRECTORY DATA_DIRECTORY "Compressed_And_Decrypted/"
+#define DECOMPRESSED_DIRECTORY DATA_DIRECTORY "Decompressed/"
+#define DICTIONARY_DIRECTORY DATA_DIRECTORY "Dictionaries/"
+#else
 #define IMAGE_DIRECTORY "D:\\Programming\\C\\FOC_AT3\\Captures\\"
 #define CLIENT_DATABASE "D:\\Programming\\C\\FOC_AT3\\Compressed\\"
 #define COMPRESSED_AND_ENCRYPTED_DIRECTORY "D:\\Programming\\C\\FOC_AT3\\Compressed_And_Encrypted\\"
 #define COMPRESSED_AND_DECRYPTED_DIRECTORY "D:\\Programming\\C\\FOC_AT3\\Compressed_And_Decrypted\\"
 #define DECOMPRESSED_DIRECTORY "D:\\Programming\\C\\FOC_AT3\\Decompressed\\"
+#define DICTIONARY_DIRECTORY "D:\\Programming\\C\\FOC_AT3\\Dictionaries\\"
+#endif
+
+// Longest Huffman code compress_image_to_database allows, in bits
+#define DEFAULT_MAX_CODE_LENGTH 0
+
+// Size of the independently coded blocks, 0 codes the whole file as one block
+#define DEFAULT_BLOCK_SIZE 0
+
+/* A shared Huffman table trained from sample images, saved once in DICTIONARY_DIRECTORY
+under its ID. A compressed file names the dictionary in its header, and each segment
+codes with it whenever that is smaller than carrying a table of its own. */
+typedef struct HuffmanDictionary HuffmanDictionary_t;
+
+// Settings for compress_image_to_database_with_options
+typedef struct CompressionOptions {
+    int max_code_length; // Longest Huffman code in bits (8 to 64), or 0 for no limit
+    unsigned int block_size; // Bytes per block with its own code table, 0 for a single block
+    int thread_count; // Threads that encode blocks, and decode them in a codec context, in parallel, 0 for one per CPU core
+    int image_filter; // 1 to store a 24 or 32-bit BMP's pixels as filtered channel planes when that codes smaller, 0 to code the bytes as they are
+    int run_length; // 1 to run-length code the data first when runs dominate it, 0 never
+    int fse; // 1 to code each block with FSE instead of Huffman when that is estimated smaller, 0 never
+    int context_model; // 1 to let the byte before each symbol pick one of several clustered Huffman tables when that is estimated smaller, 0 never
+    const HuffmanDictionary_t* dictionary; // Shared table segments use when it codes them smaller than their own, NULL for none
+} CompressionOptions_t;
+
+// Function to fill options with the settings compress_image_to_database uses
+void default_compression_options(CompressionOptions_t* options);
 
 // Function to compress an image and save it to the database
 // Returns 0 on success, non-zero on failure
 int compress_image_to_database(const char* image_name);
 
+// Function to compress an image and save it to the database with the given settings
+// Returns 0 on success, non-zero on failure
+int compress_image_to_database_with_options(const char* image_name, const CompressionOptions_t* options);
+
+// Function to get the path compress_image_to_database saves an image to; free it after use
+// Returns NULL on failure
+char* compressed_database_path(const char* image_name);
+
 // Function to decompress a file from the database and save it to the decompressed directory
 // Returns 0 on success, non-zero on failure
 int decompress_file_to_decompressed(const char* image_name);
 
+// Function to compress size bytes into a complete compressed file held in memory;
+// *output is allocated with malloc and belongs to the caller
+// Returns 0 on success, non-zero on failure
+int compress_data_to_buffer(const unsigned char* data, uint64_t size, const CompressionOptions_t* options,
+                            unsigned char** output, size_t* output_size);
+
+// Function to decompress a compressed file held in memory into outputPath
+// Returns 0 on success, non-zero on failure
+int decompress_buffer_to_file(const unsigned char* input, size_t input_size, const char* outputPath);
+
+/* A codec context keeps what a compress or decompress sets up for the next one: the
+scratch arena with its histograms, code tables and decode tables, and the output
+buffer. A run of small images then pays for them once, and the context holds on to
+the memory of the largest image it has seen until it is destroyed. A context must
+not be used by two threads at once. */
+typedef struct CodecContext CodecContext_t;
+
+// Function to create a codec context that compresses with the given settings, or the
+// defaults if options is NULL
+// Returns NULL on failure
+CodecContext_t* codec_ctx_create(const CompressionOptions_t* options);
+
+// Function to compress input_size bytes into a complete compressed file; *output points
+// into the context and stays valid until its next compress_buffer or decompress_buffer
+// Returns 0 on success, non-zero on failure
+int compress_buffer(CodecContext_t* ctx, const unsigned char* input, size_t input_size,
+                    const unsigned char** output, size_t* output_size);
+
+// Function to decompress a compressed file held in memory; *output points into the
+// context and stays valid until its next compress_buffer or decompress_buffer
+// Returns 0 on success, non-zero on failure
+int decompress_buffer(CodecContext_t* ctx, const unsigned char* input, size_t input_size,
+                      const unsigned char** output, size_t* output_size);
+
+/* The code tables decompressing one file parsed from it, kept by a caller that decodes
+the same file again to skip straight to its bitstreams. They belong to the file they
+came from and must not be used with any other. */
+typedef struct DecodeTables DecodeTables_t;
+
+// Function to decompress like decompress_buffer, with the tables an earlier call parsed
+// from the same file; if *tables is NULL it gets this file's tables, which the caller
+// destroys, or stays NULL when the file has none worth keeping
+// Returns 0 on success, non-zero on failure
+int decompress_buffer_with_tables(CodecContext_t* ctx, const unsigned char* input, size_t input_size,
+                                  DecodeTables_t** tables, const unsigned char** output, size_t* output_size);
+
+// Function to get the bytes of memory a set of decode tables holds
+size_t decode_tables_size(const DecodeTables_t* tables);
+
+void decode_tables_destroy(DecodeTables_t* tables);
+
+// Function to let a context decode files that use this dictionary without loading it from
+// DICTIONARY_DIRECTORY each time; the dictionary must outlive the context
+// Returns 0 on success, non-zero on failure
+int codec_ctx_add_dictionary(CodecContext_t* ctx, const HuffmanDictionary_t* dictionary);
+
+void codec_ctx_destroy(CodecContext_t* ctx);
+
 char* create_full_path(const char* directory, const char* filename);
 
+// Function to count how often each of the 256 byte values occurs in size bytes into freq_table
+void count_frequencies(const unsigned char* data, size_t size, uint64_t* freq_table);
+
+// Function to train a dictionary on sample_count sample files, which go through the same
+// pre-passes as a compressed file with these options (NULL for the defaults) would
+// Returns NULL on failure
+HuffmanDictionary_t* huffman_dictionary_train(const unsigned char* const* samples, const size_t* sample_sizes,
+                                              size_t sample_count, const CompressionOptions_t* options);
+
+// Function to get the ID compressed files refer to a dictionary by
+uint32_t huffman_dictionary_id(const HuffmanDictionary_t* dictionary);
+
+// Function to save a dictionary in DICTIONARY_DIRECTORY, where decompression looks for it
+// Returns 0 on success, non-zero on failure
+int huffman_dictionary_save(const HuffmanDictionary_t* dictionary);
+
+// Function to load the dictionary with the given ID from DICTIONARY_DIRECTORY
+// Returns NULL on failure
+HuffmanDictionary_t* huffman_dictionary_load(uint32_t id);
+
+void huffman_dictionary_destroy(HuffmanDictionary_t* dictionary);
+
+// Stream modes: one pass where every block gets its own table, or a histogram pass
+// over the whole input followed by an encode pass that shares a single table
+#define STREAM_MODE_SEMI_STATIC 0
+#define STREAM_MODE_TWO_PASS 1
+
+// Results of decoder_stream_decompress
+#define STREAM_CONTINUE 0
+#define STREAM_END 1
+#define STREAM_ERROR -1
+
+// Receives the compressed stream as it is produced, returns 0 on success
+typedef int (*StreamWrite_t)(void* context, const unsigned char* data, size_t size);
+
+typedef struct HuffmanEncoderStream HuffmanEncoderStream_t;
+typedef struct HuffmanDecoderStream HuffmanDecoderStream_t;
+
+// Function to start a compressed stream, options->block_size sets the frame size
+// Returns NULL on failure
+HuffmanEncoderStream_t* encoder_stream_create(int mode, const CompressionOptions_t* options, StreamWrite_t write, void* context);
+
+// Function to pass the next chunk of input; in two-pass mode the whole input is fed
+// once before encoder_stream_begin_encode and again after it
+// Returns 0 on success, non-zero on failure
+int encoder_stream_feed(HuffmanEncoderStream_t* stream, const unsigned char* data, size_t size);
+
+// Function to end the histogram pass of a two-pass stream
+// Returns 0 on success, non-zero on failure
+int encoder_stream_begin_encode(HuffmanEncoderStream_t* stream);
+
+// Function to flush the last frame and the end marker
+// Returns 0 on success, non-zero on failure
+int encoder_stream_finish(HuffmanEncoderStream_t* stream);
+
+void encoder_stream_destroy(HuffmanEncoderStream_t* stream);
+
+// Function to start decoding a compressed stream
+// Returns NULL on failure
+HuffmanDecoderStream_t* decoder_stream_create(void);
+
+// Function to consume compressed input and write decompressed bytes into output,
+// reporting how much of each was used
+// Returns STREAM_CONTINUE, STREAM_END once everything has been written, or STREAM_ERROR
+int decoder_stream_decompress(HuffmanDecoderStream_t* stream,
+                              const unsigned char* input, size_t input_size, size_t* input_used,
+                              unsigned char* output, size_t output_capacity, size_t* output_written);
+
+void decoder_stream_destroy(HuffmanDecoderStream_t* stream);
+
 #endif // HUFFMAN_COMPRESSION_H
\ No newline at end of file
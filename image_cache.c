@@ -0,0 +1,244 @@
+#include "image_cache.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Entries are found through a chained hash table that doubles when it gets as full as it is long
+#define CACHE_MIN_BUCKETS 256
+
+
+typedef struct CacheEntry {
+    unsigned char key[SHA256_DIGEST_SIZE];
+    int kind;
+    void* value;
+    size_t size;                 // Value bytes plus the entry's own
+    void (*release)(void* value);
+    struct CacheEntry* next;     // Next entry in its bucket
+    struct CacheEntry* newer;    // Towards the most recently used
+    struct CacheEntry* older;    // Towards the least recently used
+} CacheEntry_t;
+
+
+struct ImageCache {
+    size_t budget;
+    size_t used;
+    CacheEntry_t** buckets;
+    size_t bucket_count;         // A power of two
+    size_t entry_count;
+    CacheEntry_t* newest;
+    CacheEntry_t* oldest;
+    ImageCacheStats_t stats[IMAGE_CACHE_KINDS];
+};
+
+
+/*******************************************************************************
+ * Function Prototypes
+*******************************************************************************/
+static size_t entry_bucket(const ImageCache_t* cache, int kind, const unsigned char* key);
+static CacheEntry_t** find_link(ImageCache_t* cache, int kind, const unsigned char* key);
+static void unlink_recency(ImageCache_t* cache, CacheEntry_t* entry);
+static void link_newest(ImageCache_t* cache, CacheEntry_t* entry);
+static void drop_entry(ImageCache_t* cache, CacheEntry_t** link);
+static void evict_to(ImageCache_t* cache, size_t budget);
+static int grow_buckets(ImageCache_t* cache);
+
+
+/* Bucket of an entry: the digest's first sizeof(size_t) bytes read as a number, plus the
+kind, masked to the power-of-two table. Adding the kind moves an image's decoded copy
+and its decode tables to neighbouring buckets instead of one shared chain. */
+static size_t entry_bucket(const ImageCache_t* cache, int kind, const unsigned char* key) {
+    size_t hash = 0;
+    for (int i = 0; i < (int)sizeof(size_t); i++) {
+        hash = (hash << 8) | key[i];
+    }
+    return (hash + (size_t)kind) & (cache->bucket_count - 1);
+}
+
+
+// The link that points at the entry for this kind and key, or the empty link at the end of its bucket
+static CacheEntry_t** find_link(ImageCache_t* cache, int kind, const unsigned char* key) {
+    CacheEntry_t** link = &cache->buckets[entry_bucket(cache, kind, key)];
+    while (*link != NULL && ((*link)->kind != kind || memcmp((*link)->key, key, SHA256_DIGEST_SIZE) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+
+static void unlink_recency(ImageCache_t* cache, CacheEntry_t* entry) {
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+}
+
+
+static void link_newest(ImageCache_t* cache, CacheEntry_t* entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest != NULL) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+
+// Remove the entry a link from find_link points at and release its value
+static void drop_entry(ImageCache_t* cache, CacheEntry_t** link) {
+    CacheEntry_t* entry = *link;
+    *link = entry->next;
+    unlink_recency(cache, entry);
+    cache->used -= entry->size;
+    cache->entry_count--;
+    cache->stats[entry->kind].entries--;
+    cache->stats[entry->kind].bytes -= entry->size;
+    entry->release(entry->value);
+    free(entry);
+}
+
+
+// Evict the least recently used entries until the cache holds at most budget bytes
+static void evict_to(ImageCache_t* cache, size_t budget) {
+    while (cache->used > budget) {
+        CacheEntry_t* entry = cache->oldest;
+        cache->stats[entry->kind].evictions++;
+        drop_entry(cache, find_link(cache, entry->kind, entry->key));
+    }
+}
+
+
+static int grow_buckets(ImageCache_t* cache) {
+    size_t bucket_count = cache->bucket_count * 2;
+    CacheEntry_t** buckets = (CacheEntry_t**)calloc(bucket_count, sizeof(CacheEntry_t*));
+    if (buckets == NULL) {
+        return 1;
+    }
+    CacheEntry_t** old_buckets = cache->buckets;
+    size_t old_bucket_count = cache->bucket_count;
+    cache->buckets = buckets;
+    cache->bucket_count = bucket_count;
+    for (size_t i = 0; i < old_bucket_count; i++) {
+        CacheEntry_t* entry = old_buckets[i];
+        while (entry != NULL) {
+            CacheEntry_t* next = entry->next;
+            size_t bucket = entry_bucket(cache, entry->kind, entry->key);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(old_buckets);
+    return 0;
+}
+
+
+ImageCache_t* image_cache_create(size_t budget) {
+    ImageCache_t* cache = (ImageCache_t*)calloc(1, sizeof(ImageCache_t));
+    if (cache == NULL) {
+        printf("Memory allocation failed for image cache\n");
+        return NULL;
+    }
+    cache->budget = budget;
+    cache->bucket_count = CACHE_MIN_BUCKETS;
+    cache->buckets = (CacheEntry_t**)calloc(cache->bucket_count, sizeof(CacheEntry_t*));
+    if (cache->buckets == NULL) {
+        printf("Memory allocation failed for image cache\n");
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+
+void* image_cache_get(ImageCache_t* cache, int kind, const unsigned char key[SHA256_DIGEST_SIZE]) {
+    CacheEntry_t* entry = *find_link(cache, kind, key);
+    if (entry == NULL) {
+        cache->stats[kind].misses++;
+        return NULL;
+    }
+    cache->stats[kind].hits++;
+    if (entry != cache->newest) {
+        unlink_recency(cache, entry);
+        link_newest(cache, entry);
+    }
+    return entry->value;
+}
+
+
+int image_cache_put(ImageCache_t* cache, int kind, const unsigned char key[SHA256_DIGEST_SIZE], void* value,
+                    size_t size, void (*release)(void* value)) {
+    if (size > cache->budget || cache->budget - size < sizeof(CacheEntry_t)) {
+        return 1;
+    }
+    size += sizeof(CacheEntry_t);
+
+    CacheEntry_t** link = find_link(cache, kind, key);
+    if (*link != NULL) {
+        drop_entry(cache, link);
+    }
+    evict_to(cache, cache->budget - size);
+
+    // A full table only makes lookups slower, so failing to grow it is no error
+    if (cache->entry_count >= cache->bucket_count) {
+        grow_buckets(cache);
+    }
+    CacheEntry_t* entry = (CacheEntry_t*)malloc(sizeof(CacheEntry_t));
+    if (entry == NULL) {
+        printf("Memory allocation failed for image cache\n");
+        return 1;
+    }
+    memcpy(entry->key, key, SHA256_DIGEST_SIZE);
+    entry->kind = kind;
+    entry->value = value;
+    entry->size = size;
+    entry->release = release;
+    link = find_link(cache, kind, key);
+    entry->next = NULL;
+    *link = entry;
+    link_newest(cache, entry);
+    cache->used += size;
+    cache->entry_count++;
+    cache->stats[kind].entries++;
+    cache->stats[kind].bytes += size;
+    return 0;
+}
+
+
+void image_cache_remove(ImageCache_t* cache, const unsigned char key[SHA256_DIGEST_SIZE]) {
+    for (int kind = 0; kind < IMAGE_CACHE_KINDS; kind++) {
+        CacheEntry_t** link = find_link(cache, kind, key);
+        if (*link != NULL) {
+            drop_entry(cache, link);
+        }
+    }
+}
+
+
+void image_cache_set_budget(ImageCache_t* cache, size_t budget) {
+    cache->budget = budget;
+    evict_to(cache, budget);
+}
+
+
+void image_cache_stats(const ImageCache_t* cache, int kind, ImageCacheStats_t* stats) {
+    *stats = cache->stats[kind];
+}
+
+
+void image_cache_destroy(ImageCache_t* cache) {
+    if (cache == NULL) return;
+    while (cache->oldest != NULL) {
+        CacheEntry_t* entry = cache->oldest;
+        drop_entry(cache, find_link(cache, entry->kind, entry->key));
+    }
+    free(cache->buckets);
+    free(cache);
+}
@@ -0,0 +1,54 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sha256.h"
+
+/* A least-recently-used cache of what loading an image produces, keyed by the image's
+SHA-256 and by kind: the decoded image, or the decode tables parsed from its stored
+copy, which outlive the image when it is evicted and make decoding it again cheaper.
+Everything cached counts against one byte budget, and adding past it evicts the
+entries used longest ago. The cache owns what it holds and frees it with the release
+function it was added with. A cache must not be used by two threads at once. */
+#define IMAGE_CACHE_DECODED 0
+#define IMAGE_CACHE_TABLES 1
+#define IMAGE_CACHE_KINDS 2
+
+typedef struct ImageCache ImageCache_t;
+
+typedef struct ImageCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions; // Entries dropped to stay within the budget
+    uint64_t entries;
+    uint64_t bytes;     // Bytes held, each entry's bookkeeping included
+} ImageCacheStats_t;
+
+// Function to create a cache that holds at most budget bytes, 0 for one that holds nothing
+// Returns NULL on failure
+ImageCache_t* image_cache_create(size_t budget);
+
+// Function to look up an entry, making it the most recently used
+// Returns NULL on a miss
+void* image_cache_get(ImageCache_t* cache, int kind, const unsigned char key[SHA256_DIGEST_SIZE]);
+
+// Function to add size bytes at value under a key, replacing any entry it had, and evicting
+// what it takes to stay within the budget; release frees value once it leaves the cache
+// Returns 0 if the cache took value, non-zero if value is left to the caller (it is bigger
+// than the whole budget, or memory ran out)
+int image_cache_put(ImageCache_t* cache, int kind, const unsigned char key[SHA256_DIGEST_SIZE], void* value,
+                    size_t size, void (*release)(void* value));
+
+// Function to drop every kind of entry under a key
+void image_cache_remove(ImageCache_t* cache, const unsigned char key[SHA256_DIGEST_SIZE]);
+
+// Function to change the budget, evicting down to a smaller one straight away
+void image_cache_set_budget(ImageCache_t* cache, size_t budget);
+
+// Function to get the counters of one kind of entry
+void image_cache_stats(const ImageCache_t* cache, int kind, ImageCacheStats_t* stats);
+
+void image_cache_destroy(ImageCache_t* cache);
+
+#endif // IMAGE_CACHE_H
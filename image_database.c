@@ -0,0 +1,1251 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "image_database.h"
+#include "mapped_file.h"
+#include "pack_file.h"
+#include "byte_order.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/* The index file is a header followed by fixed-size records. An image record is the
+whole state of one key after a change: reference count, codec, sizes and where the
+image is stored. Replaying them in order rebuilds the index; an image record with no
+references removes its key. Segment records follow each pack segment through being
+created, sealed (with its final size) and deleted by compaction. A record cut short by
+a crash is dropped, and the journal is rewritten with just the live state when opening
+finds it mostly superseded. Version 1 indexes, whose images each sit in a file of their
+own, are read and rewritten as version 2. */
+#define INDEX_MAGIC "HUFX"
+#define INDEX_FORMAT_VERSION 2
+#define INDEX_HEADER_SIZE 8
+#define INDEX_RECORD_SIZE (1 + SHA256_DIGEST_SIZE + 4 + 1 + 8 + 8 + 4 + 8)
+#define INDEX_V1_RECORD_SIZE (SHA256_DIGEST_SIZE + 4 + 1 + 8 + 8)
+#define INDEX_COMPACT_MIN_RECORDS 4096 // Superseded records tolerated before opening rewrites the journal
+#define INDEX_TEMP_NAME "index.tmp"
+
+// Journal record types
+#define RECORD_IMAGE 0
+#define RECORD_SEGMENT_CREATED 1
+#define RECORD_SEGMENT_SEALED 2
+#define RECORD_SEGMENT_DELETED 3
+
+/* In memory the index is a chained hash table on the leading bytes of the key. Entries
+sit in fixed-size chunks that never move, and the bucket array doubles incrementally:
+while it grows, every operation moves INDEX_REHASH_STEP of the old buckets over, so
+no single save pays for rehashing the whole index. */
+#define INDEX_ENTRIES_PER_CHUNK 4096
+#define INDEX_MIN_BUCKETS 1024
+#define INDEX_REHASH_STEP 64
+
+/* Images are appended to the active pack segment, which is sealed with its footer
+index once it reaches PACK_SEGMENT_MAX_SIZE. Removing an image only drops it from the
+index; a background thread compacts a sealed segment once less than half of it is
+live, copying what is left into the active segment PACK_COMPACT_BATCH images at a
+time and then deleting it. Segment 0 stands for the loose files of a version 1 index.
+The check target builds with much smaller segments, so its few images seal and compact
+several of them. */
+#ifndef PACK_SEGMENT_MAX_SIZE
+#define PACK_SEGMENT_MAX_SIZE ((uint64_t)64 << 20)
+#endif
+#define PACK_COMPACT_LIVE_DIVISOR 2
+#define PACK_COMPACT_BATCH 64
+#define PACK_SEGMENT_NAME_SIZE 16
+#define LOOSE_SEGMENT 0
+
+#define STORED_IMAGE_SUFFIX ".huf"
+
+// Segment states
+#define SEGMENT_NONE 0
+#define SEGMENT_ACTIVE 1
+#define SEGMENT_SEALED 2
+
+
+typedef struct IndexEntry {
+    ImageRecord_t record; // No references while the entry is free
+    uint64_t offset;      // Where the image starts in its segment
+    uint32_t segment;
+    uint32_t next;        // Next entry in its bucket or the free list, plus one; 0 ends the list
+} IndexEntry_t;
+
+
+typedef struct Segment {
+    PackFile_t* pack;     // Opened on first use
+    int state;
+    int compaction_failed;
+    uint64_t size;        // Sealed segments: bytes in the file
+    uint64_t live_bytes;  // Bytes of the images the index still points at
+} Segment_t;
+
+
+// One change as the journal stores it
+typedef struct JournalRecord {
+    int type;
+    ImageRecord_t image;
+    uint32_t segment;
+    uint64_t offset; // Images: offset in the segment. Sealed segments: their size.
+} JournalRecord_t;
+
+
+struct ImageDatabase {
+    char* directory;
+    CodecContext_t* codec;    // Compresses and decompresses, its output is what loads return
+    FILE* journal;            // Index file, open for appending
+    IndexEntry_t** chunks;
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+    uint32_t entry_count;     // Entries handed out, free ones included
+    uint32_t free_list;       // First free entry, plus one
+    uint64_t image_count;
+    uint32_t* buckets;        // First entry of each bucket, plus one
+    size_t bucket_count;      // A power of two
+    uint32_t* old_buckets;    // Buckets still to move while the table grows, NULL otherwise
+    size_t old_bucket_count;
+    size_t rehash_position;   // Old buckets below this have been moved
+    Segment_t* segments;      // Indexed by segment ID; 0 is the loose files
+    uint32_t segment_count;   // Highest segment ID plus one
+    uint32_t segment_capacity;
+    uint32_t active;          // Segment appended to, 0 for none yet
+    PackEntry_t* active_entries; // Footer index of the active segment so far
+    size_t active_entry_count;
+    size_t active_entry_capacity;
+    unsigned char* read_buffer; // A stored image read from its segment
+    size_t read_capacity;
+    ImageCache_t* cache;      // Decoded images and decode tables of recent loads
+    size_t cache_size;
+    uint32_t victim;          // Segment being compacted, 0 for none
+    PackEntry_t* victim_entries;
+    size_t victim_entry_count;
+    size_t victim_position;   // Footer entries already moved out of the victim
+    pthread_mutex_t lock;     // Held by every call and by each compaction batch
+    pthread_cond_t compaction_wanted; // Signalled when a segment may need compacting or the database closes
+    pthread_t compaction_thread;
+    int compaction_running;
+    int stopping;
+};
+
+
+/*******************************************************************************
+ * Function Prototypes
+*******************************************************************************/
+static size_t key_hash(const ImageKey_t* key);
+static IndexEntry_t* entry_at(const ImageDatabase_t* database, uint32_t id);
+static void rehash_step(ImageDatabase_t* database);
+static int grow_buckets(ImageDatabase_t* database);
+static uint32_t* find_link(ImageDatabase_t* database, const ImageKey_t* key);
+static IndexEntry_t* insert_entry(ImageDatabase_t* database, const ImageRecord_t* record);
+static void remove_entry(ImageDatabase_t* database, uint32_t* link);
+static void encode_record(const JournalRecord_t* record, unsigned char* output);
+static void decode_record(const unsigned char* input, int version, JournalRecord_t* record);
+static int append_record(ImageDatabase_t* database, const JournalRecord_t* record);
+static int append_image_record(ImageDatabase_t* database, const IndexEntry_t* entry);
+static int append_segment_record(ImageDatabase_t* database, int type, uint32_t segment, uint64_t size);
+static int reserve_segment(ImageDatabase_t* database, uint32_t segment);
+static int apply_record(ImageDatabase_t* database, const JournalRecord_t* record);
+static int replay_journal(ImageDatabase_t* database, const char* path, int* rewrite);
+static int rewrite_journal(ImageDatabase_t* database, const char* path);
+static char* segment_path(const ImageDatabase_t* database, uint32_t segment);
+static char* stored_image_path(const ImageDatabase_t* database, const ImageKey_t* key);
+static PackFile_t* segment_pack(ImageDatabase_t* database, uint32_t segment);
+static int resume_active_segment(ImageDatabase_t* database);
+static int add_active_entry(ImageDatabase_t* database, const ImageKey_t* key, uint64_t offset, uint64_t size);
+static int seal_active_segment(ImageDatabase_t* database);
+static int store_image(ImageDatabase_t* database, const ImageKey_t* key, const unsigned char* data, size_t size,
+                       uint32_t* segment, uint64_t* offset);
+static int read_stored_image(ImageDatabase_t* database, const IndexEntry_t* entry);
+static int decode_stored_image(ImageDatabase_t* database, const IndexEntry_t* entry, DecodeTables_t** tables,
+                               const unsigned char** image, size_t* size);
+static void release_decode_tables(void* tables);
+static int copy_image(const unsigned char* image, size_t size, unsigned char** copy);
+static int needs_compaction(const ImageDatabase_t* database, uint32_t segment);
+static void finish_victim(ImageDatabase_t* database, int failed);
+static int compaction_step(ImageDatabase_t* database);
+static void* compaction_main(void* argument);
+
+
+// The key is already a uniform hash, so its leading bytes pick the bucket
+static size_t key_hash(const ImageKey_t* key) {
+    return (size_t)get_u64_le(key->digest);
+}
+
+
+static IndexEntry_t* entry_at(const ImageDatabase_t* database, uint32_t id) {
+    return &database->chunks[id / INDEX_ENTRIES_PER_CHUNK][id % INDEX_ENTRIES_PER_CHUNK];
+}
+
+
+// Move the next few old buckets into the grown table, freeing the old one once it is empty
+static void rehash_step(ImageDatabase_t* database) {
+    if (database->old_buckets == NULL) {
+        return;
+    }
+    size_t end = database->rehash_position + INDEX_REHASH_STEP;
+    if (end > database->old_bucket_count) {
+        end = database->old_bucket_count;
+    }
+    for (size_t i = database->rehash_position; i < end; i++) {
+        uint32_t link = database->old_buckets[i];
+        while (link != 0) {
+            IndexEntry_t* entry = entry_at(database, link - 1);
+            uint32_t next = entry->next;
+            size_t bucket = key_hash(&entry->record.key) & (database->bucket_count - 1);
+            entry->next = database->buckets[bucket];
+            database->buckets[bucket] = link;
+            link = next;
+        }
+    }
+    database->rehash_position = end;
+    if (end == database->old_bucket_count) {
+        free(database->old_buckets);
+        database->old_buckets = NULL;
+        database->old_bucket_count = 0;
+        database->rehash_position = 0;
+    }
+}
+
+
+// Start doubling the bucket array, first finishing any earlier growth that is still going
+static int grow_buckets(ImageDatabase_t* database) {
+    while (database->old_buckets != NULL) {
+        rehash_step(database);
+    }
+    uint32_t* buckets = (uint32_t*)calloc(database->bucket_count * 2, sizeof(uint32_t));
+    if (buckets == NULL) {
+        printf("Memory allocation failed for database index\n");
+        return 1;
+    }
+    database->old_buckets = database->buckets;
+    database->old_bucket_count = database->bucket_count;
+    database->rehash_position = 0;
+    database->buckets = buckets;
+    database->bucket_count *= 2;
+    return 0;
+}
+
+
+// The link that points at the key's entry, in whichever table holds it
+// Returns NULL if the key is not in the index
+static uint32_t* find_link(ImageDatabase_t* database, const ImageKey_t* key) {
+    size_t hash = key_hash(key);
+    uint32_t* link = &database->buckets[hash & (database->bucket_count - 1)];
+    while (*link != 0) {
+        IndexEntry_t* entry = entry_at(database, *link - 1);
+        if (memcmp(entry->record.key.digest, key->digest, SHA256_DIGEST_SIZE) == 0) {
+            return link;
+        }
+        link = &entry->next;
+    }
+
+    size_t old_bucket = hash & (database->old_bucket_count - 1);
+    if (database->old_buckets == NULL || old_bucket < database->rehash_position) {
+        return NULL;
+    }
+    link = &database->old_buckets[old_bucket];
+    while (*link != 0) {
+        IndexEntry_t* entry = entry_at(database, *link - 1);
+        if (memcmp(entry->record.key.digest, key->digest, SHA256_DIGEST_SIZE) == 0) {
+            return link;
+        }
+        link = &entry->next;
+    }
+    return NULL;
+}
+
+
+// Add a record for a key that is not in the index yet, with no place in storage
+// Returns NULL on failure
+static IndexEntry_t* insert_entry(ImageDatabase_t* database, const ImageRecord_t* record) {
+    if (database->image_count >= database->bucket_count && grow_buckets(database)) {
+        return NULL;
+    }
+
+    uint32_t id;
+    if (database->free_list != 0) {
+        id = database->free_list - 1;
+        database->free_list = entry_at(database, id)->next;
+    } else {
+        if (database->entry_count == UINT32_MAX - 1) {
+            printf("Database index is full\n");
+            return NULL;
+        }
+        if (database->entry_count == database->chunk_count * (uint32_t)INDEX_ENTRIES_PER_CHUNK) {
+            // Only the small array of chunk pointers ever moves
+            if (database->chunk_count == database->chunk_capacity) {
+                uint32_t capacity = database->chunk_capacity ? database->chunk_capacity * 2 : 16;
+                IndexEntry_t** chunks = (IndexEntry_t**)realloc(database->chunks, capacity * sizeof(IndexEntry_t*));
+                if (chunks == NULL) {
+                    printf("Memory allocation failed for database index\n");
+                    return NULL;
+                }
+                database->chunks = chunks;
+                database->chunk_capacity = capacity;
+            }
+            database->chunks[database->chunk_count] = (IndexEntry_t*)malloc(INDEX_ENTRIES_PER_CHUNK * sizeof(IndexEntry_t));
+            if (database->chunks[database->chunk_count] == NULL) {
+                printf("Memory allocation failed for database index\n");
+                return NULL;
+            }
+            database->chunk_count++;
+        }
+        id = database->entry_count++;
+    }
+
+    IndexEntry_t* entry = entry_at(database, id);
+    entry->record = *record;
+    entry->segment = LOOSE_SEGMENT;
+    entry->offset = 0;
+    size_t bucket = key_hash(&record->key) & (database->bucket_count - 1);
+    entry->next = database->buckets[bucket];
+    database->buckets[bucket] = id + 1;
+    database->image_count++;
+    return entry;
+}
+
+
+// Unlink the entry a link from find_link points at and put it on the free list
+static void remove_entry(ImageDatabase_t* database, uint32_t* link) {
+    uint32_t id = *link - 1;
+    IndexEntry_t* entry = entry_at(database, id);
+    *link = entry->next;
+    entry->record.references = 0;
+    entry->next = database->free_list;
+    database->free_list = id + 1;
+    database->image_count--;
+}
+
+
+static void encode_record(const JournalRecord_t* record, unsigned char* output) {
+    output[0] = (unsigned char)record->type;
+    memcpy(output + 1, record->image.key.digest, SHA256_DIGEST_SIZE);
+    unsigned char* fields = output + 1 + SHA256_DIGEST_SIZE;
+    put_u32_le(fields, record->image.references);
+    fields[4] = (unsigned char)record->image.codec;
+    put_u64_le(fields + 5, record->image.original_size);
+    put_u64_le(fields + 13, record->image.stored_size);
+    put_u32_le(fields + 21, record->segment);
+    put_u64_le(fields + 25, record->offset);
+}
+
+
+// Version 1 records are always images, and their images are loose files
+static void decode_record(const unsigned char* input, int version, JournalRecord_t* record) {
+    record->type = RECORD_IMAGE;
+    record->segment = LOOSE_SEGMENT;
+    record->offset = 0;
+    if (version != 1) {
+        record->type = input[0];
+        input++;
+    }
+    memcpy(record->image.key.digest, input, SHA256_DIGEST_SIZE);
+    const unsigned char* fields = input + SHA256_DIGEST_SIZE;
+    record->image.references = get_u32_le(fields);
+    record->image.codec = fields[4];
+    record->image.original_size = get_u64_le(fields + 5);
+    record->image.stored_size = get_u64_le(fields + 13);
+    if (version != 1) {
+        record->segment = get_u32_le(fields + 21);
+        record->offset = get_u64_le(fields + 25);
+    }
+}
+
+
+// Append a change to the journal, flushed so it survives the process
+static int append_record(ImageDatabase_t* database, const JournalRecord_t* record) {
+    unsigned char bytes[INDEX_RECORD_SIZE];
+    encode_record(record, bytes);
+    if (fwrite(bytes, 1, sizeof(bytes), database->journal) != sizeof(bytes) || fflush(database->journal) != 0) {
+        printf("Error writing database index\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+static int append_image_record(ImageDatabase_t* database, const IndexEntry_t* entry) {
+    JournalRecord_t record;
+    record.type = RECORD_IMAGE;
+    record.image = entry->record;
+    record.segment = entry->segment;
+    record.offset = entry->offset;
+    return append_record(database, &record);
+}
+
+
+static int append_segment_record(ImageDatabase_t* database, int type, uint32_t segment, uint64_t size) {
+    JournalRecord_t record;
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.segment = segment;
+    record.offset = size;
+    return append_record(database, &record);
+}
+
+
+// Make room in the segment table for this segment ID
+static int reserve_segment(ImageDatabase_t* database, uint32_t segment) {
+    if (segment == UINT32_MAX) {
+        printf("Database has run out of segment IDs\n");
+        return 1;
+    }
+    if (segment >= database->segment_capacity) {
+        uint32_t capacity = database->segment_capacity ? database->segment_capacity : 16;
+        while (capacity <= segment) {
+            capacity *= 2;
+        }
+        Segment_t* segments = (Segment_t*)realloc(database->segments, capacity * sizeof(Segment_t));
+        if (segments == NULL) {
+            printf("Memory allocation failed for database segments\n");
+            return 1;
+        }
+        memset(segments + database->segment_capacity, 0, (capacity - database->segment_capacity) * sizeof(Segment_t));
+        database->segments = segments;
+        database->segment_capacity = capacity;
+    }
+    if (segment >= database->segment_count) {
+        database->segment_count = segment + 1;
+    }
+    return 0;
+}
+
+
+// Replay one journal record into the in-memory index and segment table
+static int apply_record(ImageDatabase_t* database, const JournalRecord_t* record) {
+    if (record->type != RECORD_IMAGE) {
+        if (record->type > RECORD_SEGMENT_DELETED || record->segment == LOOSE_SEGMENT ||
+            reserve_segment(database, record->segment)) {
+            printf("Error reading database index\n");
+            return 1;
+        }
+        Segment_t* segment = &database->segments[record->segment];
+        segment->state = record->type == RECORD_SEGMENT_CREATED ? SEGMENT_ACTIVE :
+                         record->type == RECORD_SEGMENT_SEALED ? SEGMENT_SEALED : SEGMENT_NONE;
+        segment->size = record->offset;
+        return 0;
+    }
+
+    uint32_t* link = find_link(database, &record->image.key);
+    IndexEntry_t* entry = NULL;
+    if (link != NULL && record->image.references == 0) {
+        remove_entry(database, link);
+    } else if (link != NULL) {
+        entry = entry_at(database, *link - 1);
+        entry->record = record->image;
+    } else if (record->image.references != 0) {
+        entry = insert_entry(database, &record->image);
+        if (entry == NULL) {
+            return 1;
+        }
+    }
+    if (entry != NULL) {
+        entry->segment = record->segment;
+        entry->offset = record->offset;
+    }
+    return 0;
+}
+
+
+/* Rebuild the in-memory index from the journal at path, if there is one. *rewrite is set
+when the journal should be rewritten: it is missing or of version 1, ends in a partial
+record or is mostly superseded records. */
+static int replay_journal(ImageDatabase_t* database, const char* path, int* rewrite) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        *rewrite = 1;
+        return 0;
+    }
+
+    unsigned char header[INDEX_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, INDEX_MAGIC, 4) != 0 ||
+        (header[4] != 1 && header[4] != INDEX_FORMAT_VERSION)) {
+        printf("Error reading database index header\n");
+        fclose(file);
+        return 1;
+    }
+    int version = header[4];
+    size_t record_size = version == 1 ? INDEX_V1_RECORD_SIZE : INDEX_RECORD_SIZE;
+
+    uint64_t record_count = 0;
+    unsigned char bytes[INDEX_RECORD_SIZE];
+    size_t read;
+    while ((read = fread(bytes, 1, record_size, file)) == record_size) {
+        JournalRecord_t record;
+        decode_record(bytes, version, &record);
+        record_count++;
+        if (apply_record(database, &record)) {
+            fclose(file);
+            return 1;
+        }
+        rehash_step(database);
+    }
+    int status = ferror(file) != 0;
+    fclose(file);
+    if (status) {
+        printf("Error reading database index\n");
+        return 1;
+    }
+
+    // Every live image counts towards its segment
+    for (uint32_t id = 0; id < database->entry_count; id++) {
+        const IndexEntry_t* entry = entry_at(database, id);
+        if (entry->record.references == 0) {
+            continue;
+        }
+        if (entry->segment != LOOSE_SEGMENT &&
+            (entry->segment >= database->segment_count || database->segments[entry->segment].state == SEGMENT_NONE)) {
+            printf("Database index names a missing segment\n");
+            return 1;
+        }
+        if (entry->segment != LOOSE_SEGMENT) {
+            database->segments[entry->segment].live_bytes += entry->record.stored_size;
+        }
+    }
+
+    *rewrite = version != INDEX_FORMAT_VERSION || read != 0 ||
+               record_count > 2 * database->image_count + INDEX_COMPACT_MIN_RECORDS;
+    return 0;
+}
+
+
+// Write a journal holding just the live state next to path, then swap it in
+static int rewrite_journal(ImageDatabase_t* database, const char* path) {
+    char* temp_path = create_full_path(database->directory, INDEX_TEMP_NAME);
+    if (temp_path == NULL) {
+        return 1;
+    }
+    FILE* file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        printf("Error writing database index\n");
+        free(temp_path);
+        return 1;
+    }
+
+    unsigned char header[INDEX_HEADER_SIZE] = {0};
+    memcpy(header, INDEX_MAGIC, 4);
+    header[4] = INDEX_FORMAT_VERSION;
+    int status = fwrite(header, 1, sizeof(header), file) != sizeof(header);
+    unsigned char bytes[INDEX_RECORD_SIZE];
+    JournalRecord_t record;
+    memset(&record, 0, sizeof(record));
+    for (uint32_t id = 1; status == 0 && id < database->segment_count; id++) {
+        const Segment_t* segment = &database->segments[id];
+        if (segment->state != SEGMENT_NONE) {
+            record.type = segment->state == SEGMENT_ACTIVE ? RECORD_SEGMENT_CREATED : RECORD_SEGMENT_SEALED;
+            record.segment = id;
+            record.offset = segment->size;
+            encode_record(&record, bytes);
+            status = fwrite(bytes, 1, sizeof(bytes), file) != sizeof(bytes);
+        }
+    }
+    record.type = RECORD_IMAGE;
+    for (uint32_t id = 0; status == 0 && id < database->entry_count; id++) {
+        const IndexEntry_t* entry = entry_at(database, id);
+        if (entry->record.references != 0) {
+            record.image = entry->record;
+            record.segment = entry->segment;
+            record.offset = entry->offset;
+            encode_record(&record, bytes);
+            status = fwrite(bytes, 1, sizeof(bytes), file) != sizeof(bytes);
+        }
+    }
+    status |= fclose(file) != 0;
+
+#ifdef _WIN32
+    // rename won't replace an existing file here
+    if (status == 0) {
+        remove(path);
+    }
+#endif
+    if (status || rename(temp_path, path) != 0) {
+        printf("Error writing database index\n");
+        remove(temp_path);
+        status = 1;
+    }
+    free(temp_path);
+    return status;
+}
+
+
+static char* segment_path(const ImageDatabase_t* database, uint32_t segment) {
+    char file_name[PACK_SEGMENT_NAME_SIZE];
+    snprintf(file_name, sizeof(file_name), "%08lx.pack", (unsigned long)segment);
+    return create_full_path(database->directory, file_name);
+}
+
+
+// Where a version 1 index kept an image
+static char* stored_image_path(const ImageDatabase_t* database, const ImageKey_t* key) {
+    char file_name[IMAGE_KEY_HEX_SIZE + sizeof(STORED_IMAGE_SUFFIX)];
+    image_key_to_hex(key, file_name);
+    strcat(file_name, STORED_IMAGE_SUFFIX);
+    return create_full_path(database->directory, file_name);
+}
+
+
+// The open pack file of a segment, opening it on first use
+// Returns NULL on failure
+static PackFile_t* segment_pack(ImageDatabase_t* database, uint32_t segment) {
+    Segment_t* state = &database->segments[segment];
+    if (state->pack == NULL) {
+        char* path = segment_path(database, segment);
+        if (path == NULL) {
+            return NULL;
+        }
+        state->pack = pack_file_open(path, segment, state->state == SEGMENT_ACTIVE);
+        free(path);
+    }
+    return state->pack;
+}
+
+
+/* Carry on appending to the segment that was active when the database was last closed,
+rebuilding its footer index so far from the index. A segment that was sealed just
+before a crash, before the journal said so, is recorded as sealed instead. */
+static int resume_active_segment(ImageDatabase_t* database) {
+    uint32_t active = 0;
+    for (uint32_t id = 1; id < database->segment_count; id++) {
+        if (database->segments[id].state == SEGMENT_ACTIVE) {
+            active = id;
+        }
+    }
+    if (active == 0) {
+        return 0;
+    }
+    PackFile_t* pack = segment_pack(database, active);
+    if (pack == NULL) {
+        return 1;
+    }
+    if (pack_file_is_sealed(pack)) {
+        database->segments[active].state = SEGMENT_SEALED;
+        database->segments[active].size = pack_file_size(pack);
+        return append_segment_record(database, RECORD_SEGMENT_SEALED, active, pack_file_size(pack));
+    }
+
+    database->active = active;
+    for (uint32_t id = 0; id < database->entry_count; id++) {
+        const IndexEntry_t* entry = entry_at(database, id);
+        if (entry->record.references != 0 && entry->segment == active &&
+            add_active_entry(database, &entry->record.key, entry->offset, entry->record.stored_size)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static int add_active_entry(ImageDatabase_t* database, const ImageKey_t* key, uint64_t offset, uint64_t size) {
+    if (database->active_entry_count == database->active_entry_capacity) {
+        size_t capacity = database->active_entry_capacity ? database->active_entry_capacity * 2 : 1024;
+        PackEntry_t* entries = (PackEntry_t*)realloc(database->active_entries, capacity * sizeof(PackEntry_t));
+        if (entries == NULL) {
+            printf("Memory allocation failed for pack file index\n");
+            return 1;
+        }
+        database->active_entries = entries;
+        database->active_entry_capacity = capacity;
+    }
+    PackEntry_t* entry = &database->active_entries[database->active_entry_count++];
+    memcpy(entry->key, key->digest, PACK_KEY_SIZE);
+    entry->offset = offset;
+    entry->size = size;
+    return 0;
+}
+
+
+static int seal_active_segment(ImageDatabase_t* database) {
+    uint32_t active = database->active;
+    PackFile_t* pack = database->segments[active].pack;
+    if (pack_file_seal(pack, database->active_entries, database->active_entry_count) ||
+        append_segment_record(database, RECORD_SEGMENT_SEALED, active, pack_file_size(pack))) {
+        return 1;
+    }
+    database->segments[active].state = SEGMENT_SEALED;
+    database->segments[active].size = pack_file_size(pack);
+    database->active = 0;
+    database->active_entry_count = 0;
+    return 0;
+}
+
+
+// Append an image to the active segment, starting a new one if there is none
+static int store_image(ImageDatabase_t* database, const ImageKey_t* key, const unsigned char* data, size_t size,
+                       uint32_t* segment, uint64_t* offset) {
+    if (database->active == 0) {
+        uint32_t id = database->segment_count > 1 ? database->segment_count : 1;
+        if (reserve_segment(database, id)) {
+            return 1;
+        }
+        char* path = segment_path(database, id);
+        if (path == NULL) {
+            return 1;
+        }
+        PackFile_t* pack = pack_file_create(path, id);
+        free(path);
+        if (pack == NULL || append_segment_record(database, RECORD_SEGMENT_CREATED, id, 0)) {
+            pack_file_close(pack);
+            return 1;
+        }
+        database->segments[id].pack = pack;
+        database->segments[id].state = SEGMENT_ACTIVE;
+        database->active = id;
+    }
+
+    PackFile_t* pack = database->segments[database->active].pack;
+    if (pack_file_append(pack, data, size, offset) || add_active_entry(database, key, *offset, size)) {
+        return 1;
+    }
+    *segment = database->active;
+    database->segments[database->active].live_bytes += size;
+
+    // A full segment is sealed now; a failure only means it stays open for more
+    if (pack_file_size(pack) >= PACK_SEGMENT_MAX_SIZE) {
+        seal_active_segment(database);
+    }
+    return 0;
+}
+
+
+// Read an image's compressed bytes from its segment into the read buffer
+static int read_stored_image(ImageDatabase_t* database, const IndexEntry_t* entry) {
+    size_t size = (size_t)entry->record.stored_size;
+    if (size > database->read_capacity) {
+        unsigned char* buffer = (unsigned char*)realloc(database->read_buffer, size);
+        if (buffer == NULL) {
+            printf("Memory allocation failed for stored image\n");
+            return 1;
+        }
+        database->read_buffer = buffer;
+        database->read_capacity = size;
+    }
+    PackFile_t* pack = segment_pack(database, entry->segment);
+    return pack == NULL || pack_file_read(pack, entry->offset, database->read_buffer, size);
+}
+
+
+// Decompress a stored image wherever it is, with the tables of an earlier load or getting them
+static int decode_stored_image(ImageDatabase_t* database, const IndexEntry_t* entry, DecodeTables_t** tables,
+                               const unsigned char** image, size_t* size) {
+    if (entry->segment != LOOSE_SEGMENT) {
+        // One positioned read at the offset the index holds
+        return read_stored_image(database, entry) ||
+               decompress_buffer_with_tables(database->codec, database->read_buffer, (size_t)entry->record.stored_size,
+                                             tables, image, size);
+    }
+
+    MappedFile_t stored;
+    char* path = stored_image_path(database, &entry->record.key);
+    int status = path == NULL || map_file_for_reading(path, &stored);
+    free(path);
+    if (status == 0) {
+        // The decoded image lands in the codec context's buffer, so the file can go straight away
+        status = stored.size != entry->record.stored_size ||
+                 decompress_buffer_with_tables(database->codec, stored.data, (size_t)stored.size, tables, image, size);
+        unmap_file(&stored);
+    }
+    return status;
+}
+
+
+static void release_decode_tables(void* tables) {
+    decode_tables_destroy((DecodeTables_t*)tables);
+}
+
+
+// A malloc'd copy of a decoded image
+static int copy_image(const unsigned char* image, size_t size, unsigned char** copy) {
+    *copy = (unsigned char*)malloc(size ? size : 1);
+    if (*copy == NULL) {
+        printf("Memory allocation failed for loaded image\n");
+        return 1;
+    }
+    if (size > 0) {
+        memcpy(*copy, image, size);
+    }
+    return 0;
+}
+
+
+static int needs_compaction(const ImageDatabase_t* database, uint32_t segment) {
+    const Segment_t* state = &database->segments[segment];
+    return state->state == SEGMENT_SEALED && !state->compaction_failed &&
+           state->live_bytes * PACK_COMPACT_LIVE_DIVISOR < state->size;
+}
+
+
+// Stop compacting the victim; once all its images have moved it is deleted
+static void finish_victim(ImageDatabase_t* database, int failed) {
+    uint32_t victim = database->victim;
+    Segment_t* segment = &database->segments[victim];
+    if (failed || append_segment_record(database, RECORD_SEGMENT_DELETED, victim, 0)) {
+        printf("Error compacting database segment %lu\n", (unsigned long)victim);
+        segment->compaction_failed = 1;
+    } else {
+        pack_file_close(segment->pack);
+        segment->pack = NULL;
+        segment->state = SEGMENT_NONE;
+        segment->live_bytes = 0;
+        char* path = segment_path(database, victim);
+        if (path == NULL || remove(path) != 0) {
+            printf("Error deleting database segment %lu\n", (unsigned long)victim);
+        }
+        free(path);
+    }
+    free(database->victim_entries);
+    database->victim_entries = NULL;
+    database->victim_entry_count = 0;
+    database->victim_position = 0;
+    database->victim = 0;
+}
+
+
+/* Move the next batch of live images out of the segment being compacted, picking a
+segment first if none is. The victim's footer index says what it holds; an image is
+live if the index still points at that copy.
+Returns non-zero if there was anything to do. */
+static int compaction_step(ImageDatabase_t* database) {
+    if (database->victim == 0) {
+        for (uint32_t id = 1; id < database->segment_count && database->victim == 0; id++) {
+            if (needs_compaction(database, id)) {
+                database->victim = id;
+            }
+        }
+        if (database->victim == 0) {
+            return 0;
+        }
+        PackFile_t* pack = segment_pack(database, database->victim);
+        if (pack == NULL || pack_file_read_index(pack, &database->victim_entries, &database->victim_entry_count)) {
+            finish_victim(database, 1);
+            return 1;
+        }
+    }
+
+    size_t end = database->victim_position + PACK_COMPACT_BATCH;
+    if (end > database->victim_entry_count) {
+        end = database->victim_entry_count;
+    }
+    for (size_t i = database->victim_position; i < end; i++) {
+        const PackEntry_t* moved = &database->victim_entries[i];
+        ImageKey_t key;
+        memcpy(key.digest, moved->key, SHA256_DIGEST_SIZE);
+        uint32_t* link = find_link(database, &key);
+        if (link == NULL) {
+            continue;
+        }
+        IndexEntry_t* entry = entry_at(database, *link - 1);
+        if (entry->segment != database->victim || entry->offset != moved->offset) {
+            continue;
+        }
+
+        uint32_t segment;
+        uint64_t offset;
+        if (read_stored_image(database, entry) ||
+            store_image(database, &key, database->read_buffer, (size_t)entry->record.stored_size, &segment, &offset)) {
+            finish_victim(database, 1);
+            return 1;
+        }
+        uint32_t old_segment = entry->segment;
+        uint64_t old_offset = entry->offset;
+        entry->segment = segment;
+        entry->offset = offset;
+        if (append_image_record(database, entry)) {
+            // The index still points at the old copy, the new one is just dead space
+            entry->segment = old_segment;
+            entry->offset = old_offset;
+            database->segments[segment].live_bytes -= entry->record.stored_size;
+            finish_victim(database, 1);
+            return 1;
+        }
+        database->segments[old_segment].live_bytes -= entry->record.stored_size;
+    }
+    database->victim_position = end;
+    if (end == database->victim_entry_count) {
+        finish_victim(database, 0);
+    }
+    return 1;
+}
+
+
+static void* compaction_main(void* argument) {
+    ImageDatabase_t* database = (ImageDatabase_t*)argument;
+
+    pthread_mutex_lock(&database->lock);
+    while (!database->stopping) {
+        if (compaction_step(database) == 0) {
+            pthread_cond_wait(&database->compaction_wanted, &database->lock);
+        } else {
+            // Let waiting calls in between batches
+            pthread_mutex_unlock(&database->lock);
+            pthread_mutex_lock(&database->lock);
+        }
+    }
+    pthread_mutex_unlock(&database->lock);
+    return NULL;
+}
+
+
+ImageDatabase_t* image_database_open(const char* directory, const CompressionOptions_t* options) {
+    if (directory == NULL) {
+        directory = CLIENT_DATABASE;
+    }
+    ImageDatabase_t* database = (ImageDatabase_t*)calloc(1, sizeof(ImageDatabase_t));
+    if (database == NULL) {
+        printf("Memory allocation failed for database\n");
+        return NULL;
+    }
+    pthread_mutex_init(&database->lock, NULL);
+    pthread_cond_init(&database->compaction_wanted, NULL);
+    database->directory = create_full_path(directory, "");
+    database->codec = codec_ctx_create(options);
+    database->bucket_count = INDEX_MIN_BUCKETS;
+    database->buckets = (uint32_t*)calloc(database->bucket_count, sizeof(uint32_t));
+    database->cache_size = DATABASE_DEFAULT_CACHE_SIZE;
+    database->cache = image_cache_create(database->cache_size);
+    if (database->directory == NULL || database->codec == NULL || database->buckets == NULL || database->cache == NULL ||
+        reserve_segment(database, LOOSE_SEGMENT)) {
+        printf("Memory allocation failed for database\n");
+        image_database_close(database);
+        return NULL;
+    }
+    // Images saved with a dictionary decode without reading it back from disk
+    if (options != NULL && options->dictionary != NULL && codec_ctx_add_dictionary(database->codec, options->dictionary)) {
+        image_database_close(database);
+        return NULL;
+    }
+
+    char* index_path = create_full_path(directory, DATABASE_INDEX_NAME);
+    int rewrite = 0;
+    int status = index_path == NULL || replay_journal(database, index_path, &rewrite);
+    if (status == 0 && rewrite) {
+        status = rewrite_journal(database, index_path);
+    }
+    if (status == 0) {
+        database->journal = fopen(index_path, "ab");
+        if (database->journal == NULL) {
+            printf("Error opening database index\n");
+            status = 1;
+        }
+    }
+    free(index_path);
+    if (status || resume_active_segment(database)) {
+        image_database_close(database);
+        return NULL;
+    }
+
+    // Without the thread, space is only reclaimed by image_database_compact
+    if (pthread_create(&database->compaction_thread, NULL, compaction_main, database) == 0) {
+        database->compaction_running = 1;
+    } else {
+        printf("Failed to start database compaction\n");
+    }
+    return database;
+}
+
+
+int image_database_save(ImageDatabase_t* database, const unsigned char* image, size_t size, ImageKey_t* key) {
+    ImageKey_t image_key;
+    sha256(image, size, image_key.digest);
+    if (key != NULL) {
+        *key = image_key;
+    }
+
+    pthread_mutex_lock(&database->lock);
+    rehash_step(database);
+
+    // An identical image is already stored: just count the new reference
+    uint32_t* link = find_link(database, &image_key);
+    if (link != NULL) {
+        IndexEntry_t* entry = entry_at(database, *link - 1);
+        int status = entry->record.references == UINT32_MAX;
+        if (status) {
+            printf("Too many references to one image\n");
+        } else {
+            entry->record.references++;
+            status = append_image_record(database, entry);
+            if (status) {
+                entry->record.references--;
+            }
+        }
+        pthread_mutex_unlock(&database->lock);
+        return status;
+    }
+
+    // The image is stored before the index names it, so the index never points at nothing
+    const unsigned char* compressed;
+    size_t compressed_size;
+    uint32_t segment;
+    uint64_t offset;
+    if (compress_buffer(database->codec, image, size, &compressed, &compressed_size) ||
+        store_image(database, &image_key, compressed, compressed_size, &segment, &offset)) {
+        pthread_mutex_unlock(&database->lock);
+        return 1;
+    }
+
+    ImageRecord_t record;
+    record.key = image_key;
+    record.original_size = size;
+    record.stored_size = compressed_size;
+    record.references = 1;
+    record.codec = DATABASE_CODEC_HUFFMAN;
+    IndexEntry_t* entry = insert_entry(database, &record);
+    int status = entry == NULL;
+    if (entry != NULL) {
+        entry->segment = segment;
+        entry->offset = offset;
+        status = append_image_record(database, entry);
+        if (status) {
+            remove_entry(database, find_link(database, &image_key));
+        }
+    }
+    if (status) {
+        // What was appended is dead space for compaction
+        database->segments[segment].live_bytes -= compressed_size;
+    }
+    pthread_mutex_unlock(&database->lock);
+    return status;
+}
+
+
+int image_database_save_file(ImageDatabase_t* database, const char* image_name, ImageKey_t* key) {
+    char* path = create_full_path(IMAGE_DIRECTORY, image_name);
+    if (path == NULL) {
+        return 1;
+    }
+    MappedFile_t image;
+    int status = map_file_for_reading(path, &image);
+    free(path);
+    if (status) {
+        return 1;
+    }
+    status = image_database_save(database, image.data, (size_t)image.size, key);
+    unmap_file(&image);
+    return status;
+}
+
+
+int image_database_find(ImageDatabase_t* database, const ImageKey_t* key, ImageRecord_t* record) {
+    pthread_mutex_lock(&database->lock);
+    rehash_step(database);
+    uint32_t* link = find_link(database, key);
+    // Copied under the lock: once it is released a remove may free the entry and an insert reuse it
+    if (link != NULL) {
+        *record = entry_at(database, *link - 1)->record;
+    }
+    pthread_mutex_unlock(&database->lock);
+    return link == NULL;
+}
+
+
+int image_database_load(ImageDatabase_t* database, const ImageKey_t* key, unsigned char** image, size_t* size) {
+    *image = NULL;
+    *size = 0;
+    pthread_mutex_lock(&database->lock);
+    rehash_step(database);
+    uint32_t* link = find_link(database, key);
+    if (link == NULL) {
+        printf("Image not found in database\n");
+        pthread_mutex_unlock(&database->lock);
+        return 1;
+    }
+    const IndexEntry_t* entry = entry_at(database, *link - 1);
+    if (entry->record.codec != DATABASE_CODEC_HUFFMAN) {
+        printf("Unknown codec %d in database\n", entry->record.codec);
+        pthread_mutex_unlock(&database->lock);
+        return 1;
+    }
+
+    /* The caller gets a copy made under the lock: once it is released a remove or another
+    load's eviction may free the cached image, and an uncached load reuses the codec's buffer */
+    size_t decoded_size = (size_t)entry->record.original_size;
+    const unsigned char* decoded = (const unsigned char*)image_cache_get(database->cache, IMAGE_CACHE_DECODED, key->digest);
+    if (decoded != NULL) {
+        int status = copy_image(decoded, decoded_size, image);
+        if (status == 0) {
+            *size = decoded_size;
+        }
+        pthread_mutex_unlock(&database->lock);
+        return status;
+    }
+
+    DecodeTables_t* tables = (DecodeTables_t*)image_cache_get(database->cache, IMAGE_CACHE_TABLES, key->digest);
+    int had_tables = tables != NULL;
+    int status = decode_stored_image(database, entry, &tables, &decoded, &decoded_size);
+    if (status == 0 && decoded_size != entry->record.original_size) {
+        status = 1;
+    }
+    if (status) {
+        printf("Stored image is corrupt\n");
+        if (had_tables) {
+            image_cache_remove(database->cache, key->digest);
+        } else {
+            decode_tables_destroy(tables);
+        }
+        pthread_mutex_unlock(&database->lock);
+        return 1;
+    }
+
+    if (!had_tables && tables != NULL &&
+        image_cache_put(database->cache, IMAGE_CACHE_TABLES, key->digest, tables, decode_tables_size(tables),
+                        release_decode_tables)) {
+        decode_tables_destroy(tables);
+    }
+    // The cache keeps a copy of its own for the next load
+    unsigned char* cached;
+    if (decoded_size <= database->cache_size && copy_image(decoded, decoded_size, &cached) == 0 &&
+        image_cache_put(database->cache, IMAGE_CACHE_DECODED, key->digest, cached, decoded_size, free)) {
+        free(cached);
+    }
+    status = copy_image(decoded, decoded_size, image);
+    if (status == 0) {
+        *size = decoded_size;
+    }
+    pthread_mutex_unlock(&database->lock);
+    return status;
+}
+
+
+int image_database_remove(ImageDatabase_t* database, const ImageKey_t* key) {
+    pthread_mutex_lock(&database->lock);
+    rehash_step(database);
+    uint32_t* link = find_link(database, key);
+    if (link == NULL) {
+        printf("Image not found in database\n");
+        pthread_mutex_unlock(&database->lock);
+        return 1;
+    }
+
+    IndexEntry_t* entry = entry_at(database, *link - 1);
+    entry->record.references--;
+    if (append_image_record(database, entry)) {
+        entry->record.references++;
+        pthread_mutex_unlock(&database->lock);
+        return 1;
+    }
+    if (entry->record.references > 0) {
+        pthread_mutex_unlock(&database->lock);
+        return 0;
+    }
+
+    // The index no longer names the image, so its space can be reclaimed
+    int status = 0;
+    uint32_t segment = entry->segment;
+    uint64_t stored_size = entry->record.stored_size;
+    remove_entry(database, link);
+    image_cache_remove(database->cache, key->digest);
+    if (segment == LOOSE_SEGMENT) {
+        char* path = stored_image_path(database, key);
+        if (path == NULL || remove(path) != 0) {
+            printf("Error deleting image from database\n");
+            status = 1;
+        }
+        free(path);
+    } else {
+        database->segments[segment].live_bytes -= stored_size;
+        if (needs_compaction(database, segment)) {
+            pthread_cond_signal(&database->compaction_wanted);
+        }
+    }
+    pthread_mutex_unlock(&database->lock);
+    return status;
+}
+
+
+void image_database_compact(ImageDatabase_t* database) {
+    pthread_mutex_lock(&database->lock);
+    while (compaction_step(database)) {
+    }
+    pthread_mutex_unlock(&database->lock);
+}
+
+
+void image_database_set_cache_size(ImageDatabase_t* database, size_t bytes) {
+    pthread_mutex_lock(&database->lock);
+    database->cache_size = bytes;
+    image_cache_set_budget(database->cache, bytes);
+    pthread_mutex_unlock(&database->lock);
+}
+
+
+void image_database_cache_stats(ImageDatabase_t* database, int kind, ImageCacheStats_t* stats) {
+    pthread_mutex_lock(&database->lock);
+    image_cache_stats(database->cache, kind, stats);
+    pthread_mutex_unlock(&database->lock);
+}
+
+
+uint64_t image_database_count(ImageDatabase_t* database) {
+    pthread_mutex_lock(&database->lock);
+    uint64_t count = database->image_count;
+    pthread_mutex_unlock(&database->lock);
+    return count;
+}
+
+
+void image_database_close(ImageDatabase_t* database) {
+    if (database == NULL) return;
+    if (database->compaction_running) {
+        pthread_mutex_lock(&database->lock);
+        database->stopping = 1;
+        pthread_cond_signal(&database->compaction_wanted);
+        pthread_mutex_unlock(&database->lock);
+        pthread_join(database->compaction_thread, NULL);
+    }
+    if (database->journal != NULL) {
+        fclose(database->journal);
+    }
+    for (uint32_t id = 0; id < database->segment_count; id++) {
+        pack_file_close(database->segments[id].pack);
+    }
+    free(database->segments);
+    free(database->active_entries);
+    free(database->victim_entries);
+    free(database->read_buffer);
+    image_cache_destroy(database->cache);
+    for (uint32_t i = 0; i < database->chunk_count; i++) {
+        free(database->chunks[i]);
+    }
+    free(database->chunks);
+    free(database->buckets);
+    free(database->old_buckets);
+    codec_ctx_destroy(database->codec);
+    free(database->directory);
+    pthread_cond_destroy(&database->compaction_wanted);
+    pthread_mutex_destroy(&database->lock);
+    free(database);
+}
+
+
+void image_key_to_hex(const ImageKey_t* key, char hex[IMAGE_KEY_HEX_SIZE]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        hex[2 * i] = digits[key->digest[i] >> 4];
+        hex[2 * i + 1] = digits[key->digest[i] & 0x0F];
+    }
+    hex[2 * SHA256_DIGEST_SIZE] = '\0';
+}
+
+
+int image_key_from_hex(const char* hex, ImageKey_t* key) {
+    if (strlen(hex) != 2 * SHA256_DIGEST_SIZE) {
+        printf("An image key is %d hex digits\n", 2 * SHA256_DIGEST_SIZE);
+        return 1;
+    }
+    for (int i = 0; i < 2 * SHA256_DIGEST_SIZE; i++) {
+        int nibble;
+        if (hex[i] >= '0' && hex[i] <= '9') {
+            nibble = hex[i] - '0';
+        } else if (hex[i] >= 'a' && hex[i] <= 'f') {
+            nibble = hex[i] - 'a' + 10;
+        } else if (hex[i] >= 'A' && hex[i] <= 'F') {
+            nibble = hex[i] - 'A' + 10;
+        } else {
+            printf("An image key is %d hex digits\n", 2 * SHA256_DIGEST_SIZE);
+            return 1;
+        }
+        if (i % 2 == 0) {
+            key->digest[i / 2] = (unsigned char)(nibble << 4);
+        } else {
+            key->digest[i / 2] |= (unsigned char)nibble;
+        }
+    }
+    return 0;
+}
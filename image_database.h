@@ -0,0 +1,94 @@
+#ifndef IMAGE_DATABASE_H
+#define IMAGE_DATABASE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "huffman_compression.h"
+#include "image_cache.h"
+#include "sha256.h"
+
+/* Content-addressed image store. An image is keyed by the SHA-256 of its BMP bytes,
+so saving the same capture again only adds a reference to the copy already stored.
+The compressed images are appended to a few large pack segments in the database
+directory, and an index file there maps every key to its sizes, codec, reference
+count and place in a segment. The index is kept in memory as a hash table and
+persisted as a journal appended to on every change, so saves, loads and removes stay
+O(1) however many images are stored. Space left by removed images is reclaimed by a
+background thread that rewrites mostly dead segments. */
+#define DATABASE_INDEX_NAME "index.db"
+
+// Bytes of decoded images and decode tables kept for repeated loads until changed
+#define DATABASE_DEFAULT_CACHE_SIZE ((size_t)64 << 20)
+
+// How a stored image is coded
+#define DATABASE_CODEC_HUFFMAN 1
+
+typedef struct ImageDatabase ImageDatabase_t;
+
+typedef struct ImageKey {
+    unsigned char digest[SHA256_DIGEST_SIZE];
+} ImageKey_t;
+
+// Text form of a key: 64 hex digits and a terminator
+#define IMAGE_KEY_HEX_SIZE (2 * SHA256_DIGEST_SIZE + 1)
+
+typedef struct ImageRecord {
+    ImageKey_t key;
+    uint64_t original_size; // Bytes of the BMP
+    uint64_t stored_size;   // Bytes of the compressed image
+    uint32_t references;    // Saves not yet matched by a remove
+    int codec;
+} ImageRecord_t;
+
+// Function to open the database in a directory (CLIENT_DATABASE for NULL), reading its
+// index if it has one; options are used for saving, NULL for the defaults
+// Returns NULL on failure
+ImageDatabase_t* image_database_open(const char* directory, const CompressionOptions_t* options);
+
+// Function to save a BMP held in memory, compressing it only if no identical image is stored
+// yet; *key (may be NULL) gets its key
+// Returns 0 on success, non-zero on failure
+int image_database_save(ImageDatabase_t* database, const unsigned char* image, size_t size, ImageKey_t* key);
+
+// Function to save an image from IMAGE_DIRECTORY
+// Returns 0 on success, non-zero on failure
+int image_database_save_file(ImageDatabase_t* database, const char* image_name, ImageKey_t* key);
+
+// Function to copy the record of a stored image into record
+// Returns 0 on success, non-zero if there is no image with this key
+int image_database_find(ImageDatabase_t* database, const ImageKey_t* key, ImageRecord_t* record);
+
+// Function to load and decompress a stored image, or copy it from the cache if it was
+// loaded recently; *image is allocated with malloc and belongs to the caller
+// Returns 0 on success, non-zero on failure
+int image_database_load(ImageDatabase_t* database, const ImageKey_t* key, unsigned char** image, size_t* size);
+
+// Function to drop one reference to a stored image, dropping it from the index once none are left
+// Returns 0 on success, non-zero on failure, including no image with this key
+int image_database_remove(ImageDatabase_t* database, const ImageKey_t* key);
+
+// Function to reclaim the space of removed images now rather than in the background
+void image_database_compact(ImageDatabase_t* database);
+
+// Function to change how many bytes of decoded images and decode tables the database
+// keeps for repeated loads, 0 for none
+void image_database_set_cache_size(ImageDatabase_t* database, size_t bytes);
+
+// Function to get the cache counters of decoded images (IMAGE_CACHE_DECODED) or decode
+// tables (IMAGE_CACHE_TABLES)
+void image_database_cache_stats(ImageDatabase_t* database, int kind, ImageCacheStats_t* stats);
+
+// Function to get the number of distinct images stored
+uint64_t image_database_count(ImageDatabase_t* database);
+
+// Function to close the database, waiting for any compaction batch to finish; the index
+// on disk is already up to date
+void image_database_close(ImageDatabase_t* database);
+
+void image_key_to_hex(const ImageKey_t* key, char hex[IMAGE_KEY_HEX_SIZE]);
+
+// Function to parse the text form of a key
+// Returns 0 on success, non-zero if hex is not 64 hex digits
+int image_key_from_hex(const char* hex, ImageKey_t* key);
+
+#endif // IMAGE_DATABASE_H
@@ -0,0 +1,282 @@
+#include "image_filter.h"
+#include "byte_order.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// BMP file header (14 bytes) and the BITMAPINFOHEADER fields the filter reads
+#define BMP_FILE_HEADER_SIZE 14
+#define BMP_INFO_HEADER_SIZE 40
+#define BMP_COMPRESSION_RGB 0
+#define BMP_COMPRESSION_BITFIELDS 3
+
+
+int image_layout_from_bmp(const unsigned char* data, uint64_t size, ImageLayout_t* layout) {
+    if (size < BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE || data[0] != 'B' || data[1] != 'M' ||
+        get_u32_le(data + 14) < BMP_INFO_HEADER_SIZE) {
+        return 1;
+    }
+
+    int32_t width = (int32_t)get_u32_le(data + 18);
+    int32_t height = (int32_t)get_u32_le(data + 22); // Negative for top-down images
+    uint16_t planes = get_u16_le(data + 26);
+    uint16_t bits_per_pixel = get_u16_le(data + 28);
+    uint32_t compression = get_u32_le(data + 30);
+
+    // Palette images and compressed BMPs are coded as they are
+    if (width <= 0 || height == 0 || height == INT32_MIN || planes != 1 ||
+        (bits_per_pixel != 24 && bits_per_pixel != 32) ||
+        (compression != BMP_COMPRESSION_RGB && !(compression == BMP_COMPRESSION_BITFIELDS && bits_per_pixel == 32))) {
+        return 1;
+    }
+
+    layout->pixel_offset = get_u32_le(data + 10);
+    layout->width = (uint32_t)width;
+    layout->height = (uint32_t)(height < 0 ? -height : height);
+    layout->channels = bits_per_pixel / 8;
+    layout->stride = ((uint64_t)layout->width * bits_per_pixel + 31) / 32 * 4;
+    layout->colour_transform = COLOUR_TRANSFORM_NONE;
+    return image_layout_check(layout, size);
+}
+
+
+int image_layout_check(const ImageLayout_t* layout, uint64_t size) {
+    // The filter only writes 24 and 32-bit images, and reverting puts green (channel 1) first
+    if (layout->width == 0 || layout->height == 0 || layout->channels < 3 || layout->channels > 4 ||
+        layout->stride < (uint64_t)layout->width * layout->channels || layout->pixel_offset > size ||
+        layout->colour_transform > COLOUR_TRANSFORM_SUBTRACT_GREEN ||
+        (layout->colour_transform == COLOUR_TRANSFORM_SUBTRACT_GREEN && layout->channels < 3)) {
+        return 1;
+    }
+    // The rows must fit after the offset, checked without overflowing
+    return layout->stride > size || layout->height > (size - layout->pixel_offset) / layout->stride;
+}
+
+
+uint64_t image_filter_row_count(const ImageLayout_t* layout) {
+    return (uint64_t)layout->channels * layout->height;
+}
+
+
+static unsigned char paeth(int left, int up, int up_left) {
+    int estimate = left + up - up_left;
+    int distance_left = abs(estimate - left);
+    int distance_up = abs(estimate - up);
+    int distance_up_left = abs(estimate - up_left);
+    if (distance_left <= distance_up && distance_left <= distance_up_left) {
+        return (unsigned char)left;
+    }
+    return (unsigned char)(distance_up <= distance_up_left ? up : up_left);
+}
+
+
+// Filter one row of a plane against the row above it (zeros for the first row)
+static void filter_row(int filter, const unsigned char* row, const unsigned char* previous, uint32_t width, unsigned char* output) {
+    uint32_t x;
+    switch (filter) {
+    case ROW_FILTER_SUB:
+        output[0] = row[0];
+        for (x = 1; x < width; x++) {
+            output[x] = (unsigned char)(row[x] - row[x - 1]);
+        }
+        break;
+    case ROW_FILTER_UP:
+        for (x = 0; x < width; x++) {
+            output[x] = (unsigned char)(row[x] - previous[x]);
+        }
+        break;
+    case ROW_FILTER_AVERAGE:
+        output[0] = (unsigned char)(row[0] - (previous[0] >> 1));
+        for (x = 1; x < width; x++) {
+            output[x] = (unsigned char)(row[x] - ((row[x - 1] + previous[x]) >> 1));
+        }
+        break;
+    case ROW_FILTER_PAETH:
+        output[0] = (unsigned char)(row[0] - previous[0]);
+        for (x = 1; x < width; x++) {
+            output[x] = (unsigned char)(row[x] - paeth(row[x - 1], previous[x], previous[x - 1]));
+        }
+        break;
+    default:
+        memcpy(output, row, width);
+        break;
+    }
+}
+
+
+static void unfilter_row(int filter, const unsigned char* residuals, const unsigned char* previous, uint32_t width, unsigned char* row) {
+    uint32_t x;
+    switch (filter) {
+    case ROW_FILTER_SUB:
+        row[0] = residuals[0];
+        for (x = 1; x < width; x++) {
+            row[x] = (unsigned char)(residuals[x] + row[x - 1]);
+        }
+        break;
+    case ROW_FILTER_UP:
+        for (x = 0; x < width; x++) {
+            row[x] = (unsigned char)(residuals[x] + previous[x]);
+        }
+        break;
+    case ROW_FILTER_AVERAGE:
+        row[0] = (unsigned char)(residuals[0] + (previous[0] >> 1));
+        for (x = 1; x < width; x++) {
+            row[x] = (unsigned char)(residuals[x] + ((row[x - 1] + previous[x]) >> 1));
+        }
+        break;
+    case ROW_FILTER_PAETH:
+        row[0] = (unsigned char)(residuals[0] + previous[0]);
+        for (x = 1; x < width; x++) {
+            row[x] = (unsigned char)(residuals[x] + paeth(row[x - 1], previous[x], previous[x - 1]));
+        }
+        break;
+    default:
+        memcpy(row, residuals, width);
+        break;
+    }
+}
+
+
+// Whether a channel is stored as its difference from green
+static int subtracts_green(const ImageLayout_t* layout, uint32_t channel) {
+    return layout->colour_transform == COLOUR_TRANSFORM_SUBTRACT_GREEN && (channel == 0 || channel == 2);
+}
+
+
+// PNG's heuristic: the filter whose residuals, read as signed bytes, are smallest overall
+static uint64_t residual_cost(const unsigned char* residuals, uint32_t width) {
+    uint64_t cost = 0;
+    for (uint32_t x = 0; x < width; x++) {
+        cost += (uint64_t)abs((int)(signed char)residuals[x]);
+    }
+    return cost;
+}
+
+
+int image_filter_apply(const ImageLayout_t* layout, const unsigned char* data, uint64_t size,
+                       unsigned char* output, unsigned char* row_filters) {
+    uint32_t width = layout->width;
+    size_t row_bytes = (size_t)width * layout->channels;
+    size_t padding = (size_t)(layout->stride - row_bytes);
+    uint64_t pixel_end = layout->pixel_offset + layout->stride * layout->height;
+
+    // Two plane rows (current and previous) and a candidate row per filter
+    unsigned char* rows = (unsigned char*)malloc((size_t)width * (2 + ROW_FILTER_COUNT));
+    if (rows == NULL) {
+        printf("Memory allocation failed for image filter\n");
+        return 1;
+    }
+    unsigned char* current = rows;
+    unsigned char* previous = rows + width;
+    unsigned char* candidates = rows + 2 * (size_t)width;
+
+    // Everything that isn't a pixel keeps its place, the row padding is gathered after the planes
+    memcpy(output, data, (size_t)layout->pixel_offset);
+    memcpy(output + pixel_end, data + pixel_end, (size_t)(size - pixel_end));
+    unsigned char* planes = output + layout->pixel_offset;
+    unsigned char* padding_output = planes + row_bytes * layout->height;
+    for (uint32_t y = 0; y < layout->height; y++) {
+        memcpy(padding_output + (size_t)y * padding, data + layout->pixel_offset + y * layout->stride + row_bytes, padding);
+    }
+
+    for (uint32_t channel = 0; channel < layout->channels; channel++) {
+        memset(previous, 0, width);
+        for (uint32_t y = 0; y < layout->height; y++) {
+            const unsigned char* source = data + layout->pixel_offset + y * layout->stride + channel;
+            if (subtracts_green(layout, channel)) {
+                const unsigned char* green = source + 1 - (int)channel;
+                for (uint32_t x = 0; x < width; x++) {
+                    current[x] = (unsigned char)(source[(size_t)x * layout->channels] - green[(size_t)x * layout->channels]);
+                }
+            } else {
+                for (uint32_t x = 0; x < width; x++) {
+                    current[x] = source[(size_t)x * layout->channels];
+                }
+            }
+
+            int best_filter = ROW_FILTER_NONE;
+            uint64_t best_cost = UINT64_MAX;
+            for (int filter = 0; filter < ROW_FILTER_COUNT; filter++) {
+                unsigned char* candidate = candidates + (size_t)filter * width;
+                filter_row(filter, current, previous, width, candidate);
+                uint64_t cost = residual_cost(candidate, width);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_filter = filter;
+                }
+            }
+
+            uint64_t plane_row = (uint64_t)channel * layout->height + y;
+            row_filters[plane_row] = (unsigned char)best_filter;
+            memcpy(planes + plane_row * width, candidates + (size_t)best_filter * width, width);
+
+            unsigned char* swap = previous;
+            previous = current;
+            current = swap;
+        }
+    }
+
+    free(rows);
+    return 0;
+}
+
+
+int image_filter_revert(const ImageLayout_t* layout, const unsigned char* row_filters,
+                        const unsigned char* filtered, uint64_t size, unsigned char* output) {
+    if (image_layout_check(layout, size)) {
+        return 1;
+    }
+    uint32_t width = layout->width;
+    size_t row_bytes = (size_t)width * layout->channels;
+    size_t padding = (size_t)(layout->stride - row_bytes);
+    uint64_t pixel_end = layout->pixel_offset + layout->stride * layout->height;
+
+    unsigned char* rows = (unsigned char*)malloc((size_t)width * 2);
+    if (rows == NULL) {
+        printf("Memory allocation failed for image filter\n");
+        return 1;
+    }
+    unsigned char* current = rows;
+    unsigned char* previous = rows + width;
+
+    memcpy(output, filtered, (size_t)layout->pixel_offset);
+    memcpy(output + pixel_end, filtered + pixel_end, (size_t)(size - pixel_end));
+    const unsigned char* planes = filtered + layout->pixel_offset;
+    const unsigned char* padding_input = planes + row_bytes * layout->height;
+    for (uint32_t y = 0; y < layout->height; y++) {
+        memcpy(output + layout->pixel_offset + y * layout->stride + row_bytes, padding_input + (size_t)y * padding, padding);
+    }
+
+    // Green goes first, the other channels may be stored relative to it
+    for (uint32_t plane = 0; plane < layout->channels; plane++) {
+        uint32_t channel = plane == 0 ? 1 : plane == 1 ? 0 : plane;
+        memset(previous, 0, width);
+        for (uint32_t y = 0; y < layout->height; y++) {
+            uint64_t plane_row = (uint64_t)channel * layout->height + y;
+            if (row_filters[plane_row] >= ROW_FILTER_COUNT) {
+                free(rows);
+                return 1;
+            }
+            unfilter_row(row_filters[plane_row], planes + plane_row * width, previous, width, current);
+
+            unsigned char* destination = output + layout->pixel_offset + y * layout->stride + channel;
+            if (subtracts_green(layout, channel)) {
+                const unsigned char* green = destination + 1 - (int)channel;
+                for (uint32_t x = 0; x < width; x++) {
+                    destination[(size_t)x * layout->channels] = (unsigned char)(current[x] + green[(size_t)x * layout->channels]);
+                }
+            } else {
+                for (uint32_t x = 0; x < width; x++) {
+                    destination[(size_t)x * layout->channels] = current[x];
+                }
+            }
+
+            unsigned char* swap = previous;
+            previous = current;
+            current = swap;
+        }
+    }
+
+    free(rows);
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef IMAGE_FILTER_H
+#define IMAGE_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Row filters, as in PNG: every byte is replaced by its difference from a prediction
+// made out of its left, upper and upper-left neighbours in the same channel plane
+#define ROW_FILTER_NONE 0
+#define ROW_FILTER_SUB 1
+#define ROW_FILTER_UP 2
+#define ROW_FILTER_AVERAGE 3
+#define ROW_FILTER_PAETH 4
+#define ROW_FILTER_COUNT 5
+
+// Colour transforms applied before the row filters: none, or blue and red stored as
+// their difference from green, which takes out most of what the channels share
+#define COLOUR_TRANSFORM_NONE 0
+#define COLOUR_TRANSFORM_SUBTRACT_GREEN 1
+
+// Where the pixels of an uncompressed 24 or 32-bit BMP sit in the file
+typedef struct ImageLayout {
+    uint64_t pixel_offset; // Bytes in front of the pixel array (headers, masks)
+    uint64_t stride;       // Bytes per stored row, padding included
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;     // Bytes per pixel, blue, green, red and alpha
+    uint32_t colour_transform;
+} ImageLayout_t;
+
+// Function to find the pixel array of a BMP file held in memory (with no colour transform)
+// Returns 0 if the image can be filtered, non-zero if it isn't a BMP the filter handles
+int image_layout_from_bmp(const unsigned char* data, uint64_t size, ImageLayout_t* layout);
+
+// Function to check that a layout (for example one read back from a compressed file)
+// describes a 3 or 4-channel pixel array that fits in size bytes
+// Returns 0 if it does
+int image_layout_check(const ImageLayout_t* layout, uint64_t size);
+
+// Function to get the number of row filter types a layout needs, one per row of each channel plane
+uint64_t image_filter_row_count(const ImageLayout_t* layout);
+
+// Function to split the pixels into channel planes and filter every row with the filter
+// that predicts it best. output gets size bytes: whatever precedes the pixels, the
+// filtered planes, the row padding and whatever follows the pixels; row_filters gets
+// image_filter_row_count(layout) filter types
+// Returns 0 on success, non-zero on failure
+int image_filter_apply(const ImageLayout_t* layout, const unsigned char* data, uint64_t size,
+                       unsigned char* output, unsigned char* row_filters);
+
+// Function to turn the output of image_filter_apply back into the original size bytes
+// Returns 0 on success, non-zero if the layout or a row filter type is invalid
+int image_filter_revert(const ImageLayout_t* layout, const unsigned char* row_filters,
+                        const unsigned char* filtered, uint64_t size, unsigned char* output);
+
+#endif // IMAGE_FILTER_H
@@ -1,5 +1,8 @@
 #include "huffman_compression.h"
 #include "encryption.h"
+#include "batch_compress.h"
+#include "image_database.h"
+#include "mapped_file.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -18,21 +21,61 @@
 *******************************************************************************/
 void printLoginMenu(void);
 void printActionMenu(void);
+int runActionMenu(void);
+int readLine(char* line, size_t size);
+int readKey(ImageKey_t* key);
+void saveImage(ImageDatabase_t* database);
+void loadImage(ImageDatabase_t* database);
+void removeImage(ImageDatabase_t* database);
 
 
 
 /*******************************************************************************
  * Main
 *******************************************************************************/
-int main(void){
+int main(int argc, char* argv[]){
 
     char* key = "110011010101101010100";
     char* wrong_key = "11010010";
 
-    compress_image_to_database("green.bmp");
-    encrypt_file_in_database("green_compressed.bmp", key);
-    decrypt_file_from_database("green_compressed_encrypted.bmp", wrong_key);
-    decompress_file_to_decompressed("green_compressed_decrypted.bmp");
+    CompressionOptions_t options;
+    default_compression_options(&options);
+
+    // --batch saves every capture in the Captures folder, or just the ones named after it
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        BatchStats_t stats;
+        int status;
+        if (argc > 2) {
+            status = batch_compress_files((const char* const*)(argv + 2), (size_t)(argc - 2), key,
+                                          CIPHER_CHACHA20_POLY1305, &options, &stats);
+        } else {
+            status = batch_compress_directory(key, CIPHER_CHACHA20_POLY1305, &options, &stats);
+        }
+        batch_print_stats(&stats);
+        return status;
+    }
+
+    // --menu runs the action menu on the image database
+    if (argc > 1 && strcmp(argv[1], "--menu") == 0) {
+        return runActionMenu();
+    }
+
+    // Save and load through memory, without the Compressed/ and Compressed_And_Decrypted/ copies
+    if (compress_and_encrypt_to_database("green.bmp", key, CIPHER_CHACHA20_POLY1305, &options) != 0) {
+        printf("Failed to save green.bmp\n");
+        return 1;
+    }
+
+    // The wrong key is turned away before anything is decompressed
+    if (decrypt_and_decompress_to_decompressed("green_compressed_encrypted.bmp", wrong_key) == 0) {
+        printf("Loaded green.bmp with the wrong key\n");
+        return 1;
+    }
+    if (decrypt_and_decompress_to_decompressed("green_compressed_encrypted.bmp", key) != 0) {
+        printf("Failed to load green.bmp\n");
+        return 1;
+    }
+    return 0;
 }
 
 void printLoginMenu(void){
@@ -48,4 +91,115 @@ void printActionMenu(void){
      "2. Load an Image from the Database\n"
      "3. Remove an Image from the Database\n"
      "4. Exit the Program\n");
-}
\ No newline at end of file
+}
+
+int runActionMenu(void){
+    ImageDatabase_t* database = image_database_open(NULL, NULL);
+    if (database == NULL) {
+        printf("Failed to open the image database\n");
+        return 1;
+    }
+
+    char choice[16];
+    while (1) {
+        printActionMenu();
+        printf("Choice: ");
+        if (readLine(choice, sizeof(choice))) {
+            break;
+        }
+        if (strcmp(choice, "1") == 0) {
+            saveImage(database);
+        } else if (strcmp(choice, "2") == 0) {
+            loadImage(database);
+        } else if (strcmp(choice, "3") == 0) {
+            removeImage(database);
+        } else if (strcmp(choice, "4") == 0) {
+            break;
+        } else {
+            printf("Invalid choice\n");
+        }
+    }
+
+    image_database_close(database);
+    return 0;
+}
+
+// Read a line from the user without its newline; returns non-zero at the end of input
+int readLine(char* line, size_t size){
+    if (fgets(line, (int)size, stdin) == NULL) {
+        return 1;
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    return 0;
+}
+
+// Ask for the key an image was saved under; image_key_from_hex says what is wrong with it
+int readKey(ImageKey_t* key){
+    char hex[IMAGE_KEY_HEX_SIZE + 2];
+    printf("Image key: ");
+    return readLine(hex, sizeof(hex)) || image_key_from_hex(hex, key);
+}
+
+void saveImage(ImageDatabase_t* database){
+    char name[256];
+    printf("Image name in the Captures folder: ");
+    if (readLine(name, sizeof(name))) {
+        return;
+    }
+    ImageKey_t key;
+    if (image_database_save_file(database, name, &key)) {
+        printf("Failed to save %s\n", name);
+        return;
+    }
+    char hex[IMAGE_KEY_HEX_SIZE];
+    image_key_to_hex(&key, hex);
+    printf("Saved %s as %s\n", name, hex);
+}
+
+// Load an image into the Decompressed folder, named by its key
+void loadImage(ImageDatabase_t* database){
+    ImageKey_t key;
+    if (readKey(&key)) {
+        return;
+    }
+    unsigned char* image;
+    size_t size;
+    if (image_database_load(database, &key, &image, &size)) {
+        printf("Failed to load the image\n");
+        return;
+    }
+
+    char name[IMAGE_KEY_HEX_SIZE + 4];
+    image_key_to_hex(&key, name);
+    strcat(name, ".bmp");
+    char* path = create_full_path(DECOMPRESSED_DIRECTORY, name);
+    MappedFile_t output;
+    if (path == NULL || map_file_for_writing(path, size, &output)) {
+        printf("Failed to write the image\n");
+        free(path);
+        free(image);
+        return;
+    }
+    if (size > 0) {
+        memcpy(output.data, image, size);
+    }
+    if (unmap_file(&output)) {
+        printf("Failed to write the image\n");
+    } else {
+        printf("Loaded the image into %s\n", path);
+    }
+    free(path);
+    free(image);
+}
+
+void removeImage(ImageDatabase_t* database){
+    ImageKey_t key;
+    if (readKey(&key)) {
+        return;
+    }
+    if (image_database_remove(database, &key)) {
+        printf("Failed to remove the image\n");
+        return;
+    }
+    printf("Removed the image\n");
+}
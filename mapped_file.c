@@ -0,0 +1,185 @@
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include "mapped_file.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+static void clear_mapping(MappedFile_t* mapping) {
+    mapping->data = NULL;
+    mapping->size = 0;
+    mapping->mapped_size = 0;
+    mapping->is_mapped = 0;
+    mapping->writable = 0;
+    mapping->fd = -1;
+    mapping->path = NULL;
+}
+
+
+#ifdef _WIN32
+
+// No mmap here: read the file into memory, and buffer writes until unmap_file
+
+int map_file_for_reading(const char* path, MappedFile_t* mapping) {
+    clear_mapping(mapping);
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Error opening file\n");
+        return 1;
+    }
+    _fseeki64(file, 0, SEEK_END);
+    mapping->size = (uint64_t)_ftelli64(file);
+    _fseeki64(file, 0, SEEK_SET);
+
+    mapping->data = (unsigned char*)malloc(mapping->size ? (size_t)mapping->size : 1);
+    if (mapping->data == NULL || fread(mapping->data, 1, (size_t)mapping->size, file) != mapping->size) {
+        printf("Error reading file\n");
+        free(mapping->data);
+        fclose(file);
+        clear_mapping(mapping);
+        return 1;
+    }
+    mapping->mapped_size = mapping->size;
+    fclose(file);
+    return 0;
+}
+
+
+int map_file_for_writing(const char* path, uint64_t size, MappedFile_t* mapping) {
+    clear_mapping(mapping);
+    mapping->data = (unsigned char*)malloc(size ? (size_t)size : 1);
+    mapping->path = (char*)malloc(strlen(path) + 1);
+    if (mapping->data == NULL || mapping->path == NULL) {
+        printf("Memory allocation failed for output file\n");
+        free(mapping->data);
+        free(mapping->path);
+        clear_mapping(mapping);
+        return 1;
+    }
+    strcpy(mapping->path, path);
+    mapping->size = size;
+    mapping->mapped_size = size;
+    mapping->writable = 1;
+    return 0;
+}
+
+
+int unmap_file(MappedFile_t* mapping) {
+    int status = 0;
+    if (mapping->writable) {
+        FILE* file = fopen(mapping->path, "wb");
+        if (file == NULL || fwrite(mapping->data, 1, (size_t)mapping->size, file) != mapping->size) {
+            printf("Error writing file\n");
+            status = 1;
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+    free(mapping->data);
+    free(mapping->path);
+    clear_mapping(mapping);
+    return status;
+}
+
+#else
+
+int map_file_for_reading(const char* path, MappedFile_t* mapping) {
+    clear_mapping(mapping);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Error opening file\n");
+        return 1;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        printf("Error reading file size\n");
+        close(fd);
+        return 1;
+    }
+    mapping->size = (uint64_t)info.st_size;
+    mapping->mapped_size = mapping->size;
+
+    // mmap can't map an empty file, and an empty file needs no data pointer
+    if (mapping->size > 0) {
+        void* data = mmap(NULL, (size_t)mapping->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            printf("Error mapping file\n");
+            close(fd);
+            clear_mapping(mapping);
+            return 1;
+        }
+        posix_madvise(data, (size_t)mapping->size, POSIX_MADV_SEQUENTIAL);
+        mapping->data = (unsigned char*)data;
+        mapping->is_mapped = 1;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    return 0;
+}
+
+
+int map_file_for_writing(const char* path, uint64_t size, MappedFile_t* mapping) {
+    clear_mapping(mapping);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Error creating file\n");
+        return 1;
+    }
+    if (ftruncate(fd, (off_t)size) != 0) {
+        printf("Error sizing file\n");
+        close(fd);
+        return 1;
+    }
+
+    if (size > 0) {
+        void* data = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            printf("Error mapping file\n");
+            close(fd);
+            return 1;
+        }
+        posix_madvise(data, (size_t)size, POSIX_MADV_SEQUENTIAL);
+        mapping->data = (unsigned char*)data;
+        mapping->is_mapped = 1;
+    }
+
+    mapping->fd = fd;
+    mapping->size = size;
+    mapping->mapped_size = size;
+    mapping->writable = 1;
+    return 0;
+}
+
+
+int unmap_file(MappedFile_t* mapping) {
+    int status = 0;
+    if (mapping->is_mapped) {
+        munmap(mapping->data, (size_t)mapping->mapped_size);
+    }
+    if (mapping->writable) {
+        if (mapping->size != mapping->mapped_size && ftruncate(mapping->fd, (off_t)mapping->size) != 0) {
+            printf("Error sizing file\n");
+            status = 1;
+        }
+        close(mapping->fd);
+    }
+    clear_mapping(mapping);
+    return status;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stdint.h>
+
+// A whole file in memory: memory-mapped where the platform allows it, read into a
+// buffer otherwise
+typedef struct MappedFile {
+    unsigned char* data;
+    uint64_t size;          // Bytes of the file in use, a writer may lower it before unmapping
+    uint64_t mapped_size;   // Bytes actually mapped or allocated
+    int is_mapped;          // 1 if data is a memory mapping
+    int writable;
+    int fd;
+    char* path;             // Output path, kept for the buffered writer
+} MappedFile_t;
+
+// Function to map a file for reading, with a sequential access hint
+// Returns 0 on success, non-zero on failure
+int map_file_for_reading(const char* path, MappedFile_t* mapping);
+
+// Function to create (or truncate) a file of the given size and map it for writing
+// Returns 0 on success, non-zero on failure
+int map_file_for_writing(const char* path, uint64_t size, MappedFile_t* mapping);
+
+// Function to release a mapping; a writable file is cut to mapping->size
+// Returns 0 on success, non-zero if the file could not be completed
+int unmap_file(MappedFile_t* mapping);
+
+#endif // MAPPED_FILE_H
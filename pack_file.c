@@ -0,0 +1,315 @@
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include "pack_file.h"
+#include "byte_order.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+// Header: magic, version, 3 reserved bytes, segment ID
+#define PACK_MAGIC "HPAK"
+#define PACK_FORMAT_VERSION 1
+
+// Footer entry: key, offset, size. Trailer: footer offset, entry count, magic.
+#define PACK_ENTRY_SIZE (PACK_KEY_SIZE + 16)
+#define PACK_TRAILER_SIZE 20
+#define PACK_TRAILER_MAGIC "HPKF"
+
+
+struct PackFile {
+#ifdef _WIN32
+    FILE* file;
+#else
+    int fd;
+#endif
+    uint32_t id;
+    uint64_t size;
+    uint64_t index_offset; // Where the footer index starts, 0 while the segment is unsealed
+    uint64_t entry_count;
+};
+
+
+/*******************************************************************************
+ * Function Prototypes
+*******************************************************************************/
+static PackFile_t* open_segment(const char* path, int mode);
+static int read_at(PackFile_t* pack, uint64_t offset, unsigned char* output, size_t size);
+static int write_at(PackFile_t* pack, uint64_t offset, const unsigned char* data, size_t size);
+static void close_segment(PackFile_t* pack);
+static void read_trailer(PackFile_t* pack);
+
+
+// Segment open modes
+#define SEGMENT_CREATE 0
+#define SEGMENT_READ 1
+#define SEGMENT_WRITE 2
+
+
+#ifdef _WIN32
+
+// No pread here: seek and read through stdio, which the caller's lock keeps to one thread
+
+static PackFile_t* open_segment(const char* path, int mode) {
+    PackFile_t* pack = (PackFile_t*)calloc(1, sizeof(PackFile_t));
+    if (pack == NULL) {
+        printf("Memory allocation failed for pack file\n");
+        return NULL;
+    }
+    pack->file = fopen(path, mode == SEGMENT_CREATE ? "w+b" : mode == SEGMENT_WRITE ? "r+b" : "rb");
+    if (pack->file == NULL) {
+        printf("Error opening pack file\n");
+        free(pack);
+        return NULL;
+    }
+    _fseeki64(pack->file, 0, SEEK_END);
+    pack->size = (uint64_t)_ftelli64(pack->file);
+    return pack;
+}
+
+
+static int read_at(PackFile_t* pack, uint64_t offset, unsigned char* output, size_t size) {
+    return _fseeki64(pack->file, (__int64)offset, SEEK_SET) != 0 || fread(output, 1, size, pack->file) != size;
+}
+
+
+static int write_at(PackFile_t* pack, uint64_t offset, const unsigned char* data, size_t size) {
+    return _fseeki64(pack->file, (__int64)offset, SEEK_SET) != 0 || fwrite(data, 1, size, pack->file) != size ||
+           fflush(pack->file) != 0;
+}
+
+
+static void close_segment(PackFile_t* pack) {
+    fclose(pack->file);
+    free(pack);
+}
+
+#else
+
+static PackFile_t* open_segment(const char* path, int mode) {
+    PackFile_t* pack = (PackFile_t*)calloc(1, sizeof(PackFile_t));
+    if (pack == NULL) {
+        printf("Memory allocation failed for pack file\n");
+        return NULL;
+    }
+    int flags = mode == SEGMENT_CREATE ? O_RDWR | O_CREAT | O_TRUNC : mode == SEGMENT_WRITE ? O_RDWR : O_RDONLY;
+    pack->fd = open(path, flags, 0644);
+    struct stat info;
+    if (pack->fd < 0 || fstat(pack->fd, &info) != 0) {
+        printf("Error opening pack file\n");
+        if (pack->fd >= 0) {
+            close(pack->fd);
+        }
+        free(pack);
+        return NULL;
+    }
+    pack->size = (uint64_t)info.st_size;
+    return pack;
+}
+
+
+static int read_at(PackFile_t* pack, uint64_t offset, unsigned char* output, size_t size) {
+    while (size > 0) {
+        ssize_t done = pread(pack->fd, output, size, (off_t)offset);
+        if (done <= 0) {
+            return 1;
+        }
+        output += done;
+        offset += (uint64_t)done;
+        size -= (size_t)done;
+    }
+    return 0;
+}
+
+
+static int write_at(PackFile_t* pack, uint64_t offset, const unsigned char* data, size_t size) {
+    while (size > 0) {
+        ssize_t done = pwrite(pack->fd, data, size, (off_t)offset);
+        if (done <= 0) {
+            return 1;
+        }
+        data += done;
+        offset += (uint64_t)done;
+        size -= (size_t)done;
+    }
+    return 0;
+}
+
+
+static void close_segment(PackFile_t* pack) {
+    close(pack->fd);
+    free(pack);
+}
+
+#endif
+
+
+// Mark the segment sealed if it ends in a trailer that points at a whole footer index
+static void read_trailer(PackFile_t* pack) {
+    unsigned char trailer[PACK_TRAILER_SIZE];
+    if (pack->size < PACK_HEADER_SIZE + PACK_TRAILER_SIZE ||
+        read_at(pack, pack->size - PACK_TRAILER_SIZE, trailer, sizeof(trailer)) ||
+        memcmp(trailer + 16, PACK_TRAILER_MAGIC, 4) != 0) {
+        return;
+    }
+    uint64_t index_offset = get_u64_le(trailer);
+    uint64_t entry_count = get_u64_le(trailer + 8);
+    uint64_t index_space = pack->size - PACK_TRAILER_SIZE;
+    if (index_offset >= PACK_HEADER_SIZE && index_offset <= index_space &&
+        entry_count == (index_space - index_offset) / PACK_ENTRY_SIZE &&
+        (index_space - index_offset) % PACK_ENTRY_SIZE == 0) {
+        pack->index_offset = index_offset;
+        pack->entry_count = entry_count;
+    }
+}
+
+
+PackFile_t* pack_file_create(const char* path, uint32_t id) {
+    PackFile_t* pack = open_segment(path, SEGMENT_CREATE);
+    if (pack == NULL) {
+        return NULL;
+    }
+    unsigned char header[PACK_HEADER_SIZE] = {0};
+    memcpy(header, PACK_MAGIC, 4);
+    header[4] = PACK_FORMAT_VERSION;
+    put_u32_le(header + 8, id);
+    if (write_at(pack, 0, header, sizeof(header))) {
+        printf("Error writing pack file\n");
+        close_segment(pack);
+        return NULL;
+    }
+    pack->id = id;
+    pack->size = PACK_HEADER_SIZE;
+    return pack;
+}
+
+
+PackFile_t* pack_file_open(const char* path, uint32_t id, int writable) {
+    PackFile_t* pack = open_segment(path, writable ? SEGMENT_WRITE : SEGMENT_READ);
+    if (pack == NULL) {
+        return NULL;
+    }
+    unsigned char header[PACK_HEADER_SIZE];
+    if (pack->size < PACK_HEADER_SIZE || read_at(pack, 0, header, sizeof(header)) ||
+        memcmp(header, PACK_MAGIC, 4) != 0 || header[4] != PACK_FORMAT_VERSION || get_u32_le(header + 8) != id) {
+        printf("Error reading pack file header\n");
+        close_segment(pack);
+        return NULL;
+    }
+    pack->id = id;
+    read_trailer(pack);
+    return pack;
+}
+
+
+int pack_file_append(PackFile_t* pack, const unsigned char* data, size_t size, uint64_t* offset) {
+    if (pack->index_offset != 0) {
+        printf("Pack file is sealed\n");
+        return 1;
+    }
+    if (write_at(pack, pack->size, data, size)) {
+        printf("Error writing pack file\n");
+        return 1;
+    }
+    *offset = pack->size;
+    pack->size += size;
+    return 0;
+}
+
+
+int pack_file_read(PackFile_t* pack, uint64_t offset, unsigned char* output, size_t size) {
+    if (offset < PACK_HEADER_SIZE || offset > pack->size || size > pack->size - offset || read_at(pack, offset, output, size)) {
+        printf("Error reading pack file\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+int pack_file_seal(PackFile_t* pack, const PackEntry_t* entries, size_t entry_count) {
+    if (pack->index_offset != 0) {
+        printf("Pack file is sealed\n");
+        return 1;
+    }
+
+    // The footer index and trailer go out in one write
+    size_t footer_size = entry_count * PACK_ENTRY_SIZE + PACK_TRAILER_SIZE;
+    unsigned char* footer = (unsigned char*)malloc(footer_size);
+    if (footer == NULL) {
+        printf("Memory allocation failed for pack file index\n");
+        return 1;
+    }
+    for (size_t i = 0; i < entry_count; i++) {
+        unsigned char* entry = footer + i * PACK_ENTRY_SIZE;
+        memcpy(entry, entries[i].key, PACK_KEY_SIZE);
+        put_u64_le(entry + PACK_KEY_SIZE, entries[i].offset);
+        put_u64_le(entry + PACK_KEY_SIZE + 8, entries[i].size);
+    }
+    unsigned char* trailer = footer + entry_count * PACK_ENTRY_SIZE;
+    put_u64_le(trailer, pack->size);
+    put_u64_le(trailer + 8, entry_count);
+    memcpy(trailer + 16, PACK_TRAILER_MAGIC, 4);
+
+    int status = write_at(pack, pack->size, footer, footer_size);
+    free(footer);
+    if (status) {
+        printf("Error writing pack file index\n");
+        return 1;
+    }
+    pack->index_offset = pack->size;
+    pack->entry_count = entry_count;
+    pack->size += footer_size;
+    return 0;
+}
+
+
+int pack_file_read_index(PackFile_t* pack, PackEntry_t** entries, size_t* entry_count) {
+    *entries = NULL;
+    *entry_count = 0;
+    if (pack->index_offset == 0) {
+        printf("Pack file has no index\n");
+        return 1;
+    }
+
+    size_t index_size = (size_t)(pack->entry_count * PACK_ENTRY_SIZE);
+    unsigned char* index = (unsigned char*)malloc(index_size ? index_size : 1);
+    PackEntry_t* list = (PackEntry_t*)malloc(pack->entry_count ? (size_t)pack->entry_count * sizeof(PackEntry_t) : 1);
+    if (index == NULL || list == NULL || read_at(pack, pack->index_offset, index, index_size)) {
+        printf("Error reading pack file index\n");
+        free(index);
+        free(list);
+        return 1;
+    }
+    for (size_t i = 0; i < (size_t)pack->entry_count; i++) {
+        const unsigned char* entry = index + i * PACK_ENTRY_SIZE;
+        memcpy(list[i].key, entry, PACK_KEY_SIZE);
+        list[i].offset = get_u64_le(entry + PACK_KEY_SIZE);
+        list[i].size = get_u64_le(entry + PACK_KEY_SIZE + 8);
+    }
+    free(index);
+    *entries = list;
+    *entry_count = (size_t)pack->entry_count;
+    return 0;
+}
+
+
+uint64_t pack_file_size(const PackFile_t* pack) {
+    return pack->size;
+}
+
+
+int pack_file_is_sealed(const PackFile_t* pack) {
+    return pack->index_offset != 0;
+}
+
+
+void pack_file_close(PackFile_t* pack) {
+    if (pack == NULL) return;
+    close_segment(pack);
+}
@@ -0,0 +1,57 @@
+#ifndef PACK_FILE_H
+#define PACK_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A pack file is one append-only segment holding many stored images back to back,
+after a short header. Sealing it appends a footer index (the key, offset and size of
+every image written to it) and a trailer pointing at the footer, after which the
+segment never changes again. Images are read with a positioned read at the offset
+the index recorded, so a load costs no open or close. */
+#define PACK_KEY_SIZE 32
+#define PACK_HEADER_SIZE 12
+
+typedef struct PackFile PackFile_t;
+
+// One image in a segment, as the footer index lists it
+typedef struct PackEntry {
+    unsigned char key[PACK_KEY_SIZE];
+    uint64_t offset;
+    uint64_t size;
+} PackEntry_t;
+
+// Function to create an empty segment with the given ID, replacing any file at path
+// Returns NULL on failure
+PackFile_t* pack_file_create(const char* path, uint32_t id);
+
+// Function to open an existing segment, checking that it is the one with this ID;
+// writable for the segment still being appended to
+// Returns NULL on failure
+PackFile_t* pack_file_open(const char* path, uint32_t id, int writable);
+
+// Function to append size bytes to an unsealed segment; *offset gets where they start
+// Returns 0 on success, non-zero on failure
+int pack_file_append(PackFile_t* pack, const unsigned char* data, size_t size, uint64_t* offset);
+
+// Function to read size bytes at offset
+// Returns 0 on success, non-zero on failure, including a range past the end
+int pack_file_read(PackFile_t* pack, uint64_t offset, unsigned char* output, size_t size);
+
+// Function to write the footer index of the entry_count images in the segment and seal it
+// Returns 0 on success, non-zero on failure
+int pack_file_seal(PackFile_t* pack, const PackEntry_t* entries, size_t entry_count);
+
+// Function to read the footer index of a sealed segment into *entries, which the caller frees
+// Returns 0 on success, non-zero on failure
+int pack_file_read_index(PackFile_t* pack, PackEntry_t** entries, size_t* entry_count);
+
+// Function to get the bytes in the segment, the header and any footer included
+uint64_t pack_file_size(const PackFile_t* pack);
+
+// Function to tell whether the segment has its footer index
+int pack_file_is_sealed(const PackFile_t* pack);
+
+void pack_file_close(PackFile_t* pack);
+
+#endif // PACK_FILE_H
@@ -0,0 +1,169 @@
+#include "run_length.h"
+#include <string.h>
+
+// Longest varint: 64 bits, 7 per byte
+#define MAX_VARINT_SIZE 10
+
+
+uint64_t run_length_min_run(uint32_t unit) {
+    // A repeat token costs a varint and one unit, so single bytes need longer runs to pay off
+    return unit == 1 ? 3 : 2;
+}
+
+
+// Units, counting the one at position, that repeat the unit at position
+static uint64_t run_at(const unsigned char* data, uint64_t position, uint64_t unit_count, uint32_t unit) {
+    uint64_t start = position * unit;
+    uint64_t end = unit_count * unit;
+    uint64_t byte = start + unit;
+    // A run of units is a stretch where every byte equals the one a unit earlier
+    while (byte < end && data[byte] == data[byte - unit]) {
+        byte++;
+    }
+    return (byte - start) / unit;
+}
+
+
+uint64_t run_length_coverage(const unsigned char* data, uint64_t size, uint32_t unit) {
+    uint64_t unit_count = size / unit;
+    uint64_t min_run = run_length_min_run(unit);
+    uint64_t covered = 0;
+    for (uint64_t i = 0; i < unit_count;) {
+        uint64_t run = run_at(data, i, unit_count, unit);
+        if (run >= min_run) {
+            covered += run * unit;
+        }
+        i += run;
+    }
+    return covered;
+}
+
+
+static int put_varint(unsigned char* output, uint64_t capacity, uint64_t* position, uint64_t value) {
+    do {
+        if (*position >= capacity) {
+            return 1;
+        }
+        unsigned char byte = (unsigned char)(value & 0x7F);
+        value >>= 7;
+        output[(*position)++] = (unsigned char)(byte | (value ? 0x80 : 0));
+    } while (value);
+    return 0;
+}
+
+
+static int get_varint(const unsigned char* input, uint64_t input_size, uint64_t* position, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 7 * MAX_VARINT_SIZE; shift += 7) {
+        if (*position >= input_size) {
+            return 1;
+        }
+        unsigned char byte = input[(*position)++];
+        if (shift == 63 && byte > 1) {
+            return 1; // More than 64 bits
+        }
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+// Write count literal units starting at unit first
+static int put_literals(const unsigned char* data, uint64_t first, uint64_t count, uint32_t unit,
+                        unsigned char* output, uint64_t capacity, uint64_t* position) {
+    if (count == 0) {
+        return 0;
+    }
+    if (put_varint(output, capacity, position, (count - 1) << 1) || count * unit > capacity - *position) {
+        return 1;
+    }
+    memcpy(output + *position, data + first * unit, (size_t)(count * unit));
+    *position += count * unit;
+    return 0;
+}
+
+
+uint64_t run_length_encode(const unsigned char* data, uint64_t size, uint32_t unit,
+                           unsigned char* output, uint64_t capacity) {
+    uint64_t unit_count = size / unit;
+    uint64_t min_run = run_length_min_run(unit);
+    uint64_t position = 0;
+    uint64_t literal_start = 0;
+
+    for (uint64_t i = 0; i < unit_count;) {
+        uint64_t run = run_at(data, i, unit_count, unit);
+        if (run >= min_run) {
+            if (put_literals(data, literal_start, i - literal_start, unit, output, capacity, &position) ||
+                put_varint(output, capacity, &position, ((run - min_run) << 1) | 1) || unit > capacity - position) {
+                return UINT64_MAX;
+            }
+            memcpy(output + position, data + i * unit, unit);
+            position += unit;
+            literal_start = i + run;
+        }
+        i += run;
+    }
+    if (put_literals(data, literal_start, unit_count - literal_start, unit, output, capacity, &position)) {
+        return UINT64_MAX;
+    }
+
+    uint64_t tail = size - unit_count * unit;
+    if (tail > capacity - position) {
+        return UINT64_MAX;
+    }
+    memcpy(output + position, data + unit_count * unit, (size_t)tail);
+    return position + tail;
+}
+
+
+int run_length_decode(const unsigned char* input, uint64_t input_size, uint32_t unit,
+                      unsigned char* output, uint64_t output_size) {
+    if (unit == 0 || unit > RUN_LENGTH_MAX_UNIT) {
+        return 1;
+    }
+    uint64_t unit_bytes = output_size / unit * unit;
+    uint64_t min_run = run_length_min_run(unit);
+    uint64_t position = 0;
+    uint64_t written = 0;
+
+    while (written < unit_bytes) {
+        uint64_t token;
+        if (get_varint(input, input_size, &position, &token)) {
+            return 1;
+        }
+        uint64_t count = (token >> 1) + ((token & 1) ? min_run : 1);
+        if (count > (unit_bytes - written) / unit || unit > input_size - position) {
+            return 1;
+        }
+
+        if (token & 1) {
+            // Lay down one unit, then keep doubling the copy
+            uint64_t run_bytes = count * unit;
+            memcpy(output + written, input + position, unit);
+            position += unit;
+            for (uint64_t filled = unit; filled < run_bytes;) {
+                uint64_t copy = filled < run_bytes - filled ? filled : run_bytes - filled;
+                memcpy(output + written + filled, output + written, (size_t)copy);
+                filled += copy;
+            }
+            written += run_bytes;
+        } else {
+            if (count * unit > input_size - position) {
+                return 1;
+            }
+            memcpy(output + written, input + position, (size_t)(count * unit));
+            position += count * unit;
+            written += count * unit;
+        }
+    }
+
+    // The leftover bytes are all that may remain
+    if (input_size - position != output_size - unit_bytes) {
+        return 1;
+    }
+    memcpy(output + written, input + position, (size_t)(output_size - unit_bytes));
+    return 0;
+}
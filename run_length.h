@@ -0,0 +1,29 @@
+#ifndef RUN_LENGTH_H
+#define RUN_LENGTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Run-length coding over units of 1 to 4 bytes (a byte, or a whole pixel). The coded
+data is a run of tokens, each a varint v followed by its units: v odd is one unit
+repeated (v >> 1) + run_length_min_run(unit) times, v even is (v >> 1) + 1 literal
+units. The size % unit bytes that don't fill a unit are stored raw at the end. */
+#define RUN_LENGTH_MAX_UNIT 4
+
+// Function to get the shortest run of one unit that is coded as a repeat
+uint64_t run_length_min_run(uint32_t unit);
+
+// Function to count the bytes that sit in runs long enough to be coded as repeats
+uint64_t run_length_coverage(const unsigned char* data, uint64_t size, uint32_t unit);
+
+// Function to run-length code size bytes into output, which holds capacity bytes
+// Returns the coded size, or UINT64_MAX if it would not fit in capacity
+uint64_t run_length_encode(const unsigned char* data, uint64_t size, uint32_t unit,
+                           unsigned char* output, uint64_t capacity);
+
+// Function to expand run-length coded input into exactly output_size bytes
+// Returns 0 on success, non-zero if the input is malformed or expands to a different size
+int run_length_decode(const unsigned char* input, uint64_t input_size, uint32_t unit,
+                      unsigned char* output, uint64_t output_size);
+
+#endif // RUN_LENGTH_H
@@ -0,0 +1,209 @@
+#include "sha256.h"
+#include <string.h>
+
+
+static const uint32_t ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+static uint32_t rotate_right(uint32_t value, int count) {
+    return (value >> count) | (value << (32 - count));
+}
+
+
+static void sha256_compress(uint32_t state[8], const unsigned char block[SHA256_BLOCK_SIZE]) {
+    uint32_t schedule[64];
+    for (int i = 0; i < 16; i++) {
+        schedule[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) |
+                      ((uint32_t)block[4 * i + 2] << 8) | (uint32_t)block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotate_right(schedule[i - 15], 7) ^ rotate_right(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+        uint32_t s1 = rotate_right(schedule[i - 2], 17) ^ rotate_right(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+        schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t temp1 = h + s1 + choice + ROUND_CONSTANTS[i] + schedule[i];
+        uint32_t s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t temp2 = s0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+
+void sha256_init(Sha256_t* hash) {
+    static const uint32_t INITIAL_STATE[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(hash->state, INITIAL_STATE, sizeof(INITIAL_STATE));
+    hash->length = 0;
+    hash->block_fill = 0;
+}
+
+
+void sha256_update(Sha256_t* hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    hash->length += size;
+
+    if (hash->block_fill > 0) {
+        size_t take = SHA256_BLOCK_SIZE - hash->block_fill;
+        if (take > size) {
+            take = size;
+        }
+        memcpy(hash->block + hash->block_fill, bytes, take);
+        hash->block_fill += take;
+        bytes += take;
+        size -= take;
+        if (hash->block_fill < SHA256_BLOCK_SIZE) {
+            return;
+        }
+        sha256_compress(hash->state, hash->block);
+        hash->block_fill = 0;
+    }
+
+    // Whole blocks are hashed in place
+    for (; size >= SHA256_BLOCK_SIZE; size -= SHA256_BLOCK_SIZE) {
+        sha256_compress(hash->state, bytes);
+        bytes += SHA256_BLOCK_SIZE;
+    }
+    memcpy(hash->block, bytes, size);
+    hash->block_fill = size;
+}
+
+
+void sha256_final(Sha256_t* hash, unsigned char digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bit_length = hash->length * 8;
+
+    // Padding: a 1 bit, zeros up to 56 mod 64, then the length in bits, big-endian
+    unsigned char padding[SHA256_BLOCK_SIZE + 8];
+    size_t padding_size = (hash->block_fill < 56 ? 56 : 120) - hash->block_fill;
+    memset(padding, 0, sizeof(padding));
+    padding[0] = 0x80;
+    for (int i = 0; i < 8; i++) {
+        padding[padding_size + i] = (unsigned char)(bit_length >> (56 - 8 * i));
+    }
+    sha256_update(hash, padding, padding_size + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (unsigned char)(hash->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(hash->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(hash->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)hash->state[i];
+    }
+}
+
+
+void sha256(const void* data, size_t size, unsigned char digest[SHA256_DIGEST_SIZE]) {
+    Sha256_t hash;
+    sha256_init(&hash);
+    sha256_update(&hash, data, size);
+    sha256_final(&hash, digest);
+}
+
+
+// The inner and outer hashes after their padded key block, which every HMAC under one key shares
+typedef struct HmacKey {
+    Sha256_t inner;
+    Sha256_t outer;
+} HmacKey_t;
+
+
+static void hmac_key_init(HmacKey_t* hmac, const void* key, size_t key_size) {
+    unsigned char key_block[SHA256_BLOCK_SIZE];
+    memset(key_block, 0, sizeof(key_block));
+    if (key_size > SHA256_BLOCK_SIZE) {
+        sha256(key, key_size, key_block);
+    } else if (key_size > 0) {
+        memcpy(key_block, key, key_size);
+    }
+
+    unsigned char pad[SHA256_BLOCK_SIZE];
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = key_block[i] ^ 0x36;
+    }
+    sha256_init(&hmac->inner);
+    sha256_update(&hmac->inner, pad, sizeof(pad));
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = key_block[i] ^ 0x5c;
+    }
+    sha256_init(&hmac->outer);
+    sha256_update(&hmac->outer, pad, sizeof(pad));
+}
+
+
+static void hmac_finish(const HmacKey_t* hmac, Sha256_t* inner, unsigned char mac[SHA256_DIGEST_SIZE]) {
+    unsigned char inner_digest[SHA256_DIGEST_SIZE];
+    sha256_final(inner, inner_digest);
+    Sha256_t outer = hmac->outer;
+    sha256_update(&outer, inner_digest, sizeof(inner_digest));
+    sha256_final(&outer, mac);
+}
+
+
+void hmac_sha256(const void* key, size_t key_size, const void* data, size_t size, unsigned char mac[SHA256_DIGEST_SIZE]) {
+    HmacKey_t hmac;
+    hmac_key_init(&hmac, key, key_size);
+    Sha256_t inner = hmac.inner;
+    sha256_update(&inner, data, size);
+    hmac_finish(&hmac, &inner, mac);
+}
+
+
+void pbkdf2_sha256(const void* password, size_t password_size, const unsigned char* salt, size_t salt_size,
+                   uint32_t iterations, unsigned char* output, size_t output_size) {
+    HmacKey_t hmac;
+    hmac_key_init(&hmac, password, password_size);
+
+    for (uint32_t block_index = 1; output_size > 0; block_index++) {
+        unsigned char counter[4] = {
+            (unsigned char)(block_index >> 24), (unsigned char)(block_index >> 16),
+            (unsigned char)(block_index >> 8), (unsigned char)block_index
+        };
+        unsigned char u[SHA256_DIGEST_SIZE];
+        unsigned char t[SHA256_DIGEST_SIZE];
+
+        Sha256_t inner = hmac.inner;
+        sha256_update(&inner, salt, salt_size);
+        sha256_update(&inner, counter, sizeof(counter));
+        hmac_finish(&hmac, &inner, u);
+        memcpy(t, u, sizeof(t));
+
+        for (uint32_t i = 1; i < iterations; i++) {
+            inner = hmac.inner;
+            sha256_update(&inner, u, sizeof(u));
+            hmac_finish(&hmac, &inner, u);
+            for (int j = 0; j < SHA256_DIGEST_SIZE; j++) {
+                t[j] ^= u[j];
+            }
+        }
+
+        size_t take = output_size < SHA256_DIGEST_SIZE ? output_size : SHA256_DIGEST_SIZE;
+        memcpy(output, t, take);
+        output += take;
+        output_size -= take;
+    }
+}
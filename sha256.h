@@ -0,0 +1,32 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+// Running state of a SHA-256 hash (FIPS 180-4)
+typedef struct Sha256 {
+    uint32_t state[8];
+    uint64_t length;                        // Bytes hashed so far
+    unsigned char block[SHA256_BLOCK_SIZE]; // Partial block waiting for more input
+    size_t block_fill;
+} Sha256_t;
+
+void sha256_init(Sha256_t* hash);
+void sha256_update(Sha256_t* hash, const void* data, size_t size);
+void sha256_final(Sha256_t* hash, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+// Function to hash a whole buffer in one call
+void sha256(const void* data, size_t size, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+// Function to compute HMAC-SHA256 (RFC 2104) of data under key
+void hmac_sha256(const void* key, size_t key_size, const void* data, size_t size, unsigned char mac[SHA256_DIGEST_SIZE]);
+
+// Function to stretch a password into output_size bytes with PBKDF2-HMAC-SHA256 (RFC 8018)
+void pbkdf2_sha256(const void* password, size_t password_size, const unsigned char* salt, size_t salt_size,
+                   uint32_t iterations, unsigned char* output, size_t output_size);
+
+#endif // SHA256_H
@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define MAX_POOL_THREADS 256
+
+/* Every worker has a queue of its own. Submitted tasks are dealt out to the queues in
+turn; a worker runs its own tasks oldest first and, once it has none, steals the newest
+task of another worker, so a worker stuck on one long task never holds up the rest of
+its queue. The pool lock only guards the counts workers sleep and wait on. */
+
+typedef struct PoolTask {
+    ThreadTask_t task;
+    void* argument;
+    struct PoolTask* next;
+    struct PoolTask* previous;
+} PoolTask_t;
+
+
+typedef struct WorkQueue {
+    PoolTask_t* head;          // Oldest task, run next by the queue's worker
+    PoolTask_t* tail;          // Newest task, taken first by a thief
+    pthread_mutex_t lock;
+} WorkQueue_t;
+
+
+typedef struct PoolWorker {
+    struct ThreadPool* pool;
+    int index;
+} PoolWorker_t;
+
+
+struct ThreadPool {
+    pthread_t threads[MAX_POOL_THREADS];
+    PoolWorker_t workers[MAX_POOL_THREADS];
+    WorkQueue_t queues[MAX_POOL_THREADS];
+    int thread_count;
+    int next_queue;            // Queue the next submitted task goes to
+    int queued;                // Tasks in the queues not yet claimed by a worker
+    int pending;               // Tasks queued or running
+    uint64_t steals;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t task_ready; // Signalled when a task is queued or the pool stops
+    pthread_cond_t all_done;   // Signalled when pending drops to zero
+};
+
+
+// Take the oldest task of the worker's own queue, or else the newest of another's
+static PoolTask_t* take_task(ThreadPool_t* pool, int index) {
+    for (int i = 0; i < pool->thread_count; i++) {
+        WorkQueue_t* queue = &pool->queues[(index + i) % pool->thread_count];
+        pthread_mutex_lock(&queue->lock);
+        PoolTask_t* item = i == 0 ? queue->head : queue->tail;
+        if (item != NULL) {
+            if (item->previous != NULL) {
+                item->previous->next = item->next;
+            } else {
+                queue->head = item->next;
+            }
+            if (item->next != NULL) {
+                item->next->previous = item->previous;
+            } else {
+                queue->tail = item->previous;
+            }
+        }
+        pthread_mutex_unlock(&queue->lock);
+        if (item != NULL) {
+            if (i != 0) {
+                pthread_mutex_lock(&pool->lock);
+                pool->steals++;
+                pthread_mutex_unlock(&pool->lock);
+            }
+            return item;
+        }
+    }
+    return NULL;
+}
+
+
+static void* worker_main(void* argument) {
+    PoolWorker_t* worker = (PoolWorker_t*)argument;
+    ThreadPool_t* pool = worker->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->queued == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->task_ready, &pool->lock);
+        }
+        if (pool->queued == 0) {
+            break; // Stopping and nothing left to do
+        }
+
+        // Claiming a task first means one is sure to be found in some queue
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+        PoolTask_t* item;
+        while ((item = take_task(pool, worker->index)) == NULL) {
+        }
+
+        item->task(item->argument);
+        free(item);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->pending--;
+        if (pool->pending == 0) {
+            pthread_cond_broadcast(&pool->all_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+int thread_pool_default_size(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int cores = (int)info.dwNumberOfProcessors;
+#else
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (cores < 1) {
+        return 1;
+    }
+    return cores < MAX_POOL_THREADS ? cores : MAX_POOL_THREADS;
+}
+
+
+ThreadPool_t* thread_pool_create(int thread_count) {
+    if (thread_count <= 0) {
+        thread_count = thread_pool_default_size();
+    }
+    if (thread_count > MAX_POOL_THREADS) {
+        thread_count = MAX_POOL_THREADS;
+    }
+
+    ThreadPool_t* pool = (ThreadPool_t*)malloc(sizeof(ThreadPool_t));
+    if (pool == NULL) {
+        printf("Memory allocation failed for thread pool\n");
+        return NULL;
+    }
+    pool->thread_count = 0;
+    pool->next_queue = 0;
+    pool->queued = 0;
+    pool->pending = 0;
+    pool->steals = 0;
+    pool->stopping = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->task_ready, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+    for (int i = 0; i < thread_count; i++) {
+        pool->queues[i].head = NULL;
+        pool->queues[i].tail = NULL;
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, &pool->workers[i]) != 0) {
+            break;
+        }
+        pool->thread_count++;
+    }
+    // Tasks are only dealt to the queues of workers that started
+    for (int i = pool->thread_count; i < thread_count; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+    }
+
+    if (pool->thread_count == 0) {
+        printf("Failed to start worker threads\n");
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+
+int thread_pool_submit(ThreadPool_t* pool, ThreadTask_t task, void* argument) {
+    PoolTask_t* item = (PoolTask_t*)malloc(sizeof(PoolTask_t));
+    if (item == NULL) {
+        printf("Memory allocation failed for pool task\n");
+        return 1;
+    }
+    item->task = task;
+    item->argument = argument;
+    item->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    WorkQueue_t* queue = &pool->queues[pool->next_queue];
+    pool->next_queue = (pool->next_queue + 1) % pool->thread_count;
+    pthread_mutex_lock(&queue->lock);
+    item->previous = queue->tail;
+    if (queue->tail == NULL) {
+        queue->head = item;
+    } else {
+        queue->tail->next = item;
+    }
+    queue->tail = item;
+    pthread_mutex_unlock(&queue->lock);
+    pool->queued++;
+    pool->pending++;
+    pthread_cond_signal(&pool->task_ready);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+
+void thread_pool_wait(ThreadPool_t* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->all_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+uint64_t thread_pool_steal_count(ThreadPool_t* pool) {
+    pthread_mutex_lock(&pool->lock);
+    uint64_t steals = pool->steals;
+    pthread_mutex_unlock(&pool->lock);
+    return steals;
+}
+
+
+void thread_pool_destroy(ThreadPool_t* pool) {
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->task_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+        pthread_mutex_destroy(&pool->queues[i].lock);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->task_ready);
+    pthread_cond_destroy(&pool->all_done);
+    free(pool);
+}
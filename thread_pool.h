@@ -0,0 +1,31 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdint.h>
+
+// A task run by a pool worker, given the argument it was submitted with
+typedef void (*ThreadTask_t)(void* argument);
+
+typedef struct ThreadPool ThreadPool_t;
+
+// Function to start a pool of worker threads, thread_count 0 means one per CPU core
+// Returns NULL on failure
+ThreadPool_t* thread_pool_create(int thread_count);
+
+// Function to queue a task; an idle worker takes it if the one it is queued for is busy
+// Returns 0 on success, non-zero on failure
+int thread_pool_submit(ThreadPool_t* pool, ThreadTask_t task, void* argument);
+
+// Function to block until every submitted task has finished
+void thread_pool_wait(ThreadPool_t* pool);
+
+// Function to get how many tasks workers have taken from another worker's queue
+uint64_t thread_pool_steal_count(ThreadPool_t* pool);
+
+// Function to finish the queued tasks and stop the workers
+void thread_pool_destroy(ThreadPool_t* pool);
+
+// Function to get the number of CPU cores available to the program
+int thread_pool_default_size(void);
+
+#endif // THREAD_POOL_H